@@ -52,6 +52,8 @@
 
 #ifndef __ASSEMBLY__
 void clear_page(void *page);
+void clear_page_nocache(void *page);
+#define __HAVE_ARCH_CLEAR_PAGE_NOCACHE
 void copy_page(void *to, void *from);
 
 /* duplicated to the one in bootmem.h */
@@ -1099,6 +1099,20 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 		return;
 	}
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Not-present faults on anonymous memory can usually be resolved
+	 * without mmap_sem; whatever the speculative path turns down is
+	 * handled the usual way below.
+	 */
+	if (!(error_code & PF_PROT) &&
+	    handle_speculative_fault(mm, address, flags) != VM_FAULT_RETRY) {
+		tsk->min_flt++;
+		perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1, regs, address);
+		return;
+	}
+#endif
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
@@ -9,6 +9,7 @@
 #include <linux/vmstat.h>
 #include <linux/highmem.h>
 #include <linux/swap.h>
+#include <linux/hugetlb.h>
 
 #include <asm/pgtable.h>
 
@@ -197,6 +198,9 @@ static noinline int gup_huge_pud(pud_t pud, unsigned long addr,
 
 	refs = 0;
 	head = pte_page(pte);
+	/* transparent 1GB pages are split by the slow path first */
+	if (!PageHuge(head))
+		return 0;
 	page = head + ((addr & ~PUD_MASK) >> PAGE_SHIFT);
 	do {
 		VM_BUG_ON(compound_head(page) != head);
@@ -225,6 +229,9 @@ static int gup_pud_range(pgd_t pgd, unsigned long addr, unsigned long end,
 		next = pud_addr_end(addr, end);
 		if (pud_none(pud))
 			return 0;
+		/* a transparent 1GB page being split, or PROT_NONE */
+		if (unlikely(pud_trans_huge(pud) && !pud_large(pud)))
+			return 0;
 		if (unlikely(pud_large(pud))) {
 			if (!gup_huge_pud(pud, addr, next, write, pages, nr))
 				return 0;
@@ -98,7 +98,8 @@ static void flush_tlb_func(void *info)
 {
 	struct flush_tlb_info *f = info;
 
-	if (f->flush_mm != this_cpu_read(cpu_tlbstate.active_mm))
+	/* A NULL flush_mm asks for a flush whichever mm is loaded */
+	if (f->flush_mm && f->flush_mm != this_cpu_read(cpu_tlbstate.active_mm))
 		return;
 
 	if (this_cpu_read(cpu_tlbstate.state) == TLBSTATE_OK) {
@@ -224,6 +224,21 @@ static inline int blkg_path(struct blkcg_gq *blkg, char *buf, int buflen)
 	return ret;
 }
 
+/**
+ * blkg_dev_name - name of the device of a blkg
+ * @blkg: blkg of interest
+ *
+ * Returns the device name used when printing per-device stats of @blkg,
+ * or %NULL if the queue has no registered disk.
+ */
+static inline const char *blkg_dev_name(struct blkcg_gq *blkg)
+{
+	/* some drivers (floppy) instantiate a queue w/o disk registered */
+	if (blkg->q->backing_dev_info.dev)
+		return dev_name(blkg->q->backing_dev_info.dev);
+	return NULL;
+}
+
 /**
  * blkg_get - get a blkg reference
  * @blkg: blkg to get
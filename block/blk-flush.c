@@ -62,6 +62,11 @@
  * The above peculiarity requires that each FLUSH/FUA request has only one
  * bio attached to it, which is guaranteed as they aren't allowed to be
  * merged in the usual way.
+ *
+ * Multiqueue devices go through the same sequencing under the private
+ * queue_lock of the request_queue.  Their requests are passed to the
+ * software queues instead of the dispatch queue, and the flush request
+ * borrows the tag of the first request waiting on it.
  */
 
 #include <linux/kernel.h>
@@ -69,6 +74,7 @@
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/gfp.h>
+#include <linux/blk-mq.h>
 
 #include "blk.h"
 
@@ -126,6 +132,36 @@ static void blk_flush_restore_request(struct request *rq)
 	rq->end_io = rq->flush.saved_end_io;
 }
 
+/*
+ * Queue @rq for execution.  Multiqueue requests are handed to their
+ * software queue and the hardware queue is run from kblockd, as we may
+ * be called from the driver's completion path.  Returns %true if @rq was
+ * put on the dispatch queue and the queue needs to be kicked.
+ */
+static bool blk_flush_queue_rq(struct request *rq, bool add_front)
+{
+	struct request_queue *q = rq->q;
+
+	if (q->mq_ops) {
+		blk_mq_insert_request(rq, add_front, true, true);
+		return false;
+	}
+
+	if (add_front)
+		list_add(&rq->queuelist, &q->queue_head);
+	else
+		list_add_tail(&rq->queuelist, &q->queue_head);
+	return true;
+}
+
+static void blk_flush_end_request(struct request *rq, int error)
+{
+	if (rq->q->mq_ops)
+		blk_mq_end_io(rq, error);
+	else
+		__blk_end_request_all(rq, error);
+}
+
 /**
  * blk_flush_complete_seq - complete flush sequence
  * @rq: FLUSH/FUA request being sequenced
@@ -167,8 +203,7 @@ static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
 
 	case REQ_FSEQ_DATA:
 		list_move_tail(&rq->flush.list, &q->flush_data_in_flight);
-		list_add(&rq->queuelist, &q->queue_head);
-		queued = true;
+		queued = blk_flush_queue_rq(rq, true);
 		break;
 
 	case REQ_FSEQ_DONE:
@@ -181,7 +216,7 @@ static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
 		BUG_ON(!list_empty(&rq->queuelist));
 		list_del_init(&rq->flush.list);
 		blk_flush_restore_request(rq);
-		__blk_end_request_all(rq, error);
+		blk_flush_end_request(rq, error);
 		break;
 
 	default:
@@ -194,15 +229,21 @@ static bool blk_flush_complete_seq(struct request *rq, unsigned int seq,
 static void flush_end_io(struct request *flush_rq, int error)
 {
 	struct request_queue *q = flush_rq->q;
-	struct list_head *running = &q->flush_queue[q->flush_running_idx];
+	struct list_head *running;
 	bool queued = false;
 	struct request *rq, *n;
+	unsigned long flags = 0;
+
+	if (q->mq_ops)
+		spin_lock_irqsave(q->queue_lock, flags);
 
+	running = &q->flush_queue[q->flush_running_idx];
 	BUG_ON(q->flush_pending_idx == q->flush_running_idx);
 
 	/* account completion of the flush request */
 	q->flush_running_idx ^= 1;
-	elv_completed_request(q, flush_rq);
+	if (!q->mq_ops)
+		elv_completed_request(q, flush_rq);
 
 	/* and push the waiting requests to the next stage */
 	list_for_each_entry_safe(rq, n, running, flush.list) {
@@ -223,9 +264,13 @@ static void flush_end_io(struct request *flush_rq, int error)
 	 * directly into request_fn may confuse the driver.  Always use
 	 * kblockd.
 	 */
-	if (queued || q->flush_queue_delayed)
+	if (queued || q->flush_queue_delayed) {
+		WARN_ON(q->mq_ops);
 		blk_run_queue_async(q);
+	}
 	q->flush_queue_delayed = 0;
+	if (q->mq_ops)
+		spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
 /**
@@ -246,6 +291,7 @@ static bool blk_kick_flush(struct request_queue *q)
 	struct list_head *pending = &q->flush_queue[q->flush_pending_idx];
 	struct request *first_rq =
 		list_first_entry(pending, struct request, flush.list);
+	struct request *flush_rq = q->flush_rq;
 
 	/* C1 described at the top of this file */
 	if (q->flush_pending_idx != q->flush_running_idx || list_empty(pending))
@@ -261,15 +307,23 @@ static bool blk_kick_flush(struct request_queue *q)
 	 * Issue flush and toggle pending_idx.  This makes pending_idx
 	 * different from running_idx, which means flush is in flight.
 	 */
-	blk_rq_init(q, &q->flush_rq);
-	q->flush_rq.cmd_type = REQ_TYPE_FS;
-	q->flush_rq.cmd_flags = WRITE_FLUSH | REQ_FLUSH_SEQ;
-	q->flush_rq.rq_disk = first_rq->rq_disk;
-	q->flush_rq.end_io = flush_end_io;
+	blk_rq_init(q, flush_rq);
+	if (q->mq_ops) {
+		/*
+		 * @first_rq sits on the pending list until the flush is
+		 * done, so the flush can issue on its software queue and
+		 * tag.
+		 */
+		flush_rq->mq_ctx = first_rq->mq_ctx;
+		flush_rq->tag = first_rq->tag;
+	}
+	flush_rq->cmd_type = REQ_TYPE_FS;
+	flush_rq->cmd_flags = WRITE_FLUSH | REQ_FLUSH_SEQ;
+	flush_rq->rq_disk = first_rq->rq_disk;
+	flush_rq->end_io = flush_end_io;
 
 	q->flush_pending_idx ^= 1;
-	list_add_tail(&q->flush_rq.queuelist, &q->queue_head);
-	return true;
+	return blk_flush_queue_rq(flush_rq, false);
 }
 
 static void flush_data_end_io(struct request *rq, int error)
@@ -284,16 +338,27 @@ static void flush_data_end_io(struct request *rq, int error)
 		blk_run_queue_async(q);
 }
 
+static void mq_flush_data_end_io(struct request *rq, int error)
+{
+	struct request_queue *q = rq->q;
+	unsigned long flags;
+
+	/* the hardware queue is run by blk_flush_queue_rq() */
+	spin_lock_irqsave(q->queue_lock, flags);
+	blk_flush_complete_seq(rq, REQ_FSEQ_DATA, error);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+
 /**
  * blk_insert_flush - insert a new FLUSH/FUA request
  * @rq: request to insert
  *
- * To be called from __elv_add_request() for %ELEVATOR_INSERT_FLUSH insertions.
- * @rq is being submitted.  Analyze what needs to be done and put it on the
- * right queue.
+ * To be called from __elv_add_request() for %ELEVATOR_INSERT_FLUSH insertions,
+ * or from the multiqueue submission path.  @rq is being submitted.  Analyze
+ * what needs to be done and put it on the right queue.
  *
  * CONTEXT:
- * spin_lock_irq(q->queue_lock)
+ * spin_lock_irq(q->queue_lock) for legacy queues, no locks for multiqueue
  */
 void blk_insert_flush(struct request *rq)
 {
@@ -316,7 +381,10 @@ void blk_insert_flush(struct request *rq)
 	 * complete the request.
 	 */
 	if (!policy) {
-		__blk_end_bidi_request(rq, 0, 0, 0);
+		if (q->mq_ops)
+			blk_mq_end_io(rq, 0);
+		else
+			__blk_end_bidi_request(rq, 0, 0, 0);
 		return;
 	}
 
@@ -329,7 +397,10 @@ void blk_insert_flush(struct request *rq)
 	 */
 	if ((policy & REQ_FSEQ_DATA) &&
 	    !(policy & (REQ_FSEQ_PREFLUSH | REQ_FSEQ_POSTFLUSH))) {
-		list_add_tail(&rq->queuelist, &q->queue_head);
+		if (q->mq_ops)
+			blk_mq_insert_request(rq, false, true, false);
+		else
+			list_add_tail(&rq->queuelist, &q->queue_head);
 		return;
 	}
 
@@ -341,8 +412,17 @@ void blk_insert_flush(struct request *rq)
 	INIT_LIST_HEAD(&rq->flush.list);
 	rq->cmd_flags |= REQ_FLUSH_SEQ;
 	rq->flush.saved_end_io = rq->end_io; /* Usually NULL */
-	rq->end_io = flush_data_end_io;
 
+	if (q->mq_ops) {
+		rq->end_io = mq_flush_data_end_io;
+
+		spin_lock_irq(q->queue_lock);
+		blk_flush_complete_seq(rq, REQ_FSEQ_ACTIONS & ~policy, 0);
+		spin_unlock_irq(q->queue_lock);
+		return;
+	}
+
+	rq->end_io = flush_data_end_io;
 	blk_flush_complete_seq(rq, REQ_FSEQ_ACTIONS & ~policy, 0);
 }
 
@@ -0,0 +1,120 @@
+/*
+ * Per-queue I/O latency histograms.
+ *
+ * Every request completing on a queue with iostats enabled is accounted
+ * in three log2 histograms, split by data direction: the time it spent
+ * queued before being dispatched to the driver, the time the driver took
+ * to complete it, and the sum of both.  The buckets are kept per cpu so
+ * that accounting a completion doesn't touch shared cachelines, and are
+ * only summed up when the latency_hist sysfs attribute is read.
+ */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+
+#include "blk.h"
+
+static const char *blk_lat_stage_name[BLK_LAT_NR_STAGES] = {
+	[BLK_LAT_QUEUE]		= "queue",
+	[BLK_LAT_SERVICE]	= "service",
+	[BLK_LAT_TOTAL]		= "total",
+};
+
+int blk_latency_init(struct request_queue *q)
+{
+	q->lat_stat = alloc_percpu(struct blk_lat_stat);
+	if (!q->lat_stat)
+		return -ENOMEM;
+	return 0;
+}
+
+void blk_latency_exit(struct request_queue *q)
+{
+	free_percpu(q->lat_stat);
+}
+
+static void blk_latency_add(struct request_queue *q, enum blk_lat_stage stage,
+			    int rw, u64 start, u64 end)
+{
+	u64 nsec = 0;
+
+	/* sched_clock() isn't synchronized across cpus */
+	if (time_after64(end, start))
+		nsec = end - start;
+
+	this_cpu_inc(q->lat_stat->stage[stage].cnt[rw][blk_lat_hist_bucket(nsec)]);
+}
+
+/**
+ * blk_latency_account - account a completed request in the histograms
+ * @rq: request being completed
+ *
+ * Called from the completion accounting, so only for requests which are
+ * accounted in the disk statistics as well.
+ */
+void blk_latency_account(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	const int rw = rq_data_dir(rq);
+	u64 start = rq_start_time_ns(rq);
+	u64 io_start = rq_io_start_time_ns(rq);
+	u64 now;
+
+	preempt_disable();
+	now = sched_clock();
+	blk_latency_add(q, BLK_LAT_QUEUE, rw, start, io_start);
+	blk_latency_add(q, BLK_LAT_SERVICE, rw, io_start, now);
+	blk_latency_add(q, BLK_LAT_TOTAL, rw, start, now);
+	preempt_enable();
+}
+
+ssize_t blk_latency_show(struct request_queue *q, char *page)
+{
+	struct blk_lat_hist *hist;
+	ssize_t ret = 0;
+	int cpu, stage, rw, i;
+
+	hist = kzalloc(sizeof(*hist) * BLK_LAT_NR_STAGES, GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_lat_stat *stat = per_cpu_ptr(q->lat_stat, cpu);
+
+		for (stage = 0; stage < BLK_LAT_NR_STAGES; stage++)
+			for (rw = READ; rw <= WRITE; rw++)
+				for (i = 0; i < BLK_LAT_HIST_BUCKETS; i++)
+					hist[stage].cnt[rw][i] +=
+						stat->stage[stage].cnt[rw][i];
+	}
+
+	for (stage = 0; stage < BLK_LAT_NR_STAGES; stage++) {
+		for (rw = READ; rw <= WRITE; rw++) {
+			ret += sprintf(page + ret, "%s %s",
+				       blk_lat_stage_name[stage],
+				       rw == READ ? "read" : "write");
+			for (i = 0; i < BLK_LAT_HIST_BUCKETS; i++)
+				ret += sprintf(page + ret, " %lu",
+					       hist[stage].cnt[rw][i]);
+			ret += sprintf(page + ret, "\n");
+		}
+	}
+
+	kfree(hist);
+	return ret;
+}
+
+/*
+ * Completions racing with the reset may survive it, which is fine for
+ * statistics.
+ */
+void blk_latency_reset(struct request_queue *q)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(q->lat_stat, cpu), 0,
+		       sizeof(struct blk_lat_stat));
+}
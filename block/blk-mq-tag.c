@@ -0,0 +1,234 @@
+/*
+ * Tag allocation for the multiqueue block layer.
+ *
+ * Tags are kept in two bitmaps, one for the reserved tags and one for the
+ * normal ones.  Reserved tags occupy the low end of the tag space, so a
+ * tag can be used directly as an index into the preallocated request map
+ * of a hardware queue.  Each CPU remembers where it last found a free
+ * tag, which keeps CPUs sharing a hardware queue mostly out of each
+ * other's cachelines.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+#include <linux/blk-mq.h>
+#include "blk-mq.h"
+#include "blk-mq-tag.h"
+
+struct blk_mq_tags {
+	unsigned int nr_tags;
+	unsigned int nr_reserved_tags;
+	unsigned int nr_normal_tags;
+
+	unsigned long *normal_map;
+	unsigned long *reserved_map;
+
+	unsigned int __percpu *hint;
+
+	wait_queue_head_t normal_wait;
+	wait_queue_head_t reserved_wait;
+};
+
+/*
+ * Find and grab a clear bit in @map, starting the search at @start and
+ * wrapping around once.  Returns -1 if the map is full.
+ */
+static int __bt_get(unsigned long *map, unsigned int depth, unsigned int start)
+{
+	unsigned int bit;
+	bool wrapped = false;
+
+	if (start >= depth)
+		start = 0;
+
+	bit = start;
+	while (1) {
+		bit = find_next_zero_bit(map, depth, bit);
+		if (bit >= depth) {
+			if (wrapped || !start)
+				return -1;
+			wrapped = true;
+			bit = 0;
+			continue;
+		}
+		if (wrapped && bit >= start)
+			return -1;
+		if (!test_and_set_bit_lock(bit, map))
+			return bit;
+		bit++;
+	}
+}
+
+static int __blk_mq_get_normal_tag(struct blk_mq_tags *tags)
+{
+	int bit;
+
+	bit = __bt_get(tags->normal_map, tags->nr_normal_tags,
+		       this_cpu_read(*tags->hint));
+	if (bit < 0)
+		return -1;
+
+	this_cpu_write(*tags->hint, bit + 1);
+	return bit + tags->nr_reserved_tags;
+}
+
+static int __blk_mq_get_reserved_tag(struct blk_mq_tags *tags)
+{
+	return __bt_get(tags->reserved_map, tags->nr_reserved_tags, 0);
+}
+
+static unsigned int __blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp,
+				     bool reserved)
+{
+	wait_queue_head_t *wq;
+	DEFINE_WAIT(wait);
+	int tag;
+
+	if (reserved)
+		tag = __blk_mq_get_reserved_tag(tags);
+	else
+		tag = __blk_mq_get_normal_tag(tags);
+
+	if (tag >= 0 || !(gfp & __GFP_WAIT))
+		return tag < 0 ? BLK_MQ_TAG_FAIL : tag;
+
+	wq = reserved ? &tags->reserved_wait : &tags->normal_wait;
+	do {
+		prepare_to_wait_exclusive(wq, &wait, TASK_UNINTERRUPTIBLE);
+
+		if (reserved)
+			tag = __blk_mq_get_reserved_tag(tags);
+		else
+			tag = __blk_mq_get_normal_tag(tags);
+		if (tag >= 0)
+			break;
+
+		io_schedule();
+	} while (1);
+
+	finish_wait(wq, &wait);
+	return tag;
+}
+
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp, bool reserved)
+{
+	if (unlikely(reserved && !tags->nr_reserved_tags)) {
+		WARN_ON_ONCE(1);
+		return BLK_MQ_TAG_FAIL;
+	}
+
+	return __blk_mq_get_tag(tags, gfp, reserved);
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	wait_queue_head_t *wq;
+
+	BUG_ON(tag >= tags->nr_tags);
+
+	if (tag >= tags->nr_reserved_tags) {
+		clear_bit_unlock(tag - tags->nr_reserved_tags,
+				 tags->normal_map);
+		wq = &tags->normal_wait;
+	} else {
+		clear_bit_unlock(tag, tags->reserved_map);
+		wq = &tags->reserved_wait;
+	}
+
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(wq))
+		wake_up(wq);
+}
+
+bool blk_mq_tags_busy(struct blk_mq_tags *tags)
+{
+	if (find_first_bit(tags->normal_map, tags->nr_normal_tags) <
+	    tags->nr_normal_tags)
+		return true;
+
+	return tags->nr_reserved_tags &&
+		find_first_bit(tags->reserved_map, tags->nr_reserved_tags) <
+		tags->nr_reserved_tags;
+}
+
+/*
+ * Call @fn for every tag that is currently allocated.  The caller must be
+ * prepared for tags getting freed and reallocated under it.
+ */
+void blk_mq_tag_busy_iter(struct blk_mq_tags *tags,
+			  void (*fn)(void *data, unsigned int tag), void *data)
+{
+	unsigned int bit;
+
+	for_each_set_bit(bit, tags->reserved_map, tags->nr_reserved_tags)
+		fn(data, bit);
+
+	for_each_set_bit(bit, tags->normal_map, tags->nr_normal_tags)
+		fn(data, bit + tags->nr_reserved_tags);
+}
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int total_tags,
+				     unsigned int reserved_tags, int node)
+{
+	unsigned int nr_normal = total_tags - reserved_tags;
+	struct blk_mq_tags *tags;
+	unsigned int cpu;
+
+	if (total_tags > BLK_MQ_TAG_MAX || reserved_tags >= total_tags) {
+		pr_err("blk-mq: tag depth too large\n");
+		return NULL;
+	}
+
+	tags = kzalloc_node(sizeof(*tags), GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->nr_tags = total_tags;
+	tags->nr_reserved_tags = reserved_tags;
+	tags->nr_normal_tags = nr_normal;
+	init_waitqueue_head(&tags->normal_wait);
+	init_waitqueue_head(&tags->reserved_wait);
+
+	tags->normal_map = kzalloc_node(BITS_TO_LONGS(nr_normal) *
+					sizeof(unsigned long), GFP_KERNEL,
+					node);
+	if (!tags->normal_map)
+		goto err_free;
+
+	if (reserved_tags) {
+		tags->reserved_map = kzalloc_node(BITS_TO_LONGS(reserved_tags) *
+						  sizeof(unsigned long),
+						  GFP_KERNEL, node);
+		if (!tags->reserved_map)
+			goto err_free;
+	}
+
+	tags->hint = alloc_percpu(unsigned int);
+	if (!tags->hint)
+		goto err_free;
+
+	/* spread the CPUs over the tag space to start with */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(tags->hint, cpu) =
+			(unsigned long)cpu * nr_normal / nr_cpu_ids;
+
+	return tags;
+
+err_free:
+	kfree(tags->reserved_map);
+	kfree(tags->normal_map);
+	kfree(tags);
+	return NULL;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	free_percpu(tags->hint);
+	kfree(tags->reserved_map);
+	kfree(tags->normal_map);
+	kfree(tags);
+}
@@ -0,0 +1,198 @@
+/*
+ * Polled I/O completion.
+ *
+ * On devices that complete an I/O faster than an interrupt plus two
+ * context switches, a task waiting synchronously for its I/O is better off
+ * spinning in the driver's completion handler than sleeping.  Polling is
+ * enabled per queue through the io_poll sysfs attribute and needs a driver
+ * that registered a ->poll_fn with blk_queue_poll_fn().
+ *
+ * io_poll_delay controls how long the waiter sleeps before it starts to
+ * spin: -1 spins right away, 0 sleeps for half of the mean completion time
+ * seen by polling so far, and a positive value sleeps for that many usecs.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+
+#include "blk.h"
+
+/**
+ * blk_queue_poll_fn - set the polled completion handler of a queue
+ * @q:		the request queue for the device
+ * @fn:		function that reaps completions for the calling cpu
+ *
+ * Description:
+ *    @fn is called by waiters on @q with polling enabled, and should
+ *    process the completions of the hardware queue the calling cpu submits
+ *    to.  It returns the number of completions found, or a negative value
+ *    if polling cannot make progress.  Polling stays disabled until it is
+ *    turned on through sysfs.
+ **/
+void blk_queue_poll_fn(struct request_queue *q, poll_fn *fn)
+{
+	if (!q->poll_stat) {
+		q->poll_stat = alloc_percpu(struct blk_poll_stat);
+		if (!q->poll_stat)
+			return;
+	}
+
+	q->poll_nsec = -1;
+	q->poll_fn = fn;
+}
+EXPORT_SYMBOL_GPL(blk_queue_poll_fn);
+
+void blk_poll_exit(struct request_queue *q)
+{
+	free_percpu(q->poll_stat);
+}
+
+/*
+ * Account a completion observed @start nsecs after the I/O was submitted.
+ * The mean is an exponentially weighted average giving new samples 1/8
+ * weight.  It is updated without locking, an occasional lost update does
+ * not matter for a sleep heuristic.
+ */
+static void blk_poll_account(struct request_queue *q, ktime_t start)
+{
+	s64 nsec = ktime_to_ns(ktime_sub(ktime_get(), start));
+	s64 mean = q->poll_mean_nsec;
+	unsigned int bucket;
+
+	if (nsec < 0)
+		nsec = 0;
+
+	if (mean)
+		mean += (nsec - mean) >> 3;
+	else
+		mean = nsec;
+	q->poll_mean_nsec = mean;
+
+	bucket = fls64(div_u64(nsec, NSEC_PER_USEC));
+	if (bucket >= BLK_POLL_HIST_BUCKETS)
+		bucket = BLK_POLL_HIST_BUCKETS - 1;
+	this_cpu_inc(q->poll_stat->hist[bucket]);
+}
+
+/*
+ * Sleep until the point at which polling should start.  The deadline is
+ * absolute, so a waiter that comes back here after the timer fired
+ * carries on polling right away.  Returns true if we slept, in which case
+ * the caller has to recheck its wait condition.
+ */
+static bool blk_poll_sleep(struct request_queue *q, ktime_t start)
+{
+	struct hrtimer_sleeper hs;
+	ktime_t deadline;
+	u64 nsec;
+
+	if (q->poll_nsec > 0)
+		nsec = q->poll_nsec;
+	else
+		nsec = q->poll_mean_nsec >> 1;
+	if (!nsec)
+		return false;
+
+	deadline = ktime_add_ns(start, nsec);
+	if (ktime_to_ns(ktime_sub(deadline, ktime_get())) <= 0)
+		return false;
+
+	hrtimer_init_on_stack(&hs.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_set_expires(&hs.timer, deadline);
+	hrtimer_init_sleeper(&hs, current);
+
+	hrtimer_start_expires(&hs.timer, HRTIMER_MODE_ABS);
+	if (hs.task)
+		io_schedule();
+	hrtimer_cancel(&hs.timer);
+	destroy_hrtimer_on_stack(&hs.timer);
+
+	/* still set if the completion woke us up before the timer did */
+	if (hs.task)
+		blk_poll_account(q, start);
+
+	__set_current_state(TASK_RUNNING);
+	return true;
+}
+
+/**
+ * blk_poll - poll for the completion of synchronous I/O
+ * @q:		the request queue the I/O was submitted to
+ * @start:	when the I/O was submitted
+ *
+ * Description:
+ *    Called by a task that has set itself TASK_UNINTERRUPTIBLE and arranged
+ *    to be woken up by the completion of its I/O, in place of
+ *    io_schedule().  Returns true if the task is TASK_RUNNING again and
+ *    must recheck its wait condition, false if polling is not enabled on
+ *    @q or was given up, in which case the caller should go to sleep.
+ **/
+bool blk_poll(struct request_queue *q, ktime_t start)
+{
+	struct blk_poll_stat __percpu *stat = q->poll_stat;
+
+	if (!q->poll_fn || !blk_queue_poll(q))
+		return false;
+
+	this_cpu_inc(stat->considered);
+
+	if (q->poll_nsec >= 0 && blk_poll_sleep(q, start))
+		return true;
+
+	while (!need_resched()) {
+		int ret;
+
+		this_cpu_inc(stat->invoked);
+		ret = q->poll_fn(q);
+		if (ret > 0) {
+			this_cpu_inc(stat->success);
+			blk_poll_account(q, start);
+			__set_current_state(TASK_RUNNING);
+			return true;
+		}
+
+		/* completed from interrupt or by another poller */
+		if (current->state == TASK_RUNNING)
+			return true;
+		if (ret < 0)
+			break;
+		cpu_relax();
+	}
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
+ssize_t blk_poll_stat_show(struct request_queue *q, char *page)
+{
+	unsigned long considered = 0, invoked = 0, success = 0;
+	unsigned long hist[BLK_POLL_HIST_BUCKETS] = { 0, };
+	ssize_t ret;
+	int cpu, i;
+
+	if (!q->poll_stat)
+		return sprintf(page, "unsupported\n");
+
+	for_each_possible_cpu(cpu) {
+		struct blk_poll_stat *stat = per_cpu_ptr(q->poll_stat, cpu);
+
+		considered += stat->considered;
+		invoked += stat->invoked;
+		success += stat->success;
+		for (i = 0; i < BLK_POLL_HIST_BUCKETS; i++)
+			hist[i] += stat->hist[i];
+	}
+
+	ret = sprintf(page, "considered=%lu invoked=%lu success=%lu "
+		      "mean_nsec=%llu\n", considered, invoked, success,
+		      (unsigned long long)q->poll_mean_nsec);
+	for (i = 0; i < BLK_POLL_HIST_BUCKETS; i++)
+		ret += sprintf(page + ret, "%lu%c", hist[i],
+			       i == BLK_POLL_HIST_BUCKETS - 1 ? '\n' : ' ');
+
+	return ret;
+}
@@ -0,0 +1,361 @@
+/*
+ * Buffered writeback throttling.
+ *
+ * Background writeback can fill the whole request queue of a device, and
+ * reads issued behind it then wait for hundreds of writes to drain.  To
+ * keep read latency in check, the number of background writes (REQ_WRITE
+ * without REQ_SYNC) that may hold a request at the same time is capped by
+ * a window, which is scaled against a read latency target.
+ *
+ * Every 100ms the completions of the past window are looked at.  If the
+ * fastest read took longer than the target, or no read completed while
+ * one has been at the device for longer than the target, the device is
+ * considered congested and the window is halved.  Otherwise it is doubled
+ * again, up to three quarters of nr_requests.  Using the minimum rather
+ * than the mean makes the decision robust against the odd slow read that
+ * has nothing to do with queueing.  Sync writes (fsync, journal commits)
+ * are left out on purpose, the target is about reads only.
+ *
+ * Throttling applies to request based queues only, and sits in front of
+ * request allocation, so it works the same with every elevator.  All
+ * state is protected by the queue lock.
+ */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+
+#include "blk.h"
+
+#define WBT_WINDOW_NSEC		(100 * NSEC_PER_MSEC)
+
+/* default read latency targets */
+#define WBT_DEF_LAT_NONROT	(2 * NSEC_PER_MSEC)
+#define WBT_DEF_LAT_ROT		(75 * NSEC_PER_MSEC)
+
+struct rq_wb {
+	struct request_queue	*q;
+
+	u64			min_lat_nsec;	/* read latency target, 0 is off */
+	unsigned int		max_depth;	/* window at scale_step 0 */
+	unsigned int		window;		/* current window */
+	unsigned int		scale_step;
+	unsigned int		inflight;	/* tracked background writes */
+
+	/*
+	 * Reads at the device, and when the last of them completed or,
+	 * if none did since, when the first of them was issued.
+	 */
+	unsigned int		reads_inflight;
+	u64			read_stamp;
+
+	/* stats of the current monitoring window */
+	u64			read_min_nsec;
+	unsigned int		nr_reads;
+
+	struct timer_list	timer;
+	wait_queue_head_t	wait;
+};
+
+static inline bool wbt_enabled(struct rq_wb *rwb)
+{
+	return rwb && rwb->min_lat_nsec;
+}
+
+static void wbt_calc_window(struct rq_wb *rwb)
+{
+	unsigned int old = rwb->window;
+
+	rwb->window = max(rwb->max_depth >> rwb->scale_step, 1U);
+
+	if (rwb->window > old)
+		wake_up_all(&rwb->wait);
+}
+
+static void wbt_arm_timer(struct rq_wb *rwb)
+{
+	if (!timer_pending(&rwb->timer))
+		mod_timer(&rwb->timer,
+			  jiffies + nsecs_to_jiffies(WBT_WINDOW_NSEC));
+}
+
+static u64 wbt_now(void)
+{
+	u64 now;
+
+	preempt_disable();
+	now = sched_clock();
+	preempt_enable();
+	return now;
+}
+
+/*
+ * With no read completed in the window, the device is only to blame if
+ * a read has been waiting on it for longer than the target.
+ */
+static bool wbt_reads_stalled(struct rq_wb *rwb)
+{
+	u64 now = wbt_now();
+
+	return rwb->reads_inflight && rwb->inflight &&
+	       time_after64(now, rwb->read_stamp + rwb->min_lat_nsec);
+}
+
+static void wbt_timer_fn(unsigned long data)
+{
+	struct rq_wb *rwb = (struct rq_wb *)data;
+	struct request_queue *q = rwb->q;
+	bool congested;
+
+	spin_lock_irq(q->queue_lock);
+
+	if (!wbt_enabled(rwb))
+		goto out_unlock;
+
+	if (rwb->nr_reads)
+		congested = rwb->read_min_nsec > rwb->min_lat_nsec;
+	else
+		congested = wbt_reads_stalled(rwb);
+
+	if (congested) {
+		if (rwb->window > 1)
+			rwb->scale_step++;
+	} else if (rwb->scale_step) {
+		rwb->scale_step--;
+	}
+	wbt_calc_window(rwb);
+
+	rwb->nr_reads = 0;
+	rwb->read_min_nsec = 0;
+
+	/* keep going while there is something to watch or to undo */
+	if (rwb->inflight || rwb->scale_step)
+		wbt_arm_timer(rwb);
+out_unlock:
+	spin_unlock_irq(q->queue_lock);
+}
+
+static bool wbt_should_throttle(struct bio *bio)
+{
+	const unsigned long mask = REQ_SYNC | REQ_FLUSH | REQ_FUA |
+				   REQ_DISCARD;
+
+	return (bio->bi_rw & REQ_WRITE) && !(bio->bi_rw & mask);
+}
+
+/**
+ * wbt_wait - throttle a background write before it allocates a request
+ * @q: request queue
+ * @bio: bio about to allocate a request
+ *
+ * Called with the queue lock held, which may be dropped while waiting for
+ * the window to open.  Returns %true if the request allocated for @bio has
+ * to be marked REQ_WB_TRACKED.  kswapd is accounted but never made to wait,
+ * reclaim must not stall behind the writeback it is trying to get done.
+ */
+bool wbt_wait(struct request_queue *q, struct bio *bio)
+{
+	struct rq_wb *rwb = q->rq_wb;
+	DEFINE_WAIT(wait);
+
+	if (!wbt_enabled(rwb) || !wbt_should_throttle(bio))
+		return false;
+
+	while (!current_is_kswapd() && rwb->inflight >= rwb->window) {
+		prepare_to_wait_exclusive(&rwb->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		spin_unlock_irq(q->queue_lock);
+		io_schedule();
+		spin_lock_irq(q->queue_lock);
+		finish_wait(&rwb->wait, &wait);
+
+		if (!wbt_enabled(rwb) || unlikely(blk_queue_dead(q)))
+			return false;
+	}
+
+	rwb->inflight++;
+	wbt_arm_timer(rwb);
+	return true;
+}
+
+static void __wbt_done(struct rq_wb *rwb)
+{
+	rwb->inflight--;
+	if (rwb->inflight < rwb->window)
+		wake_up(&rwb->wait);
+}
+
+/**
+ * wbt_issue - a request is being handed to the driver
+ * @q: request queue
+ * @rq: request
+ *
+ * Called with the queue lock held.  Reads are marked REQ_WB_TRACKED
+ * until they are freed, so that stalled reads can be told apart from
+ * reads that are merely queued in the elevator.  A requeued read stays
+ * tracked and is not counted again.
+ */
+void wbt_issue(struct request_queue *q, struct request *rq)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!wbt_enabled(rwb) || rq->cmd_type != REQ_TYPE_FS ||
+	    rq_data_dir(rq) != READ || (rq->cmd_flags & REQ_WB_TRACKED))
+		return;
+
+	rq->cmd_flags |= REQ_WB_TRACKED;
+	if (!rwb->reads_inflight++)
+		rwb->read_stamp = wbt_now();
+}
+
+/**
+ * wbt_done - a request is being freed
+ * @q: request queue
+ * @rq: request
+ *
+ * Called with the queue lock held, for requests that were merged away
+ * as well as for completed ones.
+ */
+void wbt_done(struct request_queue *q, struct request *rq)
+{
+	if (!(rq->cmd_flags & REQ_WB_TRACKED))
+		return;
+
+	rq->cmd_flags &= ~REQ_WB_TRACKED;
+	if (rq_data_dir(rq) == READ)
+		q->rq_wb->reads_inflight--;
+	else
+		__wbt_done(q->rq_wb);
+}
+
+/**
+ * wbt_cancel - undo wbt_wait() for a bio that didn't get a request
+ * @q: request queue
+ *
+ * Called with the queue lock held.
+ */
+void wbt_cancel(struct request_queue *q)
+{
+	__wbt_done(q->rq_wb);
+}
+
+/**
+ * wbt_complete - sample the latency of a completed read
+ * @q: request queue
+ * @rq: request being completed
+ *
+ * Called with the queue lock held.
+ */
+void wbt_complete(struct request_queue *q, struct request *rq)
+{
+	struct rq_wb *rwb = q->rq_wb;
+	u64 io_start = rq_io_start_time_ns(rq);
+	u64 now, lat = 0;
+
+	if (!wbt_enabled(rwb) || rq->cmd_type != REQ_TYPE_FS ||
+	    rq_data_dir(rq) != READ || !io_start)
+		return;
+
+	now = wbt_now();
+	if (time_after64(now, io_start))
+		lat = now - io_start;
+	rwb->read_stamp = now;
+
+	if (!rwb->nr_reads || lat < rwb->read_min_nsec)
+		rwb->read_min_nsec = lat;
+	rwb->nr_reads++;
+	wbt_arm_timer(rwb);
+}
+
+/**
+ * wbt_update_limits - recalculate the window after nr_requests changed
+ * @q: request queue
+ *
+ * Called with the queue lock held.
+ */
+void wbt_update_limits(struct request_queue *q)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!rwb)
+		return;
+
+	rwb->max_depth = max(q->nr_requests * 3 / 4, 1UL);
+	wbt_calc_window(rwb);
+}
+
+u64 wbt_get_min_lat(struct request_queue *q)
+{
+	return q->rq_wb ? q->rq_wb->min_lat_nsec : 0;
+}
+
+/**
+ * wbt_set_min_lat - set the read latency target
+ * @q: request queue
+ * @nsec: new target, 0 disables throttling
+ *
+ * Called with the queue lock held.
+ */
+void wbt_set_min_lat(struct request_queue *q, u64 nsec)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	rwb->min_lat_nsec = nsec;
+	rwb->scale_step = 0;
+	rwb->nr_reads = 0;
+	rwb->read_min_nsec = 0;
+	wbt_calc_window(rwb);
+
+	/* let everybody go if throttling was switched off */
+	if (!nsec)
+		wake_up_all(&rwb->wait);
+}
+
+unsigned int wbt_get_window(struct request_queue *q)
+{
+	return wbt_enabled(q->rq_wb) ? q->rq_wb->window : 0;
+}
+
+/*
+ * Called when the queue is registered, by which time the driver has told
+ * us whether the device is rotational.
+ */
+int wbt_init(struct request_queue *q)
+{
+	struct rq_wb *rwb;
+
+	if (!q->request_fn || q->rq_wb)
+		return 0;
+
+	rwb = kzalloc_node(sizeof(*rwb), GFP_KERNEL, q->node);
+	if (!rwb)
+		return -ENOMEM;
+
+	rwb->q = q;
+	init_waitqueue_head(&rwb->wait);
+	setup_timer(&rwb->timer, wbt_timer_fn, (unsigned long)rwb);
+
+	if (blk_queue_nonrot(q))
+		rwb->min_lat_nsec = WBT_DEF_LAT_NONROT;
+	else
+		rwb->min_lat_nsec = WBT_DEF_LAT_ROT;
+
+	spin_lock_irq(q->queue_lock);
+	q->rq_wb = rwb;
+	wbt_update_limits(q);
+	spin_unlock_irq(q->queue_lock);
+	return 0;
+}
+
+void wbt_exit(struct request_queue *q)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!rwb)
+		return;
+
+	del_timer_sync(&rwb->timer);
+	q->rq_wb = NULL;
+	kfree(rwb);
+}
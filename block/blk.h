@@ -32,6 +32,101 @@ void blk_dequeue_request(struct request *rq);
 void __blk_queue_free_tags(struct request_queue *q);
 bool __blk_end_bidi_request(struct request *rq, int error,
 			    unsigned int nr_bytes, unsigned int bidi_bytes);
+void drive_stat_acct(struct request *rq, int new_io);
+void blk_account_io_done(struct request *req);
+bool blk_attempt_plug_merge(struct request_queue *q, struct bio *bio,
+			    unsigned int *request_count);
+
+/*
+ * Polled completion statistics, kept per cpu.  hist[] counts polled
+ * completions by latency: bucket 0 is below 1us, bucket n covers
+ * [2^(n-1), 2^n) usecs and the last bucket everything above.
+ */
+#define BLK_POLL_HIST_BUCKETS	16
+
+struct blk_poll_stat {
+	unsigned long	considered;	/* blk_poll() calls */
+	unsigned long	invoked;	/* ->poll_fn() calls */
+	unsigned long	success;	/* ->poll_fn() found completions */
+	unsigned long	hist[BLK_POLL_HIST_BUCKETS];
+};
+
+void blk_poll_exit(struct request_queue *q);
+ssize_t blk_poll_stat_show(struct request_queue *q, char *page);
+
+/*
+ * I/O latency histograms, see blk-latency.c.  Buckets are laid out like
+ * the polling histogram above: bucket 0 is below 1us, bucket n covers
+ * [2^(n-1), 2^n) usecs and the last bucket everything above.
+ */
+#define BLK_LAT_HIST_BUCKETS	24
+
+struct blk_lat_hist {
+	unsigned long	cnt[2][BLK_LAT_HIST_BUCKETS];	/* READ, WRITE */
+};
+
+static inline unsigned int blk_lat_hist_bucket(u64 nsec)
+{
+	unsigned int bucket = fls64(div_u64(nsec, NSEC_PER_USEC));
+
+	return min_t(unsigned int, bucket, BLK_LAT_HIST_BUCKETS - 1);
+}
+
+#ifdef CONFIG_BLK_LATENCY_HIST
+enum blk_lat_stage {
+	BLK_LAT_QUEUE,		/* allocation to dispatch to the driver */
+	BLK_LAT_SERVICE,	/* dispatch to completion */
+	BLK_LAT_TOTAL,		/* allocation to completion */
+	BLK_LAT_NR_STAGES,
+};
+
+struct blk_lat_stat {
+	struct blk_lat_hist	stage[BLK_LAT_NR_STAGES];
+};
+
+int blk_latency_init(struct request_queue *q);
+void blk_latency_exit(struct request_queue *q);
+void blk_latency_account(struct request *rq);
+ssize_t blk_latency_show(struct request_queue *q, char *page);
+void blk_latency_reset(struct request_queue *q);
+#else
+static inline int blk_latency_init(struct request_queue *q)
+{
+	return 0;
+}
+static inline void blk_latency_exit(struct request_queue *q) { }
+static inline void blk_latency_account(struct request *rq) { }
+#endif
+
+#ifdef CONFIG_BLK_WBT
+int wbt_init(struct request_queue *q);
+void wbt_exit(struct request_queue *q);
+bool wbt_wait(struct request_queue *q, struct bio *bio);
+void wbt_issue(struct request_queue *q, struct request *rq);
+void wbt_done(struct request_queue *q, struct request *rq);
+void wbt_cancel(struct request_queue *q);
+void wbt_complete(struct request_queue *q, struct request *rq);
+void wbt_update_limits(struct request_queue *q);
+u64 wbt_get_min_lat(struct request_queue *q);
+void wbt_set_min_lat(struct request_queue *q, u64 nsec);
+unsigned int wbt_get_window(struct request_queue *q);
+#else
+static inline int wbt_init(struct request_queue *q)
+{
+	return 0;
+}
+static inline void wbt_exit(struct request_queue *q) { }
+static inline bool wbt_wait(struct request_queue *q, struct bio *bio)
+{
+	return false;
+}
+static inline void wbt_issue(struct request_queue *q, struct request *rq) { }
+static inline void wbt_done(struct request_queue *q, struct request *rq) { }
+static inline void wbt_cancel(struct request_queue *q) { }
+static inline void wbt_complete(struct request_queue *q,
+				struct request *rq) { }
+static inline void wbt_update_limits(struct request_queue *q) { }
+#endif
 
 void blk_rq_timed_out_timer(unsigned long data);
 void blk_delete_timer(struct request *);
@@ -42,6 +137,7 @@ void blk_add_timer(struct request *);
  */
 enum rq_atomic_flags {
 	REQ_ATOM_COMPLETE = 0,
+	REQ_ATOM_STARTED,
 };
 
 /*
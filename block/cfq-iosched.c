@@ -189,6 +189,11 @@ struct cfqg_stats {
 	struct blkg_stat		sectors;
 	/* total disk time and nr sectors dispatched by this group */
 	struct blkg_stat		time;
+#ifdef CONFIG_BLK_LATENCY_HIST
+	/* log2 histograms of service_time and wait_time */
+	struct blk_lat_hist		service_hist;
+	struct blk_lat_hist		wait_hist;
+#endif
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	/* time not charged to this cgroup */
 	struct blkg_stat		unaccounted_time;
@@ -638,12 +643,24 @@ static inline void cfqg_stats_update_completion(struct cfq_group *cfqg,
 {
 	struct cfqg_stats *stats = &cfqg->stats;
 	unsigned long long now = sched_clock();
+#ifdef CONFIG_BLK_LATENCY_HIST
+	int dir = (rw & REQ_WRITE) ? WRITE : READ;
+	u64 service = 0, wait = 0;
+#endif
 
 	if (time_after64(now, io_start_time))
 		blkg_rwstat_add(&stats->service_time, rw, now - io_start_time);
 	if (time_after64(io_start_time, start_time))
 		blkg_rwstat_add(&stats->wait_time, rw,
 				io_start_time - start_time);
+#ifdef CONFIG_BLK_LATENCY_HIST
+	if (time_after64(now, io_start_time))
+		service = now - io_start_time;
+	if (time_after64(io_start_time, start_time))
+		wait = io_start_time - start_time;
+	stats->service_hist.cnt[dir][blk_lat_hist_bucket(service)]++;
+	stats->wait_hist.cnt[dir][blk_lat_hist_bucket(wait)]++;
+#endif
 }
 
 static void cfq_pd_reset_stats(struct blkcg_gq *blkg)
@@ -658,6 +675,10 @@ static void cfq_pd_reset_stats(struct blkcg_gq *blkg)
 	blkg_rwstat_reset(&stats->service_time);
 	blkg_rwstat_reset(&stats->wait_time);
 	blkg_stat_reset(&stats->time);
+#ifdef CONFIG_BLK_LATENCY_HIST
+	memset(&stats->service_hist, 0, sizeof(stats->service_hist));
+	memset(&stats->wait_hist, 0, sizeof(stats->wait_hist));
+#endif
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	blkg_stat_reset(&stats->unaccounted_time);
 	blkg_stat_reset(&stats->avg_queue_size_sum);
@@ -1474,6 +1495,37 @@ static int cfqg_print_rwstat(struct cgroup *cgrp, struct cftype *cft,
 	return 0;
 }
 
+#ifdef CONFIG_BLK_LATENCY_HIST
+static u64 cfqg_prfill_lat_hist(struct seq_file *sf,
+				struct blkg_policy_data *pd, int off)
+{
+	const struct blk_lat_hist *hist = (void *)pd + off;
+	const char *dname = blkg_dev_name(pd->blkg);
+	int rw, i;
+
+	if (!dname)
+		return 0;
+
+	for (rw = READ; rw <= WRITE; rw++) {
+		seq_printf(sf, "%s %s", dname, rw == READ ? "Read" : "Write");
+		for (i = 0; i < BLK_LAT_HIST_BUCKETS; i++)
+			seq_printf(sf, " %lu", hist->cnt[rw][i]);
+		seq_putc(sf, '\n');
+	}
+	return 0;
+}
+
+static int cfqg_print_lat_hist(struct cgroup *cgrp, struct cftype *cft,
+			       struct seq_file *sf)
+{
+	struct blkcg *blkcg = cgroup_to_blkcg(cgrp);
+
+	blkcg_print_blkgs(sf, blkcg, cfqg_prfill_lat_hist, &blkcg_policy_cfq,
+			  cft->private, false);
+	return 0;
+}
+#endif	/* CONFIG_BLK_LATENCY_HIST */
+
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 static u64 cfqg_prfill_avg_queue_size(struct seq_file *sf,
 				      struct blkg_policy_data *pd, int off)
@@ -1554,6 +1606,18 @@ static struct cftype cfq_blkcg_files[] = {
 		.private = offsetof(struct cfq_group, stats.queued),
 		.read_seq_string = cfqg_print_rwstat,
 	},
+#ifdef CONFIG_BLK_LATENCY_HIST
+	{
+		.name = "io_service_time_hist",
+		.private = offsetof(struct cfq_group, stats.service_hist),
+		.read_seq_string = cfqg_print_lat_hist,
+	},
+	{
+		.name = "io_wait_time_hist",
+		.private = offsetof(struct cfq_group, stats.wait_hist),
+		.read_seq_string = cfqg_print_lat_hist,
+	},
+#endif
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	{
 		.name = "avg_queue_size",
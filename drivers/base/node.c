@@ -118,6 +118,9 @@ static ssize_t node_read_meminfo(struct device *dev,
 		       "Node %d SUnreclaim:     %8lu kB\n"
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 		       "Node %d AnonHugePages:  %8lu kB\n"
+#endif
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+		       "Node %d AnonHugePudPages: %6lu kB\n"
 #endif
 			,
 		       nid, K(node_page_state(nid, NR_FILE_DIRTY)),
@@ -145,7 +148,13 @@ static ssize_t node_read_meminfo(struct device *dev,
 		       nid, K(node_page_state(nid, NR_SLAB_UNRECLAIMABLE))
 			, nid,
 			K(node_page_state(nid, NR_ANON_TRANSPARENT_HUGEPAGES) *
-			HPAGE_PMD_NR));
+			HPAGE_PMD_NR)
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+			, nid,
+			K(node_page_state(nid, NR_ANON_PUD_HUGEPAGES) *
+			HPAGE_PUD_NR)
+#endif
+			);
 #else
 		       nid, K(node_page_state(nid, NR_SLAB_UNRECLAIMABLE)));
 #endif
@@ -76,6 +76,7 @@
 #include <linux/sysfs.h>
 #include <linux/miscdevice.h>
 #include <linux/falloc.h>
+#include <linux/workqueue.h>
 
 #include <asm/uaccess.h>
 
@@ -85,6 +86,21 @@ static DEFINE_MUTEX(loop_index_mutex);
 static int max_part;
 static int part_shift;
 
+/*
+ * Direct I/O: bios are handed to a pool of workers instead of the loop
+ * thread, so that many of them are in flight against the backing file at
+ * once.  The I/O still goes through the backing file, but like O_DIRECT
+ * a bio only completes once its data is on the device, and the range it
+ * covered is dropped from the page cache again so that it isn't cached
+ * twice.
+ */
+#define LOOP_DIO_WORKERS	16
+
+struct loop_dio_worker {
+	struct work_struct	work;
+	struct loop_device	*lo;
+};
+
 /*
  * Transfer functions
  */
@@ -458,6 +474,132 @@ out:
 	return ret;
 }
 
+/*
+ * Write the range of a completed bio through to the device and drop it
+ * from the page cache.  invalidate_mapping_pages() leaves pages alone that
+ * are dirty, mapped or in use, so other users of the file are not hurt.
+ */
+static int loop_dio_sync_range(struct loop_device *lo, struct bio *bio)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	loff_t pos = ((loff_t) bio->bi_sector << 9) + lo->lo_offset;
+	loff_t end = pos + bio->bi_size - 1;
+	int ret = 0;
+
+	if (!bio->bi_size || (bio->bi_rw & REQ_DISCARD))
+		return 0;
+
+	if (bio_rw(bio) == WRITE) {
+		ret = filemap_write_and_wait_range(mapping, pos, end);
+		if (unlikely(ret))
+			ret = -EIO;
+	}
+	invalidate_mapping_pages(mapping, pos >> PAGE_CACHE_SHIFT,
+				 end >> PAGE_CACHE_SHIFT);
+	return ret;
+}
+
+static void loop_dio_work_fn(struct work_struct *work)
+{
+	struct loop_dio_worker *worker =
+		container_of(work, struct loop_dio_worker, work);
+	struct loop_device *lo = worker->lo;
+	struct bio *bio;
+	int ret;
+
+	spin_lock_irq(&lo->lo_lock);
+	while ((bio = bio_list_pop(&lo->lo_dio_list))) {
+		spin_unlock_irq(&lo->lo_lock);
+
+		ret = do_bio_filebacked(lo, bio);
+		if (!ret)
+			ret = loop_dio_sync_range(lo, bio);
+		bio_endio(bio, ret);
+
+		spin_lock_irq(&lo->lo_lock);
+	}
+	spin_unlock_irq(&lo->lo_lock);
+}
+
+/*
+ * Queue @bio for the workers and kick the next one.  A worker keeps
+ * going until the list is empty, so no bio is left behind if the one
+ * kicked is already busy.  Called with lo_lock held, which keeps
+ * loop_dio_disable() from tearing the workers down under us.
+ */
+static void loop_dio_queue(struct loop_device *lo, struct bio *bio)
+{
+	struct loop_dio_worker *worker;
+
+	bio_list_add(&lo->lo_dio_list, bio);
+	worker = lo->lo_dio_workers + lo->lo_dio_next++ % LOOP_DIO_WORKERS;
+	queue_work(lo->lo_dio_wq, &worker->work);
+}
+
+/*
+ * Set up the workers from process context, before the switch, as the
+ * loop thread must not allocate memory with __GFP_IO.
+ */
+static int loop_dio_alloc(struct loop_device *lo)
+{
+	int i;
+
+	lo->lo_dio_workers = kcalloc(LOOP_DIO_WORKERS,
+				     sizeof(struct loop_dio_worker),
+				     GFP_KERNEL);
+	if (!lo->lo_dio_workers)
+		return -ENOMEM;
+	lo->lo_dio_wq = alloc_workqueue("loop%d_dio",
+					WQ_MEM_RECLAIM | WQ_UNBOUND,
+					LOOP_DIO_WORKERS, lo->lo_number);
+	if (!lo->lo_dio_wq) {
+		kfree(lo->lo_dio_workers);
+		lo->lo_dio_workers = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < LOOP_DIO_WORKERS; i++) {
+		INIT_WORK(&lo->lo_dio_workers[i].work, loop_dio_work_fn);
+		lo->lo_dio_workers[i].lo = lo;
+	}
+	bio_list_init(&lo->lo_dio_list);
+	lo->lo_dio_next = 0;
+	return 0;
+}
+
+static void loop_dio_free(struct loop_device *lo)
+{
+	destroy_workqueue(lo->lo_dio_wq);
+	lo->lo_dio_wq = NULL;
+	kfree(lo->lo_dio_workers);
+	lo->lo_dio_workers = NULL;
+}
+
+/*
+ * Called from the loop thread, so all bios queued before the switch have
+ * been handled by it.
+ */
+static void loop_dio_enable(struct loop_device *lo)
+{
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+}
+
+/*
+ * Called from the loop thread, or from loop_clr_fd() once the thread is
+ * gone and no new bios can come in.  destroy_workqueue() waits for the
+ * workers to drain lo_dio_list.
+ */
+static void loop_dio_disable(struct loop_device *lo)
+{
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+
+	loop_dio_free(lo);
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -489,8 +631,12 @@ static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
-	loop_add_bio(lo, old_bio);
-	wake_up(&lo->lo_event);
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		loop_dio_queue(lo, old_bio);
+	} else {
+		loop_add_bio(lo, old_bio);
+		wake_up(&lo->lo_event);
+	}
 	spin_unlock_irq(&lo->lo_lock);
 	return;
 
@@ -501,6 +647,8 @@ out:
 
 struct switch_request {
 	struct file *file;
+	int dio;		/* direct I/O mode to switch to, or -1 */
+	int error;
 	struct completion wait;
 };
 
@@ -511,6 +659,11 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+	} else if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		/* queued behind the switch that enabled direct I/O */
+		spin_lock_irq(&lo->lo_lock);
+		loop_dio_queue(lo, bio);
+		spin_unlock_irq(&lo->lo_lock);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
@@ -560,7 +713,7 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct file *file, int dio)
 {
 	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
@@ -568,11 +721,30 @@ static int loop_switch(struct loop_device *lo, struct file *file)
 		return -ENOMEM;
 	init_completion(&w.wait);
 	w.file = file;
+	w.dio = dio;
+	w.error = 0;
 	bio->bi_private = &w;
 	bio->bi_bdev = NULL;
-	loop_make_request(lo->lo_queue, bio);
+	/*
+	 * Queue it by hand, loop_make_request() would send it down in
+	 * direct I/O mode.
+	 */
+	spin_lock_irq(&lo->lo_lock);
+	if (lo->lo_state != Lo_bound) {
+		spin_unlock_irq(&lo->lo_lock);
+		bio_put(bio);
+		return -ENXIO;
+	}
+	loop_add_bio(lo, bio);
+	wake_up(&lo->lo_event);
+	spin_unlock_irq(&lo->lo_lock);
 	wait_for_completion(&w.wait);
-	return 0;
+	return w.error;
+}
+
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	return __loop_switch(lo, file, -1);
 }
 
 /*
@@ -596,6 +768,18 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	if (p->dio >= 0) {
+		if (p->dio)
+			loop_dio_enable(lo);
+		else
+			loop_dio_disable(lo);
+		goto out;
+	}
+
+	/* make a flush wait for the workers as well */
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		flush_workqueue(lo->lo_dio_wq);
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -636,6 +820,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
 		goto out;
 
+	/* the direct I/O workers use the file outside the loop thread */
+	error = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
+
 	error = -EBADF;
 	file = fget(arg);
 	if (!file)
@@ -743,11 +932,19 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RO(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -755,6 +952,7 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -988,6 +1186,9 @@ static int loop_clr_fd(struct loop_device *lo)
 
 	kthread_stop(lo->lo_thread);
 
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		loop_dio_disable(lo);
+
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
 	spin_unlock_irq(&lo->lo_lock);
@@ -1048,6 +1249,9 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		return -ENXIO;
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
+	/* the direct I/O workers don't stop for a new transfer function */
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) && info->lo_encrypt_type)
+		return -EBUSY;
 
 	err = loop_release_xfer(lo);
 	if (err)
@@ -1247,6 +1451,28 @@ loop_get_status64(struct loop_device *lo, struct loop_info64 __user *arg) {
 	return err;
 }
 
+static int loop_set_dio(struct loop_device *lo, unsigned long arg)
+{
+	int err;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+	if (!!arg == !!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+	if (arg) {
+		if (lo->transfer != transfer_none)
+			return -EINVAL;
+		err = loop_dio_alloc(lo);
+		if (err)
+			return err;
+	}
+
+	err = __loop_switch(lo, NULL, !!arg);
+	if (err && arg)
+		loop_dio_free(lo);
+	return err;
+}
+
 static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 {
 	int err;
@@ -1316,6 +1542,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
+			err = loop_set_dio(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1470,6 +1701,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -692,6 +692,27 @@ static irqreturn_t nvme_irq_check(int irq, void *data)
 	return IRQ_WAKE_THREAD;
 }
 
+/*
+ * Reap completions on the queue of the current CPU for a task polling
+ * for its I/O instead of waiting for the interrupt.
+ */
+static int nvme_poll(struct request_queue *q)
+{
+	struct nvme_ns *ns = q->queuedata;
+	struct nvme_queue *nvmeq = get_nvmeq(ns->dev);
+	volatile struct nvme_completion *cqe = &nvmeq->cqes[nvmeq->cq_head];
+	int found = 0;
+
+	if ((le16_to_cpu(cqe->status) & 1) == nvmeq->cq_phase) {
+		spin_lock_irq(&nvmeq->q_lock);
+		found = nvme_process_cq(nvmeq) == IRQ_HANDLED;
+		spin_unlock_irq(&nvmeq->q_lock);
+	}
+	put_nvmeq(nvmeq);
+
+	return found;
+}
+
 static void nvme_abort_command(struct nvme_queue *nvmeq, int cmdid)
 {
 	spin_lock_irq(&nvmeq->q_lock);
@@ -1353,6 +1374,7 @@ static struct nvme_ns *nvme_alloc_ns(struct nvme_dev *dev, int nsid,
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, ns->queue);
 /*	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, ns->queue); */
 	blk_queue_make_request(ns->queue, nvme_make_request);
+	blk_queue_poll_fn(ns->queue, nvme_poll);
 	ns->dev = dev;
 	ns->queue->queuedata = ns;
 
@@ -0,0 +1,939 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-metadata.h"
+
+#include "persistent-data/dm-btree.h"
+#include "persistent-data/dm-space-map.h"
+#include "persistent-data/dm-transaction-manager.h"
+
+#include <linux/device-mapper.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+/*--------------------------------------------------------------------------
+ * As far as the metadata goes, there is:
+ *
+ * - A superblock in block zero, taking up fewer than 512 bytes for
+ *   atomic writes.
+ *
+ * - A space map managing the metadata blocks.
+ *
+ * - A btree mapping cache blocks onto origin blocks.  The value holds
+ *   the origin block in the top 48 bits and some flags in the low 16.
+ *
+ * - A btree mapping cache blocks onto the 32-bit hints of the policy
+ *   named in the superblock.
+ *
+ * Dirty flags and hints are only brought up to date at clean shutdown.
+ * If the superblock doesn't carry the CLEAN_SHUTDOWN flag every mapped
+ * block is assumed to be dirty when the metadata is loaded.
+ *--------------------------------------------------------------------------*/
+
+#define DM_MSG_PREFIX   "cache metadata"
+
+#define CACHE_SUPERBLOCK_MAGIC 06142003
+#define CACHE_SUPERBLOCK_LOCATION 0
+#define CACHE_VERSION 1
+#define CACHE_METADATA_CACHE_SIZE 64
+
+/*
+ *  3 for btree insert +
+ *  2 for btree lookup used within space map +
+ *  3 for the path held by a walk that does lookups
+ */
+#define CACHE_MAX_CONCURRENT_LOCKS 8
+
+/* This should be plenty */
+#define SPACE_MAP_ROOT_SIZE 128
+
+enum superblock_flag_bits {
+	/* for spotting crashes that would invalidate the dirty flags */
+	CLEAN_SHUTDOWN,
+};
+
+/*
+ * Little endian on-disk superblock.
+ */
+struct cache_disk_superblock {
+	__le32 csum;	/* Checksum of superblock except for this field. */
+	__le32 flags;
+	__le64 blocknr;	/* This block number, dm_block_t. */
+
+	__u8 uuid[16];
+	__le64 magic;
+	__le32 version;
+
+	__u8 policy_name[CACHE_POLICY_NAME_SIZE];
+	__le32 policy_hint_size;
+
+	__u8 metadata_space_map_root[SPACE_MAP_ROOT_SIZE];
+
+	__le64 mapping_root;
+	__le64 hint_root;
+
+	__le32 data_block_size;		/* In 512-byte sectors. */
+	__le32 metadata_block_size;	/* In 512-byte sectors. */
+	__le32 cache_blocks;
+
+	__le32 compat_flags;
+	__le32 compat_ro_flags;
+	__le32 incompat_flags;
+
+	__le32 read_hits;
+	__le32 read_misses;
+	__le32 write_hits;
+	__le32 write_misses;
+} __packed;
+
+struct dm_cache_metadata {
+	struct list_head list;
+	int ref_count;
+
+	struct block_device *bdev;
+	struct dm_block_manager *bm;
+	struct dm_space_map *metadata_sm;
+	struct dm_transaction_manager *tm;
+
+	struct dm_btree_info info;
+	struct dm_btree_info hint_info;
+
+	struct rw_semaphore root_lock;
+	dm_block_t root;
+	dm_block_t hint_root;
+	sector_t data_block_size;
+	dm_cblock_t cache_blocks;
+	unsigned long flags;
+	bool changed:1;
+
+	char policy_name[CACHE_POLICY_NAME_SIZE];
+	struct dm_cache_statistics stats;
+};
+
+/*----------------------------------------------------------------
+ * superblock validator
+ *--------------------------------------------------------------*/
+
+#define SUPERBLOCK_CSUM_XOR 9031977
+
+static void sb_prepare_for_write(struct dm_block_validator *v,
+				 struct dm_block *b,
+				 size_t block_size)
+{
+	struct cache_disk_superblock *disk_super = dm_block_data(b);
+
+	disk_super->blocknr = cpu_to_le64(dm_block_location(b));
+	disk_super->csum = cpu_to_le32(dm_bm_checksum(&disk_super->flags,
+						      block_size - sizeof(__le32),
+						      SUPERBLOCK_CSUM_XOR));
+}
+
+static int sb_check(struct dm_block_validator *v,
+		    struct dm_block *b,
+		    size_t block_size)
+{
+	struct cache_disk_superblock *disk_super = dm_block_data(b);
+	__le32 csum_le;
+
+	if (dm_block_location(b) != le64_to_cpu(disk_super->blocknr)) {
+		DMERR("sb_check failed: blocknr %llu: wanted %llu",
+		      le64_to_cpu(disk_super->blocknr),
+		      (unsigned long long)dm_block_location(b));
+		return -ENOTBLK;
+	}
+
+	if (le64_to_cpu(disk_super->magic) != CACHE_SUPERBLOCK_MAGIC) {
+		DMERR("sb_check failed: magic %llu: wanted %llu",
+		      le64_to_cpu(disk_super->magic),
+		      (unsigned long long)CACHE_SUPERBLOCK_MAGIC);
+		return -EILSEQ;
+	}
+
+	csum_le = cpu_to_le32(dm_bm_checksum(&disk_super->flags,
+					     block_size - sizeof(__le32),
+					     SUPERBLOCK_CSUM_XOR));
+	if (csum_le != disk_super->csum) {
+		DMERR("sb_check failed: csum %u: wanted %u",
+		      le32_to_cpu(csum_le), le32_to_cpu(disk_super->csum));
+		return -EILSEQ;
+	}
+
+	return 0;
+}
+
+static struct dm_block_validator sb_validator = {
+	.name = "superblock",
+	.prepare_for_write = sb_prepare_for_write,
+	.check = sb_check
+};
+
+/*----------------------------------------------------------------
+ * Methods for the btree value types
+ *--------------------------------------------------------------*/
+
+enum mapping_bits {
+	/*
+	 * A mapping only exists in the btree if it's valid, the flag is
+	 * there to catch stray zeroed values.
+	 */
+	M_VALID = 1,
+
+	/*
+	 * The data on the cache is different from that on the origin.
+	 */
+	M_DIRTY = 2
+};
+
+static __le64 pack_value(dm_oblock_t block, unsigned flags)
+{
+	uint64_t value = from_oblock(block);
+	value <<= 16;
+	value = value | (flags & ((1 << 16) - 1));
+	return cpu_to_le64(value);
+}
+
+static void unpack_value(__le64 value_le, dm_oblock_t *block, unsigned *flags)
+{
+	uint64_t value = le64_to_cpu(value_le);
+	uint64_t b = value >> 16;
+	*block = to_oblock(b);
+	*flags = value & ((1 << 16) - 1);
+}
+
+/*----------------------------------------------------------------*/
+
+static int superblock_lock_zero(struct dm_cache_metadata *cmd,
+				struct dm_block **sblock)
+{
+	return dm_bm_write_lock_zero(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+				     &sb_validator, sblock);
+}
+
+static int superblock_lock(struct dm_cache_metadata *cmd,
+			   struct dm_block **sblock)
+{
+	return dm_bm_write_lock(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+				&sb_validator, sblock);
+}
+
+static int __superblock_all_zeroes(struct dm_block_manager *bm, int *result)
+{
+	int r;
+	unsigned i;
+	struct dm_block *b;
+	__le64 *data_le, zero = cpu_to_le64(0);
+	unsigned block_size = dm_bm_block_size(bm) / sizeof(__le64);
+
+	/*
+	 * We can't use a validator here - it may be all zeroes.
+	 */
+	r = dm_bm_read_lock(bm, CACHE_SUPERBLOCK_LOCATION, NULL, &b);
+	if (r)
+		return r;
+
+	data_le = dm_block_data(b);
+	*result = 1;
+	for (i = 0; i < block_size; i++) {
+		if (data_le[i] != zero) {
+			*result = 0;
+			break;
+		}
+	}
+
+	return dm_bm_unlock(b);
+}
+
+static void __setup_mapping_info(struct dm_cache_metadata *cmd)
+{
+	cmd->info.tm = cmd->tm;
+	cmd->info.levels = 1;
+	cmd->info.value_type.context = NULL;
+	cmd->info.value_type.size = sizeof(__le64);
+	cmd->info.value_type.inc = NULL;
+	cmd->info.value_type.dec = NULL;
+	cmd->info.value_type.equal = NULL;
+
+	cmd->hint_info.tm = cmd->tm;
+	cmd->hint_info.levels = 1;
+	cmd->hint_info.value_type.context = NULL;
+	cmd->hint_info.value_type.size = sizeof(__le32);
+	cmd->hint_info.value_type.inc = NULL;
+	cmd->hint_info.value_type.dec = NULL;
+	cmd->hint_info.value_type.equal = NULL;
+}
+
+static int __write_initial_superblock(struct dm_cache_metadata *cmd)
+{
+	int r;
+	struct dm_block *sblock;
+	size_t metadata_len;
+	struct cache_disk_superblock *disk_super;
+
+	/*
+	 * We need to know if the cache_disk_superblock exceeds a 512-byte sector.
+	 */
+	BUILD_BUG_ON(sizeof(struct cache_disk_superblock) > 512);
+
+	r = dm_sm_root_size(cmd->metadata_sm, &metadata_len);
+	if (r < 0)
+		return r;
+
+	r = dm_tm_pre_commit(cmd->tm);
+	if (r < 0)
+		return r;
+
+	r = superblock_lock_zero(cmd, &sblock);
+	if (r)
+		return r;
+
+	disk_super = dm_block_data(sblock);
+	disk_super->flags = 0;
+	memset(disk_super->uuid, 0, sizeof(disk_super->uuid));
+	disk_super->magic = cpu_to_le64(CACHE_SUPERBLOCK_MAGIC);
+	disk_super->version = cpu_to_le32(CACHE_VERSION);
+	memset(disk_super->policy_name, 0, sizeof(disk_super->policy_name));
+	disk_super->policy_hint_size = cpu_to_le32(sizeof(__le32));
+
+	r = dm_sm_copy_root(cmd->metadata_sm, &disk_super->metadata_space_map_root,
+			    metadata_len);
+	if (r < 0)
+		goto bad_locked;
+
+	disk_super->mapping_root = cpu_to_le64(cmd->root);
+	disk_super->hint_root = cpu_to_le64(cmd->hint_root);
+	disk_super->data_block_size = cpu_to_le32(cmd->data_block_size);
+	disk_super->metadata_block_size = cpu_to_le32(DM_CACHE_METADATA_BLOCK_SIZE >> SECTOR_SHIFT);
+	disk_super->cache_blocks = cpu_to_le32(0);
+
+	disk_super->read_hits = cpu_to_le32(0);
+	disk_super->read_misses = cpu_to_le32(0);
+	disk_super->write_hits = cpu_to_le32(0);
+	disk_super->write_misses = cpu_to_le32(0);
+
+	return dm_tm_commit(cmd->tm, sblock);
+
+bad_locked:
+	dm_bm_unlock(sblock);
+	return r;
+}
+
+static int __format_metadata(struct dm_cache_metadata *cmd)
+{
+	int r;
+
+	r = dm_tm_create_with_sm(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+				 &cmd->tm, &cmd->metadata_sm);
+	if (r < 0) {
+		DMERR("tm_create_with_sm failed");
+		return r;
+	}
+
+	__setup_mapping_info(cmd);
+
+	r = dm_btree_empty(&cmd->info, &cmd->root);
+	if (r < 0)
+		goto bad;
+
+	r = dm_btree_empty(&cmd->hint_info, &cmd->hint_root);
+	if (r < 0)
+		goto bad;
+
+	r = __write_initial_superblock(cmd);
+	if (r)
+		goto bad;
+
+	return 0;
+
+bad:
+	dm_tm_destroy(cmd->tm);
+	dm_sm_destroy(cmd->metadata_sm);
+
+	return r;
+}
+
+static int __check_incompat_features(struct cache_disk_superblock *disk_super,
+				     struct dm_cache_metadata *cmd)
+{
+	uint32_t features;
+
+	features = le32_to_cpu(disk_super->incompat_flags);
+	if (features) {
+		DMERR("could not access metadata due to unsupported optional features (%lx).",
+		      (unsigned long)features);
+		return -EINVAL;
+	}
+
+	/*
+	 * Check for read-only metadata to skip the following RDWR checks.
+	 */
+	if (get_disk_ro(cmd->bdev->bd_disk))
+		return 0;
+
+	features = le32_to_cpu(disk_super->compat_ro_flags);
+	if (features) {
+		DMERR("could not access metadata RDWR due to unsupported optional features (%lx).",
+		      (unsigned long)features);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int __open_metadata(struct dm_cache_metadata *cmd)
+{
+	int r;
+	struct dm_block *sblock;
+	struct cache_disk_superblock *disk_super;
+	unsigned long sb_flags;
+
+	r = dm_bm_read_lock(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+			    &sb_validator, &sblock);
+	if (r < 0) {
+		DMERR("couldn't read superblock");
+		return r;
+	}
+
+	disk_super = dm_block_data(sblock);
+
+	r = __check_incompat_features(disk_super, cmd);
+	if (r < 0)
+		goto bad;
+
+	if (le32_to_cpu(disk_super->data_block_size) != cmd->data_block_size) {
+		DMERR("changing the data block size (from %u to %llu) is not supported",
+		      le32_to_cpu(disk_super->data_block_size),
+		      (unsigned long long)cmd->data_block_size);
+		r = -EINVAL;
+		goto bad;
+	}
+
+	r = dm_tm_open_with_sm(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+			       disk_super->metadata_space_map_root,
+			       sizeof(disk_super->metadata_space_map_root),
+			       &cmd->tm, &cmd->metadata_sm);
+	if (r < 0) {
+		DMERR("tm_open_with_sm failed");
+		goto bad;
+	}
+
+	__setup_mapping_info(cmd);
+
+	/*
+	 * The clean shutdown flag is cleared with the next commit.
+	 */
+	sb_flags = le32_to_cpu(disk_super->flags);
+	if (!test_bit(CLEAN_SHUTDOWN, &sb_flags))
+		DMWARN("metadata wasn't shut down cleanly, all cached blocks are considered dirty");
+
+	return dm_bm_unlock(sblock);
+
+bad:
+	dm_bm_unlock(sblock);
+	return r;
+}
+
+static int __open_or_format_metadata(struct dm_cache_metadata *cmd,
+				     bool format_device)
+{
+	int r, unformatted;
+
+	r = __superblock_all_zeroes(cmd->bm, &unformatted);
+	if (r)
+		return r;
+
+	if (unformatted)
+		return format_device ? __format_metadata(cmd) : -EPERM;
+
+	return __open_metadata(cmd);
+}
+
+static int __create_persistent_data_objects(struct dm_cache_metadata *cmd,
+					    bool may_format_device)
+{
+	int r;
+
+	cmd->bm = dm_block_manager_create(cmd->bdev, DM_CACHE_METADATA_BLOCK_SIZE,
+					  CACHE_METADATA_CACHE_SIZE,
+					  CACHE_MAX_CONCURRENT_LOCKS);
+	if (IS_ERR(cmd->bm)) {
+		DMERR("could not create block manager");
+		return PTR_ERR(cmd->bm);
+	}
+
+	r = __open_or_format_metadata(cmd, may_format_device);
+	if (r)
+		dm_block_manager_destroy(cmd->bm);
+
+	return r;
+}
+
+static void __destroy_persistent_data_objects(struct dm_cache_metadata *cmd)
+{
+	dm_sm_destroy(cmd->metadata_sm);
+	dm_tm_destroy(cmd->tm);
+	dm_block_manager_destroy(cmd->bm);
+}
+
+static int __begin_transaction(struct dm_cache_metadata *cmd)
+{
+	int r;
+	struct cache_disk_superblock *disk_super;
+	struct dm_block *sblock;
+
+	r = dm_bm_read_lock(cmd->bm, CACHE_SUPERBLOCK_LOCATION,
+			    &sb_validator, &sblock);
+	if (r)
+		return r;
+
+	disk_super = dm_block_data(sblock);
+	cmd->root = le64_to_cpu(disk_super->mapping_root);
+	cmd->hint_root = le64_to_cpu(disk_super->hint_root);
+	cmd->cache_blocks = to_cblock(le32_to_cpu(disk_super->cache_blocks));
+	cmd->flags = le32_to_cpu(disk_super->flags);
+	strncpy(cmd->policy_name, (char *) disk_super->policy_name,
+		sizeof(cmd->policy_name));
+
+	cmd->stats.read_hits = le32_to_cpu(disk_super->read_hits);
+	cmd->stats.read_misses = le32_to_cpu(disk_super->read_misses);
+	cmd->stats.write_hits = le32_to_cpu(disk_super->write_hits);
+	cmd->stats.write_misses = le32_to_cpu(disk_super->write_misses);
+
+	cmd->changed = false;
+
+	dm_bm_unlock(sblock);
+	return 0;
+}
+
+static int __commit_transaction(struct dm_cache_metadata *cmd,
+				bool clean_shutdown)
+{
+	int r;
+	size_t metadata_len;
+	struct cache_disk_superblock *disk_super;
+	struct dm_block *sblock;
+
+	r = dm_tm_pre_commit(cmd->tm);
+	if (r < 0)
+		return r;
+
+	r = dm_sm_root_size(cmd->metadata_sm, &metadata_len);
+	if (r < 0)
+		return r;
+
+	r = superblock_lock(cmd, &sblock);
+	if (r)
+		return r;
+
+	if (clean_shutdown)
+		set_bit(CLEAN_SHUTDOWN, &cmd->flags);
+	else
+		clear_bit(CLEAN_SHUTDOWN, &cmd->flags);
+
+	disk_super = dm_block_data(sblock);
+	disk_super->flags = cpu_to_le32(cmd->flags);
+	disk_super->mapping_root = cpu_to_le64(cmd->root);
+	disk_super->hint_root = cpu_to_le64(cmd->hint_root);
+	disk_super->cache_blocks = cpu_to_le32(from_cblock(cmd->cache_blocks));
+	strncpy((char *) disk_super->policy_name, cmd->policy_name,
+		sizeof(disk_super->policy_name));
+
+	disk_super->read_hits = cpu_to_le32(cmd->stats.read_hits);
+	disk_super->read_misses = cpu_to_le32(cmd->stats.read_misses);
+	disk_super->write_hits = cpu_to_le32(cmd->stats.write_hits);
+	disk_super->write_misses = cpu_to_le32(cmd->stats.write_misses);
+
+	r = dm_sm_copy_root(cmd->metadata_sm, &disk_super->metadata_space_map_root,
+			    metadata_len);
+	if (r < 0) {
+		dm_bm_unlock(sblock);
+		return r;
+	}
+
+	r = dm_tm_commit(cmd->tm, sblock);
+	if (!r)
+		cmd->changed = false;
+
+	return r;
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * A metadata device is shared by all the tables that refer to it, so a
+ * table reload doesn't end up with two transaction managers writing to
+ * the same device.
+ */
+static DEFINE_MUTEX(table_lock);
+static LIST_HEAD(table);
+
+static struct dm_cache_metadata *__metadata_open(struct block_device *bdev,
+						 sector_t data_block_size,
+						 bool may_format_device)
+{
+	int r;
+	struct dm_cache_metadata *cmd;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd) {
+		DMERR("could not allocate metadata struct");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	init_rwsem(&cmd->root_lock);
+	cmd->ref_count = 1;
+	cmd->bdev = bdev;
+	cmd->data_block_size = data_block_size;
+
+	r = __create_persistent_data_objects(cmd, may_format_device);
+	if (r) {
+		kfree(cmd);
+		return ERR_PTR(r);
+	}
+
+	r = __begin_transaction(cmd);
+	if (r < 0) {
+		__destroy_persistent_data_objects(cmd);
+		kfree(cmd);
+		return ERR_PTR(r);
+	}
+
+	return cmd;
+}
+
+struct dm_cache_metadata *dm_cache_metadata_open(struct block_device *bdev,
+						 sector_t data_block_size,
+						 bool may_format_device)
+{
+	struct dm_cache_metadata *cmd;
+
+	mutex_lock(&table_lock);
+	list_for_each_entry(cmd, &table, list)
+		if (cmd->bdev == bdev) {
+			if (cmd->data_block_size != data_block_size) {
+				DMERR("data_block_size (%llu) different from that in metadata (%llu)",
+				      (unsigned long long)data_block_size,
+				      (unsigned long long)cmd->data_block_size);
+				cmd = ERR_PTR(-EINVAL);
+			} else
+				cmd->ref_count++;
+			goto out;
+		}
+
+	cmd = __metadata_open(bdev, data_block_size, may_format_device);
+	if (!IS_ERR(cmd))
+		list_add(&cmd->list, &table);
+out:
+	mutex_unlock(&table_lock);
+
+	return cmd;
+}
+
+void dm_cache_metadata_close(struct dm_cache_metadata *cmd)
+{
+	mutex_lock(&table_lock);
+	if (--cmd->ref_count) {
+		mutex_unlock(&table_lock);
+		return;
+	}
+	list_del(&cmd->list);
+	mutex_unlock(&table_lock);
+
+	__destroy_persistent_data_objects(cmd);
+	kfree(cmd);
+}
+
+/*----------------------------------------------------------------*/
+
+struct check_size_context {
+	dm_cblock_t new_cache_size;
+};
+
+static int __check_mapping_size(void *context, uint64_t *keys, void *leaf)
+{
+	struct check_size_context *csc = context;
+
+	if (keys[0] >= from_cblock(csc->new_cache_size)) {
+		DMERR("unable to shrink cache; cache block %llu is in use",
+		      (unsigned long long)keys[0]);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int dm_cache_resize(struct dm_cache_metadata *cmd, dm_cblock_t new_cache_size)
+{
+	int r = 0;
+	struct check_size_context csc;
+
+	down_write(&cmd->root_lock);
+	if (from_cblock(new_cache_size) < from_cblock(cmd->cache_blocks)) {
+		csc.new_cache_size = new_cache_size;
+		r = dm_btree_walk(&cmd->info, cmd->root, __check_mapping_size, &csc);
+		if (r)
+			goto out;
+	}
+
+	if (from_cblock(new_cache_size) != from_cblock(cmd->cache_blocks)) {
+		cmd->cache_blocks = new_cache_size;
+		cmd->changed = true;
+	}
+out:
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+dm_cblock_t dm_cache_size(struct dm_cache_metadata *cmd)
+{
+	dm_cblock_t r;
+
+	down_read(&cmd->root_lock);
+	r = cmd->cache_blocks;
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+struct load_context {
+	struct dm_cache_metadata *cmd;
+	bool hints_valid;
+	bool clean_shutdown;
+	load_mapping_fn fn;
+	void *context;
+};
+
+static int __load_mapping(void *context, uint64_t *keys, void *leaf)
+{
+	int r;
+	struct load_context *lc = context;
+	struct dm_cache_metadata *cmd = lc->cmd;
+	dm_oblock_t oblock;
+	unsigned flags;
+	__le64 value;
+	__le32 hint_le = cpu_to_le32(0);
+	bool hint_valid = false;
+
+	memcpy(&value, leaf, sizeof(value));
+	unpack_value(value, &oblock, &flags);
+
+	if (!(flags & M_VALID))
+		return 0;
+
+	if (lc->hints_valid) {
+		r = dm_btree_lookup(&cmd->hint_info, cmd->hint_root, keys, &hint_le);
+		if (!r)
+			hint_valid = true;
+		else if (r != -ENODATA)
+			return r;
+	}
+
+	return lc->fn(lc->context, oblock, to_cblock(keys[0]),
+		      !lc->clean_shutdown || (flags & M_DIRTY),
+		      le32_to_cpu(hint_le), hint_valid);
+}
+
+int dm_cache_load_mappings(struct dm_cache_metadata *cmd,
+			   const char *policy_name,
+			   load_mapping_fn fn,
+			   void *context)
+{
+	int r;
+	struct load_context lc;
+
+	down_read(&cmd->root_lock);
+	lc.cmd = cmd;
+	lc.hints_valid = !strncmp(cmd->policy_name, policy_name,
+				  sizeof(cmd->policy_name));
+	lc.clean_shutdown = test_bit(CLEAN_SHUTDOWN, &cmd->flags);
+	lc.fn = fn;
+	lc.context = context;
+	r = dm_btree_walk(&cmd->info, cmd->root, __load_mapping, &lc);
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_remove_mapping(struct dm_cache_metadata *cmd, dm_cblock_t cblock)
+{
+	int r;
+	uint64_t key = from_cblock(cblock);
+
+	down_write(&cmd->root_lock);
+	r = dm_btree_remove(&cmd->info, cmd->root, &key, &cmd->root);
+	if (!r)
+		cmd->changed = true;
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_insert_mapping(struct dm_cache_metadata *cmd, dm_cblock_t cblock,
+			    dm_oblock_t oblock)
+{
+	int r;
+	uint64_t key = from_cblock(cblock);
+	__le64 value = pack_value(oblock, M_VALID);
+
+	__dm_bless_for_disk(&value);
+
+	down_write(&cmd->root_lock);
+	r = dm_btree_insert(&cmd->info, cmd->root, &key, &value, &cmd->root);
+	if (!r)
+		cmd->changed = true;
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_changed_this_transaction(struct dm_cache_metadata *cmd)
+{
+	int r;
+
+	down_read(&cmd->root_lock);
+	r = cmd->changed;
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_set_dirty(struct dm_cache_metadata *cmd, dm_cblock_t cblock,
+		       dm_oblock_t oblock, bool dirty)
+{
+	int r;
+	uint64_t key = from_cblock(cblock);
+	dm_oblock_t old_oblock;
+	unsigned flags;
+	__le64 value;
+
+	down_write(&cmd->root_lock);
+	r = dm_btree_lookup(&cmd->info, cmd->root, &key, &value);
+	if (r)
+		goto out;
+
+	unpack_value(value, &old_oblock, &flags);
+	if (from_oblock(old_oblock) != from_oblock(oblock)) {
+		DMERR("cache block %u maps origin block %llu, not %llu",
+		      from_cblock(cblock),
+		      (unsigned long long)from_oblock(old_oblock),
+		      (unsigned long long)from_oblock(oblock));
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (!!(flags & M_DIRTY) == dirty)
+		goto out;
+
+	value = pack_value(oblock, M_VALID | (dirty ? M_DIRTY : 0));
+	__dm_bless_for_disk(&value);
+
+	r = dm_btree_insert(&cmd->info, cmd->root, &key, &value, &cmd->root);
+	if (!r)
+		cmd->changed = true;
+out:
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+void dm_cache_metadata_get_stats(struct dm_cache_metadata *cmd,
+				 struct dm_cache_statistics *stats)
+{
+	down_read(&cmd->root_lock);
+	memcpy(stats, &cmd->stats, sizeof(*stats));
+	up_read(&cmd->root_lock);
+}
+
+void dm_cache_metadata_set_stats(struct dm_cache_metadata *cmd,
+				 struct dm_cache_statistics *stats)
+{
+	down_write(&cmd->root_lock);
+	memcpy(&cmd->stats, stats, sizeof(*stats));
+	cmd->changed = true;
+	up_write(&cmd->root_lock);
+}
+
+int dm_cache_commit(struct dm_cache_metadata *cmd, bool clean_shutdown)
+{
+	int r;
+
+	down_write(&cmd->root_lock);
+	r = __commit_transaction(cmd, clean_shutdown);
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_get_free_metadata_block_count(struct dm_cache_metadata *cmd,
+					   dm_block_t *result)
+{
+	int r;
+
+	down_read(&cmd->root_lock);
+	r = dm_sm_get_nr_free(cmd->metadata_sm, result);
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_get_metadata_dev_size(struct dm_cache_metadata *cmd,
+				   dm_block_t *result)
+{
+	int r;
+
+	down_read(&cmd->root_lock);
+	r = dm_sm_get_nr_blocks(cmd->metadata_sm, result);
+	up_read(&cmd->root_lock);
+
+	return r;
+}
+
+/*----------------------------------------------------------------*/
+
+int dm_cache_begin_hints(struct dm_cache_metadata *cmd, const char *policy_name)
+{
+	int r;
+
+	down_write(&cmd->root_lock);
+
+	/*
+	 * Throw away all the old hints, they're rewritten for every cached
+	 * block on each clean shutdown.
+	 */
+	r = dm_btree_del(&cmd->hint_info, cmd->hint_root);
+	if (r)
+		goto out;
+
+	r = dm_btree_empty(&cmd->hint_info, &cmd->hint_root);
+	if (r)
+		goto out;
+
+	strlcpy(cmd->policy_name, policy_name, sizeof(cmd->policy_name));
+	cmd->changed = true;
+out:
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+int dm_cache_save_hint(struct dm_cache_metadata *cmd, dm_cblock_t cblock,
+		       uint32_t hint)
+{
+	int r;
+	uint64_t key = from_cblock(cblock);
+	__le32 value = cpu_to_le32(hint);
+
+	__dm_bless_for_disk(&value);
+
+	down_write(&cmd->root_lock);
+	r = dm_btree_insert(&cmd->hint_info, cmd->hint_root, &key, &value,
+			    &cmd->hint_root);
+	if (!r)
+		cmd->changed = true;
+	up_write(&cmd->root_lock);
+
+	return r;
+}
+
+/*----------------------------------------------------------------*/
@@ -0,0 +1,921 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm-cache-policy.h"
+#include "dm.h"
+
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#define DM_MSG_PREFIX "cache-policy-mq"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Tracks whether the io is sequential or random.  Sequential io isn't
+ * worth promoting, the spindles of the origin handle it well enough and
+ * a large stream would wipe out the cache.
+ */
+enum io_pattern {
+	PATTERN_SEQUENTIAL,
+	PATTERN_RANDOM
+};
+
+struct io_tracker {
+	enum io_pattern pattern;
+
+	unsigned nr_seq_samples;
+	unsigned nr_rand_samples;
+	unsigned thresholds[2];
+
+	sector_t next_sector;
+};
+
+static void iot_init(struct io_tracker *t,
+		     unsigned sequential_threshold, unsigned random_threshold)
+{
+	t->pattern = PATTERN_RANDOM;
+	t->nr_seq_samples = 0;
+	t->nr_rand_samples = 0;
+	t->next_sector = 0;
+	t->thresholds[PATTERN_SEQUENTIAL] = sequential_threshold;
+	t->thresholds[PATTERN_RANDOM] = random_threshold;
+}
+
+static void iot_update(struct io_tracker *t, struct bio *bio)
+{
+	if (bio->bi_sector == t->next_sector)
+		t->nr_seq_samples++;
+	else {
+		/*
+		 * Just one non-sequential IO is enough to reset the
+		 * counters.
+		 */
+		if (t->nr_seq_samples) {
+			t->nr_seq_samples = 0;
+			t->nr_rand_samples = 0;
+		}
+
+		t->nr_rand_samples++;
+	}
+
+	t->next_sector = bio->bi_sector + bio_sectors(bio);
+
+	switch (t->pattern) {
+	case PATTERN_SEQUENTIAL:
+		if (t->nr_rand_samples >= t->thresholds[PATTERN_RANDOM]) {
+			t->pattern = PATTERN_RANDOM;
+			t->nr_seq_samples = t->nr_rand_samples = 0;
+		}
+		break;
+
+	case PATTERN_RANDOM:
+		if (t->nr_seq_samples >= t->thresholds[PATTERN_SEQUENTIAL]) {
+			t->pattern = PATTERN_SEQUENTIAL;
+			t->nr_seq_samples = t->nr_rand_samples = 0;
+		}
+		break;
+	}
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * A queue of entries split into levels by hit count.  Within a level the
+ * entries are kept in lru order, so popping takes the least recently used
+ * entry of the lowest level.
+ */
+#define NR_QUEUE_LEVELS 16u
+
+struct queue {
+	struct list_head qs[NR_QUEUE_LEVELS];
+};
+
+static void queue_init(struct queue *q)
+{
+	unsigned i;
+
+	for (i = 0; i < NR_QUEUE_LEVELS; i++)
+		INIT_LIST_HEAD(q->qs + i);
+}
+
+static void queue_push(struct queue *q, unsigned level, struct list_head *elt)
+{
+	list_add_tail(elt, q->qs + level);
+}
+
+static void queue_remove(struct list_head *elt)
+{
+	list_del_init(elt);
+}
+
+static struct list_head *queue_peek(struct queue *q)
+{
+	unsigned level;
+
+	for (level = 0; level < NR_QUEUE_LEVELS; level++)
+		if (!list_empty(q->qs + level))
+			return q->qs[level].next;
+
+	return NULL;
+}
+
+static struct list_head *queue_pop(struct queue *q)
+{
+	struct list_head *r = queue_peek(q);
+
+	if (r)
+		list_del_init(r);
+
+	return r;
+}
+
+/*----------------------------------------------------------------*/
+
+struct entry {
+	struct hlist_node hlist;
+	struct list_head list;
+	dm_oblock_t oblock;
+	dm_cblock_t cblock;
+	unsigned hit_count;
+
+	bool in_cache:1;
+	bool dirty:1;
+	bool writeback:1;	/* handed out by writeback_work() */
+};
+
+struct mq_policy {
+	struct dm_cache_policy policy;
+
+	/* protects everything */
+	struct mutex lock;
+
+	struct io_tracker tracker;
+
+	/*
+	 * Entries for blocks that aren't in the cache, kept to remember
+	 * their hit counts.
+	 */
+	struct queue pre_cache;
+
+	/*
+	 * Entries for blocks in the cache.  Only clean blocks may be
+	 * replaced, dirty ones have to be written back first.
+	 */
+	struct queue cache_clean;
+	struct queue cache_dirty;
+
+	/*
+	 * Hit counts are halved every generation_period lookups so the
+	 * queues follow changes of the working set.
+	 */
+	unsigned tick;
+	unsigned generation_period;
+
+	unsigned read_promote_adjustment;
+	unsigned write_promote_adjustment;
+
+	/*
+	 * The entries are preallocated, an entry for a block that isn't in
+	 * the cache is recycled when they run out.
+	 */
+	unsigned nr_entries;
+	unsigned nr_entries_allocated;
+	struct list_head free;
+	struct entry *entries;
+
+	dm_cblock_t cache_size;
+	unsigned nr_cblocks_allocated;
+	unsigned nr_dirty;
+	unsigned long *allocation_bitset;
+	unsigned find_free_last;
+
+	unsigned hash_bits;
+	struct hlist_head *table;
+};
+
+/*----------------------------------------------------------------*/
+
+static void hash_insert(struct mq_policy *mq, struct entry *e)
+{
+	unsigned h = hash_64(from_oblock(e->oblock), mq->hash_bits);
+
+	hlist_add_head(&e->hlist, mq->table + h);
+}
+
+static struct entry *hash_lookup(struct mq_policy *mq, dm_oblock_t oblock)
+{
+	unsigned h = hash_64(from_oblock(oblock), mq->hash_bits);
+	struct hlist_head *bucket = mq->table + h;
+	struct hlist_node *tmp;
+	struct entry *e;
+
+	hlist_for_each_entry(e, tmp, bucket, hlist)
+		if (e->oblock == oblock) {
+			/* keep recently used entries at the front */
+			hlist_del(&e->hlist);
+			hlist_add_head(&e->hlist, bucket);
+			return e;
+		}
+
+	return NULL;
+}
+
+static void hash_remove(struct entry *e)
+{
+	hlist_del(&e->hlist);
+}
+
+/*----------------------------------------------------------------*/
+
+static bool any_free_cblocks(struct mq_policy *mq)
+{
+	return mq->nr_cblocks_allocated < from_cblock(mq->cache_size);
+}
+
+static int alloc_cblock(struct mq_policy *mq, dm_cblock_t *result)
+{
+	unsigned nr = from_cblock(mq->cache_size);
+	unsigned b = find_next_zero_bit(mq->allocation_bitset, nr,
+					mq->find_free_last);
+
+	if (b >= nr) {
+		b = find_first_zero_bit(mq->allocation_bitset, nr);
+		if (b >= nr)
+			return -ENOSPC;
+	}
+
+	set_bit(b, mq->allocation_bitset);
+	mq->nr_cblocks_allocated++;
+	mq->find_free_last = b + 1;
+	*result = to_cblock(b);
+
+	return 0;
+}
+
+static void free_cblock(struct mq_policy *mq, dm_cblock_t cblock)
+{
+	BUG_ON(!test_bit(from_cblock(cblock), mq->allocation_bitset));
+	clear_bit(from_cblock(cblock), mq->allocation_bitset);
+	mq->nr_cblocks_allocated--;
+}
+
+/*----------------------------------------------------------------*/
+
+static unsigned queue_level(struct entry *e)
+{
+	return min((unsigned) ilog2(e->hit_count + 1), NR_QUEUE_LEVELS - 1u);
+}
+
+/*
+ * Puts an entry on the queue matching its state.  Entries being written
+ * back are on no queue at all.
+ */
+static void push(struct mq_policy *mq, struct entry *e)
+{
+	struct queue *q;
+
+	if (e->writeback)
+		return;
+
+	if (!e->in_cache)
+		q = &mq->pre_cache;
+	else if (e->dirty)
+		q = &mq->cache_dirty;
+	else
+		q = &mq->cache_clean;
+
+	queue_push(q, queue_level(e), &e->list);
+}
+
+static void requeue(struct mq_policy *mq, struct entry *e)
+{
+	if (e->writeback)
+		return;
+
+	queue_remove(&e->list);
+	push(mq, e);
+}
+
+static struct entry *alloc_entry(struct mq_policy *mq)
+{
+	struct entry *e;
+	struct list_head *l;
+
+	if (mq->nr_entries_allocated < mq->nr_entries) {
+		e = list_first_entry(&mq->free, struct entry, list);
+		list_del_init(&e->list);
+		mq->nr_entries_allocated++;
+		return e;
+	}
+
+	/*
+	 * Forget about the coldest block outside the cache.
+	 */
+	l = queue_pop(&mq->pre_cache);
+	if (!l)
+		return NULL;
+
+	e = list_entry(l, struct entry, list);
+	hash_remove(e);
+
+	return e;
+}
+
+static void free_entry(struct mq_policy *mq, struct entry *e)
+{
+	hash_remove(e);
+	list_del_init(&e->list);
+	list_add(&e->list, &mq->free);
+	mq->nr_entries_allocated--;
+}
+
+/*
+ * Halves all the hit counts, so blocks that were popular a long time ago
+ * make way for the current working set.
+ */
+static void age_queue(struct mq_policy *mq, struct queue *q)
+{
+	unsigned level;
+	struct entry *e, *tmp;
+	LIST_HEAD(all);
+
+	for (level = 0; level < NR_QUEUE_LEVELS; level++)
+		list_splice_init(q->qs + level, &all);
+
+	list_for_each_entry_safe(e, tmp, &all, list) {
+		list_del_init(&e->list);
+		e->hit_count >>= 1;
+		push(mq, e);
+	}
+}
+
+static void tick(struct mq_policy *mq)
+{
+	if (++mq->tick < mq->generation_period)
+		return;
+
+	mq->tick = 0;
+	age_queue(mq, &mq->pre_cache);
+	age_queue(mq, &mq->cache_clean);
+	age_queue(mq, &mq->cache_dirty);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * A block gets promoted once it's been hit more often than the least
+ * popular clean block in the cache, plus an adjustment that makes writes
+ * harder to promote than reads.
+ */
+static unsigned promote_threshold(struct mq_policy *mq, struct bio *bio)
+{
+	unsigned threshold = 0;
+	struct list_head *l;
+
+	if (!any_free_cblocks(mq)) {
+		l = queue_peek(&mq->cache_clean);
+		if (!l)
+			return UINT_MAX;
+
+		threshold = list_entry(l, struct entry, list)->hit_count;
+	}
+
+	return threshold + (bio_data_dir(bio) == WRITE ?
+			    mq->write_promote_adjustment :
+			    mq->read_promote_adjustment);
+}
+
+static void map_hit(struct mq_policy *mq, struct entry *e, bool writeback,
+		    struct bio *bio, struct policy_result *result)
+{
+	e->hit_count++;
+
+	if (writeback && bio_data_dir(bio) == WRITE && !e->dirty) {
+		e->dirty = true;
+		mq->nr_dirty++;
+	}
+
+	requeue(mq, e);
+
+	result->op = POLICY_HIT;
+	result->cblock = e->cblock;
+}
+
+static void promote(struct mq_policy *mq, struct entry *e,
+		    struct policy_result *result)
+{
+	struct entry *victim;
+
+	if (!alloc_cblock(mq, &e->cblock))
+		result->op = POLICY_NEW;
+	else {
+		victim = list_entry(queue_pop(&mq->cache_clean), struct entry, list);
+		result->op = POLICY_REPLACE;
+		result->old_oblock = victim->oblock;
+		e->cblock = victim->cblock;
+		free_entry(mq, victim);
+	}
+
+	queue_remove(&e->list);
+	e->in_cache = true;
+	e->dirty = false;
+	push(mq, e);
+
+	result->cblock = e->cblock;
+}
+
+static int map(struct mq_policy *mq, dm_oblock_t oblock,
+	       bool can_migrate, bool writeback, struct bio *bio,
+	       struct policy_result *result)
+{
+	struct entry *e = hash_lookup(mq, oblock);
+	struct io_tracker tracker;
+	bool want_promotion;
+
+	if (e && e->in_cache) {
+		iot_update(&mq->tracker, bio);
+		map_hit(mq, e, writeback, bio, result);
+		tick(mq);
+		return 0;
+	}
+
+	/*
+	 * Work out what we'd do before touching anything, we mustn't change
+	 * any state if the migration gets denied.
+	 */
+	tracker = mq->tracker;
+	iot_update(&tracker, bio);
+	want_promotion = tracker.pattern == PATTERN_RANDOM &&
+		(e ? e->hit_count : 0) + 1 >= promote_threshold(mq, bio);
+
+	if (want_promotion && !can_migrate)
+		return -EWOULDBLOCK;
+
+	mq->tracker = tracker;
+	result->op = POLICY_MISS;
+
+	if (tracker.pattern == PATTERN_SEQUENTIAL)
+		return 0;
+
+	if (!e) {
+		e = alloc_entry(mq);
+		if (!e)
+			return 0;
+
+		e->oblock = oblock;
+		e->hit_count = 0;
+		e->in_cache = false;
+		e->dirty = false;
+		e->writeback = false;
+		hash_insert(mq, e);
+		push(mq, e);
+	}
+
+	e->hit_count++;
+	requeue(mq, e);
+
+	if (want_promotion)
+		promote(mq, e, result);
+
+	tick(mq);
+
+	return 0;
+}
+
+/*----------------------------------------------------------------
+ * Public interface, via the policy struct.  See dm-cache-policy.h for a
+ * description of these.
+ *--------------------------------------------------------------*/
+
+static struct mq_policy *to_mq_policy(struct dm_cache_policy *p)
+{
+	return container_of(p, struct mq_policy, policy);
+}
+
+static void mq_destroy(struct dm_cache_policy *p)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+
+	vfree(mq->table);
+	vfree(mq->allocation_bitset);
+	vfree(mq->entries);
+	kfree(mq);
+}
+
+static int mq_map(struct dm_cache_policy *p, dm_oblock_t oblock,
+		  bool can_migrate, bool writeback, struct bio *bio,
+		  struct policy_result *result)
+{
+	int r;
+	struct mq_policy *mq = to_mq_policy(p);
+
+	/*
+	 * Without permission to migrate we mustn't block either, the core
+	 * calls us from its map function then.
+	 */
+	if (can_migrate)
+		mutex_lock(&mq->lock);
+	else if (!mutex_trylock(&mq->lock))
+		return -EWOULDBLOCK;
+
+	r = map(mq, oblock, can_migrate, writeback, bio, result);
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static int mq_lookup(struct dm_cache_policy *p, dm_oblock_t oblock,
+		     dm_cblock_t *cblock)
+{
+	int r = -ENOENT;
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	if (!mutex_trylock(&mq->lock))
+		return -EWOULDBLOCK;
+
+	e = hash_lookup(mq, oblock);
+	if (e && e->in_cache) {
+		*cblock = e->cblock;
+		r = 0;
+	}
+
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static int mq_load_mapping(struct dm_cache_policy *p,
+			   dm_oblock_t oblock, dm_cblock_t cblock,
+			   bool dirty, uint32_t hint, bool hint_valid)
+{
+	int r = 0;
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	mutex_lock(&mq->lock);
+
+	if (from_cblock(cblock) >= from_cblock(mq->cache_size) ||
+	    test_bit(from_cblock(cblock), mq->allocation_bitset) ||
+	    hash_lookup(mq, oblock)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	e = alloc_entry(mq);
+	if (!e) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	set_bit(from_cblock(cblock), mq->allocation_bitset);
+	mq->nr_cblocks_allocated++;
+
+	e->oblock = oblock;
+	e->cblock = cblock;
+	e->hit_count = hint_valid ? hint : 1;
+	e->in_cache = true;
+	e->dirty = dirty;
+	e->writeback = false;
+	if (dirty)
+		mq->nr_dirty++;
+
+	hash_insert(mq, e);
+	push(mq, e);
+out:
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static int walk_queue(struct queue *q, policy_walk_fn fn, void *context)
+{
+	int r;
+	unsigned level;
+	struct entry *e;
+
+	for (level = 0; level < NR_QUEUE_LEVELS; level++)
+		list_for_each_entry(e, q->qs + level, list) {
+			r = fn(context, e->cblock, e->oblock, e->dirty, e->hit_count);
+			if (r)
+				return r;
+		}
+
+	return 0;
+}
+
+static int mq_walk_mappings(struct dm_cache_policy *p, policy_walk_fn fn,
+			    void *context)
+{
+	int r;
+	struct mq_policy *mq = to_mq_policy(p);
+
+	mutex_lock(&mq->lock);
+	r = walk_queue(&mq->cache_clean, fn, context);
+	if (!r)
+		r = walk_queue(&mq->cache_dirty, fn, context);
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static void mq_remove_mapping(struct dm_cache_policy *p, dm_oblock_t oblock)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	mutex_lock(&mq->lock);
+
+	e = hash_lookup(mq, oblock);
+	BUG_ON(!e || !e->in_cache);
+
+	free_cblock(mq, e->cblock);
+	if (e->dirty)
+		mq->nr_dirty--;
+	free_entry(mq, e);
+
+	mutex_unlock(&mq->lock);
+}
+
+static void mq_force_mapping(struct dm_cache_policy *p,
+			     dm_oblock_t current_oblock, dm_oblock_t new_oblock)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	mutex_lock(&mq->lock);
+
+	/*
+	 * The new block may have picked up a pre cache entry in the
+	 * meantime, it's superseded by the cached one.
+	 */
+	e = hash_lookup(mq, new_oblock);
+	if (e) {
+		BUG_ON(e->in_cache);
+		free_entry(mq, e);
+	}
+
+	e = hash_lookup(mq, current_oblock);
+	BUG_ON(!e || !e->in_cache);
+
+	hash_remove(e);
+	e->oblock = new_oblock;
+	hash_insert(mq, e);
+
+	mutex_unlock(&mq->lock);
+}
+
+static int mq_writeback_work(struct dm_cache_policy *p, dm_oblock_t *oblock,
+			     dm_cblock_t *cblock)
+{
+	int r = -ENODATA;
+	struct mq_policy *mq = to_mq_policy(p);
+	struct list_head *l;
+	struct entry *e;
+
+	mutex_lock(&mq->lock);
+
+	l = queue_pop(&mq->cache_dirty);
+	if (l) {
+		e = list_entry(l, struct entry, list);
+		e->writeback = true;
+		*oblock = e->oblock;
+		*cblock = e->cblock;
+		r = 0;
+	}
+
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static void mq_writeback_done(struct dm_cache_policy *p, dm_oblock_t oblock,
+			      bool success)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	struct entry *e;
+
+	mutex_lock(&mq->lock);
+
+	e = hash_lookup(mq, oblock);
+	BUG_ON(!e || !e->in_cache || !e->writeback);
+
+	e->writeback = false;
+	if (success) {
+		e->dirty = false;
+		mq->nr_dirty--;
+	}
+	push(mq, e);
+
+	mutex_unlock(&mq->lock);
+}
+
+static dm_cblock_t mq_residency(struct dm_cache_policy *p)
+{
+	dm_cblock_t r;
+	struct mq_policy *mq = to_mq_policy(p);
+
+	mutex_lock(&mq->lock);
+	r = to_cblock(mq->nr_cblocks_allocated);
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static dm_cblock_t mq_nr_dirty(struct dm_cache_policy *p)
+{
+	dm_cblock_t r;
+	struct mq_policy *mq = to_mq_policy(p);
+
+	mutex_lock(&mq->lock);
+	r = to_cblock(mq->nr_dirty);
+	mutex_unlock(&mq->lock);
+
+	return r;
+}
+
+static int mq_emit_config_values(struct dm_cache_policy *p,
+				 char *result, unsigned maxlen)
+{
+	ssize_t sz = 0;
+	struct mq_policy *mq = to_mq_policy(p);
+
+	DMEMIT("8 sequential_threshold %u random_threshold %u "
+	       "read_promote_adjustment %u write_promote_adjustment %u",
+	       mq->tracker.thresholds[PATTERN_SEQUENTIAL],
+	       mq->tracker.thresholds[PATTERN_RANDOM],
+	       mq->read_promote_adjustment,
+	       mq->write_promote_adjustment);
+
+	return 0;
+}
+
+static int mq_set_config_value(struct dm_cache_policy *p,
+			       const char *key, const char *value)
+{
+	struct mq_policy *mq = to_mq_policy(p);
+	unsigned long tmp;
+	unsigned *field;
+
+	if (!strcasecmp(key, "sequential_threshold"))
+		field = mq->tracker.thresholds + PATTERN_SEQUENTIAL;
+	else if (!strcasecmp(key, "random_threshold"))
+		field = mq->tracker.thresholds + PATTERN_RANDOM;
+	else if (!strcasecmp(key, "read_promote_adjustment"))
+		field = &mq->read_promote_adjustment;
+	else if (!strcasecmp(key, "write_promote_adjustment"))
+		field = &mq->write_promote_adjustment;
+	else
+		return -EINVAL;
+
+	if (kstrtoul(value, 10, &tmp) || tmp > UINT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&mq->lock);
+	*field = tmp;
+	mutex_unlock(&mq->lock);
+
+	return 0;
+}
+
+/*----------------------------------------------------------------*/
+
+#define DEFAULT_SEQUENTIAL_THRESHOLD 512
+#define DEFAULT_RANDOM_THRESHOLD 4
+#define DEFAULT_READ_PROMOTE_ADJUSTMENT 4
+#define DEFAULT_WRITE_PROMOTE_ADJUSTMENT 8
+
+static void init_policy_functions(struct mq_policy *mq)
+{
+	mq->policy.destroy = mq_destroy;
+	mq->policy.map = mq_map;
+	mq->policy.lookup = mq_lookup;
+	mq->policy.load_mapping = mq_load_mapping;
+	mq->policy.walk_mappings = mq_walk_mappings;
+	mq->policy.remove_mapping = mq_remove_mapping;
+	mq->policy.force_mapping = mq_force_mapping;
+	mq->policy.writeback_work = mq_writeback_work;
+	mq->policy.writeback_done = mq_writeback_done;
+	mq->policy.residency = mq_residency;
+	mq->policy.nr_dirty = mq_nr_dirty;
+	mq->policy.emit_config_values = mq_emit_config_values;
+	mq->policy.set_config_value = mq_set_config_value;
+}
+
+static struct dm_cache_policy *mq_create(dm_cblock_t cache_size,
+					 sector_t origin_size,
+					 sector_t cache_block_size)
+{
+	unsigned i, nr_buckets;
+	struct mq_policy *mq = kzalloc(sizeof(*mq), GFP_KERNEL);
+
+	if (!mq)
+		return NULL;
+
+	init_policy_functions(mq);
+	mutex_init(&mq->lock);
+	iot_init(&mq->tracker, DEFAULT_SEQUENTIAL_THRESHOLD,
+		 DEFAULT_RANDOM_THRESHOLD);
+
+	queue_init(&mq->pre_cache);
+	queue_init(&mq->cache_clean);
+	queue_init(&mq->cache_dirty);
+
+	mq->tick = 0;
+	mq->generation_period = max((unsigned) from_cblock(cache_size), 1024u);
+	mq->read_promote_adjustment = DEFAULT_READ_PROMOTE_ADJUSTMENT;
+	mq->write_promote_adjustment = DEFAULT_WRITE_PROMOTE_ADJUSTMENT;
+
+	/*
+	 * Twice as many entries for blocks outside the cache as there are
+	 * cache blocks.
+	 */
+	mq->nr_entries = 3 * from_cblock(cache_size);
+	mq->nr_entries_allocated = 0;
+	INIT_LIST_HEAD(&mq->free);
+	mq->entries = vzalloc(sizeof(*mq->entries) * mq->nr_entries);
+	if (!mq->entries)
+		goto bad_entries;
+
+	for (i = 0; i < mq->nr_entries; i++)
+		list_add(&mq->entries[i].list, &mq->free);
+
+	mq->cache_size = cache_size;
+	mq->nr_cblocks_allocated = 0;
+	mq->nr_dirty = 0;
+	mq->find_free_last = 0;
+	mq->allocation_bitset = vzalloc(BITS_TO_LONGS(from_cblock(cache_size)) *
+					sizeof(unsigned long));
+	if (!mq->allocation_bitset)
+		goto bad_bitset;
+
+	nr_buckets = roundup_pow_of_two(max(mq->nr_entries / 4u, 16u));
+	mq->hash_bits = ffs(nr_buckets) - 1;
+	mq->table = vzalloc(sizeof(*mq->table) * nr_buckets);
+	if (!mq->table)
+		goto bad_table;
+
+	return &mq->policy;
+
+bad_table:
+	vfree(mq->allocation_bitset);
+bad_bitset:
+	vfree(mq->entries);
+bad_entries:
+	kfree(mq);
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------*/
+
+static struct dm_cache_policy_type mq_policy_type = {
+	.name = "mq",
+	.owner = THIS_MODULE,
+	.create = mq_create
+};
+
+static struct dm_cache_policy_type default_policy_type = {
+	.name = "default",
+	.owner = THIS_MODULE,
+	.create = mq_create
+};
+
+static int __init mq_init(void)
+{
+	int r;
+
+	r = dm_cache_policy_register(&mq_policy_type);
+	if (r) {
+		DMERR("register failed %d", r);
+		return -ENOMEM;
+	}
+
+	r = dm_cache_policy_register(&default_policy_type);
+	if (r) {
+		DMERR("register failed (as default) %d", r);
+		dm_cache_policy_unregister(&mq_policy_type);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void __exit mq_exit(void)
+{
+	dm_cache_policy_unregister(&mq_policy_type);
+	dm_cache_policy_unregister(&default_policy_type);
+}
+
+module_init(mq_init);
+module_exit(mq_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("mq cache policy");
+
+MODULE_ALIAS("dm-cache-default");
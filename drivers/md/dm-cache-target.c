@@ -0,0 +1,1675 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "dm.h"
+#include "dm-bio-prison.h"
+#include "dm-bio-record.h"
+#include "dm-cache-metadata.h"
+
+#include <linux/dm-io.h>
+#include <linux/dm-kcopyd.h>
+#include <linux/init.h>
+#include <linux/mempool.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#define DM_MSG_PREFIX "cache"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Glossary:
+ *
+ * oblock: index of an origin block
+ * cblock: index of a cache block
+ * promotion: movement of a block from origin to cache
+ * demotion: movement of a block from cache to origin
+ * migration: movement of a block between the origin and cache device,
+ *	      either direction
+ * writeback: copying a dirty block back to the origin, after which it is
+ *	      clean
+ */
+
+#define PER_BIO_DATA_POOL_SIZE 256
+#define MIGRATION_POOL_SIZE 128
+#define PRISON_CELLS 1024
+
+#define DEFAULT_MIGRATION_THRESHOLD 2048
+
+/*
+ * The block size of the cache device has to be a multiple of 32KB, and
+ * between 32KB and 1GB.
+ */
+#define DATA_DEV_BLOCK_SIZE_MIN_SECTORS (32 * 1024 >> SECTOR_SHIFT)
+#define DATA_DEV_BLOCK_SIZE_MAX_SECTORS (1024 * 1024 * 1024 >> SECTOR_SHIFT)
+
+struct cache_features {
+	/*
+	 * In writeback mode writes that hit the cache only go to the cache,
+	 * and the block is copied back to the origin later.  In
+	 * writethrough mode they go to both devices, and cached blocks are
+	 * never dirtied.
+	 */
+	bool write_through:1;
+};
+
+struct cache_stats {
+	atomic_t read_hit;
+	atomic_t read_miss;
+	atomic_t write_hit;
+	atomic_t write_miss;
+	atomic_t demotion;
+	atomic_t promotion;
+};
+
+struct cache {
+	struct dm_target *ti;
+
+	/*
+	 * Metadata is written to this device.
+	 */
+	struct dm_dev *metadata_dev;
+
+	/*
+	 * The slower of the two data devices.  Typically a spindle.
+	 */
+	struct dm_dev *origin_dev;
+
+	/*
+	 * The faster of the two data devices.  Typically an SSD.
+	 */
+	struct dm_dev *cache_dev;
+
+	/*
+	 * Size of the origin device in _complete_ blocks.  A partial block
+	 * at the end of the origin is never cached.
+	 */
+	dm_oblock_t origin_blocks;
+
+	/*
+	 * Size of the cache device in blocks.
+	 */
+	dm_cblock_t cache_size;
+
+	sector_t sectors_per_block;
+	int sectors_per_block_shift;
+
+	struct cache_features features;
+
+	struct dm_cache_metadata *cmd;
+	struct dm_cache_policy *policy;
+
+	spinlock_t lock;
+	struct bio_list deferred_bios;
+	struct bio_list deferred_writethrough_bios;
+	struct list_head quiesced_migrations;
+	struct list_head completed_migrations;
+	struct list_head need_commit_migrations;
+
+	/*
+	 * Migrations in flight, and the number of sectors they may copy
+	 * at once.
+	 */
+	atomic_t nr_migrations;
+	sector_t migration_threshold;
+	wait_queue_head_t migration_wait;
+
+	struct workqueue_struct *wq;
+	struct work_struct worker;
+
+	struct dm_kcopyd_client *copier;
+	struct dm_bio_prison *prison;
+	struct dm_deferred_set *all_io_ds;
+
+	mempool_t *per_bio_data_pool;
+	mempool_t *migration_pool;
+
+	bool loaded_mappings:1;
+	bool quiescing:1;
+
+	struct cache_stats stats;
+};
+
+struct per_bio_data {
+	struct cache *cache;
+	bool accounted:1;
+	unsigned req_nr:2;
+	struct dm_deferred_entry *all_io_entry;
+
+	/*
+	 * writethrough fields.
+	 */
+	dm_cblock_t cblock;
+	bio_end_io_t *saved_bi_end_io;
+	struct dm_bio_details bio_details;
+};
+
+struct dm_cache_migration {
+	struct list_head list;
+	struct cache *cache;
+
+	dm_oblock_t old_oblock;
+	dm_oblock_t new_oblock;
+	dm_cblock_t cblock;
+
+	bool err:1;
+	bool writeback:1;
+	bool demote:1;
+	bool promote:1;
+
+	struct dm_bio_prison_cell *old_ocell;
+	struct dm_bio_prison_cell *new_ocell;
+};
+
+static void wake_worker(struct cache *cache)
+{
+	queue_work(cache->wq, &cache->worker);
+}
+
+/*----------------------------------------------------------------*/
+
+static struct kmem_cache *_migration_cache;
+static struct kmem_cache *_per_bio_data_cache;
+
+static struct dm_cache_migration *alloc_migration(struct cache *cache)
+{
+	/*
+	 * Migrations are freed by the worker, so the worker mustn't wait
+	 * for one to become available.
+	 */
+	return mempool_alloc(cache->migration_pool, GFP_NOWAIT);
+}
+
+static void free_migration(struct dm_cache_migration *mg)
+{
+	mempool_free(mg, mg->cache->migration_pool);
+}
+
+static void build_key(dm_oblock_t oblock, struct dm_cell_key *key)
+{
+	key->virtual = 0;
+	key->dev = 0;
+	key->block = from_oblock(oblock);
+}
+
+/*
+ * Sends the bios held in the cell back to the worker, along with the
+ * holder if @holder is set.
+ */
+static void cell_defer(struct cache *cache, struct dm_bio_prison_cell *cell,
+		       bool holder)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	if (holder)
+		dm_cell_release(cell, &cache->deferred_bios);
+	else
+		dm_cell_release_no_holder(cell, &cache->deferred_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+/*----------------------------------------------------------------
+ * Remapping
+ *--------------------------------------------------------------*/
+
+static struct per_bio_data *get_per_bio_data(struct bio *bio)
+{
+	return dm_get_mapinfo(bio)->ptr;
+}
+
+static dm_oblock_t get_bio_block(struct cache *cache, struct bio *bio)
+{
+	sector_t block_nr = bio->bi_sector;
+
+	if (cache->sectors_per_block_shift < 0)
+		(void) sector_div(block_nr, cache->sectors_per_block);
+	else
+		block_nr >>= cache->sectors_per_block_shift;
+
+	return to_oblock(block_nr);
+}
+
+static void remap_to_origin(struct cache *cache, struct bio *bio)
+{
+	bio->bi_bdev = cache->origin_dev->bdev;
+}
+
+static void remap_to_cache(struct cache *cache, struct bio *bio,
+			   dm_cblock_t cblock)
+{
+	sector_t bi_sector = bio->bi_sector;
+	sector_t block = from_cblock(cblock);
+
+	bio->bi_bdev = cache->cache_dev->bdev;
+	if (cache->sectors_per_block_shift < 0)
+		bio->bi_sector = (block * cache->sectors_per_block) +
+				 sector_div(bi_sector, cache->sectors_per_block);
+	else
+		bio->bi_sector = (block << cache->sectors_per_block_shift) |
+				 (bi_sector & (cache->sectors_per_block - 1));
+}
+
+static void account_bio(struct cache *cache, struct bio *bio, bool hit)
+{
+	struct per_bio_data *pb = get_per_bio_data(bio);
+
+	/*
+	 * Bios that wait in a cell get looked up again, only the first
+	 * lookup counts.
+	 */
+	if (pb->accounted)
+		return;
+	pb->accounted = true;
+
+	if (bio_data_dir(bio) == WRITE)
+		atomic_inc(hit ? &cache->stats.write_hit : &cache->stats.write_miss);
+	else
+		atomic_inc(hit ? &cache->stats.read_hit : &cache->stats.read_miss);
+}
+
+static void inc_all_io_entry(struct cache *cache, struct bio *bio)
+{
+	struct per_bio_data *pb = get_per_bio_data(bio);
+
+	BUG_ON(pb->all_io_entry);
+	pb->all_io_entry = dm_deferred_entry_inc(cache->all_io_ds);
+}
+
+/*
+ * In writethrough mode a write hit goes to the origin first.  When that
+ * completes the bio is restored and sent on to the cache by the worker.
+ */
+static void writethrough_endio(struct bio *bio, int err)
+{
+	unsigned long flags;
+	struct per_bio_data *pb = get_per_bio_data(bio);
+	struct cache *cache = pb->cache;
+
+	bio->bi_end_io = pb->saved_bi_end_io;
+
+	if (err) {
+		bio_endio(bio, err);
+		return;
+	}
+
+	dm_bio_restore(&pb->bio_details, bio);
+	remap_to_cache(cache, bio, pb->cblock);
+
+	/*
+	 * We can't issue this bio directly, since we're in interrupt
+	 * context.  So it gets put on a bio list for processing by the
+	 * worker thread.
+	 */
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_add(&cache->deferred_writethrough_bios, bio);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void remap_to_origin_then_cache(struct cache *cache, struct bio *bio,
+				       dm_cblock_t cblock)
+{
+	struct per_bio_data *pb = get_per_bio_data(bio);
+
+	pb->cblock = cblock;
+	pb->saved_bi_end_io = bio->bi_end_io;
+	dm_bio_record(&pb->bio_details, bio);
+
+	bio->bi_end_io = writethrough_endio;
+	remap_to_origin(cache, bio);
+}
+
+/*
+ * Remaps a bio that hit or missed the cache, taking an all_io entry so
+ * migrations of the block wait for it.  Must be called while holding the
+ * cell for the block.
+ */
+static void remap_hit(struct cache *cache, struct bio *bio, dm_cblock_t cblock)
+{
+	account_bio(cache, bio, true);
+	inc_all_io_entry(cache, bio);
+
+	if (bio_data_dir(bio) == WRITE && cache->features.write_through)
+		remap_to_origin_then_cache(cache, bio, cblock);
+	else
+		remap_to_cache(cache, bio, cblock);
+}
+
+static void remap_miss(struct cache *cache, struct bio *bio)
+{
+	account_bio(cache, bio, false);
+	inc_all_io_entry(cache, bio);
+	remap_to_origin(cache, bio);
+}
+
+/*----------------------------------------------------------------
+ * Migration processing
+ *
+ * Migration covers moving data from the origin device to the cache, or
+ * vice versa.
+ *--------------------------------------------------------------*/
+
+static void cleanup_migration(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+
+	free_migration(mg);
+	if (atomic_dec_and_test(&cache->nr_migrations))
+		wake_up(&cache->migration_wait);
+}
+
+static void migration_failure(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+
+	if (mg->writeback) {
+		DMWARN_LIMIT("writeback failed; couldn't copy block");
+		policy_writeback_done(cache->policy, mg->old_oblock, false);
+		cell_defer(cache, mg->old_ocell, false);
+
+	} else {
+		DMWARN_LIMIT("promotion failed; couldn't copy block");
+		policy_remove_mapping(cache->policy, mg->new_oblock);
+		cell_defer(cache, mg->new_ocell, true);
+	}
+
+	cleanup_migration(mg);
+}
+
+static void migration_success_pre_commit(struct dm_cache_migration *mg)
+{
+	unsigned long flags;
+	struct cache *cache = mg->cache;
+
+	if (mg->writeback) {
+		policy_writeback_done(cache->policy, mg->old_oblock, true);
+		cell_defer(cache, mg->old_ocell, false);
+		cleanup_migration(mg);
+		return;
+
+	} else if (mg->demote) {
+		if (dm_cache_remove_mapping(cache->cmd, mg->cblock)) {
+			DMWARN_LIMIT("demotion failed; couldn't update on disk metadata");
+			policy_force_mapping(cache->policy, mg->new_oblock,
+					     mg->old_oblock);
+			cell_defer(cache, mg->old_ocell, false);
+			if (mg->promote)
+				cell_defer(cache, mg->new_ocell, true);
+			cleanup_migration(mg);
+			return;
+		}
+
+	} else {
+		if (dm_cache_insert_mapping(cache->cmd, mg->cblock, mg->new_oblock)) {
+			DMWARN_LIMIT("promotion failed; couldn't update on disk metadata");
+			policy_remove_mapping(cache->policy, mg->new_oblock);
+			cell_defer(cache, mg->new_ocell, true);
+			cleanup_migration(mg);
+			return;
+		}
+	}
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_add_tail(&mg->list, &cache->need_commit_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+static void migration_success_post_commit(struct dm_cache_migration *mg)
+{
+	unsigned long flags;
+	struct cache *cache = mg->cache;
+
+	if (mg->demote) {
+		atomic_inc(&cache->stats.demotion);
+		cell_defer(cache, mg->old_ocell, false);
+
+		if (mg->promote) {
+			/*
+			 * The io to the cache block has already been
+			 * quiesced, so go straight on to the copy.
+			 */
+			mg->demote = false;
+
+			spin_lock_irqsave(&cache->lock, flags);
+			list_add_tail(&mg->list, &cache->quiesced_migrations);
+			spin_unlock_irqrestore(&cache->lock, flags);
+
+			wake_worker(cache);
+		} else
+			cleanup_migration(mg);
+
+	} else {
+		atomic_inc(&cache->stats.promotion);
+		cell_defer(cache, mg->new_ocell, true);
+		cleanup_migration(mg);
+	}
+}
+
+static void migration_commit_failed(struct dm_cache_migration *mg)
+{
+	struct cache *cache = mg->cache;
+
+	if (mg->demote) {
+		policy_force_mapping(cache->policy, mg->new_oblock, mg->old_oblock);
+		cell_defer(cache, mg->old_ocell, false);
+		if (mg->promote)
+			dm_cell_error(mg->new_ocell);
+	} else {
+		policy_remove_mapping(cache->policy, mg->new_oblock);
+		dm_cell_error(mg->new_ocell);
+	}
+
+	cleanup_migration(mg);
+}
+
+static void copy_complete(int read_err, unsigned long write_err, void *context)
+{
+	unsigned long flags;
+	struct dm_cache_migration *mg = (struct dm_cache_migration *) context;
+	struct cache *cache = mg->cache;
+
+	if (read_err || write_err)
+		mg->err = true;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_add_tail(&mg->list, &cache->completed_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void issue_copy(struct dm_cache_migration *mg)
+{
+	int r;
+	struct dm_io_region o_region, c_region;
+	struct cache *cache = mg->cache;
+
+	o_region.bdev = cache->origin_dev->bdev;
+	o_region.count = cache->sectors_per_block;
+
+	c_region.bdev = cache->cache_dev->bdev;
+	c_region.sector = from_cblock(mg->cblock) * cache->sectors_per_block;
+	c_region.count = cache->sectors_per_block;
+
+	if (mg->writeback) {
+		/* cache -> origin */
+		o_region.sector = from_oblock(mg->old_oblock) * cache->sectors_per_block;
+		r = dm_kcopyd_copy(cache->copier, &c_region, 1, &o_region, 0,
+				   copy_complete, mg);
+	} else {
+		/* origin -> cache */
+		o_region.sector = from_oblock(mg->new_oblock) * cache->sectors_per_block;
+		r = dm_kcopyd_copy(cache->copier, &o_region, 1, &c_region, 0,
+				   copy_complete, mg);
+	}
+
+	if (r < 0) {
+		DMERR_LIMIT("issuing migration failed");
+		migration_failure(mg);
+	}
+}
+
+static void process_quiesced_migration(struct dm_cache_migration *mg)
+{
+	/*
+	 * Only clean blocks get demoted, so a demotion just has to update
+	 * the metadata.
+	 */
+	if (mg->demote)
+		migration_success_pre_commit(mg);
+	else
+		issue_copy(mg);
+}
+
+static void process_completed_migration(struct dm_cache_migration *mg)
+{
+	if (mg->err)
+		migration_failure(mg);
+	else
+		migration_success_pre_commit(mg);
+}
+
+static void process_migrations(struct cache *cache, struct list_head *head,
+			       void (*fn)(struct dm_cache_migration *))
+{
+	unsigned long flags;
+	struct list_head list;
+	struct dm_cache_migration *mg, *tmp;
+
+	INIT_LIST_HEAD(&list);
+	spin_lock_irqsave(&cache->lock, flags);
+	list_splice_init(head, &list);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	list_for_each_entry_safe(mg, tmp, &list, list) {
+		list_del(&mg->list);
+		fn(mg);
+	}
+}
+
+static void __queue_quiesced_migration(struct dm_cache_migration *mg)
+{
+	list_add_tail(&mg->list, &mg->cache->quiesced_migrations);
+}
+
+static void queue_quiesced_migration(struct dm_cache_migration *mg)
+{
+	unsigned long flags;
+	struct cache *cache = mg->cache;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	__queue_quiesced_migration(mg);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+static void queue_quiesced_migrations(struct cache *cache, struct list_head *work)
+{
+	unsigned long flags;
+	struct dm_cache_migration *mg, *tmp;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	list_for_each_entry_safe(mg, tmp, work, list)
+		__queue_quiesced_migration(mg);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	wake_worker(cache);
+}
+
+/*
+ * A migration waits for all io that was in flight when it started, so
+ * nothing is still using the blocks it's about to copy.
+ */
+static void quiesce_migration(struct dm_cache_migration *mg)
+{
+	if (!dm_deferred_set_add_work(mg->cache->all_io_ds, &mg->list))
+		queue_quiesced_migration(mg);
+}
+
+static void promote(struct cache *cache, struct dm_cache_migration *mg,
+		    dm_oblock_t oblock, dm_cblock_t cblock,
+		    struct dm_bio_prison_cell *cell)
+{
+	mg->err = false;
+	mg->writeback = false;
+	mg->demote = false;
+	mg->promote = true;
+	mg->cache = cache;
+	mg->new_oblock = oblock;
+	mg->cblock = cblock;
+	mg->old_ocell = NULL;
+	mg->new_ocell = cell;
+
+	atomic_inc(&cache->nr_migrations);
+	quiesce_migration(mg);
+}
+
+static void writeback(struct cache *cache, struct dm_cache_migration *mg,
+		      dm_oblock_t oblock, dm_cblock_t cblock,
+		      struct dm_bio_prison_cell *cell)
+{
+	mg->err = false;
+	mg->writeback = true;
+	mg->demote = false;
+	mg->promote = false;
+	mg->cache = cache;
+	mg->old_oblock = oblock;
+	mg->cblock = cblock;
+	mg->old_ocell = cell;
+	mg->new_ocell = NULL;
+
+	atomic_inc(&cache->nr_migrations);
+	quiesce_migration(mg);
+}
+
+static void demote_then_promote(struct cache *cache, struct dm_cache_migration *mg,
+				dm_oblock_t old_oblock, dm_oblock_t new_oblock,
+				dm_cblock_t cblock,
+				struct dm_bio_prison_cell *old_ocell,
+				struct dm_bio_prison_cell *new_ocell)
+{
+	mg->err = false;
+	mg->writeback = false;
+	mg->demote = true;
+	mg->promote = true;
+	mg->cache = cache;
+	mg->old_oblock = old_oblock;
+	mg->new_oblock = new_oblock;
+	mg->cblock = cblock;
+	mg->old_ocell = old_ocell;
+	mg->new_ocell = new_ocell;
+
+	atomic_inc(&cache->nr_migrations);
+	quiesce_migration(mg);
+}
+
+/*----------------------------------------------------------------
+ * bio processing
+ *--------------------------------------------------------------*/
+
+static bool spare_migration_bandwidth(struct cache *cache)
+{
+	sector_t current_volume = atomic_read(&cache->nr_migrations) *
+		cache->sectors_per_block;
+
+	return current_volume < cache->migration_threshold;
+}
+
+static void process_bio(struct cache *cache, struct bio *bio)
+{
+	int r;
+	bool can_migrate;
+	dm_oblock_t block = get_bio_block(cache, bio);
+	struct dm_cell_key key;
+	struct dm_bio_prison_cell *cell, *old_ocell;
+	struct policy_result lookup_result;
+	struct dm_cache_migration *mg;
+
+	/*
+	 * Check to see if that block is currently migrating.
+	 */
+	build_key(block, &key);
+	if (dm_bio_detain(cache->prison, &key, bio, &cell))
+		return;
+
+	mg = alloc_migration(cache);
+	can_migrate = mg && !cache->quiescing && spare_migration_bandwidth(cache);
+
+	r = policy_map(cache->policy, block, can_migrate,
+		       !cache->features.write_through, bio, &lookup_result);
+	if (r == -EWOULDBLOCK)
+		/* migration has been denied */
+		lookup_result.op = POLICY_MISS;
+
+	switch (lookup_result.op) {
+	case POLICY_HIT:
+		remap_hit(cache, bio, lookup_result.cblock);
+		cell_defer(cache, cell, false);
+		generic_make_request(bio);
+		break;
+
+	case POLICY_MISS:
+		remap_miss(cache, bio);
+		cell_defer(cache, cell, false);
+		generic_make_request(bio);
+		break;
+
+	case POLICY_NEW:
+		account_bio(cache, bio, false);
+		promote(cache, mg, block, lookup_result.cblock, cell);
+		mg = NULL;
+		break;
+
+	case POLICY_REPLACE:
+		account_bio(cache, bio, false);
+		build_key(lookup_result.old_oblock, &key);
+		if (dm_cell_lock(cache->prison, &key, &old_ocell)) {
+			/*
+			 * We have to be careful to avoid lock inversion of
+			 * the cells.  So we back off, and wait for the
+			 * old_ocell to become free.
+			 */
+			policy_force_mapping(cache->policy, block,
+					     lookup_result.old_oblock);
+			remap_miss(cache, bio);
+			cell_defer(cache, cell, false);
+			generic_make_request(bio);
+			break;
+		}
+
+		demote_then_promote(cache, mg, lookup_result.old_oblock, block,
+				    lookup_result.cblock, old_ocell, cell);
+		mg = NULL;
+		break;
+
+	default:
+		DMERR_LIMIT("%s: erroring bio, unknown policy op: %u", __func__,
+			    (unsigned) lookup_result.op);
+		dm_cell_error(cell);
+	}
+
+	if (mg)
+		free_migration(mg);
+}
+
+static void process_deferred_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio_list bios;
+	struct bio *bio;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_bios);
+	bio_list_init(&cache->deferred_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios)))
+		process_bio(cache, bio);
+}
+
+static void process_deferred_writethrough_bios(struct cache *cache)
+{
+	unsigned long flags;
+	struct bio_list bios;
+	struct bio *bio;
+
+	bio_list_init(&bios);
+
+	spin_lock_irqsave(&cache->lock, flags);
+	bio_list_merge(&bios, &cache->deferred_writethrough_bios);
+	bio_list_init(&cache->deferred_writethrough_bios);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	while ((bio = bio_list_pop(&bios)))
+		generic_make_request(bio);
+}
+
+/*
+ * Hands dirty blocks to the kcopyd client while there's spare migration
+ * bandwidth.  The cell of the block is held for the duration, so new io
+ * can't dirty it again behind our back.
+ */
+static void writeback_some_dirty_blocks(struct cache *cache)
+{
+	dm_oblock_t oblock;
+	dm_cblock_t cblock;
+	struct dm_cell_key key;
+	struct dm_bio_prison_cell *old_ocell;
+	struct dm_cache_migration *mg;
+
+	while (!cache->quiescing && spare_migration_bandwidth(cache)) {
+		mg = alloc_migration(cache);
+		if (!mg)
+			break;
+
+		if (policy_writeback_work(cache->policy, &oblock, &cblock)) {
+			free_migration(mg);
+			break;
+		}
+
+		build_key(oblock, &key);
+		if (dm_cell_lock(cache->prison, &key, &old_ocell)) {
+			policy_writeback_done(cache->policy, oblock, false);
+			free_migration(mg);
+			break;
+		}
+
+		writeback(cache, mg, oblock, cblock, old_ocell);
+	}
+}
+
+/*
+ * Migrations aren't finished until the metadata describing them has been
+ * committed.  The data they copied has to be on stable storage first.
+ */
+static int commit(struct cache *cache)
+{
+	int r;
+
+	r = blkdev_issue_flush(cache->origin_dev->bdev, GFP_NOIO, NULL);
+	if (!r)
+		r = blkdev_issue_flush(cache->cache_dev->bdev, GFP_NOIO, NULL);
+	if (r && r != -EOPNOTSUPP)
+		return r;
+
+	return dm_cache_commit(cache->cmd, false);
+}
+
+static void process_need_commit_migrations(struct cache *cache)
+{
+	int r;
+	unsigned long flags;
+	bool empty;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	empty = list_empty(&cache->need_commit_migrations);
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	if (empty)
+		return;
+
+	r = commit(cache);
+	if (r) {
+		DMERR_LIMIT("commit failed, error = %d", r);
+		process_migrations(cache, &cache->need_commit_migrations,
+				   migration_commit_failed);
+		return;
+	}
+
+	process_migrations(cache, &cache->need_commit_migrations,
+			   migration_success_post_commit);
+}
+
+static void do_worker(struct work_struct *ws)
+{
+	struct cache *cache = container_of(ws, struct cache, worker);
+
+	process_deferred_bios(cache);
+	process_migrations(cache, &cache->quiesced_migrations,
+			   process_quiesced_migration);
+	process_migrations(cache, &cache->completed_migrations,
+			   process_completed_migration);
+	writeback_some_dirty_blocks(cache);
+	process_deferred_writethrough_bios(cache);
+	process_need_commit_migrations(cache);
+}
+
+/*----------------------------------------------------------------
+ * Target methods
+ *--------------------------------------------------------------*/
+
+static sector_t get_dev_size(struct dm_dev *dev)
+{
+	return i_size_read(dev->bdev->bd_inode) >> SECTOR_SHIFT;
+}
+
+static void destroy(struct cache *cache)
+{
+	if (cache->migration_pool)
+		mempool_destroy(cache->migration_pool);
+
+	if (cache->per_bio_data_pool)
+		mempool_destroy(cache->per_bio_data_pool);
+
+	if (cache->all_io_ds)
+		dm_deferred_set_destroy(cache->all_io_ds);
+
+	if (cache->prison)
+		dm_bio_prison_destroy(cache->prison);
+
+	if (cache->wq)
+		destroy_workqueue(cache->wq);
+
+	if (cache->copier)
+		dm_kcopyd_client_destroy(cache->copier);
+
+	if (cache->cmd)
+		dm_cache_metadata_close(cache->cmd);
+
+	if (cache->metadata_dev)
+		dm_put_device(cache->ti, cache->metadata_dev);
+
+	if (cache->origin_dev)
+		dm_put_device(cache->ti, cache->origin_dev);
+
+	if (cache->cache_dev)
+		dm_put_device(cache->ti, cache->cache_dev);
+
+	if (cache->policy)
+		dm_cache_policy_destroy(cache->policy);
+
+	kfree(cache);
+}
+
+static void cache_dtr(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+
+	destroy(cache);
+}
+
+static int parse_features(struct dm_arg_set *as, struct cache_features *cf,
+			  char **error)
+{
+	static struct dm_arg _args[] = {
+		{0, 1, "Invalid number of cache feature arguments"},
+	};
+
+	int r;
+	unsigned argc;
+	const char *arg;
+
+	cf->write_through = false;
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r)
+		return -EINVAL;
+
+	while (argc--) {
+		arg = dm_shift_arg(as);
+
+		if (!strcasecmp(arg, "writeback"))
+			cf->write_through = false;
+
+		else if (!strcasecmp(arg, "writethrough"))
+			cf->write_through = true;
+
+		else {
+			*error = "Unrecognised cache feature requested";
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int set_config_value(struct cache *cache, const char *key,
+			    const char *value)
+{
+	unsigned long tmp;
+
+	if (!strcasecmp(key, "migration_threshold")) {
+		if (kstrtoul(value, 10, &tmp))
+			return -EINVAL;
+
+		cache->migration_threshold = tmp;
+		return 0;
+	}
+
+	return policy_set_config_value(cache->policy, key, value);
+}
+
+static int parse_policy_args(struct cache *cache, struct dm_arg_set *as,
+			     char **error)
+{
+	static struct dm_arg _args[] = {
+		{0, 1024, "Invalid number of policy arguments"},
+	};
+
+	int r;
+	unsigned argc;
+	const char *key, *value;
+
+	r = dm_read_arg_group(_args, as, &argc, error);
+	if (r)
+		return -EINVAL;
+
+	if (argc & 1) {
+		*error = "Policy arguments must be <key> <value> pairs";
+		return -EINVAL;
+	}
+
+	while (argc) {
+		key = dm_shift_arg(as);
+		value = dm_shift_arg(as);
+		argc -= 2;
+
+		r = set_config_value(cache, key, value);
+		if (r) {
+			*error = "Error setting policy argument";
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Construct a cache device mapping.
+ *
+ * cache <metadata dev> <cache dev> <origin dev> <block size>
+ *       <#feature args> [<feature arg>]*
+ *       <policy> <#policy args> [<policy arg>]*
+ *
+ * metadata dev    : fast device holding the persistent metadata
+ * cache dev	   : fast device holding cached data blocks
+ * origin dev	   : slow device holding original data blocks
+ * block size	   : cache unit size in sectors
+ *
+ * #feature args   : number of feature arguments passed
+ * feature args    : writethrough or writeback (the default)
+ *
+ * policy	   : the replacement policy to use
+ * #policy args    : an even number of policy arguments corresponding
+ *		     to key/value pairs passed to the policy
+ * policy args	   : key/value pairs passed to the policy
+ *		     E.g. 'sequential_threshold 1024'
+ *		     See cache-policies.txt for details.
+ */
+static int cache_ctr(struct dm_target *ti, unsigned argc, char **argv)
+{
+	int r = -EINVAL;
+	struct cache *cache;
+	struct dm_arg_set as;
+	unsigned long block_size;
+	sector_t origin_blocks, cache_blocks;
+	struct dm_cache_statistics stats;
+	const char *policy_name;
+	char b[BDEVNAME_SIZE];
+
+	if (argc < 6) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
+	}
+	as.argc = argc;
+	as.argv = argv;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache) {
+		ti->error = "Error allocating memory for cache";
+		return -ENOMEM;
+	}
+
+	cache->ti = ti;
+	ti->private = cache;
+
+	r = dm_get_device(ti, argv[0], FMODE_READ | FMODE_WRITE,
+			  &cache->metadata_dev);
+	if (r) {
+		ti->error = "Error opening metadata device";
+		goto bad;
+	}
+
+	if (get_dev_size(cache->metadata_dev) > DM_CACHE_METADATA_MAX_SECTORS_WARNING)
+		DMWARN("Metadata device %s is larger than %u sectors: excess space will not be used.",
+		       bdevname(cache->metadata_dev->bdev, b),
+		       DM_CACHE_METADATA_MAX_SECTORS);
+
+	r = dm_get_device(ti, argv[1], FMODE_READ | FMODE_WRITE,
+			  &cache->cache_dev);
+	if (r) {
+		ti->error = "Error opening cache device";
+		goto bad;
+	}
+
+	r = dm_get_device(ti, argv[2], FMODE_READ | FMODE_WRITE,
+			  &cache->origin_dev);
+	if (r) {
+		ti->error = "Error opening origin device";
+		goto bad;
+	}
+
+	if (ti->len > get_dev_size(cache->origin_dev)) {
+		ti->error = "Device size larger than the origin device";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	if (kstrtoul(argv[3], 10, &block_size) || !block_size ||
+	    block_size < DATA_DEV_BLOCK_SIZE_MIN_SECTORS ||
+	    block_size > DATA_DEV_BLOCK_SIZE_MAX_SECTORS ||
+	    block_size & (DATA_DEV_BLOCK_SIZE_MIN_SECTORS - 1)) {
+		ti->error = "Invalid data block size";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	cache->sectors_per_block = block_size;
+	if (block_size & (block_size - 1))
+		cache->sectors_per_block_shift = -1;
+	else
+		cache->sectors_per_block_shift = __ffs(block_size);
+
+	origin_blocks = ti->len;
+	(void) sector_div(origin_blocks, block_size);
+	cache->origin_blocks = to_oblock(origin_blocks);
+
+	cache_blocks = get_dev_size(cache->cache_dev);
+	(void) sector_div(cache_blocks, block_size);
+	if (!cache_blocks || cache_blocks > UINT_MAX) {
+		ti->error = "Invalid cache device size";
+		r = -EINVAL;
+		goto bad;
+	}
+	cache->cache_size = to_cblock(cache_blocks);
+
+	dm_consume_args(&as, 4);
+	r = parse_features(&as, &cache->features, &ti->error);
+	if (r)
+		goto bad;
+
+	policy_name = dm_shift_arg(&as);
+	if (!policy_name) {
+		ti->error = "Missing cache policy";
+		r = -EINVAL;
+		goto bad;
+	}
+
+	cache->policy = dm_cache_policy_create(policy_name, cache->cache_size,
+					       ti->len, block_size);
+	if (!cache->policy) {
+		ti->error = "Error creating cache's policy";
+		r = -ENOMEM;
+		goto bad;
+	}
+
+	cache->migration_threshold = DEFAULT_MIGRATION_THRESHOLD;
+
+	r = parse_policy_args(cache, &as, &ti->error);
+	if (r)
+		goto bad;
+
+	cache->cmd = dm_cache_metadata_open(cache->metadata_dev->bdev,
+					    block_size, true);
+	if (IS_ERR(cache->cmd)) {
+		ti->error = "Error creating metadata object";
+		r = PTR_ERR(cache->cmd);
+		cache->cmd = NULL;
+		goto bad;
+	}
+
+	spin_lock_init(&cache->lock);
+	bio_list_init(&cache->deferred_bios);
+	bio_list_init(&cache->deferred_writethrough_bios);
+	INIT_LIST_HEAD(&cache->quiesced_migrations);
+	INIT_LIST_HEAD(&cache->completed_migrations);
+	INIT_LIST_HEAD(&cache->need_commit_migrations);
+	atomic_set(&cache->nr_migrations, 0);
+	init_waitqueue_head(&cache->migration_wait);
+
+	r = -ENOMEM;
+	cache->wq = alloc_ordered_workqueue("dm-" DM_MSG_PREFIX, WQ_MEM_RECLAIM);
+	if (!cache->wq) {
+		ti->error = "Error creating cache's workqueue";
+		goto bad;
+	}
+	INIT_WORK(&cache->worker, do_worker);
+
+	cache->copier = dm_kcopyd_client_create();
+	if (IS_ERR(cache->copier)) {
+		ti->error = "Error creating cache's kcopyd client";
+		r = PTR_ERR(cache->copier);
+		cache->copier = NULL;
+		goto bad;
+	}
+
+	cache->prison = dm_bio_prison_create(PRISON_CELLS);
+	if (!cache->prison) {
+		ti->error = "Error creating cache's bio prison";
+		goto bad;
+	}
+
+	cache->all_io_ds = dm_deferred_set_create();
+	if (!cache->all_io_ds) {
+		ti->error = "Error creating cache's all io deferred set";
+		goto bad;
+	}
+
+	cache->per_bio_data_pool = mempool_create_slab_pool(PER_BIO_DATA_POOL_SIZE,
+							    _per_bio_data_cache);
+	if (!cache->per_bio_data_pool) {
+		ti->error = "Error creating cache's per bio data mempool";
+		goto bad;
+	}
+
+	cache->migration_pool = mempool_create_slab_pool(MIGRATION_POOL_SIZE,
+							 _migration_cache);
+	if (!cache->migration_pool) {
+		ti->error = "Error creating cache's migration mempool";
+		goto bad;
+	}
+
+	cache->loaded_mappings = false;
+	cache->quiescing = false;
+
+	dm_cache_metadata_get_stats(cache->cmd, &stats);
+	atomic_set(&cache->stats.read_hit, stats.read_hits);
+	atomic_set(&cache->stats.read_miss, stats.read_misses);
+	atomic_set(&cache->stats.write_hit, stats.write_hits);
+	atomic_set(&cache->stats.write_miss, stats.write_misses);
+	atomic_set(&cache->stats.demotion, 0);
+	atomic_set(&cache->stats.promotion, 0);
+
+	r = dm_set_target_max_io_len(ti, cache->sectors_per_block);
+	if (r)
+		goto bad;
+
+	/*
+	 * One empty flush goes to the origin, the other to the cache.
+	 */
+	ti->num_flush_requests = 2;
+
+	return 0;
+
+bad:
+	destroy(cache);
+	return r;
+}
+
+static int cache_map(struct dm_target *ti, struct bio *bio,
+		     union map_info *map_context)
+{
+	int r;
+	struct cache *cache = ti->private;
+	struct per_bio_data *pb;
+	dm_oblock_t block;
+	struct dm_cell_key key;
+	struct dm_bio_prison_cell *cell;
+	struct policy_result lookup_result;
+
+	pb = mempool_alloc(cache->per_bio_data_pool, GFP_NOIO);
+	pb->cache = cache;
+	pb->accounted = false;
+	pb->req_nr = map_context->target_request_nr;
+	pb->all_io_entry = NULL;
+	map_context->ptr = pb;
+
+	bio->bi_sector = dm_target_offset(ti, bio->bi_sector);
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		BUG_ON(bio->bi_size);
+		if (!pb->req_nr)
+			remap_to_origin(cache, bio);
+		else
+			bio->bi_bdev = cache->cache_dev->bdev;
+		return DM_MAPIO_REMAPPED;
+	}
+
+	block = get_bio_block(cache, bio);
+	if (from_oblock(block) >= from_oblock(cache->origin_blocks)) {
+		/*
+		 * This can only occur if the io goes to a partial block at
+		 * the end of the origin device.  We don't cache these.
+		 */
+		remap_to_origin(cache, bio);
+		return DM_MAPIO_REMAPPED;
+	}
+
+	/*
+	 * Check to see if that block is currently migrating.
+	 */
+	build_key(block, &key);
+	if (dm_bio_detain(cache->prison, &key, bio, &cell))
+		return DM_MAPIO_SUBMITTED;
+
+	r = policy_map(cache->policy, block, false,
+		       !cache->features.write_through, bio, &lookup_result);
+	if (r == -EWOULDBLOCK) {
+		/*
+		 * The policy wants to migrate, or couldn't take its lock
+		 * without blocking.  Let the worker sort it out.
+		 */
+		cell_defer(cache, cell, true);
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	switch (lookup_result.op) {
+	case POLICY_HIT:
+		remap_hit(cache, bio, lookup_result.cblock);
+		r = DM_MAPIO_REMAPPED;
+		break;
+
+	case POLICY_MISS:
+		remap_miss(cache, bio);
+		r = DM_MAPIO_REMAPPED;
+		break;
+
+	default:
+		DMERR_LIMIT("%s: erroring bio: unknown policy op: %u", __func__,
+			    (unsigned) lookup_result.op);
+		bio_io_error(bio);
+		r = DM_MAPIO_SUBMITTED;
+	}
+
+	cell_defer(cache, cell, false);
+
+	return r;
+}
+
+static int cache_end_io(struct dm_target *ti, struct bio *bio, int error,
+			union map_info *map_context)
+{
+	struct cache *cache = ti->private;
+	struct per_bio_data *pb = map_context->ptr;
+	struct list_head work;
+
+	if (pb->all_io_entry) {
+		INIT_LIST_HEAD(&work);
+		dm_deferred_entry_dec(pb->all_io_entry, &work);
+
+		if (!list_empty(&work))
+			queue_quiesced_migrations(cache, &work);
+	}
+
+	mempool_free(pb, cache->per_bio_data_pool);
+
+	return 0;
+}
+
+static int load_mapping(void *context, dm_oblock_t oblock, dm_cblock_t cblock,
+			bool dirty, uint32_t hint, bool hint_valid)
+{
+	struct cache *cache = context;
+
+	if (from_oblock(oblock) >= from_oblock(cache->origin_blocks)) {
+		DMERR("cache block %u maps origin block %llu, beyond the end of the origin",
+		      from_cblock(cblock), (unsigned long long)from_oblock(oblock));
+		return -EINVAL;
+	}
+
+	return policy_load_mapping(cache->policy, oblock, cblock, dirty,
+				   hint, hint_valid);
+}
+
+/*
+ * The dirty flags and hints are only kept in core while the cache is
+ * running.  We get them from the metadata on the first resume, once any
+ * previous table has had a chance to write them back.
+ */
+static int cache_preresume(struct dm_target *ti)
+{
+	int r;
+	struct cache *cache = ti->private;
+	struct dm_cache_statistics stats;
+
+	if (!cache->loaded_mappings) {
+		r = dm_cache_resize(cache->cmd, cache->cache_size);
+		if (r) {
+			DMERR("could not resize cache metadata");
+			return r;
+		}
+
+		r = dm_cache_load_mappings(cache->cmd,
+					   dm_cache_policy_get_name(cache->policy),
+					   load_mapping, cache);
+		if (r) {
+			DMERR("could not load cache mappings");
+			return r;
+		}
+
+		dm_cache_metadata_get_stats(cache->cmd, &stats);
+		atomic_set(&cache->stats.read_hit, stats.read_hits);
+		atomic_set(&cache->stats.read_miss, stats.read_misses);
+		atomic_set(&cache->stats.write_hit, stats.write_hits);
+		atomic_set(&cache->stats.write_miss, stats.write_misses);
+
+		cache->loaded_mappings = true;
+	}
+
+	/*
+	 * Writes may dirty blocks from now on, so the metadata mustn't
+	 * claim a clean shutdown any more.
+	 */
+	r = dm_cache_commit(cache->cmd, false);
+	if (r)
+		DMERR("could not commit metadata");
+
+	return r;
+}
+
+static void cache_resume(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+
+	cache->quiescing = false;
+	wake_worker(cache);
+}
+
+static void cache_presuspend(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+
+	cache->quiescing = true;
+}
+
+static int save_dirty_and_hint(void *context, dm_cblock_t cblock,
+			       dm_oblock_t oblock, bool dirty, uint32_t hint)
+{
+	int r;
+	struct cache *cache = context;
+
+	r = dm_cache_set_dirty(cache->cmd, cblock, oblock, dirty);
+	if (r)
+		return r;
+
+	return dm_cache_save_hint(cache->cmd, cblock, hint);
+}
+
+static int sync_metadata(struct cache *cache)
+{
+	int r;
+	struct dm_cache_statistics stats;
+
+	r = dm_cache_begin_hints(cache->cmd, dm_cache_policy_get_name(cache->policy));
+	if (r) {
+		DMERR("could not begin writing hints");
+		return r;
+	}
+
+	r = policy_walk_mappings(cache->policy, save_dirty_and_hint, cache);
+	if (r) {
+		DMERR("could not write dirty bits and hints");
+		return r;
+	}
+
+	stats.read_hits = atomic_read(&cache->stats.read_hit);
+	stats.read_misses = atomic_read(&cache->stats.read_miss);
+	stats.write_hits = atomic_read(&cache->stats.write_hit);
+	stats.write_misses = atomic_read(&cache->stats.write_miss);
+	dm_cache_metadata_set_stats(cache->cmd, &stats);
+
+	/*
+	 * Blocks cleaned by kcopyd must be on the origin before the
+	 * metadata says they're clean.
+	 */
+	r = blkdev_issue_flush(cache->origin_dev->bdev, GFP_KERNEL, NULL);
+	if (r && r != -EOPNOTSUPP) {
+		DMERR("could not flush origin device");
+		return r;
+	}
+
+	r = dm_cache_commit(cache->cmd, true);
+	if (r)
+		DMERR("could not commit metadata for a clean shutdown");
+
+	return r;
+}
+
+static void cache_postsuspend(struct dm_target *ti)
+{
+	struct cache *cache = ti->private;
+
+	wait_event(cache->migration_wait, !atomic_read(&cache->nr_migrations));
+	flush_workqueue(cache->wq);
+
+	if (!cache->loaded_mappings)
+		return;
+
+	if (sync_metadata(cache))
+		(void) dm_cache_commit(cache->cmd, false);
+}
+
+/*
+ * Status format:
+ *
+ * <metadata block size> <#used metadata blocks>/<#total metadata blocks>
+ * <cache block size> <#used cache blocks>/<#total cache blocks>
+ * <#read hits> <#read misses> <#write hits> <#write misses>
+ * <#demotions> <#promotions> <#dirty>
+ * <#features> <features>*
+ * <#core args> <core args>
+ * <policy name> <#policy args> <policy args>*
+ */
+static int cache_status(struct dm_target *ti, status_type_t type,
+			unsigned status_flags, char *result, unsigned maxlen)
+{
+	int r = 0;
+	unsigned sz = 0;
+	dm_block_t nr_free_blocks_metadata = 0;
+	dm_block_t nr_blocks_metadata = 0;
+	char buf[BDEVNAME_SIZE];
+	struct cache *cache = ti->private;
+	dm_cblock_t residency;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		r = dm_cache_get_free_metadata_block_count(cache->cmd,
+							   &nr_free_blocks_metadata);
+		if (r) {
+			DMERR("could not get metadata free block count");
+			return r;
+		}
+
+		r = dm_cache_get_metadata_dev_size(cache->cmd, &nr_blocks_metadata);
+		if (r) {
+			DMERR("could not get metadata device size");
+			return r;
+		}
+
+		residency = policy_residency(cache->policy);
+
+		DMEMIT("%u %llu/%llu %lu %u/%u %u %u %u %u %u %u %u ",
+		       (unsigned)(DM_CACHE_METADATA_BLOCK_SIZE >> SECTOR_SHIFT),
+		       (unsigned long long)(nr_blocks_metadata - nr_free_blocks_metadata),
+		       (unsigned long long)nr_blocks_metadata,
+		       (unsigned long)cache->sectors_per_block,
+		       (unsigned) from_cblock(residency),
+		       (unsigned) from_cblock(cache->cache_size),
+		       (unsigned) atomic_read(&cache->stats.read_hit),
+		       (unsigned) atomic_read(&cache->stats.read_miss),
+		       (unsigned) atomic_read(&cache->stats.write_hit),
+		       (unsigned) atomic_read(&cache->stats.write_miss),
+		       (unsigned) atomic_read(&cache->stats.demotion),
+		       (unsigned) atomic_read(&cache->stats.promotion),
+		       (unsigned) from_cblock(policy_nr_dirty(cache->policy)));
+
+		if (cache->features.write_through)
+			DMEMIT("1 writethrough ");
+		else
+			DMEMIT("0 ");
+
+		DMEMIT("2 migration_threshold %llu ",
+		       (unsigned long long) cache->migration_threshold);
+
+		DMEMIT("%s ", dm_cache_policy_get_name(cache->policy));
+		r = policy_emit_config_values(cache->policy, result + sz, maxlen - sz);
+		if (r)
+			DMERR("policy_emit_config_values returned %d", r);
+		break;
+
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s ", format_dev_t(buf, cache->metadata_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->cache_dev->bdev->bd_dev));
+		DMEMIT("%s ", format_dev_t(buf, cache->origin_dev->bdev->bd_dev));
+		DMEMIT("%lu ", (unsigned long)cache->sectors_per_block);
+
+		if (cache->features.write_through)
+			DMEMIT("1 writethrough ");
+		else
+			DMEMIT("0 ");
+
+		DMEMIT("%s ", dm_cache_policy_get_name(cache->policy));
+		r = policy_emit_config_values(cache->policy, result + sz, maxlen - sz);
+		break;
+	}
+
+	return r;
+}
+
+/*
+ * Supports <key> <value>.
+ *
+ * The key migration_threshold is supported by the cache target core.
+ */
+static int cache_message(struct dm_target *ti, unsigned argc, char **argv)
+{
+	struct cache *cache = ti->private;
+
+	if (argc != 2)
+		return -EINVAL;
+
+	return set_config_value(cache, argv[0], argv[1]);
+}
+
+static int cache_iterate_devices(struct dm_target *ti,
+				 iterate_devices_callout_fn fn, void *data)
+{
+	int r = 0;
+	struct cache *cache = ti->private;
+
+	r = fn(ti, cache->cache_dev, 0, get_dev_size(cache->cache_dev), data);
+	if (!r)
+		r = fn(ti, cache->origin_dev, 0, ti->len, data);
+
+	return r;
+}
+
+/*
+ * We assume I/O is going to the origin (which is the volume
+ * more likely to have restrictions e.g. by being striped).
+ * (Looking up the exact location of the data would be expensive
+ * and could always be out of date by the time the bio is submitted.)
+ */
+static int cache_bvec_merge(struct dm_target *ti,
+			    struct bvec_merge_data *bvm,
+			    struct bio_vec *biovec, int max_size)
+{
+	struct cache *cache = ti->private;
+	struct request_queue *q = bdev_get_queue(cache->origin_dev->bdev);
+
+	if (!q->merge_bvec_fn)
+		return max_size;
+
+	bvm->bi_bdev = cache->origin_dev->bdev;
+	return min(max_size, q->merge_bvec_fn(q, bvm, biovec));
+}
+
+static void cache_io_hints(struct dm_target *ti, struct queue_limits *limits)
+{
+	struct cache *cache = ti->private;
+
+	blk_limits_io_min(limits, 0);
+	blk_limits_io_opt(limits, cache->sectors_per_block << SECTOR_SHIFT);
+}
+
+/*----------------------------------------------------------------*/
+
+static struct target_type cache_target = {
+	.name = "cache",
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.ctr = cache_ctr,
+	.dtr = cache_dtr,
+	.map = cache_map,
+	.end_io = cache_end_io,
+	.presuspend = cache_presuspend,
+	.postsuspend = cache_postsuspend,
+	.preresume = cache_preresume,
+	.resume = cache_resume,
+	.status = cache_status,
+	.message = cache_message,
+	.iterate_devices = cache_iterate_devices,
+	.merge = cache_bvec_merge,
+	.io_hints = cache_io_hints,
+};
+
+static int __init dm_cache_init(void)
+{
+	int r;
+
+	r = dm_register_target(&cache_target);
+	if (r) {
+		DMERR("cache target registration failed: %d", r);
+		return r;
+	}
+
+	r = -ENOMEM;
+
+	_migration_cache = KMEM_CACHE(dm_cache_migration, 0);
+	if (!_migration_cache)
+		goto bad_migration_cache;
+
+	_per_bio_data_cache = KMEM_CACHE(per_bio_data, 0);
+	if (!_per_bio_data_cache)
+		goto bad_per_bio_data_cache;
+
+	return 0;
+
+bad_per_bio_data_cache:
+	kmem_cache_destroy(_migration_cache);
+bad_migration_cache:
+	dm_unregister_target(&cache_target);
+
+	return r;
+}
+
+static void __exit dm_cache_exit(void)
+{
+	dm_unregister_target(&cache_target);
+	kmem_cache_destroy(_migration_cache);
+	kmem_cache_destroy(_per_bio_data_cache);
+}
+
+module_init(dm_cache_init);
+module_exit(dm_cache_exit);
+
+MODULE_DESCRIPTION(DM_NAME " cache target");
+MODULE_LICENSE("GPL");
@@ -92,8 +92,12 @@
  * not hashed must be on the inactive_list, and will normally be at
  * the front.  All stripes start life this way.
  *
- * The inactive_list, handle_list and hash bucket lists are all protected by the
- * device_lock.
+ * The stripe cache is split into NR_STRIPE_HASH_LOCKS partitions by sector.
+ * Each partition has its own inactive_list, and that list together with the
+ * hash buckets of the partition is protected by conf->hash_locks[].  The
+ * handle_list, hold_list, delayed_list, bitmap_list and the per-group
+ * handle lists are protected by the device_lock.  When both are needed
+ * the hash lock is taken first.
  *  - stripes have a reference counter. If count==0, they are on a list.
  *  - If a stripe might need handling, STRIPE_HANDLE is set.
  *  - When refcount reaches zero, then if STRIPE_HANDLE it is put on
@@ -200,6 +204,13 @@ struct stripe_head {
 	struct r5conf		*raid_conf;
 	short			generation;	/* increments with every
 						 * reshape */
+	int			hash_lock_index; /* partition of the stripe
+						  * cache this stripe serves */
+	int			cpu;		/* cpu that activated the
+						 * stripe, picks the worker
+						 * group */
+	struct r5worker_group	*group;		/* group whose handle_list
+						 * the stripe is on */
 	sector_t		sector;		/* sector of this row */
 	short			pd_idx;		/* parity disk index */
 	short			qd_idx;		/* 'Q' disk index for raid6 */
@@ -364,6 +375,31 @@ struct disk_info {
 	struct md_rdev	*rdev, *replacement;
 };
 
+/* NOTE NR_STRIPE_HASH_LOCKS must remain below 64.
+ * This is because we sometimes take all the spinlocks
+ * and creating that much locking depth can cause
+ * problems.
+ */
+#define NR_STRIPE_HASH_LOCKS 8
+#define STRIPE_HASH_LOCKS_MASK (NR_STRIPE_HASH_LOCKS - 1)
+
+struct r5worker {
+	struct work_struct work;
+	struct r5worker_group *group;
+	/* stripes released by this worker, moved to the inactive
+	 * lists once device_lock has been dropped
+	 */
+	struct list_head temp_inactive_list[NR_STRIPE_HASH_LOCKS];
+	bool working;
+};
+
+struct r5worker_group {
+	struct list_head handle_list;
+	struct r5conf *conf;
+	struct r5worker *workers;
+	int stripes_cnt;
+};
+
 struct r5conf {
 	struct hlist_head	*stripe_hashtbl;
 	struct mddev		*mddev;
@@ -445,7 +481,11 @@ struct r5conf {
 	 * Free stripes pool
 	 */
 	atomic_t		active_stripes;
-	struct list_head	inactive_list;
+	struct list_head	inactive_list[NR_STRIPE_HASH_LOCKS];
+	atomic_t		empty_inactive_list_nr;
+	spinlock_t		hash_locks[NR_STRIPE_HASH_LOCKS];
+	/* stripes released by raid5d while holding device_lock */
+	struct list_head	temp_inactive_list[NR_STRIPE_HASH_LOCKS];
 	wait_queue_head_t	wait_for_stripe;
 	wait_queue_head_t	wait_for_overlap;
 	int			inactive_blocked;	/* release of inactive stripes blocked,
@@ -459,6 +499,13 @@ struct r5conf {
 	 * the new thread here until we fully activate the array.
 	 */
 	struct md_thread	*thread;
+
+	/* stripe handling offloaded to workqueue workers, one
+	 * group per NUMA node
+	 */
+	struct r5worker_group	*worker_groups;
+	int			group_cnt;
+	int			worker_cnt_per_group;
 };
 
 /*
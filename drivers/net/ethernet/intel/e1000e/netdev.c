@@ -749,6 +749,9 @@ no_buffers:
 	rx_ring->next_to_use = i;
 }
 
+/* pages taken from the page allocator at once when refilling the ring */
+#define E1000_RX_PAGE_BATCH	16
+
 /**
  * e1000_alloc_jumbo_rx_buffers - Replace used jumbo receive buffers
  * @rx_ring: Rx descriptor ring
@@ -763,6 +766,8 @@ static void e1000_alloc_jumbo_rx_buffers(struct e1000_ring *rx_ring,
 	struct pci_dev *pdev = adapter->pdev;
 	union e1000_rx_desc_extended *rx_desc;
 	struct e1000_buffer *buffer_info;
+	struct page *pages[E1000_RX_PAGE_BATCH];
+	unsigned int nr_pages = 0, next_page = 0;
 	struct sk_buff *skb;
 	unsigned int i;
 	unsigned int bufsz = 256 - 16 /* for skb_reserve */;
@@ -788,11 +793,19 @@ static void e1000_alloc_jumbo_rx_buffers(struct e1000_ring *rx_ring,
 check_page:
 		/* allocate a new page if necessary */
 		if (!buffer_info->page) {
-			buffer_info->page = alloc_page(gfp);
-			if (unlikely(!buffer_info->page)) {
+			if (next_page == nr_pages) {
+				memset(pages, 0, sizeof(pages));
+				nr_pages = alloc_pages_bulk_array(gfp,
+						min_t(int, cleaned_count + 1,
+						      E1000_RX_PAGE_BATCH),
+						pages);
+				next_page = 0;
+			}
+			if (unlikely(next_page == nr_pages)) {
 				adapter->alloc_rx_buff_failed++;
 				break;
 			}
+			buffer_info->page = pages[next_page++];
 		}
 
 		if (!buffer_info->dma)
@@ -809,6 +822,10 @@ check_page:
 		buffer_info = &rx_ring->buffer_info[i];
 	}
 
+	/* return the pages left over from the last batch */
+	if (next_page < nr_pages)
+		free_pages_bulk(nr_pages - next_page, &pages[next_page]);
+
 	if (likely(rx_ring->next_to_use != i)) {
 		rx_ring->next_to_use = i;
 		if (unlikely(i-- == 0))
@@ -993,7 +1010,7 @@ next_desc:
 }
 
 static void e1000_put_txbuf(struct e1000_ring *tx_ring,
-			    struct e1000_buffer *buffer_info)
+			    struct e1000_buffer *buffer_info, int budget)
 {
 	struct e1000_adapter *adapter = tx_ring->adapter;
 
@@ -1007,7 +1024,7 @@ static void e1000_put_txbuf(struct e1000_ring *tx_ring,
 		buffer_info->dma = 0;
 	}
 	if (buffer_info->skb) {
-		dev_kfree_skb_any(buffer_info->skb);
+		napi_consume_skb(buffer_info->skb, budget);
 		buffer_info->skb = NULL;
 	}
 	buffer_info->time_stamp = 0;
@@ -1097,11 +1114,12 @@ static void e1000_print_hw_hang(struct work_struct *work)
 /**
  * e1000_clean_tx_irq - Reclaim resources after transmit completes
  * @tx_ring: Tx descriptor ring
+ * @budget: NAPI budget, 0 when not called from the poll routine
  *
  * the return value indicates whether actual cleaning was done, there
  * is no guarantee that everything was cleaned
  **/
-static bool e1000_clean_tx_irq(struct e1000_ring *tx_ring)
+static bool e1000_clean_tx_irq(struct e1000_ring *tx_ring, int budget)
 {
 	struct e1000_adapter *adapter = tx_ring->adapter;
 	struct net_device *netdev = adapter->netdev;
@@ -1135,7 +1153,7 @@ static bool e1000_clean_tx_irq(struct e1000_ring *tx_ring)
 				}
 			}
 
-			e1000_put_txbuf(tx_ring, buffer_info);
+			e1000_put_txbuf(tx_ring, buffer_info, budget);
 			tx_desc->upper.data = 0;
 
 			i++;
@@ -1809,7 +1827,7 @@ static irqreturn_t e1000_intr_msix_tx(int irq, void *data)
 	adapter->total_tx_bytes = 0;
 	adapter->total_tx_packets = 0;
 
-	if (!e1000_clean_tx_irq(tx_ring))
+	if (!e1000_clean_tx_irq(tx_ring, 0))
 		/* Ring was not completely cleaned, so fire another interrupt */
 		ew32(ICS, tx_ring->ims_val);
 
@@ -2290,7 +2308,7 @@ static void e1000_clean_tx_ring(struct e1000_ring *tx_ring)
 
 	for (i = 0; i < tx_ring->count; i++) {
 		buffer_info = &tx_ring->buffer_info[i];
-		e1000_put_txbuf(tx_ring, buffer_info);
+		e1000_put_txbuf(tx_ring, buffer_info, 0);
 	}
 
 	netdev_reset_queue(adapter->netdev);
@@ -2558,7 +2576,7 @@ static int e1000e_poll(struct napi_struct *napi, int weight)
 
 	if (!adapter->msix_entries ||
 	    (adapter->rx_ring->ims_val & adapter->tx_ring->ims_val))
-		tx_cleaned = e1000_clean_tx_irq(adapter->tx_ring);
+		tx_cleaned = e1000_clean_tx_irq(adapter->tx_ring, weight);
 
 	adapter->clean_rx(adapter->rx_ring, &work_done, weight);
 
@@ -4884,7 +4902,7 @@ dma_error:
 			i += tx_ring->count;
 		i--;
 		buffer_info = &tx_ring->buffer_info[i];
-		e1000_put_txbuf(tx_ring, buffer_info);
+		e1000_put_txbuf(tx_ring, buffer_info, 0);
 	}
 
 	return 0;
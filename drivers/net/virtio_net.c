@@ -135,8 +135,20 @@ static struct page *get_a_page(struct virtnet_info *vi, gfp_t gfp_mask)
 		vi->pages = (struct page *)p->private;
 		/* clear private here, it is used to chain pages */
 		p->private = 0;
-	} else
-		p = alloc_page(gfp_mask);
+	} else {
+		/* enough for a big packet buffer, the rest is kept for later */
+		struct page *pages[MAX_SKB_FRAGS + 2] = { NULL };
+		unsigned long i, nr;
+
+		nr = alloc_pages_bulk_array(gfp_mask, ARRAY_SIZE(pages), pages);
+		if (!nr)
+			return NULL;
+		for (i = 1; i < nr; i++) {
+			pages[i]->private = (unsigned long)vi->pages;
+			vi->pages = pages[i];
+		}
+		p = pages[0];
+	}
 	return p;
 }
 
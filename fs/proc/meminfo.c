@@ -103,6 +103,9 @@ static int meminfo_proc_show(struct seq_file *m, void *v)
 #endif
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 		"AnonHugePages:  %8lu kB\n"
+#endif
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+		"AnonHugePudPages: %6lu kB\n"
 #endif
 		,
 		K(i.totalram),
@@ -163,6 +166,10 @@ static int meminfo_proc_show(struct seq_file *m, void *v)
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 		,K(global_page_state(NR_ANON_TRANSPARENT_HUGEPAGES) *
 		   HPAGE_PMD_NR)
+#endif
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+		,K(global_page_state(NR_ANON_PUD_HUGEPAGES) *
+		   HPAGE_PUD_NR)
 #endif
 		);
 
@@ -480,6 +480,31 @@ static int smaps_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 	return 0;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+static int smaps_pud_range(pud_t *pud, unsigned long addr, unsigned long end,
+			   struct mm_walk *walk)
+{
+	struct mem_size_stats *mss = walk->private;
+	unsigned long size = end - addr;
+
+	if (!pud_trans_huge(*pud))
+		return 0;
+
+	/* a 1GB page is anonymous and mapped exactly once */
+	mss->resident += size;
+	mss->anonymous += size;
+	mss->anonymous_thp += size;
+	if (pud_young(*pud))
+		mss->referenced += size;
+	if (pud_dirty(*pud))
+		mss->private_dirty += size;
+	else
+		mss->private_clean += size;
+	mss->pss += (u64)size << PSS_SHIFT;
+	return 0;
+}
+#endif
+
 static int show_smap(struct seq_file *m, void *v, int is_pid)
 {
 	struct proc_maps_private *priv = m->private;
@@ -487,6 +512,9 @@ static int show_smap(struct seq_file *m, void *v, int is_pid)
 	struct vm_area_struct *vma = v;
 	struct mem_size_stats mss;
 	struct mm_walk smaps_walk = {
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+		.pud_entry = smaps_pud_range,
+#endif
 		.pmd_entry = smaps_pte_range,
 		.mm = vma->vm_mm,
 		.private = &mss,
@@ -620,6 +648,20 @@ static int clear_refs_pte_range(pmd_t *pmd, unsigned long addr,
 	return 0;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+static int clear_refs_pud_range(pud_t *pud, unsigned long addr,
+				unsigned long end, struct mm_walk *walk)
+{
+	if (!pud_trans_huge(*pud))
+		return 0;
+
+	/* the TLB is flushed once the whole mm has been walked */
+	set_pud_at(walk->mm, addr, pud, pud_mkold(*pud));
+	ClearPageReferenced(pfn_to_page(pud_pfn(*pud)));
+	return 0;
+}
+#endif
+
 #define CLEAR_REFS_ALL 1
 #define CLEAR_REFS_ANON 2
 #define CLEAR_REFS_MAPPED 3
@@ -650,6 +692,9 @@ static ssize_t clear_refs_write(struct file *file, const char __user *buf,
 	mm = get_task_mm(task);
 	if (mm) {
 		struct mm_walk clear_refs_walk = {
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+			.pud_entry = clear_refs_pud_range,
+#endif
 			.pmd_entry = clear_refs_pte_range,
 			.mm = mm,
 		};
@@ -799,6 +844,30 @@ static inline void thp_pmd_to_pagemap_entry(pagemap_entry_t *pme,
 }
 #endif
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+static int pagemap_pud_range(pud_t *pud, unsigned long addr, unsigned long end,
+			     struct mm_walk *walk)
+{
+	struct pagemapread *pm = walk->private;
+	pagemap_entry_t pme;
+	int err = 0;
+
+	if (!pud_trans_huge(*pud))
+		return 0;
+
+	for (; addr != end; addr += PAGE_SIZE) {
+		unsigned long offset = (addr & ~HPAGE_PUD_MASK) >> PAGE_SHIFT;
+
+		pme = make_pme(PM_PFRAME(pud_pfn(*pud) + offset)
+			       | PM_PSHIFT(PAGE_SHIFT) | PM_PRESENT);
+		err = add_to_pagemap(addr, &pme, pm);
+		if (err)
+			break;
+	}
+	return err;
+}
+#endif
+
 static int pagemap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 			     struct mm_walk *walk)
 {
@@ -950,6 +1019,9 @@ static ssize_t pagemap_read(struct file *file, char __user *buf,
 	if (!mm || IS_ERR(mm))
 		goto out_free;
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	pagemap_walk.pud_entry = pagemap_pud_range;
+#endif
 	pagemap_walk.pmd_entry = pagemap_pte_range;
 	pagemap_walk.pte_hole = pagemap_pte_hole;
 #ifdef CONFIG_HUGETLB_PAGE
@@ -1121,6 +1193,22 @@ static int gather_pte_stats(pmd_t *pmd, unsigned long addr,
 	pte_unmap_unlock(orig_pte, ptl);
 	return 0;
 }
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+static int gather_pud_stats(pud_t *pud, unsigned long addr,
+		unsigned long end, struct mm_walk *walk)
+{
+	struct numa_maps *md = walk->private;
+	struct page *page;
+
+	if (!pud_trans_huge(*pud))
+		return 0;
+
+	page = pfn_to_page(pud_pfn(*pud));
+	gather_stats(page, md, pud_dirty(*pud), (end - addr) >> PAGE_SHIFT);
+	return 0;
+}
+#endif
+
 #ifdef CONFIG_HUGETLB_PAGE
 static int gather_hugetbl_stats(pte_t *pte, unsigned long hmask,
 		unsigned long addr, unsigned long end, struct mm_walk *walk)
@@ -1173,6 +1261,9 @@ static int show_numa_map(struct seq_file *m, void *v, int is_pid)
 	md->vma = vma;
 
 	walk.hugetlb_entry = gather_hugetbl_stats;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	walk.pud_entry = gather_pud_stats;
+#endif
 	walk.pmd_entry = gather_pte_stats;
 	walk.private = md;
 	walk.mm = mm;
@@ -13,6 +13,7 @@
 #include <linux/kdev_t.h>
 #include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <asm/local.h>
 
 #ifdef CONFIG_BLOCK
 
@@ -85,6 +86,7 @@ struct disk_stats {
 	unsigned long ticks[2];
 	unsigned long io_ticks;
 	unsigned long time_in_queue;
+	local_t in_flight[2];		/* may go negative on a single cpu */
 };
 
 #define PARTITION_META_INFO_VOLNAMELTH	64
@@ -114,7 +116,6 @@ struct hd_struct {
 	int make_it_fail;
 #endif
 	unsigned long stamp;
-	atomic_t in_flight[2];
 #ifdef	CONFIG_SMP
 	struct disk_stats __percpu *dkstats;
 #else
@@ -309,6 +310,18 @@ extern struct hd_struct *disk_map_sector_rcu(struct gendisk *disk,
 	res;								\
 })
 
+#define __part_stat_local(part, field)					\
+	(this_cpu_ptr((part)->dkstats)->field)
+
+#define part_stat_local_read(part, field)				\
+({									\
+	long res = 0;							\
+	unsigned int _cpu;						\
+	for_each_possible_cpu(_cpu)					\
+		res += local_read(&per_cpu_ptr((part)->dkstats, _cpu)->field); \
+	res;								\
+})
+
 static inline void part_stat_set_all(struct hd_struct *part, int value)
 {
 	int i;
@@ -340,6 +353,10 @@ static inline void free_part_stats(struct hd_struct *part)
 
 #define part_stat_read(part, field)	((part)->dkstats.field)
 
+#define __part_stat_local(part, field)	((part)->dkstats.field)
+#define part_stat_local_read(part, field)	\
+	local_read(&(part)->dkstats.field)
+
 static inline void part_stat_set_all(struct hd_struct *part, int value)
 {
 	memset(&part->dkstats, value, sizeof(struct disk_stats));
@@ -370,23 +387,47 @@ static inline void free_part_stats(struct hd_struct *part)
 #define part_stat_sub(cpu, gendiskp, field, subnd)			\
 	part_stat_add(cpu, gendiskp, field, -subnd)
 
+/*
+ * In-flight requests are counted per cpu and only summed up when somebody
+ * asks, so that starting and completing I/O doesn't bounce a shared
+ * cacheline between cpus.  A request may complete on a different cpu than
+ * it was started on, which is why a single cpu's count can go negative;
+ * only the sum is meaningful.  Must be called under part_stat_lock().
+ */
 static inline void part_inc_in_flight(struct hd_struct *part, int rw)
 {
-	atomic_inc(&part->in_flight[rw]);
+	local_inc(&__part_stat_local(part, in_flight[rw]));
 	if (part->partno)
-		atomic_inc(&part_to_disk(part)->part0.in_flight[rw]);
+		local_inc(&__part_stat_local(&part_to_disk(part)->part0,
+					     in_flight[rw]));
 }
 
 static inline void part_dec_in_flight(struct hd_struct *part, int rw)
 {
-	atomic_dec(&part->in_flight[rw]);
+	local_dec(&__part_stat_local(part, in_flight[rw]));
 	if (part->partno)
-		atomic_dec(&part_to_disk(part)->part0.in_flight[rw]);
+		local_dec(&__part_stat_local(&part_to_disk(part)->part0,
+					     in_flight[rw]));
+}
+
+static inline void part_in_flight_rw(struct hd_struct *part,
+				     unsigned int inflight[2])
+{
+	long count;
+
+	/* a racing inc/dec pair can make the sum briefly negative */
+	count = part_stat_local_read(part, in_flight[0]);
+	inflight[0] = max(count, 0L);
+	count = part_stat_local_read(part, in_flight[1]);
+	inflight[1] = max(count, 0L);
 }
 
 static inline int part_in_flight(struct hd_struct *part)
 {
-	return atomic_read(&part->in_flight[0]) + atomic_read(&part->in_flight[1]);
+	unsigned int inflight[2];
+
+	part_in_flight_rw(part, inflight);
+	return inflight[0] + inflight[1];
 }
 
 static inline struct partition_meta_info *alloc_part_info(struct gendisk *disk)
@@ -308,6 +308,30 @@ __alloc_pages(gfp_t gfp_mask, unsigned int order,
 	return __alloc_pages_nodemask(gfp_mask, order, zonelist, NULL);
 }
 
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, struct zonelist *zonelist,
+			nodemask_t *nodemask, unsigned long nr_pages,
+			struct list_head *page_list, struct page **page_array);
+
+/* Bulk allocate 0-order pages from the local node onto a list */
+static inline unsigned long
+alloc_pages_bulk_list(gfp_t gfp_mask, unsigned long nr_pages,
+		      struct list_head *list)
+{
+	return __alloc_pages_bulk(gfp_mask,
+				  node_zonelist(numa_node_id(), gfp_mask),
+				  NULL, nr_pages, list, NULL);
+}
+
+/* Bulk allocate 0-order pages from the local node into the NULL entries */
+static inline unsigned long
+alloc_pages_bulk_array(gfp_t gfp_mask, unsigned long nr_pages,
+		       struct page **page_array)
+{
+	return __alloc_pages_bulk(gfp_mask,
+				  node_zonelist(numa_node_id(), gfp_mask),
+				  NULL, nr_pages, NULL, page_array);
+}
+
 static inline struct page *alloc_pages_node(int nid, gfp_t gfp_mask,
 						unsigned int order)
 {
@@ -367,12 +391,13 @@ extern void __free_pages(struct page *page, unsigned int order);
 extern void free_pages(unsigned long addr, unsigned int order);
 extern void free_hot_cold_page(struct page *page, int cold);
 extern void free_hot_cold_page_list(struct list_head *list, int cold);
+extern void free_pages_bulk(unsigned long nr_pages, struct page **page_array);
 
 #define __free_page(page) __free_pages((page), 0)
 #define free_page(addr) free_pages((addr), 0)
 
 void page_alloc_init(void);
-void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp);
+void drain_zone_pages(struct zone *zone, struct per_cpu_pageset *pset);
 void drain_all_pages(void);
 void drain_local_pages(void *dummy);
 
@@ -400,13 +425,17 @@ static inline bool pm_suspended_storage(void)
 }
 #endif /* CONFIG_PM_SLEEP */
 
-#ifdef CONFIG_CMA
+#if defined CONFIG_CMA || defined CONFIG_TRANSPARENT_HUGEPAGE_PUD
 
 /* The below functions must be run on a range from a single zone. */
 extern int alloc_contig_range(unsigned long start, unsigned long end,
 			      unsigned migratetype);
 extern void free_contig_range(unsigned long pfn, unsigned nr_pages);
 
+#endif
+
+#ifdef CONFIG_CMA
+
 /* CMA stuff */
 extern void init_cma_reserved_pageblock(struct page *page);
 
@@ -189,6 +189,18 @@ static inline void clear_highpage(struct page *page)
 	kunmap_atomic(kaddr);
 }
 
+#ifndef __HAVE_ARCH_CLEAR_PAGE_NOCACHE
+#define clear_page_nocache(page)	clear_page(page)
+#endif
+
+/* Zero a page without pulling it into the CPU caches, where supported */
+static inline void clear_highpage_nocache(struct page *page)
+{
+	void *kaddr = kmap_atomic(page);
+	clear_page_nocache(kaddr);
+	kunmap_atomic(kaddr);
+}
+
 static inline void zero_user_segments(struct page *page,
 	unsigned start1, unsigned end1,
 	unsigned start2, unsigned end2)
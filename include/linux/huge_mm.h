@@ -29,6 +29,22 @@ extern int move_huge_pmd(struct vm_area_struct *vma,
 			 pmd_t *old_pmd, pmd_t *new_pmd);
 extern int change_huge_pmd(struct vm_area_struct *vma, pmd_t *pmd,
 			unsigned long addr, pgprot_t newprot);
+extern int do_huge_pud_anonymous_page(struct mm_struct *mm,
+				      struct vm_area_struct *vma,
+				      unsigned long address, pud_t *pud,
+				      unsigned int flags);
+extern int do_huge_pud_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			    unsigned long address, pud_t *pud,
+			    pud_t orig_pud, unsigned int flags);
+extern struct page *follow_trans_huge_pud(struct mm_struct *mm,
+					  unsigned long addr,
+					  pud_t *pud,
+					  unsigned int flags);
+extern int zap_huge_pud(struct mmu_gather *tlb,
+			struct vm_area_struct *vma,
+			pud_t *pud, unsigned long addr);
+extern int change_huge_pud(struct vm_area_struct *vma, pud_t *pud,
+			unsigned long addr, pgprot_t newprot);
 
 enum transparent_hugepage_flag {
 	TRANSPARENT_HUGEPAGE_FLAG,
@@ -36,6 +52,9 @@ enum transparent_hugepage_flag {
 	TRANSPARENT_HUGEPAGE_DEFRAG_FLAG,
 	TRANSPARENT_HUGEPAGE_DEFRAG_REQ_MADV_FLAG,
 	TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG,
+#endif
 #ifdef CONFIG_DEBUG_VM
 	TRANSPARENT_HUGEPAGE_DEBUG_COW_FLAG,
 #endif
@@ -198,4 +217,58 @@ static inline int pmd_trans_huge_lock(pmd_t *pmd,
 }
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+#define HPAGE_PUD_SHIFT PUD_SHIFT
+#define HPAGE_PUD_SIZE	(1UL << HPAGE_PUD_SHIFT)
+#define HPAGE_PUD_MASK	(~(HPAGE_PUD_SIZE - 1))
+#define HPAGE_PUD_ORDER (HPAGE_PUD_SHIFT-PAGE_SHIFT)
+#define HPAGE_PUD_NR (1<<HPAGE_PUD_ORDER)
+
+/* 1GB pages are only handed out to MADV_HUGEPAGE regions */
+#define transparent_hugepage_pud_enabled(__vma)			\
+	((transparent_hugepage_flags &					\
+	  (1<<TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG)) &&		\
+	 ((__vma)->vm_flags & VM_HUGEPAGE) &&				\
+	 transparent_hugepage_enabled(__vma))
+
+extern void __split_huge_pud(struct vm_area_struct *vma, pud_t *pud,
+			     unsigned long address);
+#define split_huge_pud(__vma, __pud, __address)				\
+	do {								\
+		pud_t *____pud = (__pud);				\
+		if (unlikely(pud_trans_huge(*____pud)))			\
+			__split_huge_pud(__vma, ____pud, __address);	\
+	}  while (0)
+/*
+ * Returns 1 with the page_table_lock held if the pud maps a 1GB page.
+ * mmap_sem must be held on entry.
+ */
+static inline int pud_trans_huge_lock(pud_t *pud,
+				      struct vm_area_struct *vma)
+{
+	VM_BUG_ON(!rwsem_is_locked(&vma->vm_mm->mmap_sem));
+	if (!pud_trans_huge(*pud))
+		return 0;
+	spin_lock(&vma->vm_mm->page_table_lock);
+	if (likely(pud_trans_huge(*pud)))
+		return 1;
+	spin_unlock(&vma->vm_mm->page_table_lock);
+	return 0;
+}
+#else /* CONFIG_TRANSPARENT_HUGEPAGE_PUD */
+#define HPAGE_PUD_SHIFT ({ BUILD_BUG(); 0; })
+#define HPAGE_PUD_MASK ({ BUILD_BUG(); 0; })
+#define HPAGE_PUD_SIZE ({ BUILD_BUG(); 0; })
+
+#define transparent_hugepage_pud_enabled(__vma) 0
+
+#define split_huge_pud(__vma, __pud, __address)	\
+	do { } while (0)
+static inline int pud_trans_huge_lock(pud_t *pud,
+				      struct vm_area_struct *vma)
+{
+	return 0;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE_PUD */
+
 #endif /* _LINUX_HUGE_MM_H */
@@ -8,6 +8,7 @@
 #include <linux/spinlock.h>
 #include <linux/prio_tree.h>
 #include <linux/rbtree.h>
+#include <linux/seqlock.h>
 #include <linux/rwsem.h>
 #include <linux/completion.h>
 #include <linux/cpumask.h>
@@ -25,6 +26,17 @@ struct address_space;
 
 #define USE_SPLIT_PTLOCKS	(NR_CPUS >= CONFIG_SPLIT_PTLOCK_CPUS)
 
+#ifdef CONFIG_MEMCG
+/*
+ * The memory cgroup a page is charged to.  Holds the mem_cgroup pointer
+ * with the PCG_* bits of <linux/page_cgroup.h> packed into its low bits,
+ * see the helpers there.
+ */
+struct page_cgroup {
+	unsigned long flags;
+};
+#endif
+
 /*
  * Each physical page in the system has a struct page associated with
  * it to keep track of whatever it is we are using the page for at the
@@ -151,6 +163,14 @@ struct page {
 		struct page *first_page;	/* Compound tail pages */
 	};
 
+#ifdef CONFIG_MEMCG
+	/*
+	 * A single word, so on 64-bit with an aligned struct page this
+	 * fits the padding that would otherwise follow the union above.
+	 */
+	struct page_cgroup page_cgroup;
+#endif
+
 	/*
 	 * On machines where all RAM is mapped into kernel address space,
 	 * we can simply calculate the virtual address. On machines with
@@ -279,6 +299,12 @@ struct vm_area_struct {
 #ifdef CONFIG_NUMA
 	struct mempolicy *vm_policy;	/* NUMA policy for the VMA */
 #endif
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_t vm_sequence;		/* Bumped by anyone changing the
+					   fields a speculative fault uses */
+	struct rcu_head vm_rcu;		/* vmas are freed after a grace
+					   period for the lockless lookup */
+#endif
 };
 
 struct core_thread {
@@ -403,6 +429,13 @@ struct mm_struct {
 #endif
 #ifdef CONFIG_CPUMASK_OFFSTACK
 	struct cpumask cpumask_allocation;
+#endif
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+	/*
+	 * Set when reclaim has cleared ptes of this mm but deferred the
+	 * TLB flush; see flush_tlb_batched_pending().
+	 */
+	bool tlb_flush_batched;
 #endif
 	struct uprobes_state uprobes_state;
 };
@@ -142,6 +142,8 @@ enum zone_stat_item {
 	NUMA_OTHER,		/* allocation from other node */
 #endif
 	NR_ANON_TRANSPARENT_HUGEPAGES,
+	NR_ANON_PUD_HUGEPAGES,	/* transparent 1GB pages mapped by a pud */
+	NR_ZEROED_PAGES,	/* free pages in the pre-zeroed pool */
 	NR_VM_ZONE_STAT_ITEMS };
 
 /*
@@ -241,8 +243,19 @@ struct per_cpu_pages {
 	struct list_head lists[MIGRATE_PCPTYPES];
 };
 
+/*
+ * Orders 1 to PCP_HIGH_ORDER are cached on per-cpu lists of their own, with
+ * count, high and batch in units of blocks of that order.
+ */
+#define PCP_HIGH_ORDER	PAGE_ALLOC_COSTLY_ORDER
+
 struct per_cpu_pageset {
 	struct per_cpu_pages pcp;
+	struct per_cpu_pages hpcp[PCP_HIGH_ORDER];
+#ifdef CONFIG_PAGE_PREZERO
+	int nr_zeroed;
+	struct list_head zeroed;	/* taken from the zone's pre-zeroed pool */
+#endif
 #ifdef CONFIG_NUMA
 	s8 expire;
 #endif
@@ -252,6 +265,26 @@ struct per_cpu_pageset {
 #endif
 };
 
+static inline struct per_cpu_pages *pageset_pcp(struct per_cpu_pageset *p,
+					       unsigned int order)
+{
+	return order ? &p->hpcp[order - 1] : &p->pcp;
+}
+
+static inline bool pageset_empty(struct per_cpu_pageset *p)
+{
+	unsigned int order;
+
+	for (order = 0; order <= PCP_HIGH_ORDER; order++)
+		if (pageset_pcp(p, order)->count)
+			return false;
+#ifdef CONFIG_PAGE_PREZERO
+	if (p->nr_zeroed)
+		return false;
+#endif
+	return true;
+}
+
 #endif /* !__GENERATING_BOUNDS.H */
 
 enum zone_type {
@@ -385,6 +418,14 @@ struct zone {
 #endif
 	struct free_area	free_area[MAX_ORDER];
 
+#ifdef CONFIG_PAGE_PREZERO
+	/*
+	 * Free order-0 movable pages cleared by kzerod. They stay accounted
+	 * in NR_FREE_PAGES but are off the buddy lists.
+	 */
+	struct list_head	zeroed_pages;
+#endif
+
 #ifndef CONFIG_SPARSEMEM
 	/*
 	 * Flags for a pageblock_nr_pages block. See pageblock-flags.h.
@@ -682,9 +723,6 @@ typedef struct pglist_data {
 	int nr_zones;
 #ifdef CONFIG_FLAT_NODE_MEM_MAP	/* means !SPARSEMEM */
 	struct page *node_mem_map;
-#ifdef CONFIG_MEMCG
-	struct page_cgroup *node_page_cgroup;
-#endif
 #endif
 #ifndef CONFIG_NO_BOOTMEM
 	struct bootmem_data *bdata;
@@ -709,6 +747,16 @@ typedef struct pglist_data {
 	struct task_struct *kswapd;	/* Protected by lock_memory_hotplug() */
 	int kswapd_max_order;
 	enum zone_type classzone_idx;
+#ifdef CONFIG_COMPACTION
+	int kcompactd_max_order;
+	enum zone_type kcompactd_classzone_idx;
+	wait_queue_head_t kcompactd_wait;
+	struct task_struct *kcompactd;	/* Protected by lock_memory_hotplug() */
+#endif
+#ifdef CONFIG_PAGE_PREZERO
+	wait_queue_head_t kzerod_wait;
+	struct task_struct *kzerod;	/* Protected by lock_memory_hotplug() */
+#endif
 } pg_data_t;
 
 #define node_present_pages(nid)	(NODE_DATA(nid)->node_present_pages)
@@ -1046,7 +1094,6 @@ static inline unsigned long early_pfn_to_nid(unsigned long pfn)
 #define SECTION_ALIGN_DOWN(pfn)	((pfn) & PAGE_SECTION_MASK)
 
 struct page;
-struct page_cgroup;
 struct mem_section {
 	/*
 	 * This is, logically, a pointer to an array of struct
@@ -1064,14 +1111,6 @@ struct mem_section {
 
 	/* See declaration of similar field in struct zone */
 	unsigned long *pageblock_flags;
-#ifdef CONFIG_MEMCG
-	/*
-	 * If !SPARSEMEM, pgdat doesn't have page_cgroup pointer. We use
-	 * section. (see memcontrol.h/page_cgroup.h about this.)
-	 */
-	struct page_cgroup *page_cgroup;
-	unsigned long pad;
-#endif
 };
 
 #ifdef CONFIG_SPARSEMEM_EXTREME
@@ -14,35 +14,50 @@ enum {
 
 #ifdef CONFIG_MEMCG
 #include <linux/bit_spinlock.h>
+#include <linux/mm_types.h>
+#include <linux/mmdebug.h>
+#include <linux/atomic.h>
 
 /*
- * Page Cgroup can be considered as an extended mem_map.
- * A page_cgroup page is associated with every page descriptor. The
- * page_cgroup helps us identify information about the cgroup
- * All page cgroups are allocated at boot or memory hotplug event,
- * then the page cgroup for pfn always exists.
+ * Page Cgroup is embedded in every page descriptor and identifies the
+ * mem_cgroup the page is charged to.  It is a single word: the PCG_*
+ * flags live in the low bits, which are always clear in a pointer to
+ * the (at least 8 byte aligned) struct mem_cgroup, and the rest is the
+ * pointer itself.
  */
-struct page_cgroup {
-	unsigned long flags;
-	struct mem_cgroup *mem_cgroup;
-};
+#define PCG_FLAGS_MASK	((1UL << __NR_PCG_FLAGS) - 1)
 
-void __meminit pgdat_page_cgroup_init(struct pglist_data *pgdat);
+static inline struct page_cgroup *lookup_page_cgroup(struct page *page)
+{
+	return &page->page_cgroup;
+}
 
-#ifdef CONFIG_SPARSEMEM
-static inline void __init page_cgroup_init_flatmem(void)
+static inline struct mem_cgroup *page_cgroup_memcg(struct page_cgroup *pc)
 {
+	return (struct mem_cgroup *)(ACCESS_ONCE(pc->flags) & ~PCG_FLAGS_MASK);
 }
-extern void __init page_cgroup_init(void);
-#else
-void __init page_cgroup_init_flatmem(void);
-static inline void __init page_cgroup_init(void)
+
+/*
+ * The flag bits are updated with atomic bitops, not all of them under
+ * lock_page_cgroup(), so the pointer must be replaced atomically too.
+ */
+static inline void page_cgroup_set_memcg(struct page_cgroup *pc,
+					 struct mem_cgroup *memcg)
 {
+	unsigned long old, new;
+
+	VM_BUG_ON((unsigned long)memcg & PCG_FLAGS_MASK);
+	do {
+		old = ACCESS_ONCE(pc->flags);
+		new = (old & PCG_FLAGS_MASK) | (unsigned long)memcg;
+	} while (cmpxchg(&pc->flags, old, new) != old);
 }
-#endif
 
-struct page_cgroup *lookup_page_cgroup(struct page *page);
-struct page *lookup_cgroup_page(struct page_cgroup *pc);
+/* Reset the page_cgroup of a page whose struct page is being set up */
+static inline void page_cgroup_init_page(struct page *page)
+{
+	page->page_cgroup.flags = 0;
+}
 
 #define TESTPCGFLAG(uname, lname)			\
 static inline int PageCgroup##uname(struct page_cgroup *pc)	\
@@ -85,20 +100,12 @@ static inline void unlock_page_cgroup(struct page_cgroup *pc)
 #else /* CONFIG_MEMCG */
 struct page_cgroup;
 
-static inline void __meminit pgdat_page_cgroup_init(struct pglist_data *pgdat)
-{
-}
-
 static inline struct page_cgroup *lookup_page_cgroup(struct page *page)
 {
 	return NULL;
 }
 
-static inline void page_cgroup_init(void)
-{
-}
-
-static inline void __init page_cgroup_init_flatmem(void)
+static inline void page_cgroup_init_page(struct page *page)
 {
 }
 
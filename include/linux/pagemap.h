@@ -202,11 +202,21 @@ static inline void page_unfreeze_refs(struct page *page, int count)
 
 #ifdef CONFIG_NUMA
 extern struct page *__page_cache_alloc(gfp_t gfp);
+extern unsigned long __page_cache_alloc_bulk(gfp_t gfp,
+					     unsigned long nr_pages,
+					     struct list_head *list);
 #else
 static inline struct page *__page_cache_alloc(gfp_t gfp)
 {
 	return alloc_pages(gfp, 0);
 }
+
+static inline unsigned long __page_cache_alloc_bulk(gfp_t gfp,
+						    unsigned long nr_pages,
+						    struct list_head *list)
+{
+	return alloc_pages_bulk_list(gfp, nr_pages, list);
+}
 #endif
 
 static inline struct page *page_cache_alloc(struct address_space *x)
@@ -225,6 +235,19 @@ static inline struct page *page_cache_alloc_readahead(struct address_space *x)
 				  __GFP_COLD | __GFP_NORETRY | __GFP_NOWARN);
 }
 
+/*
+ * Add up to @nr_pages readahead pages to @list, returns how many were
+ * added.  May return fewer than asked for even if memory is plentiful.
+ */
+static inline unsigned long
+page_cache_alloc_readahead_bulk(struct address_space *x,
+				unsigned long nr_pages, struct list_head *list)
+{
+	return __page_cache_alloc_bulk(mapping_gfp_mask(x) |
+				__GFP_COLD | __GFP_NORETRY | __GFP_NOWARN,
+				nr_pages, list);
+}
+
 typedef int filler_t(void *, struct page *);
 
 extern struct page * find_get_page(struct address_space *mapping,
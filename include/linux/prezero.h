@@ -0,0 +1,24 @@
+#ifndef _LINUX_PREZERO_H
+#define _LINUX_PREZERO_H
+
+struct ctl_table;
+
+#ifdef CONFIG_PAGE_PREZERO
+extern int sysctl_prezero_ratio;
+extern int sysctl_prezero_ratio_handler(struct ctl_table *table, int write,
+			void __user *buffer, size_t *length, loff_t *ppos);
+
+extern int kzerod_run(int nid);
+extern void kzerod_stop(int nid);
+#else
+static inline int kzerod_run(int nid)
+{
+	return 0;
+}
+
+static inline void kzerod_stop(int nid)
+{
+}
+#endif /* CONFIG_PAGE_PREZERO */
+
+#endif /* _LINUX_PREZERO_H */
@@ -754,6 +754,17 @@ extern struct user_struct root_user;
 struct backing_dev_info;
 struct reclaim_state;
 
+/*
+ * Reclaim clears ptes without flushing the TLB right away and gathers
+ * the cpus that may still cache them here, so that a single flush can
+ * be sent before the pages are freed.
+ */
+struct tlbflush_unmap_batch {
+	struct cpumask cpumask;	/* cpus that may hold stale entries */
+	bool flush_required;	/* a pte was cleared without a flush */
+	bool writable;		/* one of them was dirty */
+};
+
 #if defined(CONFIG_SCHEDSTATS) || defined(CONFIG_TASK_DELAY_ACCT)
 struct sched_info {
 	/* cumulative counters */
@@ -1480,6 +1491,9 @@ struct task_struct {
 
 /* VM state */
 	struct reclaim_state *reclaim_state;
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+	struct tlbflush_unmap_batch tlb_ubc;
+#endif
 
 	struct backing_dev_info *backing_dev_info;
 
@@ -1583,6 +1597,9 @@ struct task_struct {
 		unsigned long memsw_nr_pages; /* uncharged mem+swap usage */
 	} memcg_batch;
 #endif
+#ifdef CONFIG_MEMCG_KMEM /* don't redirect slab allocations to memcg caches */
+	unsigned int memcg_kmem_skip_account;
+#endif
 #ifdef CONFIG_HAVE_HW_BREAKPOINT
 	atomic_t ptrace_bp_refcnt;
 #endif
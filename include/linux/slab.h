@@ -11,6 +11,7 @@
 
 #include <linux/gfp.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 /*
  * Flags to pass to kmem_cache_create().
@@ -130,6 +131,54 @@ int kmem_cache_shrink(struct kmem_cache *);
 void kmem_cache_free(struct kmem_cache *, void *);
 unsigned int kmem_cache_size(struct kmem_cache *);
 
+/*
+ * Bulk allocation and freeing of objects.  kmem_cache_alloc_bulk() either
+ * fills all entries of the array and returns their number, or allocates
+ * nothing and returns 0.  Both may be called with interrupts disabled,
+ * under the same gfp rules as kmem_cache_alloc().
+ */
+void kmem_cache_free_bulk(struct kmem_cache *, size_t, void **);
+int kmem_cache_alloc_bulk(struct kmem_cache *, gfp_t, size_t, void **);
+
+struct mem_cgroup;
+struct kmem_cache *kmem_cache_create_memcg(struct mem_cgroup *, const char *,
+			size_t, size_t, unsigned long, void (*)(void *),
+			struct kmem_cache *);
+
+#ifdef CONFIG_MEMCG_KMEM
+/*
+ * Per-memcg information attached to a kmem cache through ->memcg_params.
+ *
+ * A root cache (one created by kmem_cache_create()) carries an array of
+ * its per-memcg clones, indexed by memcg_cache_id() and grown whenever a
+ * new memcg activates kmem accounting.  The array is RCU protected and may
+ * still be NULL for caches nobody has asked to account yet.
+ *
+ * A clone carries the memcg it charges its slab pages to, the root cache
+ * it was derived from, and the state needed to destroy it once the memcg
+ * is gone and its last slab page has been freed.
+ */
+struct memcg_cache_params {
+	bool is_root_cache;
+	union {
+		struct {
+			struct rcu_head rcu_head;
+			struct kmem_cache *memcg_caches[0];
+		};
+		struct {
+			struct mem_cgroup *memcg;
+			struct list_head list;	/* memcg->memcg_slab_caches */
+			struct kmem_cache *root_cache;
+			struct kmem_cache *cachep;
+			char *name;
+			atomic_t nr_pages;	/* charged slab pages, +1 while memcg lives */
+			bool dead;		/* memcg has been destroyed */
+			struct work_struct destroy;
+		};
+	};
+};
+#endif
+
 /*
  * Please use this macro to create slab caches. Simply specify the
  * name of the structure and maybe some flags that are listed above.
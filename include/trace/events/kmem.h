@@ -243,7 +243,7 @@ DECLARE_EVENT_CLASS(mm_page,
 		__entry->page ? page_to_pfn(__entry->page) : 0,
 		__entry->order,
 		__entry->migratetype,
-		__entry->order == 0)
+		__entry->order <= PCP_HIGH_ORDER)
 );
 
 DEFINE_EVENT(mm_page, mm_page_alloc_zone_locked,
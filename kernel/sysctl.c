@@ -41,6 +41,7 @@
 #include <linux/writeback.h>
 #include <linux/ratelimit.h>
 #include <linux/compaction.h>
+#include <linux/prezero.h>
 #include <linux/hugetlb.h>
 #include <linux/initrd.h>
 #include <linux/key.h>
@@ -1192,6 +1193,15 @@ static struct ctl_table vm_table[] = {
 		.extra1		= &min_extfrag_threshold,
 		.extra2		= &max_extfrag_threshold,
 	},
+	{
+		.procname	= "compaction_frag_target",
+		.data		= &sysctl_compaction_frag_target,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= sysctl_compaction_frag_target_handler,
+		.extra1		= &zero,
+		.extra2		= &one_hundred,
+	},
 
 #endif /* CONFIG_COMPACTION */
 	{
@@ -1210,6 +1220,17 @@ static struct ctl_table vm_table[] = {
 		.proc_handler	= percpu_pagelist_fraction_sysctl_handler,
 		.extra1		= &min_percpu_pagelist_fract,
 	},
+#ifdef CONFIG_PAGE_PREZERO
+	{
+		.procname	= "prezero_ratio",
+		.data		= &sysctl_prezero_ratio,
+		.maxlen		= sizeof(sysctl_prezero_ratio),
+		.mode		= 0644,
+		.proc_handler	= sysctl_prezero_ratio_handler,
+		.extra1		= &zero,
+		.extra2		= &one_hundred,
+	},
+#endif
 #ifdef CONFIG_MMU
 	{
 		.procname	= "max_map_count",
@@ -1219,6 +1240,13 @@ static struct ctl_table vm_table[] = {
 		.proc_handler	= proc_dointvec_minmax,
 		.extra1		= &zero,
 	},
+	{
+		.procname	= "fault_around_bytes",
+		.data		= &sysctl_fault_around_bytes,
+		.maxlen		= sizeof(sysctl_fault_around_bytes),
+		.mode		= 0644,
+		.proc_handler	= sysctl_fault_around_bytes_handler,
+	},
 #else
 	{
 		.procname	= "nr_trim_pages",
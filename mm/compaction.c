@@ -14,6 +14,9 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/cpu.h>
 #include "internal.h"
 
 #if defined CONFIG_COMPACTION || defined CONFIG_CMA
@@ -642,6 +645,37 @@ static isolate_migrate_t isolate_migratepages(struct zone *zone,
 	return ISOLATE_SUCCESS;
 }
 
+/*
+ * Percentage of a zone's free memory that kcompactd tolerates in blocks
+ * smaller than a pageblock before it compacts the zone proactively.
+ * 100 disables proactive compaction.
+ */
+int sysctl_compaction_frag_target = 80;
+
+/*
+ * The fragmentation score of a zone is the percentage of its free pages
+ * that cannot satisfy a pageblock sized allocation. nr_free is read
+ * without zone->lock, the result is only a hint.
+ */
+static unsigned int fragmentation_score_zone(struct zone *zone)
+{
+	unsigned long free = 0, unusable = 0;
+	unsigned int order;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		unsigned long pages = zone->free_area[order].nr_free << order;
+
+		free += pages;
+		if (order < pageblock_order)
+			unusable += pages;
+	}
+
+	if (!free)
+		return 0;
+
+	return unusable * 100 / free;
+}
+
 static int compact_finished(struct zone *zone,
 			    struct compact_control *cc)
 {
@@ -673,6 +707,21 @@ static int compact_finished(struct zone *zone,
 	if (cc->wrapped && cc->free_pfn <= cc->start_free_pfn)
 		return COMPACT_COMPLETE;
 
+	/*
+	 * kcompactd gives up as soon as the zone meets the fragmentation
+	 * target, kswapd wakes up or it has to contend with allocators for
+	 * the zone locks.
+	 */
+	if (cc->proactive) {
+		if (*cc->contended || kthread_should_stop())
+			return COMPACT_PARTIAL;
+		if (!waitqueue_active(&zone->zone_pgdat->kswapd_wait))
+			return COMPACT_PARTIAL;
+		if (fragmentation_score_zone(zone) <=
+					sysctl_compaction_frag_target)
+			return COMPACT_PARTIAL;
+	}
+
 	/*
 	 * order == -1 is expected when compacting via
 	 * /proc/sys/vm/compact_memory
@@ -935,16 +984,6 @@ static int __compact_pgdat(pg_data_t *pgdat, struct compact_control *cc)
 	return 0;
 }
 
-int compact_pgdat(pg_data_t *pgdat, int order)
-{
-	struct compact_control cc = {
-		.order = order,
-		.sync = false,
-	};
-
-	return __compact_pgdat(pgdat, &cc);
-}
-
 static int compact_node(int nid)
 {
 	struct compact_control cc = {
@@ -990,6 +1029,372 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+int sysctl_compaction_frag_target_handler(struct ctl_table *table, int write,
+			void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int ret, nid;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (ret || !write)
+		return ret;
+
+	/* Let sleeping kcompactd threads pick up the new target */
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		wake_up_interruptible(&NODE_DATA(nid)->kcompactd_wait);
+
+	return 0;
+}
+
+/* How often kcompactd checks the fragmentation score of its node */
+#define KCOMPACTD_PROACTIVE_MSECS	500
+
+/*
+ * kcompactd leaves a node alone this many intervals after a proactive
+ * pass that failed to lower its fragmentation score.
+ */
+#define KCOMPACTD_PROACTIVE_DEFER	(1 << COMPACT_MAX_DEFER_SHIFT)
+
+/* Proactive compaction starts this far above the fragmentation target */
+#define KCOMPACTD_SCORE_HYSTERESIS	10
+
+static unsigned int fragmentation_score_node(pg_data_t *pgdat)
+{
+	unsigned long score = 0;
+	int zoneid;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+
+		/* Weigh each zone by its share of the node */
+		score += fragmentation_score_zone(zone) * zone->present_pages;
+	}
+
+	return score / (pgdat->node_present_pages + 1);
+}
+
+static bool kcompactd_node_suitable(pg_data_t *pgdat)
+{
+	int zoneid;
+
+	for (zoneid = 0; zoneid <= pgdat->kcompactd_classzone_idx; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (compaction_suitable(zone, pgdat->kcompactd_max_order) ==
+							COMPACT_CONTINUE)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Compact the node on behalf of a high-order allocation that kswapd
+ * could not satisfy by reclaim alone. Deferral is shared with direct
+ * compaction so that neither keeps retrying a zone that does not improve.
+ */
+static void kcompactd_do_work(pg_data_t *pgdat)
+{
+	int order = pgdat->kcompactd_max_order;
+	int classzone_idx = pgdat->kcompactd_classzone_idx;
+	int zoneid;
+
+	/* Flush pending updates to the LRU lists */
+	lru_add_drain();
+
+	for (zoneid = 0; zoneid <= classzone_idx; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+		bool contended = false;
+		struct compact_control cc = {
+			.order = order,
+			.migratetype = MIGRATE_MOVABLE,
+			.zone = zone,
+			.sync = true,
+			.contended = &contended,
+		};
+		int ok;
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (compaction_deferred(zone, order))
+			continue;
+
+		if (compaction_suitable(zone, order) != COMPACT_CONTINUE)
+			continue;
+
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		if (kthread_should_stop())
+			return;
+
+		compact_zone(zone, &cc);
+
+		ok = zone_watermark_ok(zone, order, low_wmark_pages(zone), 0, 0);
+		if (ok && order >= zone->compact_order_failed)
+			zone->compact_order_failed = order + 1;
+		else if (!ok)
+			defer_compaction(zone, order);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+	}
+
+	/*
+	 * Regardless of success, we are done until woken up next. But remember
+	 * the requested order/classzone_idx in case it was higher/tighter than
+	 * our current ones
+	 */
+	if (pgdat->kcompactd_max_order <= order)
+		pgdat->kcompactd_max_order = 0;
+	if (pgdat->kcompactd_classzone_idx >= classzone_idx)
+		pgdat->kcompactd_classzone_idx = pgdat->nr_zones - 1;
+}
+
+/*
+ * Proactive compaction only runs while kswapd sleeps, so that the two
+ * daemons do not fight over the same free pages, and only while the node
+ * is clearly above the fragmentation target.
+ */
+static bool kcompactd_should_proact(pg_data_t *pgdat)
+{
+	unsigned int target = sysctl_compaction_frag_target;
+
+	if (target >= 100)
+		return false;
+
+	if (!waitqueue_active(&pgdat->kswapd_wait))
+		return false;
+
+	return fragmentation_score_node(pgdat) >
+		min(target + KCOMPACTD_SCORE_HYSTERESIS, 100U);
+}
+
+/*
+ * Reduce the fragmentation score of the node with async compaction, which
+ * backs off as soon as it has to contend for zone->lock or lru_lock.
+ */
+static void kcompactd_do_proactive(pg_data_t *pgdat)
+{
+	int zoneid;
+
+	count_vm_event(KCOMPACTD_PROACTIVE);
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+		bool contended = false;
+		struct compact_control cc = {
+			.order = -1,
+			.migratetype = MIGRATE_MOVABLE,
+			.zone = zone,
+			.sync = false,
+			.contended = &contended,
+			.proactive = true,
+		};
+
+		if (!populated_zone(zone))
+			continue;
+
+		/* kswapd woke up, leave the free pages to it */
+		if (!waitqueue_active(&pgdat->kswapd_wait))
+			break;
+
+		if (fragmentation_score_zone(zone) <=
+					sysctl_compaction_frag_target)
+			continue;
+
+		/* Not enough free memory to be worth compacting */
+		if (compaction_suitable(zone, pageblock_order) == COMPACT_SKIPPED)
+			continue;
+
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		compact_zone(zone, &cc);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+
+		if (contended) {
+			count_vm_event(KCOMPACTD_CONTENDED);
+			break;
+		}
+
+		if (kthread_should_stop())
+			break;
+	}
+}
+
+static bool kcompactd_work_requested(pg_data_t *pgdat, bool proactive)
+{
+	if (kthread_should_stop() || pgdat->kcompactd_max_order > 0)
+		return true;
+
+	/* Proactive compaction was just enabled */
+	return !proactive && sysctl_compaction_frag_target < 100;
+}
+
+/*
+ * The background compaction daemon, started as a kernel thread
+ * from the init process.
+ */
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	struct task_struct *tsk = current;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	unsigned int proactive_defer = 0;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(tsk, cpumask);
+
+	set_freezable();
+
+	pgdat->kcompactd_max_order = 0;
+	pgdat->kcompactd_classzone_idx = pgdat->nr_zones - 1;
+
+	while (!kthread_should_stop()) {
+		bool proactive = sysctl_compaction_frag_target < 100;
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+		unsigned int score;
+
+		if (proactive)
+			timeout = msecs_to_jiffies(KCOMPACTD_PROACTIVE_MSECS);
+
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+				kcompactd_work_requested(pgdat, proactive),
+				timeout);
+		if (kthread_should_stop())
+			break;
+
+		if (pgdat->kcompactd_max_order > 0) {
+			kcompactd_do_work(pgdat);
+			continue;
+		}
+
+		if (proactive_defer) {
+			proactive_defer--;
+			continue;
+		}
+
+		if (!kcompactd_should_proact(pgdat))
+			continue;
+
+		score = fragmentation_score_node(pgdat);
+		kcompactd_do_proactive(pgdat);
+		if (fragmentation_score_node(pgdat) >= score)
+			proactive_defer = KCOMPACTD_PROACTIVE_DEFER;
+	}
+
+	return 0;
+}
+
+/*
+ * kswapd has rebalanced the node for order-0 but a high-order allocation
+ * is still failing, so hand the node over to kcompactd.
+ */
+void wakeup_kcompactd(pg_data_t *pgdat, int order, int classzone_idx)
+{
+	if (!order)
+		return;
+
+	if (pgdat->kcompactd_max_order < order)
+		pgdat->kcompactd_max_order = order;
+
+	if (pgdat->kcompactd_classzone_idx > classzone_idx)
+		pgdat->kcompactd_classzone_idx = classzone_idx;
+
+	if (!waitqueue_active(&pgdat->kcompactd_wait))
+		return;
+
+	if (!kcompactd_node_suitable(pgdat))
+		return;
+
+	count_vm_event(KCOMPACTD_WAKE);
+	wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+/*
+ * This kcompactd start function will be called by init and node-hot-add.
+ * On node-hot-add, kcompactd will moved to proper cpus if cpus are hot-added.
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		pgdat->kcompactd = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.  Caller must
+ * hold lock_memory_hotplug().
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
+
+/*
+ * It's optimal to keep kcompactd on the same CPUs as their memory, but
+ * not required for correctness. So if the last cpu in a node goes
+ * away, we get changed to run anywhere: as the first one comes back,
+ * restore their cpu bindings.
+ */
+static int __cpuinit kcompactd_cpu_callback(struct notifier_block *nfb,
+					    unsigned long action, void *hcpu)
+{
+	int nid;
+
+	if (action == CPU_ONLINE || action == CPU_ONLINE_FROZEN) {
+		for_each_node_state(nid, N_HIGH_MEMORY) {
+			pg_data_t *pgdat = NODE_DATA(nid);
+			const struct cpumask *mask;
+
+			mask = cpumask_of_node(pgdat->node_id);
+
+			if (!pgdat->kcompactd)
+				continue;
+
+			if (cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids)
+				/* One of our CPUs online: restore mask */
+				set_cpus_allowed_ptr(pgdat->kcompactd, mask);
+		}
+	}
+	return NOTIFY_OK;
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	hotcpu_notifier(kcompactd_cpu_callback, 0);
+	return 0;
+}
+subsys_initcall(kcompactd_init);
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct device *dev,
 			struct device_attribute *attr,
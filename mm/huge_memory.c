@@ -17,6 +17,7 @@
 #include <linux/khugepaged.h>
 #include <linux/freezer.h>
 #include <linux/mman.h>
+#include <linux/cpuset.h>
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
 #include "internal.h"
@@ -26,7 +27,7 @@
  * and khugepaged scans all mappings. Defrag is only invoked by
  * khugepaged hugepage allocations and by page faults inside
  * MADV_HUGEPAGE regions to avoid the risk of slowing down short lived
- * allocations.
+ * allocations. 1GB pages are only ever tried in MADV_HUGEPAGE regions.
  */
 unsigned long transparent_hugepage_flags __read_mostly =
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE_ALWAYS
@@ -34,6 +35,9 @@ unsigned long transparent_hugepage_flags __read_mostly =
 #endif
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE_MADVISE
 	(1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG)|
+#endif
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	(1<<TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG)|
 #endif
 	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)|
 	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG);
@@ -294,6 +298,39 @@ static ssize_t defrag_store(struct kobject *kobj,
 static struct kobj_attribute defrag_attr =
 	__ATTR(defrag, 0644, defrag_show, defrag_store);
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+static ssize_t pud_enabled_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	if (test_bit(TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG,
+		     &transparent_hugepage_flags))
+		return sprintf(buf, "[madvise] never\n");
+	else
+		return sprintf(buf, "madvise [never]\n");
+}
+static ssize_t pud_enabled_store(struct kobject *kobj,
+				 struct kobj_attribute *attr,
+				 const char *buf, size_t count)
+{
+	if (!memcmp("madvise", buf,
+		    min(sizeof("madvise")-1, count))) {
+		if (!has_transparent_hugepage_pud())
+			return -EINVAL;
+		set_bit(TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG,
+			&transparent_hugepage_flags);
+	} else if (!memcmp("never", buf,
+			   min(sizeof("never")-1, count)))
+		clear_bit(TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG,
+			  &transparent_hugepage_flags);
+	else
+		return -EINVAL;
+
+	return count;
+}
+static struct kobj_attribute pud_enabled_attr =
+	__ATTR(pud_enabled, 0644, pud_enabled_show, pud_enabled_store);
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE_PUD */
+
 #ifdef CONFIG_DEBUG_VM
 static ssize_t debug_cow_show(struct kobject *kobj,
 				struct kobj_attribute *attr, char *buf)
@@ -315,6 +352,9 @@ static struct kobj_attribute debug_cow_attr =
 static struct attribute *hugepage_attr[] = {
 	&enabled_attr.attr,
 	&defrag_attr.attr,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	&pud_enabled_attr.attr,
+#endif
 #ifdef CONFIG_DEBUG_VM
 	&debug_cow_attr.attr,
 #endif
@@ -546,6 +586,12 @@ static int __init hugepage_init(void)
 		return -EINVAL;
 	}
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	if (!has_transparent_hugepage_pud())
+		clear_bit(TRANSPARENT_HUGEPAGE_PUD_REQ_MADV_FLAG,
+			  &transparent_hugepage_flags);
+#endif
+
 	err = hugepage_init_sysfs(&hugepage_kobj);
 	if (err)
 		return err;
@@ -1156,6 +1202,433 @@ int __pmd_trans_huge_lock(pmd_t *pmd, struct vm_area_struct *vma)
 	return 0;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+/*
+ * 1GB pages are too big for the buddy allocator. They are carved out
+ * of a pud aligned range of movable memory with alloc_contig_range(),
+ * which migrates whatever is still in use there. That needs to be the
+ * only user changing the migratetype of the pageblocks, so the
+ * allocations are serialized by pud_alloc_mutex.
+ *
+ * A 1GB page is mapped by exactly one pud and lives outside of the
+ * rmap, the LRU and memcg. Whenever the VM needs to operate on a part
+ * of it (partial munmap or mprotect, fork, mremap, get_user_pages,
+ * page table walkers) it is split into regular transparent hugepages
+ * mapped by pmds, which the rest of the VM knows how to deal with.
+ * Everything the split needs is allocated at fault time, so that it
+ * can't fail: the pmd table is kept in page_private() of the head
+ * page, and one pte table per 2MB page is deposited in the mm.
+ */
+#define HPAGE_PUD_PMD_NR	(HPAGE_PUD_NR / HPAGE_PMD_NR)
+
+static DEFINE_MUTEX(pud_alloc_mutex);
+
+/*
+ * Cheap check that [start_pfn, start_pfn + HPAGE_PUD_NR) only contains
+ * free or migratable pages, before committing to alloc_contig_range().
+ * It's racy, alloc_contig_range() has the final word.
+ */
+static bool hugepage_pud_range_movable(struct zone *zone,
+				       unsigned long start_pfn)
+{
+	unsigned long pfn, end_pfn = start_pfn + HPAGE_PUD_NR;
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn += pageblock_nr_pages) {
+		struct page *page;
+
+		if (!pfn_valid(pfn))
+			return false;
+		page = pfn_to_page(pfn);
+		if (page_zone(page) != zone ||
+		    get_pageblock_migratetype(page) != MIGRATE_MOVABLE)
+			return false;
+	}
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+		struct page *page = pfn_to_page(pfn);
+		unsigned long order;
+
+		if (PageBuddy(page)) {
+			order = page_order(page);
+			if (order < MAX_ORDER)
+				pfn += (1UL << order) - 1;
+			continue;
+		}
+		if (!PageLRU(page))
+			return false;
+		if (PageTransHuge(page)) {
+			order = compound_order(page);
+			if (order < MAX_ORDER)
+				pfn += (1UL << order) - 1;
+		}
+	}
+
+	return true;
+}
+
+static struct page *alloc_hugepage_pud(void)
+{
+	struct zonelist *zonelist = node_zonelist(numa_node_id(),
+						  GFP_HIGHUSER_MOVABLE);
+	enum zone_type high_zoneidx = gfp_zone(GFP_HIGHUSER_MOVABLE);
+	struct page *page = NULL;
+	struct zoneref *z;
+	struct zone *zone;
+
+	mutex_lock(&pud_alloc_mutex);
+	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx) {
+		unsigned long pfn, end_pfn;
+
+		if (!cpuset_zone_allowed_hardwall(zone, GFP_HIGHUSER_MOVABLE))
+			continue;
+		/* the pages in use must have somewhere to migrate to */
+		if (!zone_watermark_ok(zone, 0,
+				       low_wmark_pages(zone) + HPAGE_PUD_NR,
+				       0, 0))
+			continue;
+
+		end_pfn = zone->zone_start_pfn + zone->spanned_pages;
+		for (pfn = ALIGN(zone->zone_start_pfn, HPAGE_PUD_NR);
+		     pfn + HPAGE_PUD_NR <= end_pfn; pfn += HPAGE_PUD_NR) {
+			if (fatal_signal_pending(current))
+				goto out;
+			if (!hugepage_pud_range_movable(zone, pfn))
+				continue;
+			if (!alloc_contig_range(pfn, pfn + HPAGE_PUD_NR,
+						MIGRATE_MOVABLE)) {
+				page = pfn_to_page(pfn);
+				goto out;
+			}
+			cond_resched();
+		}
+	}
+out:
+	mutex_unlock(&pud_alloc_mutex);
+	return page;
+}
+
+static void free_hugepage_pud(struct page *page)
+{
+	int i;
+
+	VM_BUG_ON(page_private(page));
+	__ClearPageHead(page);
+	set_page_count(page, 1);
+	for (i = 1; i < HPAGE_PUD_NR; i++) {
+		struct page *p = page + i;
+
+		__ClearPageTail(p);
+		p->first_page = NULL;
+		set_page_count(p, 1);
+	}
+	free_contig_range(page_to_pfn(page), HPAGE_PUD_NR);
+}
+
+static void prep_hugepage_pud(struct page *page)
+{
+	prep_compound_page(page, HPAGE_PUD_ORDER);
+	set_compound_page_dtor(page, free_hugepage_pud);
+}
+
+static inline pud_t maybe_pud_mkwrite(pud_t pud, struct vm_area_struct *vma)
+{
+	if (likely(vma->vm_flags & VM_WRITE))
+		pud = pud_mkwrite(pud);
+	return pud;
+}
+
+static void free_pte_tables(struct mm_struct *mm, struct list_head *list)
+{
+	pgtable_t pgtable, next;
+
+	list_for_each_entry_safe(pgtable, next, list, lru) {
+		list_del(&pgtable->lru);
+		pte_free(mm, pgtable);
+	}
+}
+
+int do_huge_pud_anonymous_page(struct mm_struct *mm,
+			       struct vm_area_struct *vma,
+			       unsigned long address, pud_t *pud,
+			       unsigned int flags)
+{
+	unsigned long haddr = address & HPAGE_PUD_MASK;
+	LIST_HEAD(pgtables);
+	pgtable_t pgtable, next;
+	struct page *page;
+	pmd_t *pmd_table;
+	pud_t entry;
+	int i;
+
+	if (haddr < vma->vm_start || haddr + HPAGE_PUD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	if (unlikely(anon_vma_prepare(vma)))
+		return VM_FAULT_OOM;
+	if (unlikely(khugepaged_enter(vma)))
+		return VM_FAULT_OOM;
+
+	pmd_table = pmd_alloc_one(mm, haddr);
+	if (unlikely(!pmd_table))
+		return VM_FAULT_OOM;
+	for (i = 0; i < HPAGE_PUD_PMD_NR; i++) {
+		pgtable = pte_alloc_one(mm, haddr + i * HPAGE_PMD_SIZE);
+		if (unlikely(!pgtable)) {
+			free_pte_tables(mm, &pgtables);
+			pmd_free(mm, pmd_table);
+			return VM_FAULT_OOM;
+		}
+		list_add(&pgtable->lru, &pgtables);
+	}
+
+	page = alloc_hugepage_pud();
+	if (unlikely(!page)) {
+		count_vm_event(THP_PUD_FAULT_FALLBACK);
+		free_pte_tables(mm, &pgtables);
+		pmd_free(mm, pmd_table);
+		return VM_FAULT_FALLBACK;
+	}
+	prep_hugepage_pud(page);
+	if (unlikely(mem_cgroup_newpage_charge(page, mm, GFP_KERNEL))) {
+		put_page(page);
+		count_vm_event(THP_PUD_FAULT_FALLBACK);
+		free_pte_tables(mm, &pgtables);
+		pmd_free(mm, pmd_table);
+		return VM_FAULT_FALLBACK;
+	}
+	count_vm_event(THP_PUD_FAULT_ALLOC);
+
+	clear_huge_page(page, haddr, HPAGE_PUD_NR);
+	__SetPageUptodate(page);
+	set_page_private(page, (unsigned long)pmd_table);
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pud_none(*pud))) {
+		spin_unlock(&mm->page_table_lock);
+		set_page_private(page, 0);
+		mem_cgroup_uncharge_page(page);
+		put_page(page);
+		free_pte_tables(mm, &pgtables);
+		pmd_free(mm, pmd_table);
+		return 0;
+	}
+	entry = mk_pud(page, vma->vm_page_prot);
+	entry = maybe_pud_mkwrite(pud_mkdirty(entry), vma);
+	entry = pud_mkhuge(entry);
+	/* make the clear_huge_page writes visible before the pud */
+	smp_wmb();
+	set_pud_at(mm, haddr, pud, entry);
+	list_for_each_entry_safe(pgtable, next, &pgtables, lru) {
+		list_del(&pgtable->lru);
+		prepare_pmd_huge_pte(pgtable, mm);
+	}
+	mm->nr_ptes += HPAGE_PUD_PMD_NR;
+	add_mm_counter(mm, MM_ANONPAGES, HPAGE_PUD_NR);
+	__inc_zone_page_state(page, NR_ANON_PUD_HUGEPAGES);
+	spin_unlock(&mm->page_table_lock);
+
+	return 0;
+}
+
+/*
+ * Fault on a present 1GB mapping. The page is never shared, so a write
+ * fault only has to make the pud writable. Anything else, like a
+ * forced write to a read-only mapping, is left to the pmd code after
+ * splitting the pud.
+ */
+int do_huge_pud_page(struct mm_struct *mm, struct vm_area_struct *vma,
+		     unsigned long address, pud_t *pud,
+		     pud_t orig_pud, unsigned int flags)
+{
+	int ret = 0;
+	pud_t entry;
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(pud_val(*pud) != pud_val(orig_pud)))
+		goto out_unlock;
+	if (unlikely(!pud_present(orig_pud) ||
+		     ((flags & FAULT_FLAG_WRITE) &&
+		      !(vma->vm_flags & VM_WRITE)))) {
+		ret = VM_FAULT_FALLBACK;
+		goto out_unlock;
+	}
+	entry = pud_mkyoung(orig_pud);
+	if (flags & FAULT_FLAG_WRITE)
+		entry = pud_mkdirty(pud_mkwrite(entry));
+	if (pud_val(entry) != pud_val(orig_pud))
+		set_pud_at(mm, address & HPAGE_PUD_MASK, pud, entry);
+out_unlock:
+	spin_unlock(&mm->page_table_lock);
+
+	if (ret & VM_FAULT_FALLBACK)
+		split_huge_pud(vma, pud, address);
+	return ret;
+}
+
+/*
+ * Called with the page_table_lock held. No reference is taken on the
+ * returned page: FOLL_GET callers split the pud first.
+ */
+struct page *follow_trans_huge_pud(struct mm_struct *mm,
+				   unsigned long addr,
+				   pud_t *pud,
+				   unsigned int flags)
+{
+	struct page *page;
+
+	assert_spin_locked(&mm->page_table_lock);
+	VM_BUG_ON(flags & FOLL_GET);
+
+	if (!pud_present(*pud))
+		return NULL;
+	if (flags & FOLL_WRITE && !pud_write(*pud))
+		return NULL;
+
+	page = pfn_to_page(pud_pfn(*pud));
+	VM_BUG_ON(!PageHead(page));
+	page += (addr & ~HPAGE_PUD_MASK) >> PAGE_SHIFT;
+	VM_BUG_ON(!PageCompound(page));
+	return page;
+}
+
+int zap_huge_pud(struct mmu_gather *tlb, struct vm_area_struct *vma,
+		 pud_t *pud, unsigned long addr)
+{
+	struct mm_struct *mm = tlb->mm;
+	struct page *page;
+	pmd_t *pmd_table;
+	pud_t orig_pud;
+	int i;
+
+	if (pud_trans_huge_lock(pud, vma) != 1)
+		return 0;
+
+	orig_pud = pudp_get_and_clear(mm, addr, pud);
+	tlb_remove_pud_tlb_entry(tlb, pud, addr);
+	page = pfn_to_page(pud_pfn(orig_pud));
+	VM_BUG_ON(!PageHead(page));
+	pmd_table = (pmd_t *)page_private(page);
+	set_page_private(page, 0);
+	for (i = 0; i < HPAGE_PUD_PMD_NR; i++)
+		pte_free(mm, get_pmd_huge_pte(mm));
+	mm->nr_ptes -= HPAGE_PUD_PMD_NR;
+	add_mm_counter(mm, MM_ANONPAGES, -HPAGE_PUD_NR);
+	__dec_zone_page_state(page, NR_ANON_PUD_HUGEPAGES);
+	spin_unlock(&mm->page_table_lock);
+
+	/* the 1GB page has no rmap: uncharge it by hand */
+	mem_cgroup_uncharge_page(page);
+	pmd_free(mm, pmd_table);
+	tlb_remove_page(tlb, page);
+	return 1;
+}
+
+int change_huge_pud(struct vm_area_struct *vma, pud_t *pud,
+		    unsigned long addr, pgprot_t newprot)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	pud_t entry;
+
+	if (pud_trans_huge_lock(pud, vma) != 1)
+		return 0;
+
+	entry = pudp_get_and_clear(mm, addr, pud);
+	entry = pud_modify(entry, newprot);
+	set_pud_at(mm, addr, pud, entry);
+	spin_unlock(&mm->page_table_lock);
+	return 1;
+}
+
+/*
+ * Turn the 1GB page into HPAGE_PUD_PMD_NR transparent hugepages and map
+ * them with the pmd table set aside at fault time. mmap_sem must be
+ * held.
+ */
+void __split_huge_pud(struct vm_area_struct *vma, pud_t *pud,
+		      unsigned long address)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long haddr = address & HPAGE_PUD_MASK;
+	struct page *page;
+	pmd_t *pmd_table;
+	pud_t orig_pud;
+	int i;
+
+	if (pud_trans_huge_lock(pud, vma) != 1)
+		return;
+
+	VM_BUG_ON(haddr < vma->vm_start || haddr + HPAGE_PUD_SIZE > vma->vm_end);
+	orig_pud = *pud;
+	page = pfn_to_page(pud_pfn(orig_pud));
+	VM_BUG_ON(!PageHead(page));
+	pmd_table = (pmd_t *)page_private(page);
+	set_page_private(page, 0);
+
+	/*
+	 * Keep the pud huge, but not present, while the 2MB pages are set
+	 * up: faults wait for the page_table_lock instead of populating
+	 * it. The 1GB translation must be gone from the TLBs before the
+	 * pmds become visible.
+	 */
+	set_pud_at(mm, haddr, pud, pud_mknotpresent(orig_pud));
+	flush_tlb_range(vma, haddr, haddr + HPAGE_PUD_SIZE);
+	mem_cgroup_split_huge_pud_fixup(page);
+
+	for (i = 0; i < HPAGE_PUD_PMD_NR; i++) {
+		struct page *hpage = page + i * HPAGE_PMD_NR;
+		unsigned long addr = haddr + i * HPAGE_PMD_SIZE;
+		pmd_t entry;
+
+		if (i) {
+			__ClearPageTail(hpage);
+			hpage->first_page = NULL;
+			set_page_count(hpage, 1);
+			__SetPageUptodate(hpage);
+		}
+		prep_compound_page(hpage, HPAGE_PMD_ORDER);
+		page_add_new_anon_rmap(hpage, vma, addr);
+
+		entry = mk_pmd(hpage, vma->vm_page_prot);
+		if (pud_write(orig_pud))
+			entry = pmd_mkwrite(entry);
+		if (pud_dirty(orig_pud))
+			entry = pmd_mkdirty(entry);
+		if (pud_young(orig_pud))
+			entry = pmd_mkyoung(entry);
+		entry = pmd_mkhuge(entry);
+		set_pmd_at(mm, addr, pmd_table + pmd_index(addr), entry);
+	}
+	smp_wmb(); /* make the pmds visible before the pmd table */
+	pud_populate(mm, pud, pmd_table);
+	__dec_zone_page_state(page, NR_ANON_PUD_HUGEPAGES);
+	spin_unlock(&mm->page_table_lock);
+
+	count_vm_event(THP_PUD_SPLIT);
+}
+
+/*
+ * Split the 1GB page an address in the middle of would cut, if the vma
+ * could map one there. Caller holds the mmap_sem write mode.
+ */
+static void split_huge_pud_address(struct vm_area_struct *vma,
+				   unsigned long address)
+{
+	unsigned long haddr = address & HPAGE_PUD_MASK;
+	pgd_t *pgd;
+	pud_t *pud;
+
+	if (!(address & ~HPAGE_PUD_MASK) ||
+	    haddr < vma->vm_start || haddr + HPAGE_PUD_SIZE > vma->vm_end)
+		return;
+
+	pgd = pgd_offset(vma->vm_mm, address);
+	if (!pgd_present(*pgd))
+		return;
+
+	pud = pud_offset(pgd, address);
+	split_huge_pud(vma, pud, address);
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE_PUD */
+
 pmd_t *page_check_address_pmd(struct page *page,
 			      struct mm_struct *mm,
 			      unsigned long address,
@@ -1173,7 +1646,7 @@ pmd_t *page_check_address_pmd(struct page *page,
 		goto out;
 
 	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		goto out;
 
 	pmd = pmd_offset(pud, address);
@@ -1923,7 +2396,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 		goto out;
 
 	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		goto out;
 
 	pmd = pmd_offset(pud, address);
@@ -1936,6 +2409,8 @@ static void collapse_huge_page(struct mm_struct *mm,
 	pte = pte_offset_map(pmd, address);
 	ptl = pte_lockptr(mm, pmd);
 
+	/* Speculative faults must not fill the ptes we are collapsing */
+	vm_write_begin(vma);
 	spin_lock(&mm->page_table_lock); /* probably unnecessary */
 	/*
 	 * After this gup_fast can't run anymore. This also removes
@@ -1956,6 +2431,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 		BUG_ON(!pmd_none(*pmd));
 		set_pmd_at(mm, address, pmd, _pmd);
 		spin_unlock(&mm->page_table_lock);
+		vm_write_end(vma);
 		anon_vma_unlock(vma->anon_vma);
 		goto out;
 	}
@@ -1991,6 +2467,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	update_mmu_cache(vma, address, _pmd);
 	prepare_pmd_huge_pte(pgtable, mm);
 	spin_unlock(&mm->page_table_lock);
+	vm_write_end(vma);
 
 #ifndef CONFIG_NUMA
 	*hpage = NULL;
@@ -2030,7 +2507,7 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 		goto out;
 
 	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		goto out;
 
 	pmd = pmd_offset(pud, address);
@@ -2409,7 +2886,7 @@ static void split_huge_page_address(struct mm_struct *mm,
 		return;
 
 	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		return;
 
 	pmd = pmd_offset(pud, address);
@@ -2427,6 +2904,17 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 			     unsigned long end,
 			     long adjust_next)
 {
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	/* 1GB pages cut by the new boundaries are split to 2MB pages first */
+	split_huge_pud_address(vma, start);
+	split_huge_pud_address(vma, end);
+	if (adjust_next > 0) {
+		struct vm_area_struct *next = vma->vm_next;
+		split_huge_pud_address(next, next->vm_start +
+				       (adjust_next << PAGE_SHIFT));
+	}
+#endif
+
 	/*
 	 * If the new start address isn't hpage aligned and it could
 	 * previously contain an hugepage: check if we need to split
@@ -131,6 +131,8 @@ struct compact_control {
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
 	struct zone *zone;
 	bool *contended;		/* True if a lock was contended */
+	bool proactive;			/* kcompactd reducing fragmentation
+					   rather than serving an order */
 };
 
 unsigned long
@@ -356,3 +358,29 @@ extern unsigned long vm_mmap_pgoff(struct file *, unsigned long,
         unsigned long, unsigned long);
 
 extern void set_pageblock_order(void);
+
+#ifdef CONFIG_PAGE_PREZERO
+extern int prezero_zone_pages(struct zone *zone, int count);
+extern void drain_zeroed_pages(struct zone *zone);
+extern void wakeup_kzerod(struct zone *zone);
+#else
+static inline void drain_zeroed_pages(struct zone *zone)
+{
+}
+#endif
+
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+void try_to_unmap_flush(void);
+void try_to_unmap_flush_dirty(void);
+void flush_tlb_batched_pending(struct mm_struct *mm);
+#else
+static inline void try_to_unmap_flush(void)
+{
+}
+static inline void try_to_unmap_flush_dirty(void)
+{
+}
+static inline void flush_tlb_batched_pending(struct mm_struct *mm)
+{
+}
+#endif /* CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH */
@@ -78,6 +78,19 @@
  *    take 10 attempts to find a page in the unstable tree, once it is found,
  *    it is secured in the stable tree.  (When we scan a new page, we first
  *    compare it against the stable tree, and then against the unstable tree.)
+ *
+ * Both trees are sorted by page checksum first, and only pages with equal
+ * checksums are compared by content: walking down a tree then costs an
+ * integer comparison per level instead of mapping and comparing two pages.
+ *
+ * When merge_across_nodes is cleared, there is a stable and an unstable tree
+ * for each NUMA node, and only pages on the same node are merged.  ksmd then
+ * hands the pages it scanned to one merging thread per node, which works on
+ * its node's trees alone: it inserts into them, and removes the unstable
+ * rmap_items it merges with and the stale stable_nodes it comes across.
+ * ksmd takes the scanned rmap_items out of whatever tree they are in before
+ * handing them over, and does all other removals, but only while none of
+ * the merging threads is running.
  */
 
 /**
@@ -101,7 +114,8 @@ struct mm_slot {
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
  * @seqnr: count of completed full scans (needed when removing unstable node)
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is only the one ksm_scan instance of this cursor structure, and it
+ * is only used by ksmd itself: the per-node merging threads just read seqnr.
  */
 struct ksm_scan {
 	struct mm_slot *mm_slot;
@@ -115,11 +129,15 @@ struct ksm_scan {
  * @node: rb node of this ksm page in the stable tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page
+ * @checksum: checksum of this ksm page, the primary key of the tree
+ * @nid: NUMA node whose stable tree this node is linked into
  */
 struct stable_node {
 	struct rb_node node;
 	struct hlist_head hlist;
 	unsigned long kpfn;
+	u32 checksum;
+	int nid;
 };
 
 /**
@@ -129,6 +147,7 @@ struct stable_node {
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
  * @oldchecksum: previous checksum of the page at that virtual address
+ * @nid: NUMA node whose unstable tree this rmap_item is linked into
  * @node: rb node of this rmap_item in the unstable tree
  * @head: pointer to stable_node heading this list in the stable tree
  * @hlist: link into hlist of rmap_items hanging off that stable_node
@@ -139,6 +158,7 @@ struct rmap_item {
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
 	unsigned int oldchecksum;	/* when unstable */
+	int nid;			/* when unstable */
 	union {
 		struct rb_node node;	/* when node of unstable tree */
 		struct {		/* when listed from stable tree */
@@ -152,9 +172,54 @@ struct rmap_item {
 #define UNSTABLE_FLAG	0x100	/* is a node of the unstable tree */
 #define STABLE_FLAG	0x200	/* is listed from the stable tree */
 
-/* The stable and unstable tree heads */
-static struct rb_root root_stable_tree = RB_ROOT;
-static struct rb_root root_unstable_tree = RB_ROOT;
+/* Number of scanned pages ksmd collects before merging them */
+#define KSM_SCAN_BATCH	64
+
+struct ksm_scan_item {
+	struct rmap_item *rmap_item;
+	struct page *page;
+};
+
+/**
+ * struct ksm_node - per NUMA node merging state
+ * @stable_tree: head of this node's stable tree
+ * @unstable_tree: head of this node's unstable tree
+ * @pages_shared: number of nodes in the stable tree
+ * @pages_sharing: number of page slots additionally sharing those nodes
+ * @pages_unshared: number of nodes in the unstable tree
+ * @worker: kthread_worker run by @task
+ * @work: work item queued on @worker to merge @batch
+ * @task: merging thread of this node, if it has one
+ * @batch: scanned pages to be merged into this node's trees
+ * @nr_batch: number of entries in @batch
+ *
+ * With merge_across_nodes set, only the ksm_node of node 0 is used.
+ */
+struct ksm_node {
+	struct rb_root stable_tree;
+	struct rb_root unstable_tree;
+	unsigned long pages_shared;
+	unsigned long pages_sharing;
+	unsigned long pages_unshared;
+	struct kthread_worker worker;
+	struct kthread_work work;
+	struct task_struct *task;
+	struct ksm_scan_item batch[KSM_SCAN_BATCH];
+	unsigned int nr_batch;
+};
+
+static struct ksm_node *ksm_nodes;
+
+/* Number of scanned pages waiting in the batches of all nodes */
+static unsigned int ksm_nr_batch;
+
+#define ksm_nodes_sum(field) ({					\
+	unsigned long __sum = 0;					\
+	int __nid;							\
+	for_each_node(__nid)						\
+		__sum += ksm_nodes[__nid].field;			\
+	__sum;								\
+})
 
 #define MM_SLOTS_HASH_SHIFT 10
 #define MM_SLOTS_HASH_HEADS (1 << MM_SLOTS_HASH_SHIFT)
@@ -171,15 +236,6 @@ static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
 static struct kmem_cache *mm_slot_cache;
 
-/* The number of nodes in the stable tree */
-static unsigned long ksm_pages_shared;
-
-/* The number of page slots additionally sharing those nodes */
-static unsigned long ksm_pages_sharing;
-
-/* The number of nodes in the unstable tree */
-static unsigned long ksm_pages_unshared;
-
 /* The number of rmap_items in use: to calculate pages_volatile */
 static unsigned long ksm_rmap_items;
 
@@ -189,6 +245,9 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/* Zero to keep separate stable and unstable trees for each NUMA node */
+static unsigned int ksm_merge_across_nodes = 1;
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
@@ -447,22 +506,31 @@ out:		page = NULL;
 	return page;
 }
 
+/*
+ * The node whose trees a page with this pfn is merged in.
+ */
+static inline int get_kpfn_nid(unsigned long kpfn)
+{
+	return ksm_merge_across_nodes ? 0 : pfn_to_nid(kpfn);
+}
+
 static void remove_node_from_stable_tree(struct stable_node *stable_node)
 {
+	struct ksm_node *kn = &ksm_nodes[stable_node->nid];
 	struct rmap_item *rmap_item;
 	struct hlist_node *hlist;
 
 	hlist_for_each_entry(rmap_item, hlist, &stable_node->hlist, hlist) {
 		if (rmap_item->hlist.next)
-			ksm_pages_sharing--;
+			kn->pages_sharing--;
 		else
-			ksm_pages_shared--;
+			kn->pages_shared--;
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
 		cond_resched();
 	}
 
-	rb_erase(&stable_node->node, &root_stable_tree);
+	rb_erase(&stable_node->node, &kn->stable_tree);
 	free_stable_node(stable_node);
 }
 
@@ -541,18 +609,19 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		put_page(page);
 
 		if (stable_node->hlist.first)
-			ksm_pages_sharing--;
+			ksm_nodes[stable_node->nid].pages_sharing--;
 		else
-			ksm_pages_shared--;
+			ksm_nodes[stable_node->nid].pages_shared--;
 
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
 
 	} else if (rmap_item->address & UNSTABLE_FLAG) {
+		struct ksm_node *kn = &ksm_nodes[rmap_item->nid];
 		unsigned char age;
 		/*
 		 * Usually ksmd can and must skip the rb_erase, because
-		 * root_unstable_tree was already reset to RB_ROOT.
+		 * the unstable tree was already reset to RB_ROOT.
 		 * But be careful when an mm is exiting: do the rb_erase
 		 * if this rmap_item was inserted by this scan, rather
 		 * than left over from before.
@@ -560,9 +629,9 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
 		BUG_ON(age > 1);
 		if (!age)
-			rb_erase(&rmap_item->node, &root_unstable_tree);
+			rb_erase(&rmap_item->node, &kn->unstable_tree);
 
-		ksm_pages_unshared--;
+		kn->pages_unshared--;
 		rmap_item->address &= PAGE_MASK;
 	}
 out:
@@ -786,7 +855,7 @@ static int replace_page(struct vm_area_struct *vma, struct page *page,
 		goto out;
 
 	pud = pud_offset(pgd, addr);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		goto out;
 
 	pmd = pmd_offset(pud, addr);
@@ -895,6 +964,12 @@ static int try_to_merge_one_page(struct vm_area_struct *vma,
 			 */
 			set_page_stable_node(page, NULL);
 			mark_page_accessed(page);
+			/*
+			 * Page reclaim just frees a clean page with no dirty
+			 * ptes: make sure that the ksm page would be swapped.
+			 */
+			if (!PageDirty(page))
+				SetPageDirty(page);
 			err = 0;
 		} else if (pages_identical(page, kpage))
 			err = replace_page(vma, page, kpage, orig_pte);
@@ -983,13 +1058,15 @@ static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
  *
  * This function checks if there is a page inside the stable tree
  * with identical content to the page that we are scanning right now.
+ * @checksum is the page's checksum, which is compared first: only
+ * ksm pages with the same checksum are looked at.
  *
  * This function returns the stable tree node of identical content if found,
  * NULL otherwise.
  */
-static struct page *stable_tree_search(struct page *page)
+static struct page *stable_tree_search(struct page *page, u32 checksum)
 {
-	struct rb_node *node = root_stable_tree.rb_node;
+	struct rb_node *node;
 	struct stable_node *stable_node;
 
 	stable_node = page_stable_node(page);
@@ -998,12 +1075,21 @@ static struct page *stable_tree_search(struct page *page)
 		return page;
 	}
 
+	node = ksm_nodes[get_kpfn_nid(page_to_pfn(page))].stable_tree.rb_node;
 	while (node) {
 		struct page *tree_page;
 		int ret;
 
 		cond_resched();
 		stable_node = rb_entry(node, struct stable_node, node);
+		if (checksum != stable_node->checksum) {
+			if (checksum < stable_node->checksum)
+				node = node->rb_left;
+			else
+				node = node->rb_right;
+			continue;
+		}
+
 		tree_page = get_ksm_page(stable_node);
 		if (!tree_page)
 			return NULL;
@@ -1032,9 +1118,18 @@ static struct page *stable_tree_search(struct page *page)
  */
 static struct stable_node *stable_tree_insert(struct page *kpage)
 {
-	struct rb_node **new = &root_stable_tree.rb_node;
+	int nid = get_kpfn_nid(page_to_pfn(kpage));
+	struct rb_root *root = &ksm_nodes[nid].stable_tree;
+	struct rb_node **new = &root->rb_node;
 	struct rb_node *parent = NULL;
 	struct stable_node *stable_node;
+	u32 checksum;
+
+	/*
+	 * kpage is write-protected now: its checksum cannot change any more,
+	 * unlike the one taken when it was scanned.
+	 */
+	checksum = calc_checksum(kpage);
 
 	while (*new) {
 		struct page *tree_page;
@@ -1042,12 +1137,16 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 
 		cond_resched();
 		stable_node = rb_entry(*new, struct stable_node, node);
-		tree_page = get_ksm_page(stable_node);
-		if (!tree_page)
-			return NULL;
+		if (checksum != stable_node->checksum) {
+			ret = checksum < stable_node->checksum ? -1 : 1;
+		} else {
+			tree_page = get_ksm_page(stable_node);
+			if (!tree_page)
+				return NULL;
 
-		ret = memcmp_pages(kpage, tree_page);
-		put_page(tree_page);
+			ret = memcmp_pages(kpage, tree_page);
+			put_page(tree_page);
+		}
 
 		parent = *new;
 		if (ret < 0)
@@ -1069,11 +1168,13 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 		return NULL;
 
 	rb_link_node(&stable_node->node, parent, new);
-	rb_insert_color(&stable_node->node, &root_stable_tree);
+	rb_insert_color(&stable_node->node, root);
 
 	INIT_HLIST_HEAD(&stable_node->hlist);
 
 	stable_node->kpfn = page_to_pfn(kpage);
+	stable_node->checksum = checksum;
+	stable_node->nid = nid;
 	set_page_stable_node(kpage, stable_node);
 
 	return stable_node;
@@ -1091,7 +1192,8 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
  * to the currently scanned page, NULL otherwise.
  *
  * This function does both searching and inserting, because they share
- * the same walking algorithm in an rbtree.
+ * the same walking algorithm in an rbtree.  The tree is keyed by the
+ * oldchecksum of its rmap_items, which must already match the page.
  */
 static
 struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
@@ -1099,8 +1201,11 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 					      struct page **tree_pagep)
 
 {
-	struct rb_node **new = &root_unstable_tree.rb_node;
+	int nid = get_kpfn_nid(page_to_pfn(page));
+	struct ksm_node *kn = &ksm_nodes[nid];
+	struct rb_node **new = &kn->unstable_tree.rb_node;
 	struct rb_node *parent = NULL;
+	u32 checksum = rmap_item->oldchecksum;
 
 	while (*new) {
 		struct rmap_item *tree_rmap_item;
@@ -1109,6 +1214,15 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 
 		cond_resched();
 		tree_rmap_item = rb_entry(*new, struct rmap_item, node);
+		if (checksum != tree_rmap_item->oldchecksum) {
+			parent = *new;
+			if (checksum < tree_rmap_item->oldchecksum)
+				new = &parent->rb_left;
+			else
+				new = &parent->rb_right;
+			continue;
+		}
+
 		tree_page = get_mergeable_page(tree_rmap_item);
 		if (IS_ERR_OR_NULL(tree_page))
 			return NULL;
@@ -1130,6 +1244,14 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 		} else if (ret > 0) {
 			put_page(tree_page);
 			new = &parent->rb_right;
+		} else if (get_kpfn_nid(page_to_pfn(tree_page)) != nid) {
+			/*
+			 * tree_page has been migrated to another node since
+			 * it was inserted: it is put into the right tree the
+			 * next time it is scanned, don't merge with it now.
+			 */
+			put_page(tree_page);
+			return NULL;
 		} else {
 			*tree_pagep = tree_page;
 			return tree_rmap_item;
@@ -1138,10 +1260,11 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 
 	rmap_item->address |= UNSTABLE_FLAG;
 	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->nid = nid;
 	rb_link_node(&rmap_item->node, parent, new);
-	rb_insert_color(&rmap_item->node, &root_unstable_tree);
+	rb_insert_color(&rmap_item->node, &kn->unstable_tree);
 
-	ksm_pages_unshared++;
+	kn->pages_unshared++;
 	return NULL;
 }
 
@@ -1158,9 +1281,9 @@ static void stable_tree_append(struct rmap_item *rmap_item,
 	hlist_add_head(&rmap_item->hlist, &stable_node->hlist);
 
 	if (rmap_item->hlist.next)
-		ksm_pages_sharing++;
+		ksm_nodes[stable_node->nid].pages_sharing++;
 	else
-		ksm_pages_shared++;
+		ksm_nodes[stable_node->nid].pages_shared++;
 }
 
 /*
@@ -1171,6 +1294,8 @@ static void stable_tree_append(struct rmap_item *rmap_item,
  *
  * @page: the page that we are searching identical page to.
  * @rmap_item: the reverse mapping into the virtual address of this page
+ *
+ * The rmap_item has already been taken out of the trees by ksm_batch_add().
  */
 static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 {
@@ -1181,10 +1306,10 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	unsigned int checksum;
 	int err;
 
-	remove_rmap_item_from_tree(rmap_item);
+	checksum = calc_checksum(page);
 
 	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(page);
+	kpage = stable_tree_search(page, checksum);
 	if (kpage) {
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
@@ -1206,7 +1331,6 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
 	 */
-	checksum = calc_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
 		return;
@@ -1248,6 +1372,32 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	}
 }
 
+/*
+ * Searches only look at the ksm pages whose checksum matches, so they no
+ * longer notice most stale stable_nodes on their way: drop those once per
+ * full scan instead.
+ */
+static void prune_stable_trees(void)
+{
+	struct rb_node *node, *next;
+	int nid;
+
+	for_each_node(nid) {
+		node = rb_first(&ksm_nodes[nid].stable_tree);
+		while (node) {
+			struct page *page;
+
+			next = rb_next(node);
+			page = get_ksm_page(rb_entry(node, struct stable_node,
+						     node));
+			if (page)
+				put_page(page);
+			node = next;
+			cond_resched();
+		}
+	}
+}
+
 static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 					    struct rmap_item **rmap_list,
 					    unsigned long addr)
@@ -1282,6 +1432,7 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 	struct mm_slot *slot;
 	struct vm_area_struct *vma;
 	struct rmap_item *rmap_item;
+	int nid;
 
 	if (list_empty(&ksm_mm_head.mm_list))
 		return NULL;
@@ -1300,7 +1451,9 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 		 */
 		lru_add_drain_all();
 
-		root_unstable_tree = RB_ROOT;
+		for_each_node(nid)
+			ksm_nodes[nid].unstable_tree = RB_ROOT;
+		prune_stable_trees();
 
 		spin_lock(&ksm_mmlist_lock);
 		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
@@ -1362,6 +1515,16 @@ next_mm:
 		}
 	}
 
+	/*
+	 * Moving on from this mm may free its rmap_items and its mm_slot,
+	 * even those behind the cursor if the mm is exiting: have ksmd merge
+	 * the pages it has batched up first, then come back here.
+	 */
+	if (ksm_nr_batch) {
+		up_read(&mm->mmap_sem);
+		return ERR_PTR(-EAGAIN);
+	}
+
 	if (ksm_test_exit(mm)) {
 		ksm_scan.address = 0;
 		ksm_scan.rmap_list = &slot->rmap_list;
@@ -1407,6 +1570,87 @@ next_mm:
 	return NULL;
 }
 
+/*
+ * ksm_batch_add - queue a scanned page for merging on the node whose trees
+ * it belongs in.  Taking the rmap_item out of the trees is done here rather
+ * than in cmp_and_merge_page(), because it may be linked into the trees of
+ * another node than the one its page is on now.
+ */
+static void ksm_batch_add(struct page *page, struct rmap_item *rmap_item)
+{
+	struct stable_node *stable_node;
+	struct ksm_node *kn;
+	int nid;
+
+	remove_rmap_item_from_tree(rmap_item);
+
+	/* A forked ksm page is merged by the thread owning its stable_node */
+	stable_node = page_stable_node(page);
+	if (stable_node)
+		nid = stable_node->nid;
+	else
+		nid = get_kpfn_nid(page_to_pfn(page));
+
+	kn = &ksm_nodes[nid];
+	kn->batch[kn->nr_batch].rmap_item = rmap_item;
+	kn->batch[kn->nr_batch].page = page;
+	kn->nr_batch++;
+	ksm_nr_batch++;
+}
+
+static void ksm_merge_node(struct ksm_node *kn)
+{
+	unsigned int i;
+
+	for (i = 0; i < kn->nr_batch; i++) {
+		cmp_and_merge_page(kn->batch[i].page, kn->batch[i].rmap_item);
+		put_page(kn->batch[i].page);
+	}
+	kn->nr_batch = 0;
+}
+
+static void ksm_merge_work(struct kthread_work *work)
+{
+	ksm_merge_node(container_of(work, struct ksm_node, work));
+}
+
+/*
+ * ksm_merge_batch - merge the pages collected by ksmd.  Each node's trees
+ * are only ever touched by one thread, so when pages of several nodes are
+ * pending, they are merged in parallel by the nodes' own threads.
+ */
+static void ksm_merge_batch(void)
+{
+	unsigned int nr_nodes = 0;
+	int nid;
+
+	if (!ksm_nr_batch)
+		return;
+
+	for_each_node(nid)
+		if (ksm_nodes[nid].nr_batch)
+			nr_nodes++;
+
+	for_each_node(nid) {
+		struct ksm_node *kn = &ksm_nodes[nid];
+
+		if (!kn->nr_batch)
+			continue;
+		if (nr_nodes > 1 && kn->task)
+			queue_kthread_work(&kn->worker, &kn->work);
+		else
+			ksm_merge_node(kn);
+	}
+
+	for_each_node(nid) {
+		struct ksm_node *kn = &ksm_nodes[nid];
+
+		if (kn->task)
+			flush_kthread_work(&kn->work);
+	}
+	ksm_nr_batch = 0;
+}
+
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
  * @scan_npages - number of pages we want to scan before we return.
@@ -1419,12 +1663,23 @@ static void ksm_do_scan(unsigned int scan_npages)
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
 		rmap_item = scan_get_next_rmap_item(&page);
+		if (rmap_item == ERR_PTR(-EAGAIN)) {
+			/* Nothing was scanned: merge the batch and retry */
+			ksm_merge_batch();
+			scan_npages++;
+			continue;
+		}
 		if (!rmap_item)
-			return;
-		if (!PageKsm(page) || !in_stable_tree(rmap_item))
-			cmp_and_merge_page(page, rmap_item);
-		put_page(page);
+			break;
+		if (PageKsm(page) && in_stable_tree(rmap_item)) {
+			put_page(page);
+			continue;
+		}
+		ksm_batch_add(page, rmap_item);
+		if (ksm_nr_batch == KSM_SCAN_BATCH)
+			ksm_merge_batch();
 	}
+	ksm_merge_batch();
 }
 
 static int ksmd_should_run(void)
@@ -1768,14 +2023,19 @@ static struct stable_node *ksm_check_stable_tree(unsigned long start_pfn,
 						 unsigned long end_pfn)
 {
 	struct rb_node *node;
+	int nid;
 
-	for (node = rb_first(&root_stable_tree); node; node = rb_next(node)) {
-		struct stable_node *stable_node;
+	for_each_node(nid) {
+		struct rb_root *root = &ksm_nodes[nid].stable_tree;
 
-		stable_node = rb_entry(node, struct stable_node, node);
-		if (stable_node->kpfn >= start_pfn &&
-		    stable_node->kpfn < end_pfn)
-			return stable_node;
+		for (node = rb_first(root); node; node = rb_next(node)) {
+			struct stable_node *stable_node;
+
+			stable_node = rb_entry(node, struct stable_node, node);
+			if (stable_node->kpfn >= start_pfn &&
+			    stable_node->kpfn < end_pfn)
+				return stable_node;
+		}
 	}
 	return NULL;
 }
@@ -1926,24 +2186,114 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 KSM_ATTR(run);
 
+#ifdef CONFIG_NUMA
+/*
+ * Start a merging thread on each node with memory, for ksmd to hand the
+ * pages of that node to.  Failing that is not fatal: ksmd merges the pages
+ * of nodes without a thread itself.  Called with ksm_thread_mutex held.
+ */
+static void ksm_start_node_threads(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		struct ksm_node *kn = &ksm_nodes[nid];
+		struct task_struct *task;
+
+		if (kn->task)
+			continue;
+		task = kthread_create_on_node(kthread_worker_fn, &kn->worker,
+					      nid, "ksmd/%d", nid);
+		if (IS_ERR(task)) {
+			printk(KERN_WARNING
+			       "ksm: creating kthread for node %d failed\n", nid);
+			continue;
+		}
+		set_cpus_allowed_ptr(task, cpumask_of_node(nid));
+		set_user_nice(task, 5);
+		kn->task = task;
+		wake_up_process(task);
+	}
+}
+
+/*
+ * With merge_across_nodes set only node 0 has pages to merge, so the
+ * threads have nothing to do.  ksm_thread_mutex is held, so they are idle.
+ */
+static void ksm_stop_node_threads(void)
+{
+	int nid;
+
+	for_each_node(nid) {
+		struct ksm_node *kn = &ksm_nodes[nid];
+
+		if (kn->task) {
+			kthread_stop(kn->task);
+			kn->task = NULL;
+		}
+	}
+}
+
+static ssize_t merge_across_nodes_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_merge_across_nodes);
+}
+
+static ssize_t merge_across_nodes_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err)
+		return err;
+	if (knob > 1)
+		return -EINVAL;
+
+	/*
+	 * ksm pages stay in the stable tree chosen for them when they were
+	 * merged: only switch while there are none, e.g. after run=2.
+	 */
+	mutex_lock(&ksm_thread_mutex);
+	if (ksm_merge_across_nodes != knob) {
+		if (ksm_nodes_sum(pages_shared)) {
+			err = -EBUSY;
+		} else {
+			ksm_merge_across_nodes = knob;
+			if (knob)
+				ksm_stop_node_threads();
+			else if (nr_node_ids > 1)
+				ksm_start_node_threads();
+		}
+	}
+	mutex_unlock(&ksm_thread_mutex);
+
+	return err ? err : count;
+}
+KSM_ATTR(merge_across_nodes);
+#endif
+
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_shared);
+	return sprintf(buf, "%lu\n", ksm_nodes_sum(pages_shared));
 }
 KSM_ATTR_RO(pages_shared);
 
 static ssize_t pages_sharing_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+	return sprintf(buf, "%lu\n", ksm_nodes_sum(pages_sharing));
 }
 KSM_ATTR_RO(pages_sharing);
 
 static ssize_t pages_unshared_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	return sprintf(buf, "%lu\n", ksm_nodes_sum(pages_unshared));
 }
 KSM_ATTR_RO(pages_unshared);
 
@@ -1952,8 +2302,9 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = ksm_rmap_items - ksm_nodes_sum(pages_shared)
+				- ksm_nodes_sum(pages_sharing)
+				- ksm_nodes_sum(pages_unshared);
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -1980,6 +2331,9 @@ static struct attribute *ksm_attrs[] = {
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+#ifdef CONFIG_NUMA
+	&merge_across_nodes_attr.attr,
+#endif
 	NULL,
 };
 
@@ -1993,6 +2347,20 @@ static int __init ksm_init(void)
 {
 	struct task_struct *ksm_thread;
 	int err;
+	int nid;
+
+	ksm_nodes = kcalloc(nr_node_ids, sizeof(struct ksm_node), GFP_KERNEL);
+	if (!ksm_nodes)
+		return -ENOMEM;
+
+	for_each_node(nid) {
+		struct ksm_node *kn = &ksm_nodes[nid];
+
+		kn->stable_tree = RB_ROOT;
+		kn->unstable_tree = RB_ROOT;
+		init_kthread_worker(&kn->worker);
+		init_kthread_work(&kn->work, ksm_merge_work);
+	}
 
 	err = ksm_slab_init();
 	if (err)
@@ -2029,6 +2397,7 @@ static int __init ksm_init(void)
 out_free:
 	ksm_slab_free();
 out:
+	kfree(ksm_nodes);
 	return err;
 }
 module_init(ksm_init)
@@ -22,6 +22,7 @@
  */
 
 #include <linux/res_counter.h>
+#include <linux/page_counter.h>
 #include <linux/memcontrol.h>
 #include <linux/cgroup.h>
 #include <linux/mm.h>
@@ -48,8 +49,10 @@
 #include <linux/mm_inline.h>
 #include <linux/page_cgroup.h>
 #include <linux/cpu.h>
+#include <linux/log2.h>
 #include <linux/oom.h>
 #include "internal.h"
+#include "slab.h"
 #include <net/sock.h>
 #include <net/tcp_memcontrol.h>
 
@@ -153,7 +156,7 @@ struct mem_cgroup_per_zone {
 	struct mem_cgroup_reclaim_iter reclaim_iter[DEF_PRIORITY + 1];
 
 	struct rb_node		tree_node;	/* RB tree node */
-	unsigned long long	usage_in_excess;/* Set to the value by which */
+	unsigned long		usage_in_excess;/* Set to the value by which */
 						/* the soft limit is exceeded*/
 	bool			on_tree;
 	struct mem_cgroup	*memcg;		/* Back pointer, we cannot */
@@ -239,19 +242,19 @@ struct mem_cgroup {
 	/*
 	 * the counter to account for memory usage
 	 */
-	struct res_counter res;
+	struct page_counter memory;
 
 	union {
 		/*
 		 * the counter to account for mem+swap usage.
 		 */
-		struct res_counter memsw;
+		struct page_counter memsw;
 
 		/*
 		 * rcu_freeing is used only when freeing struct mem_cgroup,
 		 * so put it into a union to avoid wasting more memory.
 		 * It must be disjoint from the css field.  It could be
-		 * in a union with the res field, but res plays a much
+		 * in a union with the memory field, but memory plays a much
 		 * larger part in mem_cgroup life than memsw, and might
 		 * be of interest, even at time of free, when debugging.
 		 * So share rcu_head with the less interesting memsw.
@@ -264,6 +267,16 @@ struct mem_cgroup {
 		struct work_struct work_freeing;
 	};
 
+	/*
+	 * the counter to account for kernel memory usage.
+	 */
+	struct page_counter kmem;
+
+	/*
+	 * usage above which the group is subject to soft limit reclaim
+	 */
+	unsigned long soft_limit;
+
 	/*
 	 * Per cgroup active and inactive list, similar to the
 	 * per zone LRU lists.
@@ -289,7 +302,7 @@ struct mem_cgroup {
 	/* OOM-Killer disable */
 	int		oom_kill_disable;
 
-	/* set when res.limit == memsw.limit */
+	/* set when memory.limit == memsw.limit */
 	bool		memsw_is_minimum;
 
 	/* protect arrays of thresholds */
@@ -329,8 +342,30 @@ struct mem_cgroup {
 #ifdef CONFIG_INET
 	struct tcp_memcontrol tcp_mem;
 #endif
+#ifdef CONFIG_MEMCG_KMEM
+	/* analogous to slab_common's slab_caches list. per-memcg */
+	struct list_head memcg_slab_caches;
+	/* protects memcg_slab_caches */
+	struct mutex slab_caches_mutex;
+	/* Index in the kmem_cache->memcg_params->memcg_caches array */
+	int kmemcg_id;
+	unsigned long kmem_account_flags; /* See KMEM_ACCOUNTED_*, below */
+	/* kills the slab caches once the memcg is destroyed */
+	struct work_struct kmem_destroy_work;
+#endif
+};
+
+#ifdef CONFIG_MEMCG_KMEM
+enum {
+	KMEM_ACCOUNTED_ACTIVE = 0, /* accounted by this cgroup itself */
 };
 
+static inline bool memcg_kmem_is_active(struct mem_cgroup *memcg)
+{
+	return test_bit(KMEM_ACCOUNTED_ACTIVE, &memcg->kmem_account_flags);
+}
+#endif
+
 /* Stuffs for move charges at task migration. */
 /*
  * Types of charges to be moved. "move_charge_at_immitgrate" is treated as a
@@ -388,6 +423,7 @@ enum charge_type {
 #define _MEM			(0)
 #define _MEMSWAP		(1)
 #define _OOM_TYPE		(2)
+#define _KMEM			(3)
 #define MEMFILE_PRIVATE(x, val)	((x) << 16 | (val))
 #define MEMFILE_TYPE(val)	((val) >> 16 & 0xffff)
 #define MEMFILE_ATTR(val)	((val) & 0xffff)
@@ -527,7 +563,7 @@ static void
 __mem_cgroup_insert_exceeded(struct mem_cgroup *memcg,
 				struct mem_cgroup_per_zone *mz,
 				struct mem_cgroup_tree_per_zone *mctz,
-				unsigned long long new_usage_in_excess)
+				unsigned long new_usage_in_excess)
 {
 	struct rb_node **p = &mctz->rb_root.rb_node;
 	struct rb_node *parent = NULL;
@@ -578,10 +614,21 @@ mem_cgroup_remove_exceeded(struct mem_cgroup *memcg,
 	spin_unlock(&mctz->lock);
 }
 
+static unsigned long soft_limit_excess(struct mem_cgroup *memcg)
+{
+	unsigned long nr_pages = page_counter_read(&memcg->memory);
+	unsigned long soft_limit = ACCESS_ONCE(memcg->soft_limit);
+	unsigned long excess = 0;
+
+	if (nr_pages > soft_limit)
+		excess = nr_pages - soft_limit;
+
+	return excess;
+}
 
 static void mem_cgroup_update_tree(struct mem_cgroup *memcg, struct page *page)
 {
-	unsigned long long excess;
+	unsigned long excess;
 	struct mem_cgroup_per_zone *mz;
 	struct mem_cgroup_tree_per_zone *mctz;
 	int nid = page_to_nid(page);
@@ -594,7 +641,7 @@ static void mem_cgroup_update_tree(struct mem_cgroup *memcg, struct page *page)
 	 */
 	for (; memcg; memcg = parent_mem_cgroup(memcg)) {
 		mz = mem_cgroup_zoneinfo(memcg, nid, zid);
-		excess = res_counter_soft_limit_excess(&memcg->res);
+		excess = soft_limit_excess(memcg);
 		/*
 		 * We have to update the tree if mz is on RB-tree or
 		 * mem is over its softlimit.
@@ -648,7 +695,7 @@ retry:
 	 * position in the tree.
 	 */
 	__mem_cgroup_remove_exceeded(mz->memcg, mz, mctz);
-	if (!res_counter_soft_limit_excess(&mz->memcg->res) ||
+	if (!soft_limit_excess(mz->memcg) ||
 		!css_tryget(&mz->memcg->css))
 		goto retry;
 done:
@@ -1098,7 +1145,7 @@ struct lruvec *mem_cgroup_page_lruvec(struct page *page, struct zone *zone)
 		return &zone->lruvec;
 
 	pc = lookup_page_cgroup(page);
-	memcg = pc->mem_cgroup;
+	memcg = page_cgroup_memcg(pc);
 
 	/*
 	 * Surreptitiously switch any uncharged offlist page to root:
@@ -1109,8 +1156,10 @@ struct lruvec *mem_cgroup_page_lruvec(struct page *page, struct zone *zone)
 	 * under page_cgroup lock: between them, they make all uses
 	 * of pc->mem_cgroup safe.
 	 */
-	if (!PageLRU(page) && !PageCgroupUsed(pc) && memcg != root_mem_cgroup)
-		pc->mem_cgroup = memcg = root_mem_cgroup;
+	if (!PageLRU(page) && !PageCgroupUsed(pc) && memcg != root_mem_cgroup) {
+		memcg = root_mem_cgroup;
+		page_cgroup_set_memcg(pc, memcg);
+	}
 
 	mz = page_cgroup_zoneinfo(memcg, page);
 	return &mz->lruvec;
@@ -1230,7 +1279,7 @@ int mem_cgroup_inactive_file_is_low(struct lruvec *lruvec)
 	return (active > inactive);
 }
 
-#define mem_cgroup_from_res_counter(counter, member)	\
+#define mem_cgroup_from_counter(counter, member)	\
 	container_of(counter, struct mem_cgroup, member)
 
 /**
@@ -1242,12 +1291,25 @@ int mem_cgroup_inactive_file_is_low(struct lruvec *lruvec)
  */
 static unsigned long mem_cgroup_margin(struct mem_cgroup *memcg)
 {
-	unsigned long long margin;
+	unsigned long margin = 0;
+	unsigned long count;
+	unsigned long limit;
 
-	margin = res_counter_margin(&memcg->res);
-	if (do_swap_account)
-		margin = min(margin, res_counter_margin(&memcg->memsw));
-	return margin >> PAGE_SHIFT;
+	count = page_counter_read(&memcg->memory);
+	limit = ACCESS_ONCE(memcg->memory.limit);
+	if (count < limit)
+		margin = limit - count;
+
+	if (do_swap_account) {
+		count = page_counter_read(&memcg->memsw);
+		limit = ACCESS_ONCE(memcg->memsw.limit);
+		if (count <= limit)
+			margin = min(margin, limit - count);
+		else
+			margin = 0;
+	}
+
+	return margin;
 }
 
 int mem_cgroup_swappiness(struct mem_cgroup *memcg)
@@ -1427,15 +1489,15 @@ void mem_cgroup_print_oom_info(struct mem_cgroup *memcg, struct task_struct *p)
 	printk(KERN_CONT " as a result of limit of %s\n", memcg_name);
 done:
 
-	printk(KERN_INFO "memory: usage %llukB, limit %llukB, failcnt %llu\n",
-		res_counter_read_u64(&memcg->res, RES_USAGE) >> 10,
-		res_counter_read_u64(&memcg->res, RES_LIMIT) >> 10,
-		res_counter_read_u64(&memcg->res, RES_FAILCNT));
+	printk(KERN_INFO "memory: usage %llukB, limit %llukB, failcnt %lu\n",
+		(u64)page_counter_read(&memcg->memory) << (PAGE_SHIFT - 10),
+		(u64)memcg->memory.limit << (PAGE_SHIFT - 10),
+		memcg->memory.failcnt);
 	printk(KERN_INFO "memory+swap: usage %llukB, limit %llukB, "
-		"failcnt %llu\n",
-		res_counter_read_u64(&memcg->memsw, RES_USAGE) >> 10,
-		res_counter_read_u64(&memcg->memsw, RES_LIMIT) >> 10,
-		res_counter_read_u64(&memcg->memsw, RES_FAILCNT));
+		"failcnt %lu\n",
+		(u64)page_counter_read(&memcg->memsw) << (PAGE_SHIFT - 10),
+		(u64)memcg->memsw.limit << (PAGE_SHIFT - 10),
+		memcg->memsw.failcnt);
 }
 
 /*
@@ -1455,20 +1517,21 @@ static int mem_cgroup_count_children(struct mem_cgroup *memcg)
 /*
  * Return the memory (and swap, if configured) limit for a memcg.
  */
-static u64 mem_cgroup_get_limit(struct mem_cgroup *memcg)
+static unsigned long mem_cgroup_get_limit(struct mem_cgroup *memcg)
 {
-	u64 limit;
-	u64 memsw;
+	unsigned long limit;
 
-	limit = res_counter_read_u64(&memcg->res, RES_LIMIT);
-	limit += total_swap_pages << PAGE_SHIFT;
+	limit = memcg->memory.limit;
+	if (limit < PAGE_COUNTER_MAX - total_swap_pages)
+		limit += total_swap_pages;
+	else
+		limit = PAGE_COUNTER_MAX;
 
-	memsw = res_counter_read_u64(&memcg->memsw, RES_LIMIT);
 	/*
 	 * If memsw is finite and limits the amount of swap space available
 	 * to this memcg, return that limit.
 	 */
-	return min(limit, memsw);
+	return min(limit, memcg->memsw.limit);
 }
 
 void mem_cgroup_out_of_memory(struct mem_cgroup *memcg, gfp_t gfp_mask,
@@ -1491,7 +1554,7 @@ void mem_cgroup_out_of_memory(struct mem_cgroup *memcg, gfp_t gfp_mask,
 	}
 
 	check_panic_on_oom(CONSTRAINT_MEMCG, gfp_mask, order, NULL);
-	totalpages = mem_cgroup_get_limit(memcg) >> PAGE_SHIFT ? : 1;
+	totalpages = mem_cgroup_get_limit(memcg) ? : 1;
 	for_each_mem_cgroup_tree(iter, memcg) {
 		struct cgroup *cgroup = iter->css.cgroup;
 		struct cgroup_iter it;
@@ -1726,7 +1789,7 @@ static int mem_cgroup_soft_reclaim(struct mem_cgroup *root_memcg,
 		.priority = 0,
 	};
 
-	excess = res_counter_soft_limit_excess(&root_memcg->res) >> PAGE_SHIFT;
+	excess = soft_limit_excess(root_memcg);
 
 	while (1) {
 		victim = mem_cgroup_iter(root_memcg, victim, &reclaim);
@@ -1757,7 +1820,7 @@ static int mem_cgroup_soft_reclaim(struct mem_cgroup *root_memcg,
 		total += mem_cgroup_shrink_node_zone(victim, gfp_mask, false,
 						     zone, &nr_scanned);
 		*total_scanned += nr_scanned;
-		if (!res_counter_soft_limit_excess(&root_memcg->res))
+		if (!soft_limit_excess(root_memcg))
 			break;
 	}
 	mem_cgroup_iter_break(root_memcg, victim);
@@ -1962,7 +2025,7 @@ void __mem_cgroup_begin_update_page_stat(struct page *page,
 
 	pc = lookup_page_cgroup(page);
 again:
-	memcg = pc->mem_cgroup;
+	memcg = page_cgroup_memcg(pc);
 	if (unlikely(!memcg || !PageCgroupUsed(pc)))
 		return;
 	/*
@@ -1975,7 +2038,7 @@ again:
 		return;
 
 	move_lock_mem_cgroup(memcg, flags);
-	if (memcg != pc->mem_cgroup || !PageCgroupUsed(pc)) {
+	if (memcg != page_cgroup_memcg(pc) || !PageCgroupUsed(pc)) {
 		move_unlock_mem_cgroup(memcg, flags);
 		goto again;
 	}
@@ -1991,7 +2054,7 @@ void __mem_cgroup_end_update_page_stat(struct page *page, unsigned long *flags)
 	 * lock is held because a routine modifies pc->mem_cgroup
 	 * should take move_lock_mem_cgroup().
 	 */
-	move_unlock_mem_cgroup(pc->mem_cgroup, flags);
+	move_unlock_mem_cgroup(page_cgroup_memcg(pc), flags);
 }
 
 void mem_cgroup_update_page_stat(struct page *page,
@@ -2004,7 +2067,7 @@ void mem_cgroup_update_page_stat(struct page *page,
 	if (mem_cgroup_disabled())
 		return;
 
-	memcg = pc->mem_cgroup;
+	memcg = page_cgroup_memcg(pc);
 	if (unlikely(!memcg || !PageCgroupUsed(pc)))
 		return;
 
@@ -2020,10 +2083,14 @@ void mem_cgroup_update_page_stat(struct page *page,
 }
 
 /*
- * size of first charge trial. "32" comes from vmscan.c's magic value.
- * TODO: maybe necessary to use big numbers in big irons.
+ * Size of the first charge trial.  CHARGE_BATCH is what every cpu may
+ * stock when the group is close to its limit, "32" comes from vmscan.c's
+ * magic value.  With plenty of headroom the batch grows up to
+ * MAX_CHARGE_BATCH, so big irons go back to the shared page counters
+ * less often.
  */
-#define CHARGE_BATCH	32U
+#define CHARGE_BATCH		32U
+#define MAX_CHARGE_BATCH	256U
 struct memcg_stock_pcp {
 	struct mem_cgroup *cached; /* this never be root cgroup */
 	unsigned int nr_pages;
@@ -2033,6 +2100,8 @@ struct memcg_stock_pcp {
 };
 static DEFINE_PER_CPU(struct memcg_stock_pcp, memcg_stock);
 static DEFINE_MUTEX(percpu_charge_mutex);
+/* serializes limit updates, page_counter_limit() needs that */
+static DEFINE_MUTEX(set_limit_mutex);
 
 /*
  * Try to consume stocked charge on this cpu. If success, one page is consumed
@@ -2048,25 +2117,23 @@ static bool consume_stock(struct mem_cgroup *memcg)
 	stock = &get_cpu_var(memcg_stock);
 	if (memcg == stock->cached && stock->nr_pages)
 		stock->nr_pages--;
-	else /* need to call res_counter_charge */
+	else /* need to call page_counter_try_charge */
 		ret = false;
 	put_cpu_var(memcg_stock);
 	return ret;
 }
 
 /*
- * Returns stocks cached in percpu to res_counter and reset cached information.
+ * Returns stocks cached in percpu to page_counter and reset cached information.
  */
 static void drain_stock(struct memcg_stock_pcp *stock)
 {
 	struct mem_cgroup *old = stock->cached;
 
 	if (stock->nr_pages) {
-		unsigned long bytes = stock->nr_pages * PAGE_SIZE;
-
-		res_counter_uncharge(&old->res, bytes);
+		page_counter_uncharge(&old->memory, stock->nr_pages);
 		if (do_swap_account)
-			res_counter_uncharge(&old->memsw, bytes);
+			page_counter_uncharge(&old->memsw, stock->nr_pages);
 		stock->nr_pages = 0;
 	}
 	stock->cached = NULL;
@@ -2084,7 +2151,7 @@ static void drain_local_stock(struct work_struct *dummy)
 }
 
 /*
- * Cache charges(val) which is from res_counter, to local per_cpu area.
+ * Cache charges(val) which is from page_counter, to local per_cpu area.
  * This will be consumed by consume_stock() function, later.
  */
 static void refill_stock(struct mem_cgroup *memcg, unsigned int nr_pages)
@@ -2144,7 +2211,7 @@ out:
 /*
  * Tries to drain stocked charges in other cpus. This function is asynchronous
  * and just put a work per cpu for draining localy on each cpu. Caller can
- * expects some charges will be back to res_counter later but cannot wait for
+ * expects some charges will be back to page_counter later but cannot wait for
  * it.
  */
 static void drain_all_stock_async(struct mem_cgroup *root_memcg)
@@ -2223,37 +2290,60 @@ enum {
 	CHARGE_OOM_DIE,		/* the current is killed because of OOM */
 };
 
+/*
+ * Pick how many pages to charge to the page counters when @memcg needs
+ * @nr_pages.  The surplus is parked in the per-cpu stock, so the batch
+ * is the share of the remaining headroom one cpu may hold: as the group
+ * approaches its limit the stocks shrink and stop hiding usable pages
+ * from the other cpus, and with a lot of headroom they grow so that the
+ * hierarchy's counters are touched less often.
+ */
+static unsigned int mem_cgroup_charge_batch(struct mem_cgroup *memcg,
+					    unsigned int nr_pages)
+{
+	unsigned long batch;
+
+	batch = mem_cgroup_margin(memcg) / num_online_cpus();
+	if (batch > CHARGE_BATCH)
+		batch = min(rounddown_pow_of_two(batch),
+			    (unsigned long)MAX_CHARGE_BATCH);
+	else
+		batch = CHARGE_BATCH;
+
+	return max_t(unsigned int, batch, nr_pages);
+}
+
 static int mem_cgroup_do_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
-				unsigned int nr_pages, bool oom_check)
+				unsigned int nr_pages, unsigned int min_pages,
+				bool oom_check)
 {
-	unsigned long csize = nr_pages * PAGE_SIZE;
 	struct mem_cgroup *mem_over_limit;
-	struct res_counter *fail_res;
+	struct page_counter *counter;
 	unsigned long flags = 0;
 	int ret;
 
-	ret = res_counter_charge(&memcg->res, csize, &fail_res);
-
-	if (likely(!ret)) {
+	if (likely(!page_counter_try_charge(&memcg->memory, nr_pages,
+					    &counter))) {
 		if (!do_swap_account)
 			return CHARGE_OK;
-		ret = res_counter_charge(&memcg->memsw, csize, &fail_res);
-		if (likely(!ret))
+		if (likely(!page_counter_try_charge(&memcg->memsw, nr_pages,
+						    &counter)))
 			return CHARGE_OK;
 
-		res_counter_uncharge(&memcg->res, csize);
-		mem_over_limit = mem_cgroup_from_res_counter(fail_res, memsw);
+		page_counter_uncharge(&memcg->memory, nr_pages);
+		mem_over_limit = mem_cgroup_from_counter(counter, memsw);
 		flags |= MEM_CGROUP_RECLAIM_NOSWAP;
 	} else
-		mem_over_limit = mem_cgroup_from_res_counter(fail_res, res);
+		mem_over_limit = mem_cgroup_from_counter(counter, memory);
 	/*
 	 * nr_pages can be either a huge page (HPAGE_PMD_NR), a batch
-	 * of regular pages (CHARGE_BATCH), or a single regular page (1).
+	 * of regular pages (mem_cgroup_charge_batch()), or a single
+	 * regular page (1).
 	 *
 	 * Never reclaim on behalf of optional batching, retry with a
 	 * single page instead.
 	 */
-	if (nr_pages == CHARGE_BATCH)
+	if (nr_pages > min_pages)
 		return CHARGE_RETRY;
 
 	if (!(gfp_mask & __GFP_WAIT))
@@ -2285,7 +2375,8 @@ static int mem_cgroup_do_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
 	if (!oom_check)
 		return CHARGE_NOMEM;
 	/* check OOM */
-	if (!mem_cgroup_handle_oom(mem_over_limit, gfp_mask, get_order(csize)))
+	if (!mem_cgroup_handle_oom(mem_over_limit, gfp_mask,
+				   get_order(nr_pages * PAGE_SIZE)))
 		return CHARGE_OOM_DIE;
 
 	return CHARGE_RETRY;
@@ -2294,7 +2385,7 @@ static int mem_cgroup_do_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
 /*
  * __mem_cgroup_try_charge() does
  * 1. detect memcg to be charged against from passed *mm and *ptr,
- * 2. update res_counter
+ * 2. update page_counter
  * 3. call memory reclaim if necessary.
  *
  * In some special case, if the task is fatal, fatal_signal_pending() or
@@ -2318,7 +2409,7 @@ static int __mem_cgroup_try_charge(struct mm_struct *mm,
 				   struct mem_cgroup **ptr,
 				   bool oom)
 {
-	unsigned int batch = max(CHARGE_BATCH, nr_pages);
+	unsigned int batch = 0;
 	int nr_oom_retries = MEM_CGROUP_RECLAIM_RETRIES;
 	struct mem_cgroup *memcg = NULL;
 	int ret;
@@ -2406,7 +2497,12 @@ again:
 			nr_oom_retries = MEM_CGROUP_RECLAIM_RETRIES;
 		}
 
-		ret = mem_cgroup_do_charge(memcg, gfp_mask, batch, oom_check);
+		/* a failed batch is retried with just what we need */
+		if (!batch)
+			batch = mem_cgroup_charge_batch(memcg, nr_pages);
+
+		ret = mem_cgroup_do_charge(memcg, gfp_mask, batch, nr_pages,
+					   oom_check);
 		switch (ret) {
 		case CHARGE_OK:
 			break;
@@ -2455,11 +2551,9 @@ static void __mem_cgroup_cancel_charge(struct mem_cgroup *memcg,
 				       unsigned int nr_pages)
 {
 	if (!mem_cgroup_is_root(memcg)) {
-		unsigned long bytes = nr_pages * PAGE_SIZE;
-
-		res_counter_uncharge(&memcg->res, bytes);
+		page_counter_uncharge(&memcg->memory, nr_pages);
 		if (do_swap_account)
-			res_counter_uncharge(&memcg->memsw, bytes);
+			page_counter_uncharge(&memcg->memsw, nr_pages);
 	}
 }
 
@@ -2470,17 +2564,520 @@ static void __mem_cgroup_cancel_charge(struct mem_cgroup *memcg,
 static void __mem_cgroup_cancel_local_charge(struct mem_cgroup *memcg,
 					unsigned int nr_pages)
 {
-	unsigned long bytes = nr_pages * PAGE_SIZE;
-
 	if (mem_cgroup_is_root(memcg))
 		return;
 
-	res_counter_uncharge_until(&memcg->res, memcg->res.parent, bytes);
+	page_counter_cancel(&memcg->memory, nr_pages);
 	if (do_swap_account)
-		res_counter_uncharge_until(&memcg->memsw,
-						memcg->memsw.parent, bytes);
+		page_counter_cancel(&memcg->memsw, nr_pages);
+}
+
+#ifdef CONFIG_MEMCG_KMEM
+struct static_key memcg_kmem_enabled_key;
+
+/*
+ * Each kmem-limited memcg owns an index into the memcg_caches[] arrays of
+ * the root caches.  The id is only released when the memcg is freed, which
+ * happens after all of its caches are gone, so names and slots of dead
+ * caches are never reused while they still exist.
+ */
+static DEFINE_IDA(kmem_limited_groups);
+static int memcg_limited_groups_array_size;
+#define MEMCG_CACHES_MIN_SIZE	4
+#define MEMCG_CACHES_MAX_SIZE	65535
+
+/*
+ * Serializes kmem activation, creation of per-memcg caches and all updates
+ * of the memcg_caches[] arrays.  Nests outside slab_mutex.
+ */
+static DEFINE_MUTEX(memcg_cache_mutex);
+
+/* Per-memcg caches are created from here, see memcg_create_cache_enqueue() */
+static struct workqueue_struct *memcg_kmem_wq;
+
+static int memcg_charge_kmem(struct mem_cgroup *memcg, gfp_t gfp,
+			     unsigned long nr_pages, bool may_shrink);
+static void memcg_uncharge_kmem(struct mem_cgroup *memcg,
+				unsigned long nr_pages);
+
+static int memcg_update_cache_size(struct kmem_cache *s, int num_groups)
+{
+	struct memcg_cache_params *new, *old = s->memcg_params;
+
+	new = kzalloc(sizeof(*new) + num_groups * sizeof(struct kmem_cache *),
+		      GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	new->is_root_cache = true;
+	if (old)
+		memcpy(new->memcg_caches, old->memcg_caches,
+		       memcg_limited_groups_array_size *
+		       sizeof(struct kmem_cache *));
+
+	rcu_assign_pointer(s->memcg_params, new);
+	if (old)
+		kfree_rcu(old, rcu_head);
+	return 0;
+}
+
+/* Make room for @num_groups in the clone array of every root cache */
+static int memcg_update_all_caches(int num_groups)
+{
+	struct kmem_cache *s;
+	int new_size;
+	int ret = 0;
+
+	if (num_groups <= memcg_limited_groups_array_size)
+		return 0;
+
+	new_size = max(num_groups * 2, MEMCG_CACHES_MIN_SIZE);
+	new_size = min(new_size, MEMCG_CACHES_MAX_SIZE);
+
+	memcg_stop_kmem_account();
+	mutex_lock(&slab_mutex);
+	list_for_each_entry(s, &slab_caches, list) {
+		if (!is_root_cache(s))
+			continue;
+		ret = memcg_update_cache_size(s, new_size);
+		if (ret)
+			break;
+	}
+	if (!ret)
+		memcg_limited_groups_array_size = new_size;
+	mutex_unlock(&slab_mutex);
+	memcg_resume_kmem_account();
+	return ret;
+}
+
+static int memcg_activate_kmem(struct mem_cgroup *memcg)
+{
+	int id, ret = 0;
+
+	mutex_lock(&memcg_cache_mutex);
+	if (memcg_kmem_is_active(memcg))
+		goto out;
+
+	if (!memcg_kmem_wq) {
+		memcg_kmem_wq = alloc_workqueue("memcg_kmem", 0, 0);
+		if (!memcg_kmem_wq) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	id = ida_simple_get(&kmem_limited_groups, 0, MEMCG_CACHES_MAX_SIZE,
+			    GFP_KERNEL);
+	if (id < 0) {
+		ret = id;
+		goto out;
+	}
+
+	ret = memcg_update_all_caches(id + 1);
+	if (ret) {
+		ida_simple_remove(&kmem_limited_groups, id);
+		goto out;
+	}
+
+	memcg->kmemcg_id = id;
+	static_key_slow_inc(&memcg_kmem_enabled_key);
+	/*
+	 * The clone arrays must be large enough for our id before anyone
+	 * sees the memcg as active.  Pairs with __memcg_kmem_get_cache().
+	 */
+	smp_wmb();
+	set_bit(KMEM_ACCOUNTED_ACTIVE, &memcg->kmem_account_flags);
+out:
+	mutex_unlock(&memcg_cache_mutex);
+	return ret;
+}
+
+static void disarm_kmem_keys(struct mem_cgroup *memcg)
+{
+	if (!memcg_kmem_is_active(memcg))
+		return;
+	static_key_slow_dec(&memcg_kmem_enabled_key);
+	ida_simple_remove(&kmem_limited_groups, memcg->kmemcg_id);
+}
+
+static int memcg_update_kmem_limit(struct mem_cgroup *memcg,
+				   unsigned long limit)
+{
+	int ret;
+
+	if (limit != PAGE_COUNTER_MAX && !memcg_kmem_is_active(memcg)) {
+		ret = memcg_activate_kmem(memcg);
+		if (ret)
+			return ret;
+	}
+	mutex_lock(&set_limit_mutex);
+	ret = page_counter_limit(&memcg->kmem, limit);
+	mutex_unlock(&set_limit_mutex);
+	return ret;
+}
+
+/* Children of a kmem-limited memcg account their kernel memory as well */
+static int memcg_propagate_kmem(struct mem_cgroup *memcg)
+{
+	struct mem_cgroup *parent = parent_mem_cgroup(memcg);
+
+	if (!parent || !memcg_kmem_is_active(parent))
+		return 0;
+	return memcg_activate_kmem(memcg);
+}
+
+static void memcg_cache_destroy_work_func(struct work_struct *w)
+{
+	struct memcg_cache_params *params;
+
+	params = container_of(w, struct memcg_cache_params, destroy);
+	/* Only queued once the last slab page is gone, see below */
+	kmem_cache_destroy(params->cachep);
+}
+
+int memcg_register_cache(struct mem_cgroup *memcg, struct kmem_cache *s,
+			 struct kmem_cache *root_cache)
+{
+	struct memcg_cache_params *params;
+	size_t size = sizeof(struct memcg_cache_params);
+
+	if (!memcg) {
+		/* The clone array is only needed once some memcg is limited */
+		if (!memcg_limited_groups_array_size)
+			return 0;
+		size += memcg_limited_groups_array_size *
+			sizeof(struct kmem_cache *);
+	}
+
+	params = kzalloc(size, GFP_KERNEL);
+	if (!params)
+		return -ENOMEM;
+
+	if (memcg) {
+		params->memcg = memcg;
+		params->root_cache = root_cache;
+		params->cachep = s;
+		INIT_LIST_HEAD(&params->list);
+		INIT_WORK(&params->destroy, memcg_cache_destroy_work_func);
+		/* the memcg's reference, dropped when it goes away */
+		atomic_set(&params->nr_pages, 1);
+		mem_cgroup_get(memcg);
+	} else
+		params->is_root_cache = true;
+
+	s->memcg_params = params;
+	return 0;
+}
+
+void memcg_release_cache(struct kmem_cache *s)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+
+	if (!params)
+		return;
+
+	if (!params->is_root_cache) {
+		kfree(params->name);
+		mem_cgroup_put(params->memcg);
+	}
+	s->memcg_params = NULL;
+	kfree(params);
+}
+
+bool memcg_cache_dead(struct kmem_cache *s)
+{
+	return s->memcg_params->dead;
 }
 
+/*
+ * Called when the last user of a root cache destroys it: its live clones
+ * go with it.  Clones of destroyed memcgs no longer refer to the root and
+ * are left to drain on their own.
+ */
+void kmem_cache_destroy_memcg_children(struct kmem_cache *s)
+{
+	struct kmem_cache *c;
+	struct mem_cgroup *memcg;
+	int i;
+
+	if (!s->memcg_params || !s->memcg_params->is_root_cache)
+		return;
+
+	/* Pending clone creations may still refer to @s */
+	if (memcg_kmem_wq)
+		flush_workqueue(memcg_kmem_wq);
+
+	mutex_lock(&memcg_cache_mutex);
+	for (i = 0; i < memcg_limited_groups_array_size; i++) {
+		c = s->memcg_params->memcg_caches[i];
+		if (!c)
+			continue;
+
+		s->memcg_params->memcg_caches[i] = NULL;
+		memcg = c->memcg_params->memcg;
+		mutex_lock(&memcg->slab_caches_mutex);
+		list_del(&c->memcg_params->list);
+		mutex_unlock(&memcg->slab_caches_mutex);
+
+		kmem_cache_destroy(c);
+	}
+	mutex_unlock(&memcg_cache_mutex);
+}
+
+static void memcg_create_kmem_cache(struct mem_cgroup *memcg,
+				    struct kmem_cache *cachep)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *new;
+	int idx = memcg->kmemcg_id;
+	char *name;
+
+	mutex_lock(&memcg_cache_mutex);
+	params = cachep->memcg_params;
+	if (params->memcg_caches[idx])
+		goto out;
+
+	rcu_read_lock();
+	name = kasprintf(GFP_ATOMIC, "%s(%d:%s)", cachep->name, idx,
+			 memcg->css.cgroup->dentry->d_name.name);
+	rcu_read_unlock();
+	if (!name)
+		goto out;
+
+	new = kmem_cache_create_memcg(memcg, name, cachep->object_size,
+				      cachep->align, cachep->flags & ~SLAB_PANIC,
+				      cachep->ctor, cachep);
+	if (!new) {
+		kfree(name);
+		goto out;
+	}
+	new->memcg_params->name = name;
+
+	mutex_lock(&memcg->slab_caches_mutex);
+	list_add(&new->memcg_params->list, &memcg->memcg_slab_caches);
+	mutex_unlock(&memcg->slab_caches_mutex);
+
+	/* The clone must be fully set up before allocations can find it */
+	smp_wmb();
+	params->memcg_caches[idx] = new;
+out:
+	mutex_unlock(&memcg_cache_mutex);
+}
+
+struct create_work {
+	struct mem_cgroup *memcg;
+	struct kmem_cache *cachep;
+	struct work_struct work;
+};
+
+static void memcg_create_cache_work_func(struct work_struct *w)
+{
+	struct create_work *cw = container_of(w, struct create_work, work);
+
+	memcg_create_kmem_cache(cw->memcg, cw->cachep);
+	css_put(&cw->memcg->css);
+	kfree(cw);
+}
+
+/*
+ * Cache creation needs to sleep and take slab_mutex, neither of which the
+ * allocating context can be assumed to allow, so it is deferred to a worker.
+ * Allocations keep using the root cache until the clone shows up.
+ */
+static void memcg_create_cache_enqueue(struct mem_cgroup *memcg,
+				       struct kmem_cache *cachep)
+{
+	struct create_work *cw;
+
+	memcg_stop_kmem_account();
+	cw = kmalloc(sizeof(struct create_work), GFP_NOWAIT);
+	memcg_resume_kmem_account();
+	if (!cw)
+		return;
+
+	/* The memcg can't go away while a creation is pending for it */
+	if (!css_tryget(&memcg->css)) {
+		kfree(cw);
+		return;
+	}
+
+	cw->memcg = memcg;
+	cw->cachep = cachep;
+	INIT_WORK(&cw->work, memcg_create_cache_work_func);
+	queue_work(memcg_kmem_wq, &cw->work);
+}
+
+struct kmem_cache *__memcg_kmem_get_cache(struct kmem_cache *cachep,
+					  gfp_t gfp)
+{
+	struct memcg_cache_params *params;
+	struct mem_cgroup *memcg;
+	struct kmem_cache *new = cachep;
+
+	rcu_read_lock();
+	memcg = mem_cgroup_from_task(rcu_dereference(current->mm->owner));
+	if (!memcg || mem_cgroup_is_root(memcg) ||
+	    !memcg_kmem_is_active(memcg))
+		goto out;
+
+	/* Pairs with the barrier in memcg_activate_kmem() */
+	smp_rmb();
+	params = rcu_dereference(cachep->memcg_params);
+	if (!params || !params->is_root_cache)
+		goto out;
+
+	new = rcu_dereference(params->memcg_caches[memcg->kmemcg_id]);
+	if (!new) {
+		new = cachep;
+		memcg_create_cache_enqueue(memcg, cachep);
+	}
+out:
+	rcu_read_unlock();
+	return new;
+}
+
+int __memcg_charge_slab(struct kmem_cache *s, gfp_t gfp, int order)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+	int ret;
+
+	/*
+	 * Shrinking takes slab_mutex.  Its holders stop kmem accounting
+	 * before they allocate, so a charge never nests inside it.
+	 */
+	ret = memcg_charge_kmem(params->memcg, gfp, 1 << order,
+				(gfp & GFP_KERNEL) == GFP_KERNEL);
+	if (!ret)
+		atomic_add(1 << order, &params->nr_pages);
+	return ret;
+}
+
+void __memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+
+	memcg_uncharge_kmem(params->memcg, 1 << order);
+	/*
+	 * nr_pages only drops to zero once the memcg is dead and has put its
+	 * reference, and nothing else frees the cache then.  @params must
+	 * not be looked at again after the final put.
+	 */
+	if (atomic_sub_and_test(1 << order, &params->nr_pages))
+		schedule_work(&params->destroy);
+}
+
+/*
+ * Release the empty slabs cached by the per-memcg caches of @root and its
+ * descendants, uncharging them.
+ */
+static void memcg_shrink_kmem_caches(struct mem_cgroup *root)
+{
+	struct memcg_cache_params *params;
+	struct mem_cgroup *iter;
+
+	memcg_stop_kmem_account();
+	for_each_mem_cgroup_tree(iter, root) {
+		if (!memcg_kmem_is_active(iter))
+			continue;
+		mutex_lock(&iter->slab_caches_mutex);
+		list_for_each_entry(params, &iter->memcg_slab_caches, list)
+			kmem_cache_shrink(params->cachep);
+		mutex_unlock(&iter->slab_caches_mutex);
+	}
+	memcg_resume_kmem_account();
+}
+
+static int memcg_charge_kmem(struct mem_cgroup *memcg, gfp_t gfp,
+			     unsigned long nr_pages, bool may_shrink)
+{
+	struct page_counter *counter;
+	struct mem_cgroup *_memcg;
+	int ret;
+
+	ret = page_counter_try_charge(&memcg->kmem, nr_pages, &counter);
+	/*
+	 * Over the kmem limit: give back the empty slabs the hierarchy sits
+	 * on and retry once, if the caller allows it.  Shrinking allocates
+	 * and takes slab_mutex.
+	 */
+	if (ret && may_shrink) {
+		memcg_shrink_kmem_caches(mem_cgroup_from_counter(counter, kmem));
+		ret = page_counter_try_charge(&memcg->kmem, nr_pages, &counter);
+	}
+	if (ret)
+		return ret;
+
+	_memcg = memcg;
+	ret = __mem_cgroup_try_charge(NULL, gfp, nr_pages, &_memcg,
+				      (gfp & __GFP_FS) && !(gfp & __GFP_NORETRY));
+	if (ret == -EINTR) {
+		/*
+		 * The task is dying and was let through without a charge.
+		 * Force one anyway, the uncharge side can't tell the two
+		 * cases apart.
+		 */
+		page_counter_charge(&memcg->memory, nr_pages);
+		if (do_swap_account)
+			page_counter_charge(&memcg->memsw, nr_pages);
+		ret = 0;
+	} else if (ret)
+		page_counter_uncharge(&memcg->kmem, nr_pages);
+
+	return ret;
+}
+
+static void memcg_uncharge_kmem(struct mem_cgroup *memcg,
+				unsigned long nr_pages)
+{
+	page_counter_uncharge(&memcg->memory, nr_pages);
+	if (do_swap_account)
+		page_counter_uncharge(&memcg->memsw, nr_pages);
+	page_counter_uncharge(&memcg->kmem, nr_pages);
+}
+
+/*
+ * The memcg is gone: no new allocation can be charged to it, so retire its
+ * caches.  Their empty slabs are given back right away, and each cache is
+ * destroyed as soon as its last slab page is freed.
+ */
+static void memcg_kmem_destroy_work_func(struct work_struct *w)
+{
+	struct mem_cgroup *memcg;
+	struct memcg_cache_params *params, *tmp;
+
+	memcg = container_of(w, struct mem_cgroup, kmem_destroy_work);
+
+	memcg_stop_kmem_account();
+	mutex_lock(&memcg_cache_mutex);
+	mutex_lock(&memcg->slab_caches_mutex);
+	list_for_each_entry_safe(params, tmp, &memcg->memcg_slab_caches, list) {
+		params->root_cache->memcg_params->memcg_caches[memcg->kmemcg_id] =
+			NULL;
+		list_del_init(&params->list);
+		params->dead = true;
+		kmem_cache_shrink(params->cachep);
+		/* the cache may be gone once the memcg's reference is put */
+		if (atomic_dec_and_test(&params->nr_pages))
+			schedule_work(&params->destroy);
+	}
+	mutex_unlock(&memcg->slab_caches_mutex);
+	mutex_unlock(&memcg_cache_mutex);
+	memcg_resume_kmem_account();
+
+	mem_cgroup_put(memcg);
+}
+#else
+static void disarm_kmem_keys(struct mem_cgroup *memcg)
+{
+}
+
+static int memcg_update_kmem_limit(struct mem_cgroup *memcg,
+				   unsigned long limit)
+{
+	return -EINVAL;
+}
+#endif /* CONFIG_MEMCG_KMEM */
+
 /*
  * A helper function to get mem_cgroup from ID. must be called under
  * rcu_read_lock(). The caller must check css_is_removed() or some if
@@ -2512,7 +3109,7 @@ struct mem_cgroup *try_get_mem_cgroup_from_page(struct page *page)
 	pc = lookup_page_cgroup(page);
 	lock_page_cgroup(pc);
 	if (PageCgroupUsed(pc)) {
-		memcg = pc->mem_cgroup;
+		memcg = page_cgroup_memcg(pc);
 		if (memcg && !css_tryget(&memcg->css))
 			memcg = NULL;
 	} else if (PageSwapCache(page)) {
@@ -2555,14 +3152,15 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 		zone = page_zone(page);
 		spin_lock_irq(&zone->lru_lock);
 		if (PageLRU(page)) {
-			lruvec = mem_cgroup_zone_lruvec(zone, pc->mem_cgroup);
+			lruvec = mem_cgroup_zone_lruvec(zone,
+						page_cgroup_memcg(pc));
 			ClearPageLRU(page);
 			del_page_from_lru_list(page, lruvec, page_lru(page));
 			was_on_lru = true;
 		}
 	}
 
-	pc->mem_cgroup = memcg;
+	page_cgroup_set_memcg(pc, memcg);
 	/*
 	 * We access a page_cgroup asynchronously without lock_page_cgroup().
 	 * Especially when a page_cgroup is taken from a page, pc->mem_cgroup
@@ -2575,7 +3173,7 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 
 	if (lrucare) {
 		if (was_on_lru) {
-			lruvec = mem_cgroup_zone_lruvec(zone, pc->mem_cgroup);
+			lruvec = mem_cgroup_zone_lruvec(zone, memcg);
 			VM_BUG_ON(PageLRU(page));
 			SetPageLRU(page);
 			add_page_to_lru_list(page, lruvec, page_lru(page));
@@ -2617,12 +3215,32 @@ void mem_cgroup_split_huge_fixup(struct page *head)
 	if (mem_cgroup_disabled())
 		return;
 	for (i = 1; i < HPAGE_PMD_NR; i++) {
-		pc = head_pc + i;
-		pc->mem_cgroup = head_pc->mem_cgroup;
-		smp_wmb();/* see __commit_charge() */
+		pc = lookup_page_cgroup(head + i);
+		/* the memcg pointer and the USED bit are copied in one go */
+		pc->flags = head_pc->flags & ~PCGF_NOCOPY_AT_SPLIT;
+	}
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+/*
+ * A 1GB page is being split into 2MB ones, each of which is uncharged on
+ * its own from now on: mark their heads as used.  The 1GB page is not on
+ * the LRU and not mapped anywhere else, so nothing can race with us.
+ */
+void mem_cgroup_split_huge_pud_fixup(struct page *head)
+{
+	struct page_cgroup *head_pc = lookup_page_cgroup(head);
+	struct page_cgroup *pc;
+	int i;
+
+	if (mem_cgroup_disabled())
+		return;
+	for (i = HPAGE_PMD_NR; i < HPAGE_PUD_NR; i += HPAGE_PMD_NR) {
+		pc = lookup_page_cgroup(head + i);
 		pc->flags = head_pc->flags & ~PCGF_NOCOPY_AT_SPLIT;
 	}
 }
+#endif
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
 /**
@@ -2665,7 +3283,7 @@ static int mem_cgroup_move_account(struct page *page,
 	lock_page_cgroup(pc);
 
 	ret = -EINVAL;
-	if (!PageCgroupUsed(pc) || pc->mem_cgroup != from)
+	if (!PageCgroupUsed(pc) || page_cgroup_memcg(pc) != from)
 		goto unlock;
 
 	move_lock_mem_cgroup(from, &flags);
@@ -2680,7 +3298,7 @@ static int mem_cgroup_move_account(struct page *page,
 	mem_cgroup_charge_statistics(from, anon, -nr_pages);
 
 	/* caller should have done css_get */
-	pc->mem_cgroup = to;
+	page_cgroup_set_memcg(pc, to);
 	mem_cgroup_charge_statistics(to, anon, nr_pages);
 	/*
 	 * We charges against "to" which may not have any tasks. Then, "to"
@@ -2964,8 +3582,8 @@ static void mem_cgroup_do_uncharge(struct mem_cgroup *memcg,
 
 	/*
 	 * In typical case, batch->memcg == mem. This means we can
-	 * merge a series of uncharges to an uncharge of res_counter.
-	 * If not, we uncharge res_counter ony by one.
+	 * merge a series of uncharges to an uncharge of page_counter.
+	 * If not, we uncharge page_counter ony by one.
 	 */
 	if (batch->memcg != memcg)
 		goto direct_uncharge;
@@ -2975,9 +3593,9 @@ static void mem_cgroup_do_uncharge(struct mem_cgroup *memcg,
 		batch->memsw_nr_pages++;
 	return;
 direct_uncharge:
-	res_counter_uncharge(&memcg->res, nr_pages * PAGE_SIZE);
+	page_counter_uncharge(&memcg->memory, nr_pages);
 	if (uncharge_memsw)
-		res_counter_uncharge(&memcg->memsw, nr_pages * PAGE_SIZE);
+		page_counter_uncharge(&memcg->memsw, nr_pages);
 	if (unlikely(batch->memcg != memcg))
 		memcg_oom_recover(memcg);
 }
@@ -3012,7 +3630,7 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 
 	lock_page_cgroup(pc);
 
-	memcg = pc->mem_cgroup;
+	memcg = page_cgroup_memcg(pc);
 
 	if (!PageCgroupUsed(pc))
 		goto unlock_out;
@@ -3037,7 +3655,7 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 		 * end_migration() /must/ be the one uncharging the
 		 * unused post-migration page and so it has to call
 		 * here with the migration bit still set.  See the
-		 * res_counter handling below.
+		 * page_counter handling below.
 		 */
 		if (!end_migration && PageCgroupMigration(pc))
 			goto unlock_out;
@@ -3065,7 +3683,7 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 
 	unlock_page_cgroup(pc);
 	/*
-	 * even after unlock, we have memcg->res.usage here and this memcg
+	 * even after unlock, we have memcg->memory.count here and this memcg
 	 * will never be freed.
 	 */
 	memcg_check_events(memcg, page);
@@ -3074,7 +3692,7 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 		mem_cgroup_get(memcg);
 	}
 	/*
-	 * Migration does not charge the res_counter for the
+	 * Migration does not charge the page_counter for the
 	 * replacement page, so leave it alone when phasing out the
 	 * page that is unused after the migration.
 	 */
@@ -3143,11 +3761,10 @@ void mem_cgroup_uncharge_end(void)
 	 * bacause we hide charges behind us.
 	 */
 	if (batch->nr_pages)
-		res_counter_uncharge(&batch->memcg->res,
-				     batch->nr_pages * PAGE_SIZE);
+		page_counter_uncharge(&batch->memcg->memory, batch->nr_pages);
 	if (batch->memsw_nr_pages)
-		res_counter_uncharge(&batch->memcg->memsw,
-				     batch->memsw_nr_pages * PAGE_SIZE);
+		page_counter_uncharge(&batch->memcg->memsw,
+				      batch->memsw_nr_pages);
 	memcg_oom_recover(batch->memcg);
 	/* forget this pointer (for sanity check) */
 	batch->memcg = NULL;
@@ -3200,7 +3817,7 @@ void mem_cgroup_uncharge_swap(swp_entry_t ent)
 		 * This memcg can be obsolete one. We avoid calling css_tryget
 		 */
 		if (!mem_cgroup_is_root(memcg))
-			res_counter_uncharge(&memcg->memsw, PAGE_SIZE);
+			page_counter_uncharge(&memcg->memsw, 1);
 		mem_cgroup_swap_statistics(memcg, false);
 		mem_cgroup_put(memcg);
 	}
@@ -3218,8 +3835,8 @@ void mem_cgroup_uncharge_swap(swp_entry_t ent)
  *
  * Returns 0 on success, -EINVAL on failure.
  *
- * The caller must have charged to @to, IOW, called res_counter_charge() about
- * both res and memsw, and called css_get().
+ * The caller must have charged to @to, IOW, called page_counter_try_charge()
+ * about both memory and memsw, and called css_get().
  */
 static int mem_cgroup_move_swap_account(swp_entry_t entry,
 				struct mem_cgroup *from, struct mem_cgroup *to)
@@ -3234,7 +3851,7 @@ static int mem_cgroup_move_swap_account(swp_entry_t entry,
 		mem_cgroup_swap_statistics(to, true);
 		/*
 		 * This function is only called from task migration context now.
-		 * It postpones res_counter and refcount handling till the end
+		 * It postpones page_counter and refcount handling till the end
 		 * of task migration(mem_cgroup_clear_mc()) for performance
 		 * improvement. But we cannot postpone mem_cgroup_get(to)
 		 * because if the process that has been moved to @to does
@@ -3273,7 +3890,7 @@ void mem_cgroup_prepare_migration(struct page *page, struct page *newpage,
 	pc = lookup_page_cgroup(page);
 	lock_page_cgroup(pc);
 	if (PageCgroupUsed(pc)) {
-		memcg = pc->mem_cgroup;
+		memcg = page_cgroup_memcg(pc);
 		css_get(&memcg->css);
 		/*
 		 * At migrating an anonymous page, its mapcount goes down
@@ -3328,7 +3945,7 @@ void mem_cgroup_prepare_migration(struct page *page, struct page *newpage,
 		ctype = MEM_CGROUP_CHARGE_TYPE_CACHE;
 	/*
 	 * The page is committed to the memcg, but it's not actually
-	 * charged to the res_counter since we plan on replacing the
+	 * charged to the page_counter since we plan on replacing the
 	 * old one and only one page is going to be left afterwards.
 	 */
 	__mem_cgroup_commit_charge(memcg, newpage, 1, ctype, false);
@@ -3390,7 +4007,7 @@ void mem_cgroup_end_migration(struct mem_cgroup *memcg,
 
 /*
  * At replace page cache, newpage is not under any memcg but it's on
- * LRU. So, this function doesn't touch res_counter but handles LRU
+ * LRU. So, this function doesn't touch page_counter but handles LRU
  * in correct way. Both pages are locked so we cannot race with uncharge.
  */
 void mem_cgroup_replace_page_cache(struct page *oldpage,
@@ -3407,7 +4024,7 @@ void mem_cgroup_replace_page_cache(struct page *oldpage,
 	/* fix accounting on old pages */
 	lock_page_cgroup(pc);
 	if (PageCgroupUsed(pc)) {
-		memcg = pc->mem_cgroup;
+		memcg = page_cgroup_memcg(pc);
 		mem_cgroup_charge_statistics(memcg, false, -1);
 		ClearPageCgroupUsed(pc);
 	}
@@ -3433,12 +4050,7 @@ static struct page_cgroup *lookup_page_cgroup_used(struct page *page)
 	struct page_cgroup *pc;
 
 	pc = lookup_page_cgroup(page);
-	/*
-	 * Can be NULL while feeding pages into the page allocator for
-	 * the first time, i.e. during boot or memory hotplug;
-	 * or when mem_cgroup_disabled().
-	 */
-	if (likely(pc) && PageCgroupUsed(pc))
+	if (PageCgroupUsed(pc))
 		return pc;
 	return NULL;
 }
@@ -3458,21 +4070,19 @@ void mem_cgroup_print_bad_page(struct page *page)
 	pc = lookup_page_cgroup_used(page);
 	if (pc) {
 		printk(KERN_ALERT "pc:%p pc->flags:%lx pc->mem_cgroup:%p\n",
-		       pc, pc->flags, pc->mem_cgroup);
+		       pc, pc->flags & PCG_FLAGS_MASK, page_cgroup_memcg(pc));
 	}
 }
 #endif
 
-static DEFINE_MUTEX(set_limit_mutex);
-
 static int mem_cgroup_resize_limit(struct mem_cgroup *memcg,
-				unsigned long long val)
+				   unsigned long limit)
 {
 	int retry_count;
-	u64 memswlimit, memlimit;
+	unsigned long memswlimit, memlimit;
 	int ret = 0;
 	int children = mem_cgroup_count_children(memcg);
-	u64 curusage, oldusage;
+	unsigned long curusage, oldusage;
 	int enlarge;
 
 	/*
@@ -3482,7 +4092,7 @@ static int mem_cgroup_resize_limit(struct mem_cgroup *memcg,
 	 */
 	retry_count = MEM_CGROUP_RECLAIM_RETRIES * children;
 
-	oldusage = res_counter_read_u64(&memcg->res, RES_USAGE);
+	oldusage = page_counter_read(&memcg->memory);
 
 	enlarge = 0;
 	while (retry_count) {
@@ -3493,23 +4103,23 @@ static int mem_cgroup_resize_limit(struct mem_cgroup *memcg,
 		/*
 		 * Rather than hide all in some function, I do this in
 		 * open coded manner. You see what this really does.
-		 * We have to guarantee memcg->res.limit <= memcg->memsw.limit.
+		 * We have to guarantee memcg->memory.limit <= memcg->memsw.limit.
 		 */
 		mutex_lock(&set_limit_mutex);
-		memswlimit = res_counter_read_u64(&memcg->memsw, RES_LIMIT);
-		if (memswlimit < val) {
+		memswlimit = memcg->memsw.limit;
+		if (memswlimit < limit) {
 			ret = -EINVAL;
 			mutex_unlock(&set_limit_mutex);
 			break;
 		}
 
-		memlimit = res_counter_read_u64(&memcg->res, RES_LIMIT);
-		if (memlimit < val)
+		memlimit = memcg->memory.limit;
+		if (memlimit < limit)
 			enlarge = 1;
 
-		ret = res_counter_set_limit(&memcg->res, val);
+		ret = page_counter_limit(&memcg->memory, limit);
 		if (!ret) {
-			if (memswlimit == val)
+			if (memswlimit == limit)
 				memcg->memsw_is_minimum = true;
 			else
 				memcg->memsw_is_minimum = false;
@@ -3521,7 +4131,7 @@ static int mem_cgroup_resize_limit(struct mem_cgroup *memcg,
 
 		mem_cgroup_reclaim(memcg, GFP_KERNEL,
 				   MEM_CGROUP_RECLAIM_SHRINK);
-		curusage = res_counter_read_u64(&memcg->res, RES_USAGE);
+		curusage = page_counter_read(&memcg->memory);
 		/* Usage is reduced ? */
   		if (curusage >= oldusage)
 			retry_count--;
@@ -3535,17 +4145,17 @@ static int mem_cgroup_resize_limit(struct mem_cgroup *memcg,
 }
 
 static int mem_cgroup_resize_memsw_limit(struct mem_cgroup *memcg,
-					unsigned long long val)
+					 unsigned long limit)
 {
 	int retry_count;
-	u64 memlimit, memswlimit, oldusage, curusage;
+	unsigned long memlimit, memswlimit, oldusage, curusage;
 	int children = mem_cgroup_count_children(memcg);
 	int ret = -EBUSY;
 	int enlarge = 0;
 
 	/* see mem_cgroup_resize_res_limit */
  	retry_count = children * MEM_CGROUP_RECLAIM_RETRIES;
-	oldusage = res_counter_read_u64(&memcg->memsw, RES_USAGE);
+	oldusage = page_counter_read(&memcg->memsw);
 	while (retry_count) {
 		if (signal_pending(current)) {
 			ret = -EINTR;
@@ -3554,21 +4164,21 @@ static int mem_cgroup_resize_memsw_limit(struct mem_cgroup *memcg,
 		/*
 		 * Rather than hide all in some function, I do this in
 		 * open coded manner. You see what this really does.
-		 * We have to guarantee memcg->res.limit <= memcg->memsw.limit.
+		 * We have to guarantee memcg->memory.limit <= memcg->memsw.limit.
 		 */
 		mutex_lock(&set_limit_mutex);
-		memlimit = res_counter_read_u64(&memcg->res, RES_LIMIT);
-		if (memlimit > val) {
+		memlimit = memcg->memory.limit;
+		if (memlimit > limit) {
 			ret = -EINVAL;
 			mutex_unlock(&set_limit_mutex);
 			break;
 		}
-		memswlimit = res_counter_read_u64(&memcg->memsw, RES_LIMIT);
-		if (memswlimit < val)
+		memswlimit = memcg->memsw.limit;
+		if (memswlimit < limit)
 			enlarge = 1;
-		ret = res_counter_set_limit(&memcg->memsw, val);
+		ret = page_counter_limit(&memcg->memsw, limit);
 		if (!ret) {
-			if (memlimit == val)
+			if (memlimit == limit)
 				memcg->memsw_is_minimum = true;
 			else
 				memcg->memsw_is_minimum = false;
@@ -3581,7 +4191,7 @@ static int mem_cgroup_resize_memsw_limit(struct mem_cgroup *memcg,
 		mem_cgroup_reclaim(memcg, GFP_KERNEL,
 				   MEM_CGROUP_RECLAIM_NOSWAP |
 				   MEM_CGROUP_RECLAIM_SHRINK);
-		curusage = res_counter_read_u64(&memcg->memsw, RES_USAGE);
+		curusage = page_counter_read(&memcg->memsw);
 		/* Usage is reduced ? */
 		if (curusage >= oldusage)
 			retry_count--;
@@ -3602,7 +4212,7 @@ unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 	unsigned long reclaimed;
 	int loop = 0;
 	struct mem_cgroup_tree_per_zone *mctz;
-	unsigned long long excess;
+	unsigned long excess;
 	unsigned long nr_scanned;
 
 	if (order > 0)
@@ -3656,7 +4266,7 @@ unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 			} while (1);
 		}
 		__mem_cgroup_remove_exceeded(mz->memcg, mz, mctz);
-		excess = res_counter_soft_limit_excess(&mz->memcg->res);
+		excess = soft_limit_excess(mz->memcg);
 		/*
 		 * One school of thought says that we should not add
 		 * back the node to the tree if reclaim returns 0.
@@ -3742,6 +4352,16 @@ static bool mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
  * make mem_cgroup's charge to be 0 if there is no task.
  * This enables deleting this mem_cgroup.
  */
+/*
+ * Charges that force_empty can do something about: slab pages are not on
+ * the LRU and stay charged until they are freed.
+ */
+static unsigned long mem_cgroup_lru_usage(struct mem_cgroup *memcg)
+{
+	return page_counter_read(&memcg->memory) -
+		page_counter_read(&memcg->kmem);
+}
+
 static int mem_cgroup_force_empty(struct mem_cgroup *memcg, bool free_all)
 {
 	int ret;
@@ -3782,7 +4402,7 @@ move_account:
 		memcg_oom_recover(memcg);
 		cond_resched();
 	/* "ret" should also be checked to ensure all lists are empty. */
-	} while (res_counter_read_u64(&memcg->res, RES_USAGE) > 0 || ret);
+	} while (mem_cgroup_lru_usage(memcg) > 0 || ret);
 out:
 	css_put(&memcg->css);
 	return ret;
@@ -3797,7 +4417,7 @@ try_to_free:
 	lru_add_drain_all();
 	/* try to free all pages in this cgroup */
 	shrink = 1;
-	while (nr_retries && res_counter_read_u64(&memcg->res, RES_USAGE) > 0) {
+	while (nr_retries && mem_cgroup_lru_usage(memcg) > 0) {
 		int progress;
 
 		if (signal_pending(current)) {
@@ -3890,9 +4510,10 @@ static inline u64 mem_cgroup_usage(struct mem_cgroup *memcg, bool swap)
 
 	if (!mem_cgroup_is_root(memcg)) {
 		if (!swap)
-			return res_counter_read_u64(&memcg->res, RES_USAGE);
+			val = page_counter_read(&memcg->memory);
 		else
-			return res_counter_read_u64(&memcg->memsw, RES_USAGE);
+			val = page_counter_read(&memcg->memsw);
+		return val << PAGE_SHIFT;
 	}
 
 	val = mem_cgroup_recursive_stat(memcg, MEM_CGROUP_STAT_CACHE);
@@ -3909,6 +4530,7 @@ static ssize_t mem_cgroup_read(struct cgroup *cont, struct cftype *cft,
 			       size_t nbytes, loff_t *ppos)
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
+	struct page_counter *counter;
 	char str[64];
 	u64 val;
 	int type, name, len;
@@ -3921,16 +4543,36 @@ static ssize_t mem_cgroup_read(struct cgroup *cont, struct cftype *cft,
 
 	switch (type) {
 	case _MEM:
-		if (name == RES_USAGE)
-			val = mem_cgroup_usage(memcg, false);
-		else
-			val = res_counter_read_u64(&memcg->res, name);
+		counter = &memcg->memory;
 		break;
 	case _MEMSWAP:
-		if (name == RES_USAGE)
-			val = mem_cgroup_usage(memcg, true);
+		counter = &memcg->memsw;
+		break;
+	case _KMEM:
+		counter = &memcg->kmem;
+		break;
+	default:
+		BUG();
+	}
+
+	switch (name) {
+	case RES_USAGE:
+		if (type == _KMEM)
+			val = (u64)page_counter_read(counter) * PAGE_SIZE;
 		else
-			val = res_counter_read_u64(&memcg->memsw, name);
+			val = mem_cgroup_usage(memcg, type == _MEMSWAP);
+		break;
+	case RES_LIMIT:
+		val = (u64)counter->limit * PAGE_SIZE;
+		break;
+	case RES_MAX_USAGE:
+		val = (u64)counter->watermark * PAGE_SIZE;
+		break;
+	case RES_FAILCNT:
+		val = counter->failcnt;
+		break;
+	case RES_SOFT_LIMIT:
+		val = (u64)memcg->soft_limit * PAGE_SIZE;
 		break;
 	default:
 		BUG();
@@ -3948,7 +4590,7 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
 	int type, name;
-	unsigned long long val;
+	unsigned long nr_pages;
 	int ret;
 
 	type = MEMFILE_TYPE(cft->private);
@@ -3963,17 +4605,20 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 			ret = -EINVAL;
 			break;
 		}
-		/* This function does all necessary parse...reuse it */
-		ret = res_counter_memparse_write_strategy(buffer, &val);
+		ret = page_counter_memparse(buffer, &nr_pages);
 		if (ret)
 			break;
 		if (type == _MEM)
-			ret = mem_cgroup_resize_limit(memcg, val);
+			ret = mem_cgroup_resize_limit(memcg, nr_pages);
+		else if (type == _MEMSWAP)
+			ret = mem_cgroup_resize_memsw_limit(memcg, nr_pages);
+		else if (type == _KMEM)
+			ret = memcg_update_kmem_limit(memcg, nr_pages);
 		else
-			ret = mem_cgroup_resize_memsw_limit(memcg, val);
+			return -EINVAL;
 		break;
 	case RES_SOFT_LIMIT:
-		ret = res_counter_memparse_write_strategy(buffer, &val);
+		ret = page_counter_memparse(buffer, &nr_pages);
 		if (ret)
 			break;
 		/*
@@ -3982,7 +4627,7 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 		 * control without swap
 		 */
 		if (type == _MEM)
-			ret = res_counter_set_soft_limit(&memcg->res, val);
+			memcg->soft_limit = nr_pages;
 		else
 			ret = -EINVAL;
 		break;
@@ -3994,13 +4639,13 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 }
 
 static void memcg_get_hierarchical_limit(struct mem_cgroup *memcg,
-		unsigned long long *mem_limit, unsigned long long *memsw_limit)
+		unsigned long *mem_limit, unsigned long *memsw_limit)
 {
 	struct cgroup *cgroup;
-	unsigned long long min_limit, min_memsw_limit, tmp;
+	unsigned long min_limit, min_memsw_limit;
 
-	min_limit = res_counter_read_u64(&memcg->res, RES_LIMIT);
-	min_memsw_limit = res_counter_read_u64(&memcg->memsw, RES_LIMIT);
+	min_limit = memcg->memory.limit;
+	min_memsw_limit = memcg->memsw.limit;
 	cgroup = memcg->css.cgroup;
 	if (!memcg->use_hierarchy)
 		goto out;
@@ -4010,10 +4655,8 @@ static void memcg_get_hierarchical_limit(struct mem_cgroup *memcg,
 		memcg = mem_cgroup_from_cont(cgroup);
 		if (!memcg->use_hierarchy)
 			break;
-		tmp = res_counter_read_u64(&memcg->res, RES_LIMIT);
-		min_limit = min(min_limit, tmp);
-		tmp = res_counter_read_u64(&memcg->memsw, RES_LIMIT);
-		min_memsw_limit = min(min_memsw_limit, tmp);
+		min_limit = min(min_limit, memcg->memory.limit);
+		min_memsw_limit = min(min_memsw_limit, memcg->memsw.limit);
 	}
 out:
 	*mem_limit = min_limit;
@@ -4023,6 +4666,7 @@ out:
 static int mem_cgroup_reset(struct cgroup *cont, unsigned int event)
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
+	struct page_counter *counter;
 	int type, name;
 
 	type = MEMFILE_TYPE(event);
@@ -4031,18 +4675,26 @@ static int mem_cgroup_reset(struct cgroup *cont, unsigned int event)
 	if (!do_swap_account && type == _MEMSWAP)
 		return -EOPNOTSUPP;
 
+	switch (type) {
+	case _MEM:
+		counter = &memcg->memory;
+		break;
+	case _MEMSWAP:
+		counter = &memcg->memsw;
+		break;
+	case _KMEM:
+		counter = &memcg->kmem;
+		break;
+	default:
+		return -EINVAL;
+	}
+
 	switch (name) {
 	case RES_MAX_USAGE:
-		if (type == _MEM)
-			res_counter_reset_max(&memcg->res);
-		else
-			res_counter_reset_max(&memcg->memsw);
+		page_counter_reset_watermark(counter);
 		break;
 	case RES_FAILCNT:
-		if (type == _MEM)
-			res_counter_reset_failcnt(&memcg->res);
-		else
-			res_counter_reset_failcnt(&memcg->memsw);
+		counter->failcnt = 0;
 		break;
 	}
 
@@ -4166,12 +4818,13 @@ static int memcg_stat_show(struct cgroup *cont, struct cftype *cft,
 
 	/* Hierarchical information */
 	{
-		unsigned long long limit, memsw_limit;
+		unsigned long limit, memsw_limit;
 		memcg_get_hierarchical_limit(memcg, &limit, &memsw_limit);
-		seq_printf(m, "hierarchical_memory_limit %llu\n", limit);
+		seq_printf(m, "hierarchical_memory_limit %llu\n",
+			   (u64)limit * PAGE_SIZE);
 		if (do_swap_account)
 			seq_printf(m, "hierarchical_memsw_limit %llu\n",
-				   memsw_limit);
+				   (u64)memsw_limit * PAGE_SIZE);
 	}
 
 	for (i = 0; i < MEM_CGROUP_STAT_NSTATS; i++) {
@@ -4604,12 +5257,32 @@ static int mem_cgroup_oom_control_write(struct cgroup *cgrp,
 #ifdef CONFIG_MEMCG_KMEM
 static int memcg_init_kmem(struct mem_cgroup *memcg, struct cgroup_subsys *ss)
 {
+	int ret;
+
+	memcg->kmemcg_id = -1;
+	INIT_LIST_HEAD(&memcg->memcg_slab_caches);
+	mutex_init(&memcg->slab_caches_mutex);
+	INIT_WORK(&memcg->kmem_destroy_work, memcg_kmem_destroy_work_func);
+
+	ret = memcg_propagate_kmem(memcg);
+	if (ret)
+		return ret;
+
 	return mem_cgroup_sockets_init(memcg, ss);
 };
 
 static void kmem_cgroup_destroy(struct mem_cgroup *memcg)
 {
 	mem_cgroup_sockets_destroy(memcg);
+
+	/*
+	 * We run under cgroup_mutex, which must not nest outside the slab
+	 * locks: retire the memcg's caches from a worker instead.
+	 */
+	if (memcg_kmem_is_active(memcg)) {
+		mem_cgroup_get(memcg);
+		schedule_work(&memcg->kmem_destroy_work);
+	}
 }
 #else
 static int memcg_init_kmem(struct mem_cgroup *memcg, struct cgroup_subsys *ss)
@@ -4717,6 +5390,31 @@ static struct cftype mem_cgroup_files[] = {
 		.trigger = mem_cgroup_reset,
 		.read = mem_cgroup_read,
 	},
+#endif
+#ifdef CONFIG_MEMCG_KMEM
+	{
+		.name = "kmem.limit_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_LIMIT),
+		.write_string = mem_cgroup_write,
+		.read = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_USAGE),
+		.read = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.failcnt",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_FAILCNT),
+		.trigger = mem_cgroup_reset,
+		.read = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.max_usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_MAX_USAGE),
+		.trigger = mem_cgroup_reset,
+		.read = mem_cgroup_read,
+	},
 #endif
 	{ },	/* terminate */
 };
@@ -4807,6 +5505,7 @@ static void free_work(struct work_struct *work)
 	 * the cgroup_lock.
 	 */
 	disarm_sock_keys(memcg);
+	disarm_kmem_keys(memcg);
 	if (size < PAGE_SIZE)
 		kfree(memcg);
 	else
@@ -4872,9 +5571,9 @@ static void mem_cgroup_put(struct mem_cgroup *memcg)
  */
 struct mem_cgroup *parent_mem_cgroup(struct mem_cgroup *memcg)
 {
-	if (!memcg->res.parent)
+	if (!memcg->memory.parent)
 		return NULL;
-	return mem_cgroup_from_res_counter(memcg->res.parent, res);
+	return mem_cgroup_from_counter(memcg->memory.parent, memory);
 }
 EXPORT_SYMBOL(parent_mem_cgroup);
 
@@ -4961,19 +5660,22 @@ mem_cgroup_create(struct cgroup *cont)
 	}
 
 	if (parent && parent->use_hierarchy) {
-		res_counter_init(&memcg->res, &parent->res);
-		res_counter_init(&memcg->memsw, &parent->memsw);
+		page_counter_init(&memcg->memory, &parent->memory);
+		page_counter_init(&memcg->memsw, &parent->memsw);
+		page_counter_init(&memcg->kmem, &parent->kmem);
 		/*
 		 * We increment refcnt of the parent to ensure that we can
-		 * safely access it on res_counter_charge/uncharge.
+		 * safely access it on page_counter_charge/uncharge.
 		 * This refcnt will be decremented when freeing this
 		 * mem_cgroup(see mem_cgroup_put).
 		 */
 		mem_cgroup_get(parent);
 	} else {
-		res_counter_init(&memcg->res, NULL);
-		res_counter_init(&memcg->memsw, NULL);
+		page_counter_init(&memcg->memory, NULL);
+		page_counter_init(&memcg->memsw, NULL);
+		page_counter_init(&memcg->kmem, NULL);
 	}
+	memcg->soft_limit = PAGE_COUNTER_MAX;
 	memcg->last_scanned_node = MAX_NUMNODES;
 	INIT_LIST_HEAD(&memcg->oom_notify);
 
@@ -5032,18 +5734,18 @@ static int mem_cgroup_do_precharge(unsigned long count)
 	}
 	/* try to charge at once */
 	if (count > 1) {
-		struct res_counter *dummy;
+		struct page_counter *dummy;
 		/*
 		 * "memcg" cannot be under rmdir() because we've already checked
 		 * by cgroup_lock_live_cgroup() that it is not removed and we
 		 * are still under the same cgroup_mutex. So we can postpone
 		 * css_get().
 		 */
-		if (res_counter_charge(&memcg->res, PAGE_SIZE * count, &dummy))
+		if (page_counter_try_charge(&memcg->memory, count, &dummy))
 			goto one_by_one;
-		if (do_swap_account && res_counter_charge(&memcg->memsw,
-						PAGE_SIZE * count, &dummy)) {
-			res_counter_uncharge(&memcg->res, PAGE_SIZE * count);
+		if (do_swap_account &&
+		    page_counter_try_charge(&memcg->memsw, count, &dummy)) {
+			page_counter_uncharge(&memcg->memory, count);
 			goto one_by_one;
 		}
 		mc.precharge += count;
@@ -5203,7 +5905,7 @@ static enum mc_target_type get_mctgt_type(struct vm_area_struct *vma,
 		 * mem_cgroup_move_account() checks the pc is valid or not under
 		 * the lock.
 		 */
-		if (PageCgroupUsed(pc) && pc->mem_cgroup == mc.from) {
+		if (PageCgroupUsed(pc) && page_cgroup_memcg(pc) == mc.from) {
 			ret = MC_TARGET_PAGE;
 			if (target)
 				target->page = page;
@@ -5239,7 +5941,7 @@ static enum mc_target_type get_mctgt_type_thp(struct vm_area_struct *vma,
 	if (!move_anon())
 		return ret;
 	pc = lookup_page_cgroup(page);
-	if (PageCgroupUsed(pc) && pc->mem_cgroup == mc.from) {
+	if (PageCgroupUsed(pc) && page_cgroup_memcg(pc) == mc.from) {
 		ret = MC_TARGET_PAGE;
 		if (target) {
 			get_page(page);
@@ -5340,17 +6042,15 @@ static void __mem_cgroup_clear_mc(void)
 	if (mc.moved_swap) {
 		/* uncharge swap account from the old cgroup */
 		if (!mem_cgroup_is_root(mc.from))
-			res_counter_uncharge(&mc.from->memsw,
-						PAGE_SIZE * mc.moved_swap);
+			page_counter_uncharge(&mc.from->memsw, mc.moved_swap);
 		__mem_cgroup_put(mc.from, mc.moved_swap);
 
 		if (!mem_cgroup_is_root(mc.to)) {
 			/*
-			 * we charged both to->res and to->memsw, so we should
-			 * uncharge to->res.
+			 * we charged both to->memory and to->memsw, so we
+			 * should uncharge to->memory.
 			 */
-			res_counter_uncharge(&mc.to->res,
-						PAGE_SIZE * mc.moved_swap);
+			page_counter_uncharge(&mc.to->memory, mc.moved_swap);
 		}
 		/* we've already done mem_cgroup_get(mc.to) */
 		mc.moved_swap = 0;
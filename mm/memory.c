@@ -1023,6 +1023,8 @@ static inline int copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src
 	src_pud = pud_offset(src_pgd, addr);
 	do {
 		next = pud_addr_end(addr, end);
+		/* 1GB pages are never shared: the 2MB pieces can be */
+		split_huge_pud(vma, src_pud, addr);
 		if (pud_none_or_clear_bad(src_pud))
 			continue;
 		if (copy_pmd_range(dst_mm, src_mm, dst_pud, src_pud,
@@ -1110,6 +1112,7 @@ again:
 	init_rss_vec(rss);
 	start_pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
 	pte = start_pte;
+	flush_tlb_batched_pending(mm);
 	arch_enter_lazy_mmu_mode();
 	do {
 		pte_t ptent = *pte;
@@ -1276,6 +1279,13 @@ static inline unsigned long zap_pud_range(struct mmu_gather *tlb,
 	pud = pud_offset(pgd, addr);
 	do {
 		next = pud_addr_end(addr, end);
+		if (pud_trans_huge(*pud)) {
+			if (next - addr != HPAGE_PUD_SIZE)
+				split_huge_pud(vma, pud, addr);
+			else if (zap_huge_pud(tlb, vma, pud, addr))
+				continue;
+			/* fall through */
+		}
 		if (pud_none_or_clear_bad(pud))
 			continue;
 		next = zap_pmd_range(tlb, vma, pud, addr, next, details);
@@ -1499,6 +1509,16 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 		page = follow_huge_pud(mm, address, pud, flags & FOLL_WRITE);
 		goto out;
 	}
+	if (pud_trans_huge(*pud)) {
+		if (flags & (FOLL_GET | FOLL_SPLIT)) {
+			split_huge_pud(vma, pud, address);
+		} else if (pud_trans_huge_lock(pud, vma) == 1) {
+			page = follow_trans_huge_pud(mm, address, pud, flags);
+			spin_unlock(&mm->page_table_lock);
+			goto out;
+		}
+		/* fall through */
+	}
 	if (unlikely(pud_bad(*pud)))
 		goto no_page_table;
 
@@ -3176,6 +3196,113 @@ oom:
 	return VM_FAULT_OOM;
 }
 
+/**
+ * do_set_pte - setup new PTE entry for given page and add reverse page mapping.
+ * @vma: virtual memory area
+ * @address: user virtual address
+ * @page: page to map
+ * @pte: pointer to target page table entry
+ * @write: true, if new entry is writable
+ * @anon: true, if it's anonymous page
+ *
+ * Caller must hold page table lock relevant for @pte.
+ *
+ * Target users are page handler itself and implementations of
+ * vm_ops->map_pages.
+ */
+void do_set_pte(struct vm_area_struct *vma, unsigned long address,
+		struct page *page, pte_t *pte, bool write, bool anon)
+{
+	pte_t entry;
+
+	flush_icache_page(vma, page);
+	entry = mk_pte(page, vma->vm_page_prot);
+	if (write)
+		entry = maybe_mkwrite(pte_mkdirty(entry), vma);
+	if (anon) {
+		inc_mm_counter_fast(vma->vm_mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, vma, address);
+	} else {
+		inc_mm_counter_fast(vma->vm_mm, MM_FILEPAGES);
+		page_add_file_rmap(page);
+	}
+	set_pte_at(vma->vm_mm, address, pte, entry);
+
+	/* no need to invalidate: a not-present page won't be cached */
+	update_mmu_cache(vma, address, pte);
+}
+
+/*
+ * Read faults on file mappings also map up to this many bytes of
+ * neighbouring pages that are already in the page cache. Always a power
+ * of two number of pages no larger than one page table; PAGE_SIZE turns
+ * fault-around off.
+ */
+unsigned long sysctl_fault_around_bytes __read_mostly = 65536;
+
+int sysctl_fault_around_bytes_handler(struct ctl_table *table, int write,
+		void __user *buffer, size_t *length, loff_t *ppos)
+{
+	unsigned long val = sysctl_fault_around_bytes;
+	struct ctl_table t = *table;
+	int ret;
+
+	t.data = &val;
+	ret = proc_doulongvec_minmax(&t, write, buffer, length, ppos);
+	if (ret || !write)
+		return ret;
+
+	val = clamp_t(unsigned long, val, PAGE_SIZE, PTRS_PER_PTE * PAGE_SIZE);
+	sysctl_fault_around_bytes = rounddown_pow_of_two(val);
+	return 0;
+}
+
+/*
+ * Map the uptodate pagecache pages surrounding a read fault at @address,
+ * within the fault-around window, the vma and the page table @pte lives
+ * in. Called with the page table lock held.
+ */
+static void do_fault_around(struct vm_area_struct *vma, unsigned long address,
+		pte_t *pte, pgoff_t pgoff, unsigned int flags,
+		unsigned long nr_pages)
+{
+	unsigned long start_addr;
+	pgoff_t max_pgoff;
+	struct vm_fault vmf;
+	int off;
+
+	start_addr = max(address & ~(nr_pages * PAGE_SIZE - 1), vma->vm_start);
+	off = ((address - start_addr) >> PAGE_SHIFT) & (PTRS_PER_PTE - 1);
+	pte -= off;
+	pgoff -= off;
+
+	/*
+	 *  max_pgoff is either end of page table or end of vma
+	 *  or nr_pages from pgoff, depending what is nearest.
+	 */
+	max_pgoff = pgoff - ((start_addr >> PAGE_SHIFT) & (PTRS_PER_PTE - 1)) +
+		PTRS_PER_PTE - 1;
+	max_pgoff = min3(max_pgoff, vma_pages(vma) + vma->vm_pgoff - 1,
+			pgoff + nr_pages - 1);
+
+	/* Check if it makes any sense to call ->map_pages */
+	while (!pte_none(*pte)) {
+		if (++pgoff > max_pgoff)
+			return;
+		start_addr += PAGE_SIZE;
+		if (start_addr >= vma->vm_end)
+			return;
+		pte++;
+	}
+
+	vmf.virtual_address = (void __user *) start_addr;
+	vmf.pte = pte;
+	vmf.pgoff = pgoff;
+	vmf.max_pgoff = max_pgoff;
+	vmf.flags = flags;
+	vma->vm_ops->map_pages(vma, &vmf);
+}
+
 /*
  * __do_fault() tries to create a new page mapping. It aggressively
  * tries to share with existing pages, but makes a separate copy if
@@ -3197,12 +3324,30 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	spinlock_t *ptl;
 	struct page *page;
 	struct page *cow_page;
-	pte_t entry;
 	int anon = 0;
 	struct page *dirty_page = NULL;
 	struct vm_fault vmf;
 	int ret;
 	int page_mkwrite = 0;
+	unsigned long fault_around = ACCESS_ONCE(sysctl_fault_around_bytes);
+
+	/*
+	 * A read fault on a linear file mapping first tries to map the
+	 * surrounding pagecache in one go. If that happened to cover the
+	 * faulting address as well, we are done without calling ->fault.
+	 */
+	if (!(flags & (FAULT_FLAG_WRITE | FAULT_FLAG_NONLINEAR)) &&
+	    vma->vm_ops->map_pages && fault_around > PAGE_SIZE) {
+		page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+		if (likely(pte_same(*page_table, orig_pte)))
+			do_fault_around(vma, address, page_table, pgoff, flags,
+					fault_around >> PAGE_SHIFT);
+		if (!pte_same(*page_table, orig_pte)) {
+			pte_unmap_unlock(page_table, ptl);
+			return 0;
+		}
+		pte_unmap_unlock(page_table, ptl);
+	}
 
 	/*
 	 * If we do COW later, allocate page befor taking lock_page()
@@ -3306,25 +3451,12 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	 */
 	/* Only go through if we didn't race with anybody else... */
 	if (likely(pte_same(*page_table, orig_pte))) {
-		flush_icache_page(vma, page);
-		entry = mk_pte(page, vma->vm_page_prot);
-		if (flags & FAULT_FLAG_WRITE)
-			entry = maybe_mkwrite(pte_mkdirty(entry), vma);
-		if (anon) {
-			inc_mm_counter_fast(mm, MM_ANONPAGES);
-			page_add_new_anon_rmap(page, vma, address);
-		} else {
-			inc_mm_counter_fast(mm, MM_FILEPAGES);
-			page_add_file_rmap(page);
-			if (flags & FAULT_FLAG_WRITE) {
-				dirty_page = page;
-				get_page(dirty_page);
-			}
+		if (!anon && (flags & FAULT_FLAG_WRITE)) {
+			dirty_page = page;
+			get_page(dirty_page);
 		}
-		set_pte_at(mm, address, page_table, entry);
-
-		/* no need to invalidate: a not-present page won't be cached */
-		update_mmu_cache(vma, address, page_table);
+		do_set_pte(vma, address, page, page_table,
+			   flags & FAULT_FLAG_WRITE, anon);
 	} else {
 		if (cow_page)
 			mem_cgroup_uncharge_page(cow_page);
@@ -3511,9 +3643,30 @@ retry:
 	pud = pud_alloc(mm, pgd, address);
 	if (!pud)
 		return VM_FAULT_OOM;
+	if (pud_none(*pud) && transparent_hugepage_pud_enabled(vma)) {
+		if (!vma->vm_ops) {
+			int ret = do_huge_pud_anonymous_page(mm, vma, address,
+							     pud, flags);
+			if (!(ret & VM_FAULT_FALLBACK))
+				return ret;
+		}
+	} else {
+		pud_t orig_pud = *pud;
+
+		barrier();
+		if (pud_trans_huge(orig_pud)) {
+			int ret = do_huge_pud_page(mm, vma, address, pud,
+						   orig_pud, flags);
+			if (!(ret & VM_FAULT_FALLBACK))
+				return ret;
+		}
+	}
 	pmd = pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
+	/* if an huge pud materialized from under us just retry later */
+	if (unlikely(pud_trans_huge(*pud)))
+		return 0;
 	if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
 		if (!vma->vm_ops)
 			return do_huge_pmd_anonymous_page(mm, vma, address,
@@ -3563,6 +3716,183 @@ retry:
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * The vma rbtree can be rebalanced under a lockless walker, which may
+ * then wander off course; bound the walk well above any real depth.
+ */
+#define SPF_MAX_RB_DEPTH	64
+
+static struct vm_area_struct *spf_find_vma(struct mm_struct *mm,
+					   unsigned long address)
+{
+	struct rb_node *rb_node = ACCESS_ONCE(mm->mm_rb.rb_node);
+	int depth = 0;
+
+	while (rb_node && depth++ < SPF_MAX_RB_DEPTH) {
+		struct vm_area_struct *vma;
+
+		vma = rb_entry(rb_node, struct vm_area_struct, vm_rb);
+		if (address < ACCESS_ONCE(vma->vm_start))
+			rb_node = ACCESS_ONCE(rb_node->rb_left);
+		else if (address >= ACCESS_ONCE(vma->vm_end))
+			rb_node = ACCESS_ONCE(rb_node->rb_right);
+		else
+			return vma;
+	}
+	return NULL;
+}
+
+/*
+ * Only private anonymous memory that needs neither mmap_sem nor a
+ * sleeping lock to fault in is handled speculatively. Anything else,
+ * including all the error cases, is left to the regular path.
+ */
+static bool spf_vma_suitable(struct vm_area_struct *vma,
+			     unsigned long address, unsigned int flags)
+{
+	unsigned long vm_flags = ACCESS_ONCE(vma->vm_flags);
+
+	if (address < vma->vm_start || address >= vma->vm_end)
+		return false;
+	if (vma->vm_ops || (vm_flags & (VM_SHARED | VM_LOCKED | VM_HUGETLB |
+					VM_GROWSDOWN | VM_GROWSUP)))
+		return false;
+	if (flags & FAULT_FLAG_WRITE) {
+		if (!(vm_flags & VM_WRITE) || !ACCESS_ONCE(vma->anon_vma))
+			return false;
+#ifdef CONFIG_NUMA
+		/* The page is allocated before the vma is pinned down */
+		if (vma->vm_policy)
+			return false;
+#endif
+	} else if (!(vm_flags & (VM_READ | VM_EXEC | VM_WRITE)))
+		return false;
+	return true;
+}
+
+/*
+ * Handle a not-present fault on anonymous memory without mmap_sem.
+ *
+ * The vma is found under RCU (vmas are freed after a grace period) and
+ * revalidated through vma->vm_sequence once the pte lock is held. The
+ * page tables are walked with interrupts disabled, which, as for
+ * get_user_pages_fast(), holds off the TLB shootdown that must precede
+ * freeing them. Because of that the pte lock may only be trylocked: its
+ * holder may be waiting for us to take a flush IPI.
+ *
+ * Returns 0 if the fault was handled, VM_FAULT_RETRY if the caller has
+ * to take mmap_sem and go through handle_mm_fault().
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+			     unsigned int flags)
+{
+	struct vm_area_struct *vma;
+	struct page *page = NULL;
+	unsigned int seq;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd, pmdval;
+	pte_t *pte, entry;
+	spinlock_t *ptl;
+	unsigned long irqflags;
+
+	rcu_read_lock();
+	vma = spf_find_vma(mm, address);
+	if (!vma || !spf_vma_suitable(vma, address, flags)) {
+		rcu_read_unlock();
+		return VM_FAULT_RETRY;
+	}
+	rcu_read_unlock();
+
+	if (flags & FAULT_FLAG_WRITE) {
+		/*
+		 * Allocate before disabling interrupts. Only x86 selects
+		 * this, so a __GFP_ZERO page is as good as clear_user_highpage.
+		 */
+		page = alloc_page(GFP_HIGHUSER_MOVABLE | __GFP_ZERO);
+		if (!page)
+			goto abort;
+		__SetPageUptodate(page);
+		if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL)) {
+			page_cache_release(page);
+			page = NULL;
+			goto abort;
+		}
+	}
+
+	local_irq_save(irqflags);
+	rcu_read_lock();
+
+	/* The vma may have been replaced while we slept in the allocator */
+	vma = spf_find_vma(mm, address);
+	if (!vma)
+		goto out_unlock;
+	seq = raw_seqcount_begin(&vma->vm_sequence);
+	if (RB_EMPTY_NODE(&vma->vm_rb) ||
+	    !spf_vma_suitable(vma, address, flags))
+		goto out_unlock;
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		goto out_unlock;
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		goto out_unlock;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	/* Populating page tables or huge pmds is left to the slow path */
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) ||
+	    unlikely(pmd_bad(pmdval)))
+		goto out_unlock;
+
+	ptl = pte_lockptr(mm, &pmdval);
+	pte = pte_offset_map(&pmdval, address);
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		goto out_unlock;
+	}
+	if (!pte_none(*pte) || read_seqcount_retry(&vma->vm_sequence, seq))
+		goto out_pte_unlock;
+
+	if (page) {
+		entry = mk_pte(page, vma->vm_page_prot);
+		entry = pte_mkwrite(pte_mkdirty(entry));
+		inc_mm_counter_fast(mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, vma, address);
+	} else
+		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
+					      vma->vm_page_prot));
+	set_pte_at(mm, address, pte, entry);
+
+	/* No need to invalidate - it was non-present before */
+	update_mmu_cache(vma, address, pte);
+	pte_unmap_unlock(pte, ptl);
+	rcu_read_unlock();
+	local_irq_restore(irqflags);
+
+	count_vm_event(PGFAULT);
+	count_vm_event(SPECULATIVE_PGFAULT);
+	mem_cgroup_count_vm_event(mm, PGFAULT);
+	check_sync_rss_stat(current);
+	return 0;
+
+out_pte_unlock:
+	pte_unmap_unlock(pte, ptl);
+out_unlock:
+	rcu_read_unlock();
+	local_irq_restore(irqflags);
+	if (page) {
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+	}
+abort:
+	count_vm_event(SPECULATIVE_PGFAULT_ABORT);
+	return VM_FAULT_RETRY;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
@@ -108,7 +108,7 @@ static int remove_migration_pte(struct page *new, struct vm_area_struct *vma,
 			goto out;
 
 		pud = pud_offset(pgd, addr);
-		if (!pud_present(*pud))
+		if (!pud_present(*pud) || pud_trans_huge(*pud))
 			goto out;
 
 		pmd = pmd_offset(pud, addr);
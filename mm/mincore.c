@@ -182,7 +182,10 @@ static void mincore_pud_range(struct vm_area_struct *vma, pgd_t *pgd,
 	pud = pud_offset(pgd, addr);
 	do {
 		next = pud_addr_end(addr, end);
-		if (pud_none_or_clear_bad(pud))
+		if (pud_trans_huge_lock(pud, vma) == 1) {
+			spin_unlock(&vma->vm_mm->page_table_lock);
+			memset(vec, 1, (next - addr) >> PAGE_SHIFT);
+		} else if (pud_none_or_clear_bad(pud))
 			mincore_unmapped_range(vma, addr, next, vec);
 		else
 			mincore_pmd_range(vma, pud, addr, next, vec);
@@ -626,7 +626,7 @@ static inline int free_pages_check(struct page *page)
 /*
  * Frees a number of pages from the PCP lists
  * Assumes all pages on list are in same zone, and of same order.
- * count is the number of pages to free.
+ * count is the number of blocks of that order to free.
  *
  * If the zone was previously in an "all pages pinned" state then look to
  * see if this freeing clears that state.
@@ -635,7 +635,7 @@ static inline int free_pages_check(struct page *page)
  * pinned" detection logic.
  */
 static void free_pcppages_bulk(struct zone *zone, int count,
-					struct per_cpu_pages *pcp)
+				struct per_cpu_pages *pcp, unsigned int order)
 {
 	int migratetype = 0;
 	int batch_free = 0;
@@ -672,11 +672,11 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 			/* must delete as __free_one_page list manipulates */
 			list_del(&page->lru);
 			/* MIGRATE_MOVABLE list may include MIGRATE_RESERVEs */
-			__free_one_page(page, zone, 0, page_private(page));
-			trace_mm_page_pcpu_drain(page, 0, page_private(page));
+			__free_one_page(page, zone, order, page_private(page));
+			trace_mm_page_pcpu_drain(page, order, page_private(page));
 		} while (--to_free && --batch_free && !list_empty(list));
 	}
-	__mod_zone_page_state(zone, NR_FREE_PAGES, count);
+	__mod_zone_page_state(zone, NR_FREE_PAGES, count << order);
 	spin_unlock(&zone->lock);
 }
 
@@ -718,6 +718,8 @@ static bool free_pages_prepare(struct page *page, unsigned int order)
 	return true;
 }
 
+static void free_pcp_page(struct page *page, unsigned int order, int cold);
+
 static void __free_pages_ok(struct page *page, unsigned int order)
 {
 	unsigned long flags;
@@ -726,6 +728,23 @@ static void __free_pages_ok(struct page *page, unsigned int order)
 	if (!free_pages_prepare(page, order))
 		return;
 
+	/*
+	 * Small orders go to the per-cpu lists, which hand them out again
+	 * without the compound metadata: tear it down here rather than when
+	 * the page finally reaches the buddy lists.
+	 */
+	if (order <= PCP_HIGH_ORDER) {
+		if (PageCompound(page) && destroy_compound_page(page, order))
+			return;
+		set_page_private(page, get_pageblock_migratetype(page));
+		local_irq_save(flags);
+		if (unlikely(wasMlocked))
+			free_page_mlock(page);
+		free_pcp_page(page, order, 0);
+		local_irq_restore(flags);
+		return;
+	}
+
 	local_irq_save(flags);
 	if (unlikely(wasMlocked))
 		free_page_mlock(page);
@@ -1100,6 +1119,32 @@ retry_reserve:
 	return page;
 }
 
+#ifdef CONFIG_PAGE_PREZERO
+/*
+ * Take a page off the zone's pool of pre-zeroed pages, which stays
+ * accounted in NR_FREE_PAGES until the caller takes it out.  Called with
+ * zone->lock held.
+ */
+static struct page *__rmqueue_zeroed(struct zone *zone, unsigned int order)
+{
+	struct page *page;
+
+	if (order || list_empty(&zone->zeroed_pages))
+		return NULL;
+
+	page = list_first_entry(&zone->zeroed_pages, struct page, lru);
+	list_del(&page->lru);
+	__mod_zone_page_state(zone, NR_ZEROED_PAGES, -1);
+	return page;
+}
+#else
+static inline struct page *__rmqueue_zeroed(struct zone *zone,
+					    unsigned int order)
+{
+	return NULL;
+}
+#endif
+
 /*
  * Obtain a specified number of elements from the buddy allocator, all under
  * a single hold of the lock, for efficiency.  Add them to the supplied list.
@@ -1114,6 +1159,10 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
 	spin_lock(&zone->lock);
 	for (i = 0; i < count; ++i) {
 		struct page *page = __rmqueue(zone, order, migratetype);
+
+		/* Pre-zeroed pages are as good as any before giving up */
+		if (unlikely(page == NULL))
+			page = __rmqueue_zeroed(zone, order);
 		if (unlikely(page == NULL))
 			break;
 
@@ -1143,6 +1192,154 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
 	return i;
 }
 
+#ifdef CONFIG_PAGE_PREZERO
+/*
+ * Take @count order-0 pages off the zone's movable free lists, clear them
+ * and add them to the pool of pre-zeroed pages. Called by kzerod; returns
+ * the number of pages it managed to take.
+ */
+int prezero_zone_pages(struct zone *zone, int count)
+{
+	struct page *page, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+	int i;
+
+	spin_lock_irqsave(&zone->lock, flags);
+	for (i = 0; i < count; i++) {
+		page = __rmqueue_smallest(zone, 0, MIGRATE_MOVABLE);
+		if (!page)
+			break;
+		list_add(&page->lru, &list);
+	}
+	__mod_zone_page_state(zone, NR_FREE_PAGES, -i);
+	spin_unlock_irqrestore(&zone->lock, flags);
+
+	list_for_each_entry(page, &list, lru) {
+		kernel_map_pages(page, 1, 1);
+		clear_highpage_nocache(page);
+		kernel_map_pages(page, 1, 0);
+	}
+	count_vm_events(PREZERO_PAGES_ZEROED, i);
+
+	spin_lock_irqsave(&zone->lock, flags);
+	list_for_each_entry_safe(page, next, &list, lru) {
+		int migratetype = get_pageblock_migratetype(page);
+
+		/* The pageblock was isolated or stolen while we cleared it */
+		if (unlikely(migratetype != MIGRATE_MOVABLE)) {
+			list_del(&page->lru);
+			__free_one_page(page, zone, 0, migratetype);
+			continue;
+		}
+		__mod_zone_page_state(zone, NR_ZEROED_PAGES, 1);
+	}
+	list_splice(&list, &zone->zeroed_pages);
+	__mod_zone_page_state(zone, NR_FREE_PAGES, i);
+	spin_unlock_irqrestore(&zone->lock, flags);
+
+	return i;
+}
+
+/*
+ * Give the pre-zeroed pages of @zone back to the buddy allocator, where
+ * they can merge again.
+ */
+void drain_zeroed_pages(struct zone *zone)
+{
+	struct page *page, *next;
+	unsigned long flags;
+	int count = 0;
+
+	if (list_empty(&zone->zeroed_pages))
+		return;
+
+	spin_lock_irqsave(&zone->lock, flags);
+	list_for_each_entry_safe(page, next, &zone->zeroed_pages, lru) {
+		list_del(&page->lru);
+		__free_one_page(page, zone, 0,
+				get_pageblock_migratetype(page));
+		count++;
+	}
+	__mod_zone_page_state(zone, NR_ZEROED_PAGES, -count);
+	spin_unlock_irqrestore(&zone->lock, flags);
+}
+
+/*
+ * Serve a movable order-0 __GFP_ZERO allocation from the pages kzerod has
+ * already cleared.  They are moved from the zone's pool to a per-cpu list
+ * pcp->batch at a time, so that zone->lock is not taken on every fault.
+ * Called with interrupts disabled.
+ */
+static struct page *rmqueue_zeroed(struct zone *zone, int order,
+				   gfp_t gfp_flags, int migratetype)
+{
+	struct per_cpu_pageset *pset;
+	struct page *page = NULL;
+
+	if (order || !(gfp_flags & __GFP_ZERO) ||
+	    migratetype != MIGRATE_MOVABLE)
+		return NULL;
+
+	pset = this_cpu_ptr(zone->pageset);
+	if (!pset->nr_zeroed) {
+		int i = 0;
+
+		if (!list_empty(&zone->zeroed_pages)) {
+			spin_lock(&zone->lock);
+			for (; i < pset->pcp.batch; i++) {
+				page = __rmqueue_zeroed(zone, 0);
+				if (!page)
+					break;
+				list_add_tail(&page->lru, &pset->zeroed);
+			}
+			__mod_zone_page_state(zone, NR_FREE_PAGES, -i);
+			spin_unlock(&zone->lock);
+			pset->nr_zeroed = i;
+		}
+		wakeup_kzerod(zone);
+		if (!i) {
+			__count_vm_event(PREZERO_ALLOC_MISS);
+			return NULL;
+		}
+	}
+
+	page = list_first_entry(&pset->zeroed, struct page, lru);
+	list_del(&page->lru);
+	pset->nr_zeroed--;
+	__count_vm_event(PREZERO_ALLOC_HIT);
+	return page;
+}
+
+/*
+ * Put the pre-zeroed pages cached by @pset back into the zone's pool.
+ * Called with interrupts disabled.
+ */
+static void free_pcp_zeroed(struct zone *zone, struct per_cpu_pageset *pset)
+{
+	if (!pset->nr_zeroed)
+		return;
+
+	spin_lock(&zone->lock);
+	list_splice_init(&pset->zeroed, &zone->zeroed_pages);
+	__mod_zone_page_state(zone, NR_ZEROED_PAGES, pset->nr_zeroed);
+	__mod_zone_page_state(zone, NR_FREE_PAGES, pset->nr_zeroed);
+	spin_unlock(&zone->lock);
+	pset->nr_zeroed = 0;
+}
+#else
+static inline struct page *rmqueue_zeroed(struct zone *zone, int order,
+					  gfp_t gfp_flags, int migratetype)
+{
+	return NULL;
+}
+
+static inline void free_pcp_zeroed(struct zone *zone,
+				   struct per_cpu_pageset *pset)
+{
+}
+#endif /* CONFIG_PAGE_PREZERO */
+
 #ifdef CONFIG_NUMA
 /*
  * Called from the vmstat counter updater to drain pagesets of this
@@ -1152,20 +1349,26 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
  * Note that this function must be called with the thread pinned to
  * a single processor.
  */
-void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp)
+void drain_zone_pages(struct zone *zone, struct per_cpu_pageset *pset)
 {
 	unsigned long flags;
+	unsigned int order;
 	int to_drain;
 
 	local_irq_save(flags);
-	if (pcp->count >= pcp->batch)
-		to_drain = pcp->batch;
-	else
-		to_drain = pcp->count;
-	if (to_drain > 0) {
-		free_pcppages_bulk(zone, to_drain, pcp);
-		pcp->count -= to_drain;
+	for (order = 0; order <= PCP_HIGH_ORDER; order++) {
+		struct per_cpu_pages *pcp = pageset_pcp(pset, order);
+
+		if (pcp->count >= pcp->batch)
+			to_drain = pcp->batch;
+		else
+			to_drain = pcp->count;
+		if (to_drain > 0) {
+			free_pcppages_bulk(zone, to_drain, pcp, order);
+			pcp->count -= to_drain;
+		}
 	}
+	free_pcp_zeroed(zone, pset);
 	local_irq_restore(flags);
 }
 #endif
@@ -1184,16 +1387,21 @@ static void drain_pages(unsigned int cpu)
 
 	for_each_populated_zone(zone) {
 		struct per_cpu_pageset *pset;
-		struct per_cpu_pages *pcp;
+		unsigned int order;
 
 		local_irq_save(flags);
 		pset = per_cpu_ptr(zone->pageset, cpu);
 
-		pcp = &pset->pcp;
-		if (pcp->count) {
-			free_pcppages_bulk(zone, pcp->count, pcp);
-			pcp->count = 0;
+		for (order = 0; order <= PCP_HIGH_ORDER; order++) {
+			struct per_cpu_pages *pcp = pageset_pcp(pset, order);
+
+			if (pcp->count) {
+				free_pcppages_bulk(zone, pcp->count, pcp,
+						   order);
+				pcp->count = 0;
+			}
 		}
+		free_pcp_zeroed(zone, pset);
 		local_irq_restore(flags);
 	}
 }
@@ -1237,7 +1445,7 @@ void drain_all_pages(void)
 		bool has_pcps = false;
 		for_each_populated_zone(zone) {
 			pcp = per_cpu_ptr(zone->pageset, cpu);
-			if (pcp->pcp.count) {
+			if (!pageset_empty(pcp)) {
 				has_pcps = true;
 				break;
 			}
@@ -1248,6 +1456,10 @@ void drain_all_pages(void)
 			cpumask_clear_cpu(cpu, &cpus_with_pcps);
 	}
 	on_each_cpu_mask(&cpus_with_pcps, drain_local_pages, NULL, 1);
+
+	/* The per-cpu pre-zeroed pages are back in the pools by now */
+	for_each_populated_zone(zone)
+		drain_zeroed_pages(zone);
 }
 
 #ifdef CONFIG_HIBERNATION
@@ -1287,26 +1499,17 @@ void mark_free_pages(struct zone *zone)
 #endif /* CONFIG_PM */
 
 /*
- * Free a 0-order page
- * cold == 1 ? free a cold page : free a hot page
+ * Put a page of at most PCP_HIGH_ORDER that went through free_pages_prepare(),
+ * and whose page_private holds its pageblock's migratetype, on the per-cpu
+ * lists. Must be called with interrupts disabled.
  */
-void free_hot_cold_page(struct page *page, int cold)
+static void free_pcp_page(struct page *page, unsigned int order, int cold)
 {
 	struct zone *zone = page_zone(page);
 	struct per_cpu_pages *pcp;
-	unsigned long flags;
-	int migratetype;
-	int wasMlocked = __TestClearPageMlocked(page);
+	int migratetype = page_private(page);
 
-	if (!free_pages_prepare(page, 0))
-		return;
-
-	migratetype = get_pageblock_migratetype(page);
-	set_page_private(page, migratetype);
-	local_irq_save(flags);
-	if (unlikely(wasMlocked))
-		free_page_mlock(page);
-	__count_vm_event(PGFREE);
+	__count_vm_events(PGFREE, 1 << order);
 
 	/*
 	 * We only track unmovable, reclaimable and movable on pcp lists.
@@ -1317,39 +1520,101 @@ void free_hot_cold_page(struct page *page, int cold)
 	 */
 	if (migratetype >= MIGRATE_PCPTYPES) {
 		if (unlikely(migratetype == MIGRATE_ISOLATE)) {
-			free_one_page(zone, page, 0, migratetype);
-			goto out;
+			free_one_page(zone, page, order, migratetype);
+			return;
 		}
 		migratetype = MIGRATE_MOVABLE;
 	}
 
-	pcp = &this_cpu_ptr(zone->pageset)->pcp;
+	pcp = pageset_pcp(this_cpu_ptr(zone->pageset), order);
 	if (cold)
 		list_add_tail(&page->lru, &pcp->lists[migratetype]);
 	else
 		list_add(&page->lru, &pcp->lists[migratetype]);
 	pcp->count++;
 	if (pcp->count >= pcp->high) {
-		free_pcppages_bulk(zone, pcp->batch, pcp);
+		free_pcppages_bulk(zone, pcp->batch, pcp, order);
 		pcp->count -= pcp->batch;
 	}
+}
 
-out:
+/*
+ * Free a 0-order page
+ * cold == 1 ? free a cold page : free a hot page
+ */
+void free_hot_cold_page(struct page *page, int cold)
+{
+	unsigned long flags;
+	int wasMlocked = __TestClearPageMlocked(page);
+
+	if (!free_pages_prepare(page, 0))
+		return;
+
+	set_page_private(page, get_pageblock_migratetype(page));
+	local_irq_save(flags);
+	if (unlikely(wasMlocked))
+		free_page_mlock(page);
+	free_pcp_page(page, 0, cold);
 	local_irq_restore(flags);
 }
 
 /*
  * Free a list of 0-order pages
+ *
+ * The pages are prepared one by one, then handed to the per-cpu lists
+ * with interrupts disabled once for the whole list.
  */
 void free_hot_cold_page_list(struct list_head *list, int cold)
 {
 	struct page *page, *next;
+	unsigned long flags;
 
 	list_for_each_entry_safe(page, next, list, lru) {
+		int wasMlocked = __TestClearPageMlocked(page);
+
 		trace_mm_page_free_batched(page, cold);
-		free_hot_cold_page(page, cold);
+		if (!free_pages_prepare(page, 0)) {
+			list_del(&page->lru);
+			continue;
+		}
+		if (unlikely(wasMlocked)) {
+			local_irq_save(flags);
+			free_page_mlock(page);
+			local_irq_restore(flags);
+		}
+		set_page_private(page, get_pageblock_migratetype(page));
+	}
+
+	local_irq_save(flags);
+	list_for_each_entry_safe(page, next, list, lru)
+		free_pcp_page(page, 0, cold);
+	local_irq_restore(flags);
+}
+
+/**
+ * free_pages_bulk - drop a reference to each page of an array
+ * @nr_pages: number of entries in @page_array
+ * @page_array: 0-order pages, NULL entries are skipped
+ *
+ * The counterpart of alloc_pages_bulk_array(): the pages whose last
+ * reference goes away are freed as a batch by free_hot_cold_page_list().
+ */
+void free_pages_bulk(unsigned long nr_pages, struct page **page_array)
+{
+	LIST_HEAD(pages);
+	unsigned long i;
+
+	for (i = 0; i < nr_pages; i++) {
+		struct page *page = page_array[i];
+
+		if (!page || !put_page_testzero(page))
+			continue;
+		VM_BUG_ON(PageCompound(page));
+		list_add(&page->lru, &pages);
 	}
+	free_hot_cold_page_list(&pages, 0);
 }
+EXPORT_SYMBOL(free_pages_bulk);
 
 /*
  * split_page takes a non-compound higher-order page, and splits it into
@@ -1441,17 +1706,40 @@ struct page *buffered_rmqueue(struct zone *preferred_zone,
 	unsigned long flags;
 	struct page *page;
 	int cold = !!(gfp_flags & __GFP_COLD);
+	gfp_t prep_flags;
+
+	if (unlikely(gfp_flags & __GFP_NOFAIL)) {
+		/*
+		 * __GFP_NOFAIL is not to be used in new code.
+		 *
+		 * All __GFP_NOFAIL callers should be fixed so that they
+		 * properly detect and handle allocation failures.
+		 *
+		 * We most definitely don't want callers attempting to
+		 * allocate greater than order-1 page units with
+		 * __GFP_NOFAIL.
+		 */
+		WARN_ON_ONCE(order > 1);
+	}
 
 again:
-	if (likely(order == 0)) {
+	prep_flags = gfp_flags;
+	if (likely(order <= PCP_HIGH_ORDER)) {
 		struct per_cpu_pages *pcp;
 		struct list_head *list;
 
 		local_irq_save(flags);
-		pcp = &this_cpu_ptr(zone->pageset)->pcp;
+		page = rmqueue_zeroed(zone, order, gfp_flags, migratetype);
+		if (page) {
+			/* Already cleared by kzerod */
+			prep_flags &= ~__GFP_ZERO;
+			goto allocated;
+		}
+
+		pcp = pageset_pcp(this_cpu_ptr(zone->pageset), order);
 		list = &pcp->lists[migratetype];
 		if (list_empty(list)) {
-			pcp->count += rmqueue_bulk(zone, 0,
+			pcp->count += rmqueue_bulk(zone, order,
 					pcp->batch, list,
 					migratetype, cold);
 			if (unlikely(list_empty(list)))
@@ -1466,19 +1754,6 @@ again:
 		list_del(&page->lru);
 		pcp->count--;
 	} else {
-		if (unlikely(gfp_flags & __GFP_NOFAIL)) {
-			/*
-			 * __GFP_NOFAIL is not to be used in new code.
-			 *
-			 * All __GFP_NOFAIL callers should be fixed so that they
-			 * properly detect and handle allocation failures.
-			 *
-			 * We most definitely don't want callers attempting to
-			 * allocate greater than order-1 page units with
-			 * __GFP_NOFAIL.
-			 */
-			WARN_ON_ONCE(order > 1);
-		}
 		spin_lock_irqsave(&zone->lock, flags);
 		page = __rmqueue(zone, order, migratetype);
 		spin_unlock(&zone->lock);
@@ -1487,12 +1762,13 @@ again:
 		__mod_zone_page_state(zone, NR_FREE_PAGES, -(1 << order));
 	}
 
+allocated:
 	__count_zone_vm_events(PGALLOC, zone, 1 << order);
 	zone_statistics(preferred_zone, zone, gfp_flags);
 	local_irq_restore(flags);
 
 	VM_BUG_ON(bad_range(zone, page));
-	if (prep_new_page(page, order, gfp_flags))
+	if (prep_new_page(page, order, prep_flags))
 		goto again;
 	return page;
 
@@ -1609,6 +1885,12 @@ static bool __zone_watermark_ok(struct zone *z, int order, unsigned long mark,
 	if (alloc_flags & ALLOC_HARDER)
 		min -= min / 4;
 
+	/*
+	 * Pre-zeroed pages are off the buddy lists and never merge: only
+	 * order-0 allocations can have them.
+	 */
+	if (order)
+		free_pages -= zone_page_state(z, NR_ZEROED_PAGES);
 	if (free_pages <= min + lowmem_reserve)
 		return false;
 	for (o = 0; o < order; o++) {
@@ -2594,6 +2876,172 @@ out:
 }
 EXPORT_SYMBOL(__alloc_pages_nodemask);
 
+/**
+ * __alloc_pages_bulk - allocate a number of 0-order pages at once
+ * @gfp_mask: GFP flags for the allocation
+ * @zonelist: zonelist to allocate from
+ * @nodemask: set of nodes to allocate from, may be NULL
+ * @nr_pages: number of pages wanted on the list or in the array
+ * @page_list: list to add the pages to, or NULL
+ * @page_array: array to store the pages in, used if @page_list is NULL
+ *
+ * The pages are taken from the per-cpu list of the first suitable zone,
+ * which is refilled from the buddy lists with a single hold of
+ * zone->lock when it runs dry, so interrupts are disabled only once for
+ * the whole batch.  When no zone has enough free pages above its low
+ * watermark for the batch, a single page is allocated through the
+ * regular allocator, reclaim included, and the caller can retry with
+ * what is still missing.
+ *
+ * For lists, @nr_pages pages are added.  For arrays, only the NULL
+ * entries among the first @nr_pages are filled.
+ *
+ * Returns the number of pages added to the list, or the number of
+ * leading populated entries in the array.
+ */
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, struct zonelist *zonelist,
+			nodemask_t *nodemask, unsigned long nr_pages,
+			struct list_head *page_list, struct page **page_array)
+{
+	enum zone_type high_zoneidx = gfp_zone(gfp_mask);
+	int migratetype = allocflags_to_migratetype(gfp_mask);
+	int cold = !!(gfp_mask & __GFP_COLD);
+	unsigned long nr_populated = 0, nr_wanted, nr_taken = 0;
+	unsigned int cpuset_mems_cookie;
+	struct zone *preferred_zone, *zone;
+	struct per_cpu_pages *pcp;
+	struct list_head *list;
+	struct page *page, *next;
+	struct zoneref *z;
+	unsigned long flags;
+	LIST_HEAD(taken);
+
+	/* Skip the leading populated array entries */
+	while (page_array && nr_populated < nr_pages &&
+	       page_array[nr_populated])
+		nr_populated++;
+
+	if (page_list) {
+		nr_wanted = nr_pages;
+	} else {
+		unsigned long i;
+
+		for (i = nr_populated, nr_wanted = 0; i < nr_pages; i++)
+			if (!page_array[i])
+				nr_wanted++;
+	}
+
+	if (!nr_wanted)
+		return nr_populated;
+	/* No point in batching a single page */
+	if (nr_wanted == 1)
+		goto failed;
+
+	gfp_mask &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(gfp_mask);
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	/* Debugging and fault injection work on single pages */
+	if (kmemcheck_enabled || should_fail_alloc_page(gfp_mask, 0))
+		goto failed;
+
+	if (unlikely(!zonelist->_zonerefs->zone))
+		return nr_populated;
+
+	cpuset_mems_cookie = get_mems_allowed();
+
+	/* The preferred zone is used for statistics */
+	first_zones_zonelist(zonelist, high_zoneidx,
+				nodemask ? : &cpuset_current_mems_allowed,
+				&preferred_zone);
+	if (!preferred_zone)
+		goto failed_cpuset;
+
+	/* Find a zone that can take the whole batch without reclaim */
+	for_each_zone_zonelist_nodemask(zone, z, zonelist, high_zoneidx,
+					nodemask) {
+		if (!cpuset_zone_allowed_softwall(zone,
+						  gfp_mask | __GFP_HARDWALL))
+			continue;
+		if (zone_watermark_ok(zone, 0, low_wmark_pages(zone) + nr_wanted,
+				      zone_idx(preferred_zone), 0))
+			break;
+	}
+	if (!zone)
+		goto failed_cpuset;
+
+	local_irq_save(flags);
+	pcp = &this_cpu_ptr(zone->pageset)->pcp;
+	list = &pcp->lists[migratetype];
+	while (nr_taken < nr_wanted) {
+		if (list_empty(list)) {
+			pcp->count += rmqueue_bulk(zone, 0,
+					max_t(unsigned long, pcp->batch,
+					      nr_wanted - nr_taken),
+					list, migratetype, cold);
+			if (unlikely(list_empty(list)))
+				break;
+		}
+
+		if (cold)
+			page = list_entry(list->prev, struct page, lru);
+		else
+			page = list_entry(list->next, struct page, lru);
+
+		list_move_tail(&page->lru, &taken);
+		pcp->count--;
+		nr_taken++;
+		zone_statistics(preferred_zone, zone, gfp_mask);
+	}
+	__count_zone_vm_events(PGALLOC, zone, nr_taken);
+	local_irq_restore(flags);
+
+	put_mems_allowed(cpuset_mems_cookie);
+
+	if (!nr_taken)
+		goto failed;
+
+	list_for_each_entry_safe(page, next, &taken, lru) {
+		list_del(&page->lru);
+		VM_BUG_ON(bad_range(zone, page));
+		/* A bad page is left alone, as buffered_rmqueue() does */
+		if (prep_new_page(page, 0, gfp_mask))
+			continue;
+
+		trace_mm_page_alloc(page, 0, gfp_mask, migratetype);
+		if (page_list) {
+			list_add_tail(&page->lru, page_list);
+		} else {
+			while (page_array[nr_populated])
+				nr_populated++;
+			page_array[nr_populated] = page;
+		}
+		nr_populated++;
+	}
+	goto out;
+
+failed_cpuset:
+	put_mems_allowed(cpuset_mems_cookie);
+failed:
+	page = __alloc_pages_nodemask(gfp_mask, 0, zonelist, nodemask);
+	if (page) {
+		if (page_list)
+			list_add(&page->lru, page_list);
+		else
+			page_array[nr_populated] = page;
+		nr_populated++;
+	}
+out:
+	while (!page_list && nr_populated < nr_pages &&
+	       page_array[nr_populated])
+		nr_populated++;
+
+	return nr_populated;
+}
+EXPORT_SYMBOL(__alloc_pages_bulk);
+
 /*
  * Common helper functions.
  */
@@ -3772,6 +4220,7 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		mminit_verify_page_links(page, zone, nid, pfn);
 		init_page_count(page);
 		reset_page_mapcount(page);
+		page_cgroup_init_page(page);
 		SetPageReserved(page);
 		/*
 		 * Mark the block movable so that blocks are reserved for
@@ -3865,19 +4314,31 @@ static int __meminit zone_batchsize(struct zone *zone)
 #endif
 }
 
+/*
+ * The higher order lists get the same high and batch as the 0-order one,
+ * scaled down by the size of their blocks, so that each order caches and
+ * moves about the same amount of memory.
+ */
 static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 {
 	struct per_cpu_pages *pcp;
+	unsigned int order;
 	int migratetype;
 
 	memset(p, 0, sizeof(*p));
 
-	pcp = &p->pcp;
-	pcp->count = 0;
-	pcp->high = 6 * batch;
-	pcp->batch = max(1UL, 1 * batch);
-	for (migratetype = 0; migratetype < MIGRATE_PCPTYPES; migratetype++)
-		INIT_LIST_HEAD(&pcp->lists[migratetype]);
+	for (order = 0; order <= PCP_HIGH_ORDER; order++) {
+		pcp = pageset_pcp(p, order);
+		pcp->count = 0;
+		pcp->high = (6 * batch) >> order;
+		pcp->batch = max(1UL, batch >> order);
+		for (migratetype = 0; migratetype < MIGRATE_PCPTYPES;
+		     migratetype++)
+			INIT_LIST_HEAD(&pcp->lists[migratetype]);
+	}
+#ifdef CONFIG_PAGE_PREZERO
+	INIT_LIST_HEAD(&p->zeroed);
+#endif
 }
 
 /*
@@ -3889,12 +4350,17 @@ static void setup_pagelist_highmark(struct per_cpu_pageset *p,
 				unsigned long high)
 {
 	struct per_cpu_pages *pcp;
+	unsigned int order;
 
-	pcp = &p->pcp;
-	pcp->high = high;
-	pcp->batch = max(1UL, high/4);
-	if ((high/4) > (PAGE_SHIFT * 8))
-		pcp->batch = PAGE_SHIFT * 8;
+	for (order = 0; order <= PCP_HIGH_ORDER; order++) {
+		unsigned long ohigh = high >> order;
+
+		pcp = pageset_pcp(p, order);
+		pcp->high = ohigh;
+		pcp->batch = max(1UL, ohigh/4);
+		if ((ohigh/4) > ((PAGE_SHIFT * 8) >> order))
+			pcp->batch = max(1, (PAGE_SHIFT * 8) >> order);
+	}
 }
 
 static void __meminit setup_zone_pageset(struct zone *zone)
@@ -4397,7 +4863,12 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat_resize_init(pgdat);
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	init_waitqueue_head(&pgdat->pfmemalloc_wait);
-	pgdat_page_cgroup_init(pgdat);
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+#endif
+#ifdef CONFIG_PAGE_PREZERO
+	init_waitqueue_head(&pgdat->kzerod_wait);
+#endif
 
 	for (j = 0; j < MAX_NR_ZONES; j++) {
 		struct zone *zone = pgdat->node_zones + j;
@@ -4454,6 +4925,9 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 		spin_lock_init(&zone->lru_lock);
 		zone_seqlock_init(zone);
 		zone->zone_pgdat = pgdat;
+#ifdef CONFIG_PAGE_PREZERO
+		INIT_LIST_HEAD(&zone->zeroed_pages);
+#endif
 
 		zone_pcp_init(zone);
 		lruvec_init(&zone->lruvec, zone);
@@ -5605,7 +6079,7 @@ bool is_pageblock_removable_nolock(struct page *page)
 	return !has_unmovable_pages(zone, page, 0);
 }
 
-#ifdef CONFIG_CMA
+#if defined CONFIG_CMA || defined CONFIG_TRANSPARENT_HUGEPAGE_PUD
 
 static unsigned long pfn_max_align_down(unsigned long pfn)
 {
@@ -5679,6 +6153,7 @@ static int __alloc_contig_migrate_range(unsigned long start, unsigned long end)
 	return ret > 0 ? 0 : ret;
 }
 
+#ifdef CONFIG_CMA
 /*
  * Update zone's cma pages counter used for watermark level calculation.
  */
@@ -5726,6 +6201,7 @@ static int __reclaim_pages(struct zone *zone, gfp_t gfp_mask, int count)
 
 	return count;
 }
+#endif
 
 /**
  * alloc_contig_range() -- tries to allocate given range of pages
@@ -5750,7 +6226,6 @@ static int __reclaim_pages(struct zone *zone, gfp_t gfp_mask, int count)
 int alloc_contig_range(unsigned long start, unsigned long end,
 		       unsigned migratetype)
 {
-	struct zone *zone = page_zone(pfn_to_page(start));
 	unsigned long outer_start, outer_end;
 	int ret = 0, order;
 
@@ -5825,11 +6300,14 @@ int alloc_contig_range(unsigned long start, unsigned long end,
 		goto done;
 	}
 
+#ifdef CONFIG_CMA
 	/*
 	 * Reclaim enough pages to make sure that contiguous allocation
 	 * will not starve the system.
 	 */
-	__reclaim_pages(zone, GFP_HIGHUSER_MOVABLE, end-start);
+	__reclaim_pages(page_zone(pfn_to_page(start)), GFP_HIGHUSER_MOVABLE,
+			end-start);
+#endif
 
 	/* Grab isolated pages from freelists. */
 	outer_end = isolate_freepages_range(outer_start, end);
@@ -5867,13 +6345,18 @@ static int __meminit __zone_pcp_update(void *data)
 	for_each_possible_cpu(cpu) {
 		struct per_cpu_pageset *pset;
 		struct per_cpu_pages *pcp;
+		unsigned int order;
 
 		pset = per_cpu_ptr(zone->pageset, cpu);
-		pcp = &pset->pcp;
 
 		local_irq_save(flags);
-		if (pcp->count > 0)
-			free_pcppages_bulk(zone, pcp->count, pcp);
+		for (order = 0; order <= PCP_HIGH_ORDER; order++) {
+			pcp = pageset_pcp(pset, order);
+			if (pcp->count > 0)
+				free_pcppages_bulk(zone, pcp->count, pcp,
+						   order);
+		}
+		free_pcp_zeroed(zone, pset);
 		setup_pageset(pset, batch);
 		local_irq_restore(flags);
 	}
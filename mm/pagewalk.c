@@ -72,6 +72,7 @@ again:
 static int walk_pud_range(pgd_t *pgd, unsigned long addr, unsigned long end,
 			  struct mm_walk *walk)
 {
+	struct vm_area_struct *vma;
 	pud_t *pud;
 	unsigned long next;
 	int err = 0;
@@ -79,6 +80,26 @@ static int walk_pud_range(pgd_t *pgd, unsigned long addr, unsigned long end,
 	pud = pud_offset(pgd, addr);
 	do {
 		next = pud_addr_end(addr, end);
+		if (pud_trans_huge(*pud)) {
+			/*
+			 * A ->pud_entry() handler gets the 1GB page in one
+			 * go, with the page_table_lock held so that it can't
+			 * be split under it, and it is not walked any
+			 * further.  Walkers without one get to see the pmds
+			 * the page is split into.  If it was split in the
+			 * meantime, the pmds are walked as usual.
+			 */
+			vma = find_vma(walk->mm, addr);
+			if (!walk->pud_entry) {
+				split_huge_pud(vma, pud, addr);
+			} else if (pud_trans_huge_lock(pud, vma) == 1) {
+				err = walk->pud_entry(pud, addr, next, walk);
+				spin_unlock(&walk->mm->page_table_lock);
+				if (err)
+					break;
+				continue;
+			}
+		}
 		if (pud_none_or_clear_bad(pud)) {
 			if (walk->pte_hole)
 				err = walk->pte_hole(addr, next, walk);
@@ -0,0 +1,231 @@
+/*
+ * linux/mm/prezero.c
+ *
+ * kzerod clears free pages ahead of time so that movable __GFP_ZERO
+ * allocations, anonymous page faults in particular, do not have to.
+ * The cleared pages sit in a per-zone pool next to the buddy lists,
+ * see rmqueue_zeroed() and prezero_zone_pages() in page_alloc.c.
+ */
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/cpu.h>
+#include <linux/sysctl.h>
+#include <linux/prezero.h>
+#include "internal.h"
+
+/* Percentage of each zone that kzerod keeps cleared in advance */
+int sysctl_prezero_ratio __read_mostly;
+
+/* Pages cleared per zone->lock round trip */
+#define KZEROD_BATCH		32
+
+/* How often kzerod looks for newly freed memory while its pools are short */
+#define KZEROD_SLEEP_MSECS	1000
+
+static unsigned long zone_prezero_target(struct zone *zone)
+{
+	return zone->present_pages * sysctl_prezero_ratio / 100;
+}
+
+/*
+ * Only fill the pool of a zone whose buddy lists are comfortably above its
+ * high watermark without it.  Below that the free pages are better left
+ * alone for reclaim and compaction, and drain_all_pages() hands the pool
+ * back to the buddy allocator anyway.  The pool itself is counted in
+ * NR_FREE_PAGES, so leave it out: otherwise kzerod would keep moving pages
+ * into it while kswapd sees a zone with plenty of free memory.
+ */
+static bool zone_needs_prezero(struct zone *zone)
+{
+	unsigned long target = zone_prezero_target(zone);
+	unsigned long free, zeroed;
+
+	if (!populated_zone(zone) || !target)
+		return false;
+	zeroed = zone_page_state(zone, NR_ZEROED_PAGES);
+	if (zeroed >= target)
+		return false;
+	free = zone_page_state(zone, NR_FREE_PAGES);
+	if (free < zeroed)
+		return false;
+	return free - zeroed > high_wmark_pages(zone) + KZEROD_BATCH;
+}
+
+static bool kzerod_node_needs_work(pg_data_t *pgdat)
+{
+	int zoneid;
+
+	for (zoneid = 0; zoneid < pgdat->nr_zones; zoneid++)
+		if (zone_needs_prezero(&pgdat->node_zones[zoneid]))
+			return true;
+	return false;
+}
+
+/*
+ * Fill the pools of the node's zones. Returns false if a zone ran out of
+ * free movable pages before its pool was full.
+ */
+static bool kzerod_do_work(pg_data_t *pgdat)
+{
+	int zoneid;
+
+	for (zoneid = 0; zoneid < pgdat->nr_zones; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		while (zone_needs_prezero(zone)) {
+			if (kthread_should_stop() || freezing(current))
+				return true;
+			if (!prezero_zone_pages(zone, KZEROD_BATCH))
+				return false;
+			cond_resched();
+		}
+	}
+	return true;
+}
+
+static int kzerod(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	struct task_struct *tsk = current;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	struct sched_param param = { .sched_priority = 0 };
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(tsk, cpumask);
+
+	/* Clearing pages ahead of time is only worth CPU nobody else wants */
+	sched_setscheduler(tsk, SCHED_IDLE, &param);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+
+		if (sysctl_prezero_ratio)
+			timeout = msecs_to_jiffies(KZEROD_SLEEP_MSECS);
+
+		if (!kzerod_do_work(pgdat))
+			wait_event_freezable_timeout(pgdat->kzerod_wait,
+					kthread_should_stop(), timeout);
+		else
+			wait_event_freezable_timeout(pgdat->kzerod_wait,
+					kthread_should_stop() ||
+					kzerod_node_needs_work(pgdat),
+					timeout);
+	}
+
+	return 0;
+}
+
+/*
+ * Called by the allocator, with interrupts disabled, after it served or
+ * failed to serve a page from the pool of @zone.
+ */
+void wakeup_kzerod(struct zone *zone)
+{
+	pg_data_t *pgdat = zone->zone_pgdat;
+
+	if (!sysctl_prezero_ratio || !waitqueue_active(&pgdat->kzerod_wait))
+		return;
+
+	if (zone_page_state(zone, NR_ZEROED_PAGES) >
+	    zone_prezero_target(zone) / 2)
+		return;
+
+	if (!zone_needs_prezero(zone))
+		return;
+
+	wake_up_interruptible(&pgdat->kzerod_wait);
+}
+
+int sysctl_prezero_ratio_handler(struct ctl_table *table, int write,
+			void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct zone *zone;
+	int ret, nid;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (ret || !write)
+		return ret;
+
+	if (!sysctl_prezero_ratio) {
+		for_each_populated_zone(zone)
+			drain_zeroed_pages(zone);
+		return 0;
+	}
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		wake_up_interruptible(&NODE_DATA(nid)->kzerod_wait);
+
+	return 0;
+}
+
+/*
+ * This kzerod start function will be called by init and node-hot-add.
+ */
+int kzerod_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kzerod)
+		return 0;
+
+	pgdat->kzerod = kthread_run(kzerod, pgdat, "kzerod%d", nid);
+	if (IS_ERR(pgdat->kzerod)) {
+		printk(KERN_ERR "Failed to start kzerod on node %d\n", nid);
+		pgdat->kzerod = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.  Caller must
+ * hold lock_memory_hotplug().
+ */
+void kzerod_stop(int nid)
+{
+	struct task_struct *kzerod = NODE_DATA(nid)->kzerod;
+
+	if (kzerod) {
+		kthread_stop(kzerod);
+		NODE_DATA(nid)->kzerod = NULL;
+	}
+}
+
+/* Restore the node binding of kzerod when one of its CPUs comes back */
+static int __cpuinit kzerod_cpu_callback(struct notifier_block *nfb,
+					 unsigned long action, void *hcpu)
+{
+	int nid;
+
+	if (action == CPU_ONLINE || action == CPU_ONLINE_FROZEN) {
+		for_each_node_state(nid, N_HIGH_MEMORY) {
+			pg_data_t *pgdat = NODE_DATA(nid);
+			const struct cpumask *mask;
+
+			mask = cpumask_of_node(pgdat->node_id);
+
+			if (!pgdat->kzerod)
+				continue;
+
+			if (cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids)
+				set_cpus_allowed_ptr(pgdat->kzerod, mask);
+		}
+	}
+	return NOTIFY_OK;
+}
+
+static int __init kzerod_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kzerod_run(nid);
+	hotcpu_notifier(kzerod_cpu_callback, 0);
+	return 0;
+}
+subsys_initcall(kzerod_init);
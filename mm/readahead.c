@@ -158,6 +158,7 @@ __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 	struct page *page;
 	unsigned long end_index;	/* The last page we want to read */
 	LIST_HEAD(page_pool);
+	LIST_HEAD(spare_pages);		/* Allocated in bulk, not yet used */
 	int page_idx;
 	int ret = 0;
 	loff_t isize = i_size_read(inode);
@@ -182,9 +183,14 @@ __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 		if (page)
 			continue;
 
-		page = page_cache_alloc_readahead(mapping);
-		if (!page)
+		if (list_empty(&spare_pages) &&
+		    !page_cache_alloc_readahead_bulk(mapping,
+				min(nr_to_read - page_idx,
+				    end_index - page_offset + 1),
+				&spare_pages))
 			break;
+		page = list_first_entry(&spare_pages, struct page, lru);
+		list_del(&page->lru);
 		page->index = page_offset;
 		list_add(&page->lru, &page_pool);
 		if (page_idx == nr_to_read - lookahead_size)
@@ -192,6 +198,9 @@ __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 		ret++;
 	}
 
+	/* Pages of the range that turned out to be cached already */
+	put_pages_list(&spare_pages);
+
 	/*
 	 * Now start the IO.  We ignore I/O errors - if the page is not
 	 * uptodate then the caller will launch readpage again, and
@@ -633,7 +633,7 @@ pte_t *__page_check_address(struct page *page, struct mm_struct *mm,
 		return NULL;
 
 	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		return NULL;
 
 	pmd = pmd_offset(pud, address);
@@ -1232,6 +1232,112 @@ out:
  * Subfunctions of try_to_unmap: try_to_unmap_one called
  * repeatedly from try_to_unmap_ksm, try_to_unmap_anon or try_to_unmap_file.
  */
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+/*
+ * Flush the TLB entries of every cpu recorded by try_to_unmap_one()
+ * with TTU_BATCH_FLUSH: one IPI per cpu instead of one per page.
+ */
+void try_to_unmap_flush(void)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = &current->tlb_ubc;
+	int cpu;
+
+	if (!tlb_ubc->flush_required)
+		return;
+
+	cpu = get_cpu();
+	if (cpumask_test_cpu(cpu, &tlb_ubc->cpumask))
+		local_flush_tlb();
+	if (cpumask_any_but(&tlb_ubc->cpumask, cpu) < nr_cpu_ids) {
+		count_vm_events(TLB_BATCHED_IPI,
+				cpumask_weight(&tlb_ubc->cpumask) -
+				cpumask_test_cpu(cpu, &tlb_ubc->cpumask));
+		/* A NULL mm flushes whatever the cpu has loaded */
+		flush_tlb_others(&tlb_ubc->cpumask, NULL, 0UL, TLB_FLUSH_ALL);
+	}
+	cpumask_clear(&tlb_ubc->cpumask);
+	tlb_ubc->flush_required = false;
+	tlb_ubc->writable = false;
+	put_cpu();
+}
+
+/*
+ * A dirty pte may still be cached writable somewhere: flush before the
+ * page is written back, or the data could change under the I/O.
+ */
+void try_to_unmap_flush_dirty(void)
+{
+	if (current->tlb_ubc.writable)
+		try_to_unmap_flush();
+}
+
+static void set_tlb_ubc_flush_pending(struct mm_struct *mm, bool writable)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = &current->tlb_ubc;
+
+	cpumask_or(&tlb_ubc->cpumask, &tlb_ubc->cpumask, mm_cpumask(mm));
+	tlb_ubc->flush_required = true;
+	if (writable)
+		tlb_ubc->writable = true;
+
+	/*
+	 * Make sure a later mprotect/munmap, which may find the pte
+	 * already gone, notices that a flush is still outstanding.
+	 */
+	barrier();
+	mm->tlb_flush_batched = true;
+}
+
+/* Deferring only pays off when other cpus would need an IPI */
+static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
+{
+	int cpu, nr_remote;
+	bool ret = false;
+
+	if (!(flags & TTU_BATCH_FLUSH))
+		return false;
+
+	cpu = get_cpu();
+	nr_remote = cpumask_weight(mm_cpumask(mm)) -
+		    cpumask_test_cpu(cpu, mm_cpumask(mm));
+	if (nr_remote > 0) {
+		count_vm_event(TLB_DEFERRED_UNMAP);
+		count_vm_events(TLB_DEFERRED_IPI, nr_remote);
+		ret = true;
+	}
+	put_cpu();
+	return ret;
+}
+
+/*
+ * Called under the pte lock by anyone about to rely on ptes of @mm
+ * being gone from the TLB (munmap, mprotect, mremap) while reclaim may
+ * have cleared some of them without flushing yet.
+ */
+void flush_tlb_batched_pending(struct mm_struct *mm)
+{
+	if (mm->tlb_flush_batched) {
+		flush_tlb_mm(mm);
+
+		/*
+		 * Do not allow the compiler to re-order the clearing of
+		 * tlb_flush_batched before the tlb is flushed.
+		 */
+		barrier();
+		mm->tlb_flush_batched = false;
+	}
+}
+#else
+static void set_tlb_ubc_flush_pending(struct mm_struct *mm, bool writable)
+{
+}
+
+static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
+{
+	return false;
+}
+#endif /* CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH */
+
 int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 		     unsigned long address, enum ttu_flags flags)
 {
@@ -1266,7 +1372,17 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 
 	/* Nuke the page table entry. */
 	flush_cache_page(vma, address, page_to_pfn(page));
-	pteval = ptep_clear_flush_notify(vma, address, pte);
+	if (should_defer_flush(mm, flags)) {
+		/*
+		 * The caller flushes before the page can be freed or
+		 * written back; until then other cpus may keep using
+		 * a stale TLB entry, which still maps the same page.
+		 */
+		pteval = ptep_get_and_clear(mm, address, pte);
+		set_tlb_ubc_flush_pending(mm, pte_dirty(pteval));
+		mmu_notifier_invalidate_page(mm, address);
+	} else
+		pteval = ptep_clear_flush_notify(vma, address, pte);
 
 	/* Move the dirty bit to the physical page now the pte is gone. */
 	if (pte_dirty(pteval))
@@ -1285,6 +1401,23 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else if (PageAnon(page)) {
 		swp_entry_t entry = { .val = page_private(page) };
 
+		/* MADV_FREE page: discard it unless it was written to since */
+		if (!PageSwapBacked(page) && TTU_ACTION(flags) == TTU_UNMAP) {
+			if (!PageDirty(page)) {
+				dec_mm_counter(mm, MM_ANONPAGES);
+				goto discard;
+			}
+
+			/*
+			 * The page was redirtied and cannot be discarded:
+			 * map it again and make it a normal anon page.
+			 */
+			set_pte_at(mm, address, pte, pteval);
+			SetPageSwapBacked(page);
+			ret = SWAP_FAIL;
+			goto out_unmap;
+		}
+
 		if (PageSwapCache(page)) {
 			/*
 			 * Store the swap location in the pte.
@@ -1323,6 +1456,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else
 		dec_mm_counter(mm, MM_FILEPAGES);
 
+discard:
 	page_remove_rmap(page);
 	page_cache_release(page);
 
@@ -1408,7 +1542,7 @@ static int try_to_unmap_cluster(unsigned long cursor, unsigned int *mapcount,
 		return ret;
 
 	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
 		return ret;
 
 	pmd = pmd_offset(pud, address);
@@ -1436,9 +1436,11 @@ static int __cpuinit cpuup_callback(struct notifier_block *nfb,
 	switch (action) {
 	case CPU_UP_PREPARE:
 	case CPU_UP_PREPARE_FROZEN:
+		memcg_stop_kmem_account();
 		mutex_lock(&slab_mutex);
 		err = cpuup_prepare(cpu);
 		mutex_unlock(&slab_mutex);
+		memcg_resume_kmem_account();
 		break;
 	case CPU_ONLINE:
 	case CPU_ONLINE_FROZEN:
@@ -1531,9 +1533,11 @@ static int __meminit slab_memory_callback(struct notifier_block *self,
 
 	switch (action) {
 	case MEM_GOING_ONLINE:
+		memcg_stop_kmem_account();
 		mutex_lock(&slab_mutex);
 		ret = init_cache_nodelists_node(nid);
 		mutex_unlock(&slab_mutex);
+		memcg_resume_kmem_account();
 		break;
 	case MEM_GOING_OFFLINE:
 		mutex_lock(&slab_mutex);
@@ -1685,7 +1689,7 @@ void __init kmem_cache_init(void)
 					sizes[INDEX_AC].cs_size,
 					ARCH_KMALLOC_MINALIGN,
 					ARCH_KMALLOC_FLAGS|SLAB_PANIC,
-					NULL);
+					NULL, NULL, NULL);
 
 	if (INDEX_AC != INDEX_L3) {
 		sizes[INDEX_L3].cs_cachep =
@@ -1693,7 +1697,7 @@ void __init kmem_cache_init(void)
 				sizes[INDEX_L3].cs_size,
 				ARCH_KMALLOC_MINALIGN,
 				ARCH_KMALLOC_FLAGS|SLAB_PANIC,
-				NULL);
+				NULL, NULL, NULL);
 	}
 
 	slab_early_init = 0;
@@ -1711,7 +1715,7 @@ void __init kmem_cache_init(void)
 					sizes->cs_size,
 					ARCH_KMALLOC_MINALIGN,
 					ARCH_KMALLOC_FLAGS|SLAB_PANIC,
-					NULL);
+					NULL, NULL, NULL);
 		}
 #ifdef CONFIG_ZONE_DMA
 		sizes->cs_dmacachep = __kmem_cache_create(
@@ -1720,7 +1724,7 @@ void __init kmem_cache_init(void)
 					ARCH_KMALLOC_MINALIGN,
 					ARCH_KMALLOC_FLAGS|SLAB_CACHE_DMA|
 						SLAB_PANIC,
-					NULL);
+					NULL, NULL, NULL);
 #endif
 		sizes++;
 		names++;
@@ -1901,8 +1905,12 @@ static void *kmem_getpages(struct kmem_cache *cachep, gfp_t flags, int nodeid)
 	if (cachep->flags & SLAB_RECLAIM_ACCOUNT)
 		flags |= __GFP_RECLAIMABLE;
 
+	if (memcg_charge_slab(cachep, flags, cachep->gfporder))
+		return NULL;
+
 	page = alloc_pages_exact_node(nodeid, flags | __GFP_NOTRACK, cachep->gfporder);
 	if (!page) {
+		memcg_uncharge_slab(cachep, cachep->gfporder);
 		if (!(flags & __GFP_NOWARN) && printk_ratelimit())
 			slab_out_of_memory(cachep, flags, nodeid);
 		return NULL;
@@ -1964,6 +1972,7 @@ static void kmem_freepages(struct kmem_cache *cachep, void *addr)
 	if (current->reclaim_state)
 		current->reclaim_state->reclaimed_slab += nr_freed;
 	free_pages((unsigned long)addr, cachep->gfporder);
+	memcg_uncharge_slab(cachep, cachep->gfporder);
 }
 
 static void kmem_rcu_free(struct rcu_head *head)
@@ -2383,12 +2392,20 @@ static int __init_refok setup_cpu_cache(struct kmem_cache *cachep, gfp_t gfp)
  */
 struct kmem_cache *
 __kmem_cache_create (const char *name, size_t size, size_t align,
-	unsigned long flags, void (*ctor)(void *))
+	unsigned long flags, void (*ctor)(void *),
+	struct mem_cgroup *memcg, struct kmem_cache *root_cache)
 {
 	size_t left_over, slab_size, ralign;
 	struct kmem_cache *cachep = NULL;
 	gfp_t gfp;
 
+	/*
+	 * A clone is passed the root's flags.  Drop the internal ones the
+	 * root picked up, they are worked out again for the clone below.
+	 */
+	if (root_cache)
+		flags &= CREATE_MASK;
+
 #if DEBUG
 #if FORCED_DEBUG
 	/*
@@ -2596,6 +2613,11 @@ __kmem_cache_create (const char *name, size_t size, size_t align,
 		return NULL;
 	}
 
+	if (memcg_register_cache(memcg, cachep, root_cache)) {
+		__kmem_cache_destroy(cachep);
+		return NULL;
+	}
+
 	if (flags & SLAB_DEBUG_OBJECTS) {
 		/*
 		 * Would deadlock through slab_destroy()->call_rcu()->
@@ -2787,6 +2809,8 @@ void kmem_cache_destroy(struct kmem_cache *cachep)
 {
 	BUG_ON(!cachep || in_interrupt());
 
+	kmem_cache_destroy_memcg_children(cachep);
+
 	/* Find the cache in the chain of caches. */
 	get_online_cpus();
 	mutex_lock(&slab_mutex);
@@ -2805,6 +2829,7 @@ void kmem_cache_destroy(struct kmem_cache *cachep)
 	if (unlikely(cachep->flags & SLAB_DESTROY_BY_RCU))
 		rcu_barrier();
 
+	memcg_release_cache(cachep);
 	__kmem_cache_destroy(cachep);
 	mutex_unlock(&slab_mutex);
 	put_online_cpus();
@@ -2829,9 +2854,14 @@ static struct slab *alloc_slabmgmt(struct kmem_cache *cachep, void *objp,
 	struct slab *slabp;
 
 	if (OFF_SLAB(cachep)) {
-		/* Slab management obj is off-slab. */
+		/*
+		 * Slab management obj is off-slab.  It belongs to the cache,
+		 * not to the memcg of whoever happens to grow it.
+		 */
+		memcg_stop_kmem_account();
 		slabp = kmem_cache_alloc_node(cachep->slabp_cache,
 					      local_flags, nodeid);
+		memcg_resume_kmem_account();
 		/*
 		 * If the first object in the slab is leaked (it's allocated
 		 * but no one has a reference to it), we want to make sure
@@ -3590,6 +3620,8 @@ __cache_alloc_node(struct kmem_cache *cachep, gfp_t flags, int nodeid,
 	if (slab_should_failslab(cachep, flags))
 		return NULL;
 
+	cachep = memcg_kmem_get_cache(cachep, flags);
+
 	cache_alloc_debugcheck_before(cachep, flags);
 	local_irq_save(save_flags);
 
@@ -3675,6 +3707,8 @@ __cache_alloc(struct kmem_cache *cachep, gfp_t flags, void *caller)
 	if (slab_should_failslab(cachep, flags))
 		return NULL;
 
+	cachep = memcg_kmem_get_cache(cachep, flags);
+
 	cache_alloc_debugcheck_before(cachep, flags);
 	local_irq_save(save_flags);
 	objp = __do_cache_alloc(cachep, flags);
@@ -3991,6 +4025,14 @@ void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 {
 	unsigned long flags;
 
+	/* Objects of a per-memcg clone go back to the clone */
+	if (memcg_kmem_enabled()) {
+		struct kmem_cache *c = virt_to_cache(objp);
+
+		if (slab_equal_or_root(cachep, c))
+			cachep = c;
+	}
+
 	local_irq_save(flags);
 	debug_check_no_locks_freed(objp, cachep->object_size);
 	if (!(cachep->flags & SLAB_DEBUG_OBJECTS))
@@ -4002,6 +4044,48 @@ void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/**
+ * kmem_cache_free_bulk - Deallocate an array of objects
+ * @orig_cachep: The cache the allocations were from.
+ * @nr: Number of objects in @p.
+ * @p: The previously allocated objects.
+ *
+ * Like kmem_cache_free() on every object, but returns all of them to the
+ * per-cpu array cache with interrupts disabled only once.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *orig_cachep, size_t nr, void **p)
+{
+	unsigned long flags;
+	size_t i;
+
+	local_irq_save(flags);
+	for (i = 0; i < nr; i++) {
+		struct kmem_cache *cachep = orig_cachep;
+		void *objp = p[i];
+
+		if (memcg_kmem_enabled()) {
+			struct kmem_cache *c = virt_to_cache(objp);
+
+			if (slab_equal_or_root(cachep, c))
+				cachep = c;
+		}
+
+		debug_check_no_locks_freed(objp, cachep->object_size);
+		if (!(cachep->flags & SLAB_DEBUG_OBJECTS))
+			debug_check_no_obj_freed(objp, cachep->object_size);
+		__cache_free(cachep, objp, __builtin_return_address(0));
+	}
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+int kmem_cache_alloc_bulk(struct kmem_cache *cachep, gfp_t flags, size_t nr,
+			  void **p)
+{
+	return __kmem_cache_alloc_bulk(cachep, flags, nr, p);
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /**
  * kfree - free previously allocated memory
  * @objp: pointer returned by kmalloc.
@@ -4531,6 +4615,7 @@ static ssize_t slabinfo_write(struct file *file, const char __user *buffer,
 		return -EINVAL;
 
 	/* Find the cache in the chain of caches. */
+	memcg_stop_kmem_account();
 	mutex_lock(&slab_mutex);
 	res = -EINVAL;
 	list_for_each_entry(cachep, &slab_caches, list) {
@@ -4547,6 +4632,7 @@ static ssize_t slabinfo_write(struct file *file, const char __user *buffer,
 		}
 	}
 	mutex_unlock(&slab_mutex);
+	memcg_resume_kmem_account();
 	if (res >= 0)
 		res = count;
 	return res;
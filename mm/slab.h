@@ -1,5 +1,8 @@
 #ifndef MM_SLAB_H
 #define MM_SLAB_H
+
+#include <linux/memcontrol.h>
+
 /*
  * Internal slab definitions
  */
@@ -27,7 +30,68 @@ extern enum slab_state slab_state;
 extern struct mutex slab_mutex;
 extern struct list_head slab_caches;
 
+/* Object-at-a-time bulk operations for allocators without a faster path */
+void __kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p);
+int __kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t nr,
+			    void **p);
+
+struct mem_cgroup;
 struct kmem_cache *__kmem_cache_create(const char *name, size_t size,
-	size_t align, unsigned long flags, void (*ctor)(void *));
+	size_t align, unsigned long flags, void (*ctor)(void *),
+	struct mem_cgroup *memcg, struct kmem_cache *root_cache);
+
+#ifdef CONFIG_MEMCG_KMEM
+static inline bool is_root_cache(struct kmem_cache *s)
+{
+	return !s->memcg_params || s->memcg_params->is_root_cache;
+}
+
+/* Is @p either @s itself or a per-memcg clone of @s? */
+static inline bool slab_equal_or_root(struct kmem_cache *s,
+				      struct kmem_cache *p)
+{
+	return p == s ||
+		(!is_root_cache(p) && p->memcg_params->root_cache == s);
+}
+
+/*
+ * Slab pages of per-memcg caches are charged to the owning memcg when they
+ * are allocated and uncharged when they are given back to the page
+ * allocator.
+ */
+static inline int memcg_charge_slab(struct kmem_cache *s, gfp_t gfp, int order)
+{
+	if (!memcg_kmem_enabled() || is_root_cache(s))
+		return 0;
+	return __memcg_charge_slab(s, gfp, order);
+}
+
+static inline void memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+	if (!memcg_kmem_enabled() || is_root_cache(s))
+		return;
+	__memcg_uncharge_slab(s, order);
+}
+#else
+static inline bool is_root_cache(struct kmem_cache *s)
+{
+	return true;
+}
+
+static inline bool slab_equal_or_root(struct kmem_cache *s,
+				      struct kmem_cache *p)
+{
+	return p == s;
+}
+
+static inline int memcg_charge_slab(struct kmem_cache *s, gfp_t gfp, int order)
+{
+	return 0;
+}
+
+static inline void memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+}
+#endif
 
 #endif
@@ -1256,17 +1256,26 @@ static inline void slab_free_hook(struct kmem_cache *s, void *x) {}
 /*
  * Slab allocation and freeing
  */
-static inline struct page *alloc_slab_page(gfp_t flags, int node,
-					struct kmem_cache_order_objects oo)
+static inline struct page *alloc_slab_page(struct kmem_cache *s,
+		gfp_t flags, int node, struct kmem_cache_order_objects oo)
 {
+	struct page *page;
 	int order = oo_order(oo);
 
 	flags |= __GFP_NOTRACK;
 
+	if (memcg_charge_slab(s, flags, order))
+		return NULL;
+
 	if (node == NUMA_NO_NODE)
-		return alloc_pages(flags, order);
+		page = alloc_pages(flags, order);
 	else
-		return alloc_pages_exact_node(node, flags, order);
+		page = alloc_pages_exact_node(node, flags, order);
+
+	if (!page)
+		memcg_uncharge_slab(s, order);
+
+	return page;
 }
 
 static struct page *allocate_slab(struct kmem_cache *s, gfp_t flags, int node)
@@ -1288,14 +1297,14 @@ static struct page *allocate_slab(struct kmem_cache *s, gfp_t flags, int node)
 	 */
 	alloc_gfp = (flags | __GFP_NOWARN | __GFP_NORETRY) & ~__GFP_NOFAIL;
 
-	page = alloc_slab_page(alloc_gfp, node, oo);
+	page = alloc_slab_page(s, alloc_gfp, node, oo);
 	if (unlikely(!page)) {
 		oo = s->min;
 		/*
 		 * Allocation may have failed due to fragmentation.
 		 * Try a lower order alloc if possible
 		 */
-		page = alloc_slab_page(flags, node, oo);
+		page = alloc_slab_page(s, flags, node, oo);
 
 		if (page)
 			stat(s, ORDER_FALLBACK);
@@ -1407,6 +1416,7 @@ static void __free_slab(struct kmem_cache *s, struct page *page)
 	if (current->reclaim_state)
 		current->reclaim_state->reclaimed_slab += pages;
 	__free_pages(page, order);
+	memcg_uncharge_slab(s, order);
 }
 
 #define need_reserve_slab_rcu						\
@@ -2321,6 +2331,7 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 	if (slab_pre_alloc_hook(s, gfpflags))
 		return NULL;
 
+	s = memcg_kmem_get_cache(s, gfpflags);
 redo:
 
 	/*
@@ -2469,7 +2480,7 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 		new.inuse--;
 		if ((!new.inuse || !prior) && !was_frozen && !n) {
 
-			if (!kmem_cache_debug(s) && !prior)
+			if (!kmem_cache_debug(s) && s->cpu_partial && !prior)
 
 				/*
 				 * Slab was on no list before and will be partially empty
@@ -2606,18 +2617,132 @@ redo:
 
 }
 
+/*
+ * Objects allocated from a per-memcg clone are freed by callers that only
+ * know about the root cache: hand them back to the clone they came from.
+ */
+static inline struct kmem_cache *cache_from_obj(struct kmem_cache *s,
+						struct page *page)
+{
+	if (memcg_kmem_enabled() && slab_equal_or_root(s, page->slab))
+		return page->slab;
+	return s;
+}
+
 void kmem_cache_free(struct kmem_cache *s, void *x)
 {
 	struct page *page;
 
 	page = virt_to_head_page(x);
 
-	slab_free(s, page, x, _RET_IP_);
+	slab_free(cache_from_obj(s, page), page, x, _RET_IP_);
 
 	trace_kmem_cache_free(_RET_IP_, x);
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/*
+ * Free an array of objects. Objects that belong to the current cpu slab
+ * are spliced onto the per cpu freelist directly; everything else takes
+ * the __slab_free slowpath. Interrupts stay disabled for the whole array
+ * so the per cpu freelist can be manipulated without cmpxchg.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *orig_s, size_t nr, void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long flags;
+	size_t i;
+
+	local_irq_save(flags);
+	c = this_cpu_ptr(orig_s->cpu_slab);
+
+	for (i = 0; i < nr; i++) {
+		void *object = p[i];
+		struct page *page = virt_to_head_page(object);
+		struct kmem_cache *s = cache_from_obj(orig_s, page);
+
+		slab_free_hook(s, object);
+
+		if (s == orig_s && page == c->page) {
+			set_freepointer(s, object, c->freelist);
+			c->freelist = object;
+			stat(s, FREE_FASTPATH);
+			continue;
+		}
+
+		c->tid = next_tid(c->tid);
+		__slab_free(s, page, object, _RET_IP_);
+		c = this_cpu_ptr(orig_s->cpu_slab);
+	}
+
+	c->tid = next_tid(c->tid);
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+/*
+ * Allocate an array of objects. The per cpu freelist is detached object by
+ * object with interrupts disabled instead of one cmpxchg per object, and
+ * refilled through __slab_alloc when it runs dry. Either all @nr objects
+ * are allocated or none are.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t nr,
+			  void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long irqflags;
+	size_t i;
+
+	if (slab_pre_alloc_hook(s, flags))
+		return 0;
+
+	s = memcg_kmem_get_cache(s, flags);
+
+	local_irq_save(irqflags);
+	c = this_cpu_ptr(s->cpu_slab);
+
+	for (i = 0; i < nr; i++) {
+		void *object = c->freelist;
+
+		if (unlikely(!object)) {
+			/*
+			 * The slowpath may enable interrupts to allocate a
+			 * new slab. Bump the tid first so that a fastpath
+			 * interrupted on this cpu cannot complete its cmpxchg
+			 * against the freelist we have been consuming.
+			 */
+			c->tid = next_tid(c->tid);
+			p[i] = __slab_alloc(s, flags, NUMA_NO_NODE, _RET_IP_, c);
+			if (unlikely(!p[i]))
+				goto error;
+
+			c = this_cpu_ptr(s->cpu_slab);
+			continue;
+		}
+		c->freelist = get_freepointer(s, object);
+		p[i] = object;
+		stat(s, ALLOC_FASTPATH);
+	}
+	c->tid = next_tid(c->tid);
+	local_irq_restore(irqflags);
+
+	for (i = 0; i < nr; i++) {
+		if (unlikely(flags & __GFP_ZERO))
+			memset(p[i], 0, s->object_size);
+		slab_post_alloc_hook(s, flags, p[i]);
+	}
+	return i;
+
+error:
+	local_irq_restore(irqflags);
+	nr = i;
+	for (i = 0; i < nr; i++)
+		slab_post_alloc_hook(s, flags, p[i]);
+	kmem_cache_free_bulk(s, nr, p);
+	return 0;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /*
  * Object placement in a slab is made very easy because we always start at
  * offset 0. If we tune the size of the object to the alignment then we can
@@ -3201,6 +3326,10 @@ static inline int kmem_cache_close(struct kmem_cache *s)
  */
 void kmem_cache_destroy(struct kmem_cache *s)
 {
+	/* The last user of a root cache takes its memcg clones down too */
+	if (s->refcount == 1)
+		kmem_cache_destroy_memcg_children(s);
+
 	mutex_lock(&slab_mutex);
 	s->refcount--;
 	if (!s->refcount) {
@@ -3213,6 +3342,7 @@ void kmem_cache_destroy(struct kmem_cache *s)
 		}
 		if (s->flags & SLAB_DESTROY_BY_RCU)
 			rcu_barrier();
+		memcg_release_cache(s);
 		sysfs_slab_remove(s);
 	} else
 		mutex_unlock(&slab_mutex);
@@ -3514,6 +3644,18 @@ int kmem_cache_shrink(struct kmem_cache *s)
 	if (!slabs_by_inuse)
 		return -ENOMEM;
 
+#ifdef CONFIG_MEMCG_KMEM
+	/*
+	 * Nothing allocates from the clone of a destroyed memcg any more:
+	 * stop caching empty slabs so that the cache drains as its remaining
+	 * objects are freed and can then be destroyed.
+	 */
+	if (!is_root_cache(s) && memcg_cache_dead(s)) {
+		s->min_partial = 0;
+		s->cpu_partial = 0;
+	}
+#endif
+
 	flush_all(s);
 	for_each_node_state(node, N_NORMAL_MEMORY) {
 		n = get_node(s, node);
@@ -3625,6 +3767,7 @@ static int slab_mem_going_online_callback(void *arg)
 	 * allocate a kmem_cache_node structure in order to bring the node
 	 * online.
 	 */
+	memcg_stop_kmem_account();
 	mutex_lock(&slab_mutex);
 	list_for_each_entry(s, &slab_caches, list) {
 		/*
@@ -3642,6 +3785,7 @@ static int slab_mem_going_online_callback(void *arg)
 	}
 out:
 	mutex_unlock(&slab_mutex);
+	memcg_resume_kmem_account();
 	return ret;
 }
 
@@ -3889,6 +4033,10 @@ static int slab_unmergeable(struct kmem_cache *s)
 	if (s->refcount < 0)
 		return 1;
 
+	/* Per-memcg clones must stay separate from their root cache */
+	if (!is_root_cache(s))
+		return 1;
+
 	return 0;
 }
 
@@ -3934,12 +4082,14 @@ static struct kmem_cache *find_mergeable(size_t size,
 }
 
 struct kmem_cache *__kmem_cache_create(const char *name, size_t size,
-		size_t align, unsigned long flags, void (*ctor)(void *))
+		size_t align, unsigned long flags, void (*ctor)(void *),
+		struct mem_cgroup *memcg, struct kmem_cache *root_cache)
 {
-	struct kmem_cache *s;
+	struct kmem_cache *s = NULL;
 	char *n;
 
-	s = find_mergeable(size, align, flags, name, ctor);
+	if (!memcg)
+		s = find_mergeable(size, align, flags, name, ctor);
 	if (s) {
 		s->refcount++;
 		/*
@@ -3966,6 +4116,11 @@ struct kmem_cache *__kmem_cache_create(const char *name, size_t size,
 				size, align, flags, ctor)) {
 			int r;
 
+			if (memcg_register_cache(memcg, s, root_cache)) {
+				kmem_cache_close(s);
+				goto err;
+			}
+
 			list_add(&s->list, &slab_caches);
 			mutex_unlock(&slab_mutex);
 			r = sysfs_slab_add(s);
@@ -3975,8 +4130,10 @@ struct kmem_cache *__kmem_cache_create(const char *name, size_t size,
 				return s;
 
 			list_del(&s->list);
+			memcg_release_cache(s);
 			kmem_cache_close(s);
 		}
+err:
 		kfree(s);
 	}
 	kfree(n);
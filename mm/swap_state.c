@@ -316,6 +316,13 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = swapcache_prepare(entry);
 		if (err == -EEXIST) {	/* seems racy */
 			radix_tree_preload_end();
+			/*
+			 * Nobody references a slot that is parked in a
+			 * per-cpu slot cache, and it may stay there for a
+			 * while: don't wait for it to enter the swap cache.
+			 */
+			if (swap_slot_unused(entry))
+				break;
 			continue;
 		}
 		if (err) {		/* swp entry is obsolete ? */
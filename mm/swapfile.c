@@ -411,17 +411,25 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Allocate up to @n swap entries for the swap cache, all from the same
+ * swap device and, cluster permitting, at consecutive offsets, taking
+ * swap_lock only once. Returns the number of entries stored in @entries.
+ */
+static int get_swap_pages(int n, swp_entry_t entries[])
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
+	int n_ret = 0;
 
 	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
 		goto noswap;
-	nr_swap_pages--;
+	if (n > nr_swap_pages)
+		n = nr_swap_pages;
+	nr_swap_pages -= n;
 
 	for (type = swap_list.next; type >= 0 && wrapped < 2; type = next) {
 		si = swap_info[type];
@@ -439,18 +447,21 @@ swp_entry_t get_swap_page(void)
 
 		swap_list.next = next;
 		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
-			return swp_entry(type, offset);
+		while (n_ret < n) {
+			offset = scan_swap_map(si, SWAP_HAS_CACHE);
+			if (!offset)
+				break;
+			entries[n_ret++] = swp_entry(type, offset);
 		}
+		if (n_ret)
+			break;
 		next = swap_list.next;
 	}
 
-	nr_swap_pages++;
+	nr_swap_pages += n - n_ret;
 noswap:
 	spin_unlock(&swap_lock);
-	return (swp_entry_t) {0};
+	return n_ret;
 }
 
 /* The only caller of this function is now susupend routine */
@@ -475,7 +486,7 @@ swp_entry_t get_swap_page_of_type(int type)
 	return (swp_entry_t) {0};
 }
 
-static struct swap_info_struct *swap_info_get(swp_entry_t entry)
+static struct swap_info_struct *__swap_info_get(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
 	unsigned long offset, type;
@@ -493,7 +504,6 @@ static struct swap_info_struct *swap_info_get(swp_entry_t entry)
 		goto bad_offset;
 	if (!p->swap_map[offset])
 		goto bad_free;
-	spin_lock(&swap_lock);
 	return p;
 
 bad_free:
@@ -511,6 +521,16 @@ out:
 	return NULL;
 }
 
+static struct swap_info_struct *swap_info_get(swp_entry_t entry)
+{
+	struct swap_info_struct *p;
+
+	p = __swap_info_get(entry);
+	if (p)
+		spin_lock(&swap_lock);
+	return p;
+}
+
 static unsigned char swap_entry_free(struct swap_info_struct *p,
 				     swp_entry_t entry, unsigned char usage)
 {
@@ -570,6 +590,207 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 	return usage;
 }
 
+/*
+ * Per-cpu swap slot caches.
+ *
+ * Reclaimers on many cpus would otherwise all meet on swap_lock for
+ * every page they swap out, and again for every swap slot freed. Each
+ * cpu instead grabs SWAP_SLOTS_CACHE_SIZE consecutive slots at a time,
+ * so the pages one reclaimer writes out also stay sequential on disk,
+ * and hands slots back in batches of the same size.
+ *
+ * Slots sitting in either array are marked SWAP_HAS_CACHE with no swap
+ * count, just like a slot between get_swap_page() and add_to_swap_cache().
+ * swapoff disables the caches and drains them, and the caches are only
+ * used while there is plenty of swap, so a nearly full device does not
+ * end up with its last slots stranded on other cpus.
+ */
+#define SWAP_SLOTS_CACHE_SIZE	64
+
+struct swap_slots_cache {
+	struct mutex	alloc_lock;	/* protects slots, cur, nr */
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+	int		cur;
+	int		nr;
+	spinlock_t	free_lock;	/* protects slots_ret, n_ret */
+	swp_entry_t	slots_ret[SWAP_SLOTS_CACHE_SIZE];
+	int		n_ret;
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+static DEFINE_MUTEX(swap_slots_cache_mutex);
+static int swap_slots_cache_disabled = 1;	/* until swap_slots_init() */
+
+static inline bool swap_slots_cache_usable(void)
+{
+	return !ACCESS_ONCE(swap_slots_cache_disabled) &&
+	       nr_swap_pages > 2L * SWAP_SLOTS_CACHE_SIZE * num_online_cpus();
+}
+
+/* Release a batch of slots that only carry SWAP_HAS_CACHE */
+static void swapcache_free_entries(swp_entry_t *entries, int n)
+{
+	int i;
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++)
+		swap_entry_free(swap_info[swp_type(entries[i])], entries[i],
+				SWAP_HAS_CACHE);
+	spin_unlock(&swap_lock);
+}
+
+static void drain_swap_slots_cpu(unsigned int cpu)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	mutex_lock(&cache->alloc_lock);
+	if (cache->nr) {
+		swapcache_free_entries(cache->slots + cache->cur, cache->nr);
+		cache->cur = 0;
+		cache->nr = 0;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	spin_lock(&cache->free_lock);
+	if (cache->n_ret) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	spin_unlock(&cache->free_lock);
+}
+
+/*
+ * Disabling waits for every cpu to leave its cache, so once this
+ * returns no slot is cached anywhere and none will be until the
+ * matching enable_swap_slots_cache().
+ */
+static void disable_swap_slots_cache(void)
+{
+	unsigned int cpu;
+
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slots_cache_disabled++;
+	get_online_cpus();
+	for_each_online_cpu(cpu)
+		drain_swap_slots_cpu(cpu);
+	put_online_cpus();
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+static void enable_swap_slots_cache(void)
+{
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slots_cache_disabled--;
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+static int get_swap_page_cached(swp_entry_t *entry)
+{
+	struct swap_slots_cache *cache;
+	int ret = 0;
+
+	/* Any cpu's cache will do: we may be migrated, the mutex covers it */
+	cache = &per_cpu(swp_slots, raw_smp_processor_id());
+	mutex_lock(&cache->alloc_lock);
+	if (!swap_slots_cache_disabled) {
+		if (!cache->nr) {
+			cache->cur = 0;
+			cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE,
+						   cache->slots);
+		}
+		if (cache->nr) {
+			*entry = cache->slots[cache->cur++];
+			cache->nr--;
+			ret = 1;
+		}
+	}
+	mutex_unlock(&cache->alloc_lock);
+	return ret;
+}
+
+swp_entry_t get_swap_page(void)
+{
+	swp_entry_t entry;
+
+	if (swap_slots_cache_usable() && get_swap_page_cached(&entry))
+		return entry;
+	if (get_swap_pages(1, &entry))
+		return entry;
+	return (swp_entry_t) {0};
+}
+
+/*
+ * A slot whose only reference is the swap cache being dropped by the
+ * caller cannot gain references behind our back: there are no swap ptes
+ * to copy, and swapcache_prepare() fails while SWAP_HAS_CACHE is set.
+ * So it can be queued for a batched free without taking swap_lock.
+ */
+static int swapcache_free_cached(struct swap_info_struct *p,
+				 swp_entry_t entry, struct page *page)
+{
+	struct swap_slots_cache *cache;
+	int ret = 0;
+
+	if (!swap_slots_cache_usable() ||
+	    ACCESS_ONCE(p->swap_map[swp_offset(entry)]) != SWAP_HAS_CACHE)
+		return 0;
+
+	cache = &get_cpu_var(swp_slots);
+	spin_lock(&cache->free_lock);
+	if (!swap_slots_cache_disabled) {
+		if (page)
+			mem_cgroup_uncharge_swapcache(page, entry, false);
+		if (cache->n_ret == SWAP_SLOTS_CACHE_SIZE) {
+			swapcache_free_entries(cache->slots_ret, cache->n_ret);
+			cache->n_ret = 0;
+		}
+		cache->slots_ret[cache->n_ret++] = entry;
+		ret = 1;
+	}
+	spin_unlock(&cache->free_lock);
+	put_cpu_var(swp_slots);
+	return ret;
+}
+
+/*
+ * Used by readahead to skip slots that are allocated or being freed
+ * through the slot caches but are not in use: waiting for them to show
+ * up in the swap cache could take arbitrarily long.
+ */
+int swap_slot_unused(swp_entry_t entry)
+{
+	struct swap_info_struct *p = swap_info[swp_type(entry)];
+	unsigned long offset = swp_offset(entry);
+
+	if (ACCESS_ONCE(swap_slots_cache_disabled) || offset >= p->max)
+		return 0;
+	return !swap_count(ACCESS_ONCE(p->swap_map[offset]));
+}
+
+static int __cpuinit swap_slots_cpu_callback(struct notifier_block *nfb,
+					     unsigned long action, void *hcpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_swap_slots_cpu((unsigned long)hcpu);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_init(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+	enable_swap_slots_cache();
+	return 0;
+}
+__initcall(swap_slots_init);
+
 /*
  * Caller has made sure that the swapdevice corresponding to entry
  * is still around or has not been recycled.
@@ -593,13 +814,15 @@ void swapcache_free(swp_entry_t entry, struct page *page)
 	struct swap_info_struct *p;
 	unsigned char count;
 
-	p = swap_info_get(entry);
-	if (p) {
-		count = swap_entry_free(p, entry, SWAP_HAS_CACHE);
-		if (page)
-			mem_cgroup_uncharge_swapcache(page, entry, count != 0);
-		spin_unlock(&swap_lock);
-	}
+	p = __swap_info_get(entry);
+	if (!p || swapcache_free_cached(p, entry, page))
+		return;
+
+	spin_lock(&swap_lock);
+	count = swap_entry_free(p, entry, SWAP_HAS_CACHE);
+	if (page)
+		mem_cgroup_uncharge_swapcache(page, entry, count != 0);
+	spin_unlock(&swap_lock);
 }
 
 /*
@@ -926,6 +1149,9 @@ static inline int unuse_pud_range(struct vm_area_struct *vma, pgd_t *pgd,
 	pud = pud_offset(pgd, addr);
 	do {
 		next = pud_addr_end(addr, end);
+		/* a 1GB page never has swap entries beneath it */
+		if (pud_trans_huge(*pud))
+			continue;
 		if (pud_none_or_clear_bad(pud))
 			continue;
 		ret = unuse_pmd_range(vma, pud, addr, next, entry, page);
@@ -1504,6 +1730,9 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	if (IS_ERR(victim))
 		goto out;
 
+	/* Slots parked in the per-cpu caches would never be unused */
+	disable_swap_slots_cache();
+
 	mapping = victim->f_mapping;
 	prev = -1;
 	spin_lock(&swap_lock);
@@ -1607,6 +1836,7 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	wake_up_interruptible(&proc_poll_wait);
 
 out_dput:
+	enable_swap_slots_cache();
 	filp_close(victim, NULL);
 out:
 	return err;
@@ -470,7 +470,7 @@ void refresh_cpu_vm_stats(int cpu)
 		 * Check if there are pages remaining in this pageset
 		 * if not then there is nothing to expire.
 		 */
-		if (!p->expire || !p->pcp.count)
+		if (!p->expire || pageset_empty(p))
 			continue;
 
 		/*
@@ -485,8 +485,7 @@ void refresh_cpu_vm_stats(int cpu)
 		if (p->expire)
 			continue;
 
-		if (p->pcp.count)
-			drain_zone_pages(zone, &p->pcp);
+		drain_zone_pages(zone, p);
 #endif
 	}
 
@@ -722,6 +721,8 @@ const char * const vmstat_text[] = {
 	"numa_other",
 #endif
 	"nr_anon_transparent_hugepages",
+	"nr_anon_pud_hugepages",
+	"nr_zeroed_pages",
 	"nr_dirty_threshold",
 	"nr_dirty_background_threshold",
 
@@ -736,9 +737,14 @@ const char * const vmstat_text[] = {
 	"pgfree",
 	"pgactivate",
 	"pgdeactivate",
+	"pglazyfree",
 
 	"pgfault",
 	"pgmajfault",
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	"speculative_pgfault",
+	"speculative_pgfault_abort",
+#endif
 
 	TEXTS_FOR_ZONES("pgrefill")
 	TEXTS_FOR_ZONES("pgsteal_kswapd")
@@ -760,6 +766,13 @@ const char * const vmstat_text[] = {
 	"allocstall",
 
 	"pgrotated",
+	"pglazyfreed",
+
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+	"tlb_deferred_unmap",
+	"tlb_deferred_ipi",
+	"tlb_batched_ipi",
+#endif
 
 #ifdef CONFIG_COMPACTION
 	"compact_blocks_moved",
@@ -768,6 +781,9 @@ const char * const vmstat_text[] = {
 	"compact_stall",
 	"compact_fail",
 	"compact_success",
+	"compact_daemon_wake",
+	"compact_daemon_proactive",
+	"compact_daemon_contended",
 #endif
 
 #ifdef CONFIG_HUGETLB_PAGE
@@ -789,6 +805,17 @@ const char * const vmstat_text[] = {
 	"thp_collapse_alloc",
 	"thp_collapse_alloc_failed",
 	"thp_split",
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE_PUD
+	"thp_pud_fault_alloc",
+	"thp_pud_fault_fallback",
+	"thp_pud_split",
+#endif
+#endif
+
+#ifdef CONFIG_PAGE_PREZERO
+	"prezero_alloc_hit",
+	"prezero_alloc_miss",
+	"prezero_pages_zeroed",
 #endif
 
 #endif /* CONFIG_VM_EVENTS_COUNTERS */
@@ -971,7 +998,7 @@ static const struct file_operations pagetypeinfo_file_ops = {
 static void zoneinfo_show_print(struct seq_file *m, pg_data_t *pgdat,
 							struct zone *zone)
 {
-	int i;
+	int i, j;
 	seq_printf(m, "Node %d, zone %8s", pgdat->node_id, zone->name);
 	seq_printf(m,
 		   "\n  pages free     %lu"
@@ -1014,6 +1041,13 @@ static void zoneinfo_show_print(struct seq_file *m, pg_data_t *pgdat,
 			   pageset->pcp.count,
 			   pageset->pcp.high,
 			   pageset->pcp.batch);
+		for (j = 1; j <= PCP_HIGH_ORDER; j++) {
+			struct per_cpu_pages *pcp = pageset_pcp(pageset, j);
+
+			seq_printf(m,
+				   "\n            order %i: count: %i high: %i batch: %i",
+				   j, pcp->count, pcp->high, pcp->batch);
+		}
 #ifdef CONFIG_SMP
 		seq_printf(m, "\n  vm stats threshold: %d",
 				pageset->stat_threshold);
@@ -641,6 +641,80 @@ void consume_skb(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(consume_skb);
 
+/*
+ * sk_buff heads freed from NAPI context are collected per cpu and handed
+ * back to skbuff_head_cache in bulk, either when the array fills up or at
+ * the end of the NET_RX softirq.
+ */
+#define NAPI_SKB_CACHE_SIZE	64
+
+struct napi_skb_cache {
+	unsigned int	count;
+	void		*skbs[NAPI_SKB_CACHE_SIZE];
+};
+static DEFINE_PER_CPU(struct napi_skb_cache, napi_skb_cache);
+
+void __kfree_skb_flush(void)
+{
+	struct napi_skb_cache *nc = &__get_cpu_var(napi_skb_cache);
+
+	if (nc->count) {
+		kmem_cache_free_bulk(skbuff_head_cache, nc->count, nc->skbs);
+		nc->count = 0;
+	}
+}
+
+static void _kfree_skb_defer(struct sk_buff *skb)
+{
+	struct napi_skb_cache *nc = &__get_cpu_var(napi_skb_cache);
+
+	skb_release_all(skb);
+
+	nc->skbs[nc->count++] = skb;
+	if (unlikely(nc->count == NAPI_SKB_CACHE_SIZE)) {
+		kmem_cache_free_bulk(skbuff_head_cache, NAPI_SKB_CACHE_SIZE,
+				     nc->skbs);
+		nc->count = 0;
+	}
+}
+
+/**
+ *	napi_consume_skb - free an skbuff from a NAPI poll routine
+ *	@skb: buffer to free
+ *	@budget: NAPI budget of the caller, 0 if not called from NAPI
+ *
+ *	Like consume_skb(), but buffer heads are batched and returned to the
+ *	slab allocator with kmem_cache_free_bulk().  A zero @budget means the
+ *	caller is not a NAPI poll routine, in which case the buffer is freed
+ *	immediately; so is it when netpoll invokes ->poll() with interrupts
+ *	disabled.
+ */
+void napi_consume_skb(struct sk_buff *skb, int budget)
+{
+	if (unlikely(!skb))
+		return;
+
+	if (unlikely(!budget || irqs_disabled())) {
+		dev_kfree_skb_any(skb);
+		return;
+	}
+
+	if (likely(atomic_read(&skb->users) == 1))
+		smp_rmb();
+	else if (likely(!atomic_dec_and_test(&skb->users)))
+		return;
+	trace_consume_skb(skb);
+
+	/* fclones come from a different cache and carry a shared refcount */
+	if (skb->fclone != SKB_FCLONE_UNAVAILABLE) {
+		__kfree_skb(skb);
+		return;
+	}
+
+	_kfree_skb_defer(skb);
+}
+EXPORT_SYMBOL(napi_consume_skb);
+
 static void __copy_skb_header(struct sk_buff *new, const struct sk_buff *old)
 {
 	new->tstamp		= old->tstamp;
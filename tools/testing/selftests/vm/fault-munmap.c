@@ -0,0 +1,167 @@
+/*
+ * Page fault scalability in the face of mmap_sem writers.
+ *
+ * A number of threads keep faulting in private anonymous memory (and
+ * dropping it again with MADV_DONTNEED) while another thread loops over
+ * mmap()/munmap() of an unrelated region, taking mmap_sem for write.
+ * Without speculative page faults every fault queues up behind that
+ * thread.
+ *
+ * Usage: fault-munmap [-t threads] [-s seconds] [-m MB per thread] [-n]
+ *	-n	do not run the mmap/munmap thread (baseline)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE 15
+#endif
+
+static volatile int stop;
+static unsigned long region_size = 16UL << 20;
+static long page_size;
+
+struct worker {
+	pthread_t thread;
+	unsigned long faults;
+};
+
+static void *fault_thread(void *arg)
+{
+	struct worker *w = arg;
+	char *p;
+	unsigned long off;
+
+	p = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	/* We want one fault per page, not one per huge page */
+	madvise(p, region_size, MADV_NOHUGEPAGE);
+
+	while (!stop) {
+		for (off = 0; off < region_size && !stop; off += page_size) {
+			p[off] = 1;
+			w->faults++;
+		}
+		madvise(p, region_size, MADV_DONTNEED);
+	}
+	munmap(p, region_size);
+	return NULL;
+}
+
+static void *munmap_thread(void *arg)
+{
+	unsigned long *loops = arg;
+	void *p;
+
+	while (!stop) {
+		p = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		munmap(p, page_size);
+		(*loops)++;
+	}
+	return NULL;
+}
+
+static unsigned long read_vmstat(const char *name)
+{
+	char key[64];
+	unsigned long val;
+	FILE *f = fopen("/proc/vmstat", "r");
+
+	if (!f)
+		return 0;
+	while (fscanf(f, "%63s %lu", key, &val) == 2) {
+		if (!strcmp(key, name)) {
+			fclose(f);
+			return val;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_threads = 4, seconds = 5, with_munmap = 1;
+	unsigned long total = 0, munmap_loops = 0, spf, spf_abort;
+	struct worker *workers;
+	pthread_t unmapper;
+	struct timeval start, end;
+	double elapsed;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "t:s:m:n")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			region_size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'n':
+			with_munmap = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads] [-s seconds] "
+				"[-m MB per thread] [-n]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	spf = read_vmstat("speculative_pgfault");
+	spf_abort = read_vmstat("speculative_pgfault_abort");
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&workers[i].thread, NULL, fault_thread,
+			       &workers[i]);
+	if (with_munmap)
+		pthread_create(&unmapper, NULL, munmap_thread, &munmap_loops);
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].faults;
+	}
+	if (with_munmap)
+		pthread_join(unmapper, NULL);
+
+	gettimeofday(&end, NULL);
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+
+	printf("threads %d: %lu faults in %.2fs, %.0f faults/s, "
+	       "%.0f faults/s/thread\n", nr_threads, total, elapsed,
+	       total / elapsed, total / elapsed / nr_threads);
+	if (with_munmap)
+		printf("mmap/munmap loops: %lu\n", munmap_loops);
+	printf("speculative_pgfault: %lu, aborted: %lu\n",
+	       read_vmstat("speculative_pgfault") - spf,
+	       read_vmstat("speculative_pgfault_abort") - spf_abort);
+	return 0;
+}